@@ -22,5 +22,7 @@
 #include <taningia/taningia.h>
 
 ta_list_t *bitu_conf_read_from_file (const char *file_path);
+int bitu_conf_load (const char *pattern, const char *snapshot,
+                    ta_list_t **commands, char **error);
 
 #endif /* BITU_CONF_H_ */
@@ -21,6 +21,7 @@
 
 #include <taningia/taningia.h>
 #include <bitu/transport.h>
+#include <bitu/stats.h>
 
 
 /* Types */
@@ -29,16 +30,26 @@ typedef struct bitu_plugin_ctx bitu_plugin_ctx_t;
 
 
 /* Plugin object */
-bitu_plugin_t *bitu_plugin_load (const char *lib);
+bitu_plugin_t *bitu_plugin_load (const char *lib, ta_log_t *logger);
 void bitu_plugin_free (bitu_plugin_t *plugin);
+bitu_plugin_t *bitu_plugin_ref (bitu_plugin_t *plugin);
+void bitu_plugin_unref (bitu_plugin_t *plugin);
 const char *bitu_plugin_name (bitu_plugin_t *plugin);
 char *bitu_plugin_execute (bitu_plugin_t *plugin, bitu_command_t *command);
+int bitu_plugin_isolate (bitu_plugin_t *plugin, int nworkers);
+int bitu_plugin_is_isolated (bitu_plugin_t *plugin);
 
 
-/* Plugin context */
+/* Plugin context. Lookups can run concurrently with load/unload and
+ * never block. Plugins returned by the find functions hold a reference
+ * that must be released with `bitu_plugin_unref()'. The list returned
+ * by `bitu_plugin_ctx_get_list()' holds copies of the plugin names
+ * that must be freed. */
 bitu_plugin_ctx_t *bitu_plugin_ctx_new (void);
 void bitu_plugin_ctx_free (bitu_plugin_ctx_t *plugin_ctx);
 int bitu_plugin_ctx_load (bitu_plugin_ctx_t *plugin_ctx, const char *lib);
+int bitu_plugin_ctx_load_isolated (bitu_plugin_ctx_t *plugin_ctx,
+                                   const char *lib, int nworkers);
 int bitu_plugin_ctx_unload (bitu_plugin_ctx_t *plugin_ctx, const char *lib);
 bitu_plugin_t *bitu_plugin_ctx_find (bitu_plugin_ctx_t *plugin_ctx,
                                      const char *name);
@@ -46,4 +57,10 @@ bitu_plugin_t *bitu_plugin_ctx_find_for_cmdline (bitu_plugin_ctx_t *plugin_ctx,
                                                  const char *cmdline);
 ta_list_t *bitu_plugin_ctx_get_list (bitu_plugin_ctx_t *plugin_ctx);
 
+/* Execution times of the plugins loaded in this context, by name */
+bitu_stats_t *bitu_plugin_ctx_get_stats (bitu_plugin_ctx_t *plugin_ctx);
+
+/* Where the loader and the workers of isolated plugins report errors */
+ta_log_t *bitu_plugin_ctx_get_logger (bitu_plugin_ctx_t *plugin_ctx);
+
 #endif /* BITU_LOADER_H_ */
@@ -0,0 +1,37 @@
+/* stats.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_STATS_H_
+#define BITU_STATS_H_ 1
+
+#include <stdint.h>
+
+/* Latency counters and histograms grouped by name. Each thread records
+ * into its own shard without locking. Shards are only merged when a
+ * report is requested. Whoever records from a pointer it keeps around
+ * (like plugins do) holds a reference, the last unref frees it. */
+
+typedef struct bitu_stats bitu_stats_t;
+
+bitu_stats_t *bitu_stats_new (void);
+bitu_stats_t *bitu_stats_ref (bitu_stats_t *stats);
+void bitu_stats_unref (bitu_stats_t *stats);
+void bitu_stats_record (bitu_stats_t *stats, const char *name, uint64_t usec);
+char *bitu_stats_report (bitu_stats_t *stats);
+
+#endif /* BITU_STATS_H_ */
@@ -19,6 +19,7 @@
 #ifndef BITU_TRANSPORT_H_
 #define BITU_TRANSPORT_H_ 1
 
+#include <stdint.h>
 #include <taningia/taningia.h>
 
 typedef struct bitu_queue bitu_queue_t;
@@ -37,21 +38,54 @@ typedef enum
   BITU_CONN_STATUS_RUNNING_FAILED,
   BITU_CONN_STATUS_ALREADY_SHUTDOWN,
   BITU_CONN_STATUS_STILL_RUNNING,
+  BITU_CONN_STATUS_TIMED_OUT,
 } bitu_conn_status_t;
 
+/* Life of a transport under the connection manager. Transports whose
+ * session drops are reconnected with growing delays; after too many
+ * failures in a row they're marked as broken and only tried once in a
+ * while. */
+typedef enum
+{
+  BITU_TRANSPORT_STATE_STOPPED,
+  BITU_TRANSPORT_STATE_CONNECTING,
+  BITU_TRANSPORT_STATE_RUNNING,
+  BITU_TRANSPORT_STATE_RECONNECTING,
+  BITU_TRANSPORT_STATE_BROKEN,
+} bitu_transport_state_t;
+
+/* What a transport tells its contacts about the bot's availability,
+ * besides a free form status text. Transports without presence just
+ * ignore it. */
+typedef enum
+{
+  BITU_SHOW_AVAILABLE,
+  BITU_SHOW_AWAY,
+  BITU_SHOW_XA,
+  BITU_SHOW_DND,
+} bitu_show_t;
+
 
 /* Queue api */
 typedef int (*bitu_queue_callback_consume_t) (void *data, void *extra_data);
+typedef int (*bitu_queue_callback_admit_t) (void *data, void *extra_data);
 
 bitu_queue_t *bitu_queue_new (void);
 void bitu_queue_free (bitu_queue_t *queue);
+void bitu_queue_set_callback_admit (bitu_queue_t *queue,
+                                    bitu_queue_callback_admit_t callback,
+                                    void *data);
 void bitu_queue_add (bitu_queue_t *queue, void *data);
 void bitu_queue_consume (bitu_queue_t *queue,
                          bitu_queue_callback_consume_t callback,
                          void *data);
 
 
-/* Transport manager API */
+/* Transport manager API. Transports can be added and listed from any
+ * thread. The list returned by `bitu_conn_manager_get_transports()'
+ * holds copies of the uris that must be freed. Transports returned by
+ * `bitu_conn_manager_add()' and `bitu_conn_manager_get_transport()'
+ * are new references, released with `bitu_transport_unref()'. */
 bitu_conn_manager_t *bitu_conn_manager_new (void);
 int bitu_conn_manager_get_n_transports (bitu_conn_manager_t *manager);
 ta_list_t *bitu_conn_manager_get_transports (bitu_conn_manager_t *manager);
@@ -59,7 +93,14 @@ bitu_transport_t *bitu_conn_manager_add (bitu_conn_manager_t *manager, const cha
 bitu_conn_status_t bitu_conn_manager_remove (bitu_conn_manager_t *manager, const char *uri);
 bitu_transport_t *bitu_conn_manager_get_transport (bitu_conn_manager_t *manager, const char *uri);
 bitu_conn_status_t bitu_conn_manager_run (bitu_conn_manager_t *manager, const char *uri);
+void bitu_conn_manager_run_all (bitu_conn_manager_t *manager, ta_list_t *uris,
+                                uint64_t timeout, bitu_conn_status_t *statuses);
 bitu_conn_status_t bitu_conn_manager_shutdown (bitu_conn_manager_t *manager, const char *uri);
+bitu_conn_status_t bitu_conn_manager_pool (bitu_conn_manager_t *manager, const char *uri,
+                                           const char *member);
+void bitu_conn_manager_set_callback_admit (bitu_conn_manager_t *manager,
+                                           bitu_queue_callback_admit_t callback,
+                                           void *data);
 void bitu_conn_manager_consume (bitu_conn_manager_t *manager,
                                 bitu_queue_callback_consume_t callback,
                                 void *data);
@@ -72,8 +113,17 @@ typedef int (*bitu_transport_callback_is_running_t) (bitu_transport_t *transport
 typedef int (*bitu_transport_callback_run_t) (bitu_transport_t *transport);
 typedef int (*bitu_transport_callback_send_t) (bitu_transport_t *transport,
                                                const char *msg, const char *to);
+typedef void (*bitu_transport_callback_free_t) (bitu_transport_t *transport);
+typedef int (*bitu_transport_callback_queued_t) (bitu_transport_t *transport);
+typedef int (*bitu_transport_callback_room_t) (bitu_transport_t *transport,
+                                               const char *room);
+typedef int (*bitu_transport_callback_status_t) (bitu_transport_t *transport,
+                                                 bitu_show_t show,
+                                                 const char *status);
 
 bitu_transport_t *bitu_transport_new (const char *uri);
+bitu_transport_t *bitu_transport_ref (bitu_transport_t *transport);
+void bitu_transport_unref (bitu_transport_t *transport);
 ta_iri_t *bitu_transport_get_uri (bitu_transport_t *transport);
 int bitu_transport_connect (bitu_transport_t *transport);
 int bitu_transport_disconnect (bitu_transport_t *transport);
@@ -93,13 +143,39 @@ void bitu_transport_set_callback_run (bitu_transport_t *transport,
                                       bitu_transport_callback_run_t callback);
 void bitu_transport_set_callback_send (bitu_transport_t *transport,
                                        bitu_transport_callback_send_t callback);
+void bitu_transport_set_callback_free (bitu_transport_t *transport,
+                                       bitu_transport_callback_free_t callback);
+void bitu_transport_set_callback_queued (bitu_transport_t *transport,
+                                         bitu_transport_callback_queued_t callback);
+void bitu_transport_set_callback_join (bitu_transport_t *transport,
+                                       bitu_transport_callback_room_t callback);
+void bitu_transport_set_callback_leave (bitu_transport_t *transport,
+                                        bitu_transport_callback_room_t callback);
+void bitu_transport_set_callback_status (bitu_transport_t *transport,
+                                         bitu_transport_callback_status_t callback);
 int bitu_transport_queue_command (bitu_transport_t *transport, bitu_command_t *cmd);
 int bitu_transport_send (bitu_transport_t *transport, const char *msg, const char *to);
+int bitu_transport_join (bitu_transport_t *transport, const char *room);
+int bitu_transport_leave (bitu_transport_t *transport, const char *room);
+int bitu_transport_set_status (bitu_transport_t *transport, bitu_show_t show,
+                               const char *status);
+char *bitu_transport_get_status (bitu_transport_t *transport, bitu_show_t *show);
+bitu_transport_t *bitu_transport_pool_pick (bitu_transport_t *transport,
+                                            const char *to);
+bitu_transport_state_t bitu_transport_get_state (bitu_transport_t *transport);
+int bitu_transport_wait_stopped (bitu_transport_t *transport, uint64_t timeout);
+int bitu_transport_get_queued (bitu_transport_t *transport);
+void bitu_transport_notify_ready (bitu_transport_t *transport);
+const char *bitu_transport_state_name (bitu_transport_state_t state);
 
 
 /* Command api */
 bitu_command_t *bitu_command_new (bitu_transport_t *transport,
                                   const char *cmd, const char *from);
+bitu_command_t *bitu_command_new_parsed (bitu_transport_t *transport,
+                                         char *cmd, const char *from,
+                                         const char *name, char **params,
+                                         int nparams);
 void bitu_command_free (bitu_command_t *command);
 bitu_transport_t *bitu_command_get_transport (bitu_command_t *command);
 const char *bitu_command_get_from (bitu_command_t *command);
@@ -107,6 +183,7 @@ const char *bitu_command_get_cmd (bitu_command_t *command);
 const char *bitu_command_get_name (bitu_command_t *command);
 const char **bitu_command_get_params (bitu_command_t *command);
 int bitu_command_get_nparams (bitu_command_t *command);
+const char *bitu_command_get_key (bitu_command_t *command);
 
 
 /* Forward declarations for transports */
@@ -19,12 +19,25 @@
 #ifndef BITU_UTIL_H_
 #define BITU_UTIL_H_ 1
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
 typedef void *(*bitu_util_callback_t) (void *);
 
 char *bitu_util_strstrip (const char *string);
+int bitu_util_tokenize (const char *line, char ***tokens, int *ntokens);
 int bitu_util_extract_params (const char *line, char **cmd,
                               char ***params, int *len);
+int bitu_util_create_thread (pthread_t *thread, bitu_util_callback_t callback,
+                             void *data);
 void bitu_util_start_new_thread (bitu_util_callback_t callback, void *data);
 char *bitu_util_uuid4 (void);
+uint64_t bitu_util_monotonic_time (void);
+void bitu_util_cond_init (pthread_cond_t *cond);
+void bitu_util_deadline (struct timespec *deadline, uint64_t usec);
+int bitu_util_parse_duration (const char *str, uint64_t *usec);
+int bitu_util_is_mention (const char *text, const char *nick, size_t nick_len);
 
 #endif /* BITU_UTIL_H_ */
@@ -17,29 +17,82 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <taningia/taningia.h>
 #include <bitu/errors.h>
 #include <bitu/conf.h>
 #include <bitu/transport.h>
+#include <bitu/util.h>
+#include <bitu/stats.h>
 
 #include "hashtable.h"
 #include "hashtable-utils.h"
+#include "hashtable-concurrent.h"
+#include "cache.h"
+#include "whitelist.h"
+#include "builtins.h"
+#include "builtins-table.h"
 #include "app.h"
 
+/* Amount of worker processes started by `load --isolated' when the
+ * `isolated-workers' variable is not set */
+#define DEFAULT_ISOLATED_WORKERS 2
+
+/* How long to wait for transports to connect when the
+ * `transport-connect-timeout' variable is not set */
+#define DEFAULT_CONNECT_TIMEOUT "30s"
+
+/* How often probes run when the `probe-interval' variable is not
+ * set */
+#define DEFAULT_PROBE_INTERVAL "60s"
+
+/* Longest status text published, longer ones lose their last lines */
+#define STATUS_MAX 1024
+
+/* Values of the cache column of builtins.def. Built in commands that
+ * don't change anything can have their answers cached and identical
+ * requests can share a single execution. */
+#define BUILTIN_CACHE_NONE BITU_CACHE_DEP_NONE
+#define BUILTIN_CACHE_ENV BITU_CACHE_DEP_ENV
+#define BUILTIN_CACHE_ENV_VAR BITU_CACHE_DEP_ENV_VAR
+#define BUILTIN_CACHE_PLUGINS BITU_CACHE_DEP_PLUGINS
+#define BUILTIN_CACHE_NEVER -1
+
 /* Forward declarations */
 
-typedef char * (*command_t) (bitu_app_t *, const char **, int);
+typedef char * (*command_t) (bitu_app_t *, char **, int);
+
+typedef struct {
+  const char *name;
+  const char *sub;
+  command_t handler;
+  int min_params;
+  int max_params;
+  int cache;
+} _bitu_builtin_t;
+
+static const _bitu_builtin_t *_builtin_find (const char *name,
+                                             const char *sub);
+
+static char *_builtin_run (bitu_app_t *app, const _bitu_builtin_t *builtin,
+                           char **params, int num_params);
 
-static char *_validate_num_params (const char *cmd, int x, int y);
+static char *_builtin_list (const char *name, const char *sep);
 
-static char *_validate_min_num_params (const char *cmd, int x, int y);
+static void _free_config (ta_list_t *config);
 
-static void _register_commands (bitu_app_t *app);
+static int _exec_command (void *data, void *extra_data);
+
+static int _admit_command (void *data, void *extra_data);
+
+static int _dispatch_command (bitu_app_t *app, bitu_command_t *command,
+                              char **output);
 
 
 /* App API */
@@ -54,14 +107,29 @@ bitu_app_new (void)
 
   app->logfile = NULL;
   app->logfd = -1;
+  pthread_mutex_init (&app->log_mutex, NULL);
   app->logflags = 0;
   app->plugin_ctx = bitu_plugin_ctx_new ();
+  app->cache = bitu_cache_new ();
+  app->stats = bitu_stats_new ();
   app->logger = ta_log_new ("bitu-main");
-  app->environment = hashtable_create (hash_string, string_equal, free, free);
-  app->commands = hashtable_create (hash_string, string_equal, NULL, NULL);
+  app->config = NULL;
+  app->consuming = 0;
+  app->environment = chashtable_create (hash_string, string_equal, free, free);
+  app->envstore = bitu_envstore_new (app->environment);
   app->connections = bitu_conn_manager_new ();
+  app->flights = hashtable_create (hash_string, string_equal, free, NULL);
+  pthread_mutex_init (&app->flights_mutex, NULL);
+  app->probes = NULL;
+  pthread_mutex_init (&app->probes_mutex, NULL);
+  bitu_util_cond_init (&app->probes_wakeup);
+  app->publishing = 0;
+  app->probes_changed = 0;
+  app->probes_stop = 0;
+
+  /* Identical commands arriving while one is pending share its answer */
+  bitu_conn_manager_set_callback_admit (app->connections, _admit_command, app);
 
-  _register_commands (app);
   return app;
 }
 
@@ -69,51 +137,81 @@ bitu_app_new (void)
 void
 bitu_app_free (bitu_app_t *app)
 {
+  ta_list_t *tmp;
+
+  /* The publisher runs commands, it must be gone before anything
+   * they use */
+  if (app->publishing)
+    {
+      pthread_mutex_lock (&app->probes_mutex);
+      app->probes_stop = 1;
+      pthread_cond_signal (&app->probes_wakeup);
+      pthread_mutex_unlock (&app->probes_mutex);
+      pthread_join (app->publisher, NULL);
+    }
+  for (tmp = app->probes; tmp; tmp = tmp->next)
+    free (tmp->data);
+  ta_list_free (app->probes);
+  pthread_cond_destroy (&app->probes_wakeup);
+  pthread_mutex_destroy (&app->probes_mutex);
+
   /* Freeing the main components */
-  hashtable_destroy (app->environment);
-  hashtable_destroy (app->commands);
+  _free_config (app->config);
+  bitu_envstore_free (app->envstore);
+  chashtable_destroy (app->environment);
+  hashtable_destroy (app->flights);
+  pthread_mutex_destroy (&app->flights_mutex);
   bitu_plugin_ctx_free (app->plugin_ctx);
+  bitu_cache_free (app->cache);
+  bitu_stats_unref (app->stats);
   /* bitu_conn_manager_free (app->connections); */
 
   /* Freeing other stuff */
   ta_object_unref (app->logger);
   free (app->logfile);
-  close (app->logfd);
+  if (app->logfd > -1)
+    close (app->logfd);
+  pthread_mutex_destroy (&app->log_mutex);
 
   /* Freeing the app itself */
   free (app);
 }
 
 
-int
-bitu_app_load_config (bitu_app_t *app, ta_list_t *commands)
+/* Runs a command read from the config file. They don't have a
+ * transport neither a sender. */
+static void
+_exec_config_command (bitu_app_t *app, bitu_command_t *command)
 {
-  ta_list_t *tmp;
+  char *answer = NULL;
 
-  for (tmp = commands; tmp; tmp = tmp->next)
-    {
-      bitu_command_t *command;
-      char *answer = NULL;
+  /* Leaving some traces of what's going on */
+  ta_log_warn (app->logger, "Loading command from config file: %s",
+               bitu_command_get_cmd (command));
 
-      command = (bitu_command_t *) tmp->data;
+  bitu_app_exec_command (app, command, &answer);
 
-      /* Leaving some traces of what's going on */
-      ta_log_warn (app->logger, "Loading command from config file: %s",
-                   bitu_command_get_cmd (command));
+  /* Logging stuff */
+  if (answer)
+    {
+      ta_log_info (app->logger, "Running command %s: %s",
+                   bitu_command_get_cmd (command), answer);
+      free (answer);
+    }
+}
 
-      /* Commands from config file don't have a transport neither a
-       * sender */
-      bitu_app_exec_command (app, command, &answer);
-      bitu_command_free (command);
 
-      /* Logging stuff */
-      if (answer)
-        {
-          ta_log_info (app->logger, "Running command %s: %s",
-                       bitu_command_get_cmd (command), answer);
-          free (answer);
-        }
-    }
+/* Takes ownership of the list and of its commands, they're kept to
+ * be compared with the config when it's reloaded */
+int
+bitu_app_load_config (bitu_app_t *app, ta_list_t *commands)
+{
+  ta_list_t *tmp;
+
+  for (tmp = commands; tmp; tmp = tmp->next)
+    _exec_config_command (app, tmp->data);
+  _free_config (app->config);
+  app->config = commands;
   return TA_OK;
 }
 
@@ -127,19 +225,43 @@ bitu_app_dump_config (bitu_app_t *TA_UNUSED(app))
 
 int
 bitu_app_exec_command (bitu_app_t *app, bitu_command_t *command, char **output)
+{
+  int status;
+  const char *name;
+  uint64_t start = bitu_util_monotonic_time ();
+
+  status = _dispatch_command (app, command, output);
+
+  /* Unknown commands are all accounted together, otherwise anyone
+   * could fill the table with garbage */
+  name = status == TA_OK ? bitu_command_get_name (command) : "<unknown>";
+  bitu_stats_record (app->stats, name, bitu_util_monotonic_time () - start);
+  return status;
+}
+
+
+static int
+_dispatch_command (bitu_app_t *app, bitu_command_t *command, char **output)
 {
   char answer[128];
-  command_t func;
+  const _bitu_builtin_t *builtin;
   bitu_plugin_t *plugin;
-  const char *cmd = bitu_command_get_cmd (command);;
+  const char *name = bitu_command_get_name (command);
+  const char *cmd = bitu_command_get_cmd (command);
+  uint64_t generation;
+
+  /* Commands configured with `cache' may have a fresh answer */
+  if (bitu_cache_get (app->cache, command, output, &generation) == TA_OK)
+    return TA_OK;
 
   /* Handling our internal commands first. No plugin can override
    * them */
-  if ((func = hashtable_get (app->commands, bitu_command_get_name (command))) != NULL)
+  if (name != NULL && (builtin = _builtin_find (name, NULL)) != NULL)
     {
-      *output = func (app,
-                      bitu_command_get_params (command),
-                      bitu_command_get_nparams (command));
+      *output = _builtin_run (app, builtin,
+                              (char **) bitu_command_get_params (command),
+                              bitu_command_get_nparams (command));
+      bitu_cache_put (app->cache, command, *output, generation);
       return TA_OK;
     }
 
@@ -147,6 +269,8 @@ bitu_app_exec_command (bitu_app_t *app, bitu_command_t *command, char **output)
   if ((plugin = bitu_plugin_ctx_find_for_cmdline (app->plugin_ctx, cmd)) != NULL)
     {
       *output = bitu_plugin_execute (plugin, command);
+      bitu_plugin_unref (plugin);
+      bitu_cache_put (app->cache, command, *output, generation);
       return TA_OK;
     }
 
@@ -158,12 +282,157 @@ bitu_app_exec_command (bitu_app_t *app, bitu_command_t *command, char **output)
 }
 
 
-static
-int _exec_command (void *data, void *extra_data)
+/* -- Single flight --
+ *
+ * Commands without side effects that arrive while an identical one
+ * (same normalized command line) is still waiting in the queue or
+ * running don't get queued. They're attached to the first one as
+ * waiters and its answer is sent to all of them, each one through its
+ * own transport, whoever sent them. Commands cached per sender only
+ * share with the same sender, like their cached answers. */
+
+
+typedef struct {
+  bitu_command_t *leader;
+  ta_list_t *waiters;
+} _bitu_flight_t;
+
+
+static int
+_command_is_idempotent (bitu_app_t *TA_UNUSED(app), bitu_command_t *command)
+{
+  const char *name = bitu_command_get_name (command);
+  const _bitu_builtin_t *builtin, *sub;
+
+  if (name == NULL)
+    return 0;
+
+  /* Anything that is not a built in command is a plugin and plugins
+   * only answer questions */
+  if ((builtin = _builtin_find (name, NULL)) == NULL)
+    return 1;
+
+  /* Subcommands may not be as harmless as their parents */
+  if (builtin->handler == NULL && bitu_command_get_nparams (command) > 0 &&
+      (sub = _builtin_find (name, bitu_command_get_params (command)[0])) != NULL)
+    builtin = sub;
+  return builtin->cache != BUILTIN_CACHE_NEVER;
+}
+
+
+/* Same layout as the keys of cache entries */
+static char *
+_flight_key (bitu_command_t *command, int per_sender)
+{
+  const char *from = bitu_command_get_from (command);
+  const char *key = bitu_command_get_key (command);
+  size_t len;
+  char *full;
+
+  if (!per_sender)
+    return strdup (key);
+
+  from = from ? from : "";
+  len = strlen (from) + strlen (key) + 2;
+  if ((full = malloc (len)) == NULL)
+    return NULL;
+  snprintf (full, len, "%s\n%s", from, key);
+  return full;
+}
+
+
+static int
+_admit_command (void *data, void *extra_data)
+{
+  bitu_app_t *app = (bitu_app_t *) extra_data;
+  bitu_command_t *command = (bitu_command_t *) data;
+  _bitu_flight_t *flight;
+  char *key;
+
+  if (!_command_is_idempotent (app, command))
+    return TA_OK;
+  key = _flight_key (command, bitu_cache_is_per_sender (app->cache, command));
+  if (key == NULL)
+    return TA_OK;
+
+  pthread_mutex_lock (&app->flights_mutex);
+  if ((flight = hashtable_get (app->flights, key)) != NULL)
+    {
+      flight->waiters = ta_list_append (flight->waiters, command);
+      pthread_mutex_unlock (&app->flights_mutex);
+      free (key);
+      return TA_ERROR;
+    }
+  if ((flight = malloc (sizeof (_bitu_flight_t))) != NULL)
+    {
+      flight->leader = command;
+      flight->waiters = NULL;
+      if (hashtable_set (app->flights, key, flight) == -1)
+        {
+          free (flight);
+          free (key);
+        }
+    }
+  else
+    free (key);
+  pthread_mutex_unlock (&app->flights_mutex);
+  return TA_OK;
+}
+
+
+/* Closes the flight led by `command', if any, and returns the commands
+ * waiting for its answer. */
+static ta_list_t *
+_land_flight (bitu_app_t *app, bitu_command_t *command)
+{
+  _bitu_flight_t *flight;
+  ta_list_t *waiters = NULL;
+  char *key;
+  int per_sender, landed = 0;
+
+  if (!_command_is_idempotent (app, command))
+    return NULL;
+
+  /* The policy may have changed since the flight took off, both
+   * layouts are tried */
+  for (per_sender = 0; per_sender < 2 && !landed; per_sender++)
+    {
+      if ((key = _flight_key (command, per_sender)) == NULL)
+        continue;
+      pthread_mutex_lock (&app->flights_mutex);
+      if ((flight = hashtable_get (app->flights, key)) != NULL &&
+          flight->leader == command)
+        {
+          waiters = flight->waiters;
+          hashtable_del (app->flights, key);
+          free (flight);
+          landed = 1;
+        }
+      pthread_mutex_unlock (&app->flights_mutex);
+      free (key);
+    }
+  return waiters;
+}
+
+
+static void
+_send_answer (bitu_app_t *app, bitu_command_t *command, const char *output)
+{
+  bitu_transport_t *transport;
+  if ((transport = bitu_command_get_transport (command)) != NULL)
+    if (bitu_transport_send (transport, output, bitu_command_get_from (command)) != TA_OK)
+      ta_log_warn (app->logger,
+                   "Unable to send a message to the user %s",
+                   bitu_command_get_from (command));
+}
+
+
+static int
+_exec_command (void *data, void *extra_data)
 {
   bitu_app_t *app;
   bitu_command_t *command;
-  bitu_transport_t *transport;
+  ta_list_t *waiters, *tmp;
   char *output = NULL;
   int status;
 
@@ -171,59 +440,135 @@ int _exec_command (void *data, void *extra_data)
   command = (bitu_command_t *) data;
   status = bitu_app_exec_command (app, command, &output);
 
-  if ((transport = bitu_command_get_transport (command)) != NULL)
-    if (bitu_transport_send (transport, output, bitu_command_get_from (command)) != TA_OK)
-      ta_log_warn (app->logger,
-                   "Unable to send a message to the user %s",
-                   bitu_command_get_from (command));
+  /* Fanning the answer out to everyone that asked the same thing while
+   * we were busy */
+  waiters = _land_flight (app, command);
+  _send_answer (app, command, output);
+  for (tmp = waiters; tmp; tmp = tmp->next)
+    {
+      _send_answer (app, tmp->data, output);
+      bitu_command_free (tmp->data);
+    }
+  if (waiters)
+    {
+      ta_log_debug (app->logger, "Answer of `%s' shared with %d waiter(s)",
+                    bitu_command_get_key (command), ta_list_len (waiters));
+      ta_list_free (waiters);
+    }
 
   if (output)
     free (output);
+  bitu_command_free (command);
   return status;
 }
 
 
-int
-bitu_app_run_transports (bitu_app_t *app)
+static void
+_start_consumer (bitu_app_t *app)
 {
-  int connected = 0;
-  ta_list_t *transports = NULL, *tmp = NULL;
+  if (app->consuming)
+    return;
+  bitu_conn_manager_consume (app->connections,
+                             (bitu_queue_callback_consume_t) _exec_command,
+                             app);
+  app->consuming = 1;
+}
 
-  /* Walking through all the transports found and trying to connect and
-   * run them. */
-  transports = bitu_conn_manager_get_transports (app->connections);
 
-  for (tmp = transports; tmp; tmp = tmp->next)
+/* Connects all the transports in `uris' at once and logs what happened
+ * to each of them. Returns how many are running or still trying to
+ * connect in the background. */
+static int
+_run_transports (bitu_app_t *app, ta_list_t *uris)
+{
+  bitu_conn_status_t *statuses;
+  ta_list_t *tmp;
+  char *val;
+  uint64_t timeout, started;
+  int i, n, connected = 0, failed = 0, timed_out = 0, retrying = 0;
+
+  if ((n = ta_list_len (uris)) == 0)
+    return 0;
+  if ((statuses = malloc (n * sizeof (bitu_conn_status_t))) == NULL)
+    return 0;
+
+  val = chashtable_get_copy (app->environment, "transport-connect-timeout",
+                             (copy_fn) strdup);
+  if (bitu_util_parse_duration (val ? val : DEFAULT_CONNECT_TIMEOUT,
+                                &timeout) != TA_OK)
     {
-      ta_log_info (app->logger, "Running transport: %s", tmp->data);
+      ta_log_warn (app->logger, "Invalid transport-connect-timeout `%s', "
+                   "using %s", val, DEFAULT_CONNECT_TIMEOUT);
+      bitu_util_parse_duration (DEFAULT_CONNECT_TIMEOUT, &timeout);
+    }
+  free (val);
+
+  for (tmp = uris; tmp; tmp = tmp->next)
+    ta_log_info (app->logger, "Running transport: %s", tmp->data);
 
-      switch (bitu_conn_manager_run (app->connections, tmp->data))
+  started = bitu_util_monotonic_time ();
+  bitu_conn_manager_run_all (app->connections, uris, timeout, statuses);
+
+  for (tmp = uris, i = 0; tmp; tmp = tmp->next, i++)
+    {
+      switch (statuses[i])
         {
         case BITU_CONN_STATUS_SPAWNED:
           connected++;
-          break;
+          continue;
+        case BITU_CONN_STATUS_TIMED_OUT:
+          ta_log_warn (app->logger, "Transport `%s' still connecting, "
+                       "it will keep trying in the background", tmp->data);
+          timed_out++;
+          continue;
+        case BITU_CONN_STATUS_CONNECTION_FAILED:
+          ta_log_warn (app->logger, "Transport `%s' failed to connect, "
+                       "retrying in the background", tmp->data);
+          retrying++;
+          continue;
         case BITU_CONN_STATUS_ALREADY_RUNNING:
           ta_log_warn (app->logger, "Transport `%s' already running", tmp->data);
           break;
         case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
           ta_log_warn (app->logger, "Transport `%s' not found", tmp->data);
           break;
-        case BITU_CONN_STATUS_CONNECTION_FAILED:
-          ta_log_warn (app->logger, "Transport `%s' failed to connect", tmp->data);
-          break;
         default:
           ta_log_warn (app->logger, "Transport `%s' not initialized", tmp->data);
           break;
         }
+      failed++;
     }
+  free (statuses);
+
+  ta_log_info (app->logger, "Transports: %d connected, %d retrying, "
+               "%d failed, %d timed out in %.1fs", connected, retrying,
+               failed, timed_out,
+               (bitu_util_monotonic_time () - started) / 1e6);
+  return connected + retrying + timed_out;
+}
+
+
+int
+bitu_app_run_transports (bitu_app_t *app)
+{
+  ta_list_t *transports, *tmp;
+  int running;
+
+  /* Walking through all the transports found and trying to connect and
+   * run them. They all connect at the same time, so starting up takes
+   * as long as the slowest one instead of the sum of all of them. */
+  transports = bitu_conn_manager_get_transports (app->connections);
+  running = _run_transports (app, transports);
+  for (tmp = transports; tmp; tmp = tmp->next)
+    free (tmp->data);
   ta_list_free (transports);
 
-  /* Starting the consumer thread */
-  if (connected > 0)
+  /* Starting the consumer thread. Transports that timed out count too,
+   * they may still connect and will need someone reading their
+   * messages. */
+  if (running > 0)
     {
-      bitu_conn_manager_consume (app->connections,
-                                 (bitu_queue_callback_consume_t) _exec_command,
-                                 app);
+      _start_consumer (app);
       return TA_OK;
     }
 
@@ -232,6 +577,217 @@ bitu_app_run_transports (bitu_app_t *app)
 }
 
 
+/* -- Status publishing --
+ *
+ * Probes are command lines run every `probe-interval' by a thread of
+ * their own. Their answers become the status text of every transport,
+ * one line per probe, and the bot shows itself as busy when any of
+ * them fails. Transports only tell their contacts about it when
+ * something changed, so watching the bot costs nothing but a
+ * subscription. */
+
+
+/* Runs all the probes and returns the status text they make up */
+static char *
+_probe_run (bitu_app_t *app, ta_list_t *probes, bitu_show_t *show)
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  ta_list_t *tmp;
+  bitu_command_t *command;
+  char *output, *line, *p;
+  size_t len;
+  int status;
+
+  ta_buf_alloc (&buf, 128);
+  *show = BITU_SHOW_AVAILABLE;
+
+  for (tmp = probes; tmp; tmp = tmp->next)
+    {
+      output = NULL;
+      if ((command = bitu_command_new (NULL, tmp->data, NULL)) == NULL)
+        status = TA_ERROR;
+      else
+        {
+          status = bitu_app_exec_command (app, command, &output);
+          bitu_command_free (command);
+        }
+      if (status != TA_OK || output == NULL)
+        *show = BITU_SHOW_DND;
+
+      /* Each answer takes a single line */
+      line = output && *output ? bitu_util_strstrip (output) : NULL;
+      free (output);
+      if (line == NULL || *line == '\0')
+        {
+          free (line);
+          len = strlen (tmp->data) + sizeof (": no answer");
+          if ((line = malloc (len)) == NULL)
+            continue;
+          snprintf (line, len, "%s: no answer", (char *) tmp->data);
+        }
+      for (p = line; *p; p++)
+        if (*p == '\n' || *p == '\r')
+          *p = ' ';
+
+      len = strlen (ta_buf_cstr (&buf));
+      if (len + strlen (line) + 1 <= STATUS_MAX)
+        ta_buf_catf (&buf, "%s%s", len > 0 ? "\n" : "", line);
+      free (line);
+    }
+
+  output = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return output;
+}
+
+
+static void
+_probe_publish (bitu_app_t *app, bitu_show_t show, const char *status)
+{
+  ta_list_t *transports, *tmp;
+  bitu_transport_t *transport;
+
+  transports = bitu_conn_manager_get_transports (app->connections);
+  for (tmp = transports; tmp; tmp = tmp->next)
+    {
+      transport = bitu_conn_manager_get_transport (app->connections,
+                                                   tmp->data);
+      if (transport != NULL)
+        {
+          bitu_transport_set_status (transport, show, status);
+          bitu_transport_unref (transport);
+        }
+      free (tmp->data);
+    }
+  ta_list_free (transports);
+}
+
+
+static uint64_t
+_probe_interval (bitu_app_t *app)
+{
+  uint64_t interval;
+  char *val;
+
+  val = chashtable_get_copy (app->environment, "probe-interval",
+                             (copy_fn) strdup);
+  if (bitu_util_parse_duration (val ? val : DEFAULT_PROBE_INTERVAL,
+                                &interval) != TA_OK || interval == 0)
+    {
+      ta_log_warn (app->logger, "Invalid probe-interval `%s', using %s",
+                   val, DEFAULT_PROBE_INTERVAL);
+      bitu_util_parse_duration (DEFAULT_PROBE_INTERVAL, &interval);
+    }
+  free (val);
+  return interval;
+}
+
+
+static void *
+_probe_loop (void *data)
+{
+  bitu_app_t *app = (bitu_app_t *) data;
+  ta_list_t *probes, *tmp;
+  bitu_show_t show, last_show = BITU_SHOW_AVAILABLE;
+  char *status, *last_status = NULL;
+  struct timespec deadline;
+  uint64_t interval;
+
+  pthread_mutex_lock (&app->probes_mutex);
+  while (!app->probes_stop)
+    {
+      /* Probes may be added or removed while the others run */
+      probes = NULL;
+      for (tmp = app->probes; tmp; tmp = tmp->next)
+        probes = ta_list_append (probes, strdup (tmp->data));
+      app->probes_changed = 0;
+      pthread_mutex_unlock (&app->probes_mutex);
+
+      /* Without probes the bot is just online */
+      if (probes != NULL)
+        status = _probe_run (app, probes, &show);
+      else
+        {
+          show = BITU_SHOW_AVAILABLE;
+          status = strdup ("Online");
+        }
+      for (tmp = probes; tmp; tmp = tmp->next)
+        free (tmp->data);
+      ta_list_free (probes);
+
+      if (last_status == NULL || show != last_show ||
+          strcmp (status, last_status) != 0)
+        ta_log_info (app->logger, "Status changed: %s",
+                     show == BITU_SHOW_AVAILABLE ? "available" : "busy");
+      free (last_status);
+      last_status = status;
+      last_show = show;
+
+      /* Even when nothing changed, transports added since the last
+       * round hear about it */
+      _probe_publish (app, show, status);
+
+      interval = _probe_interval (app);
+      bitu_util_deadline (&deadline, interval);
+
+      pthread_mutex_lock (&app->probes_mutex);
+      while (!app->probes_stop && !app->probes_changed)
+        if (pthread_cond_timedwait (&app->probes_wakeup, &app->probes_mutex,
+                                    &deadline) == ETIMEDOUT)
+          break;
+    }
+  pthread_mutex_unlock (&app->probes_mutex);
+  free (last_status);
+  return NULL;
+}
+
+
+/* Adds or removes a probe and makes the publisher run them all again
+ * right away. Returns 0 when nothing changed. */
+static int
+_probe_change (bitu_app_t *app, const char *cmdline, int add)
+{
+  ta_list_t *tmp;
+  char *found = NULL;
+  int changed = 0;
+
+  pthread_mutex_lock (&app->probes_mutex);
+  for (tmp = app->probes; tmp; tmp = tmp->next)
+    if (strcmp (tmp->data, cmdline) == 0)
+      {
+        found = tmp->data;
+        break;
+      }
+
+  if (add && found == NULL)
+    {
+      app->probes = ta_list_append (app->probes, strdup (cmdline));
+      changed = 1;
+    }
+  else if (!add && found != NULL)
+    {
+      app->probes = ta_list_remove (app->probes, found);
+      free (found);
+      changed = 1;
+    }
+
+  if (changed)
+    {
+      app->probes_changed = 1;
+      pthread_cond_signal (&app->probes_wakeup);
+    }
+  if (changed && !app->publishing)
+    {
+      if (bitu_util_create_thread (&app->publisher, _probe_loop, app) == 0)
+        app->publishing = 1;
+      else
+        ta_log_error (app->logger, "Could not start the status publisher");
+    }
+  pthread_mutex_unlock (&app->probes_mutex);
+  return changed;
+}
+
+
 /* -- Commands -- */
 
 
@@ -259,52 +815,99 @@ cmd_help (bitu_app_t *TA_UNUSED(app),
 
 
 static char *
-cmd_set (bitu_app_t *app, char **params, int num_params)
+cmd_set (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
 {
-  char *error;
-  if ((error = _validate_num_params ("set", 2, num_params)) != NULL)
-    return error;
-  hashtable_set (app->environment, strdup (params[0]), strdup (params[1]));
+  if (bitu_envstore_set (app->envstore, params[0], params[1]) != TA_OK)
+    return strdup ("Unable to save the variable, it was not changed");
+  bitu_cache_invalidate_variable (app->cache, params[0]);
+  return NULL;
+}
+
+
+static char *
+cmd_get (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
+{
+  return chashtable_get_copy (app->environment, params[0], (copy_fn) strdup);
+}
+
+
+static char *
+cmd_unset (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
+{
+  if (bitu_envstore_unset (app->envstore, params[0]) != TA_OK)
+    return strdup ("Unable to save the change, the variable was kept");
+  bitu_cache_invalidate_variable (app->cache, params[0]);
   return NULL;
 }
 
 
+/* Subscription requests are accepted for the jids listed in `path',
+ * see whitelist.h */
 static char *
-cmd_get (bitu_app_t *app, char **params, int num_params)
+cmd_set_whitelist (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
 {
-  char *error, *val;
-  if ((error = _validate_num_params ("set", 1, num_params)) != NULL)
-    return error;
-  val = hashtable_get (app->environment, params[0]);
-  return val ? strdup (val) : NULL;
+  char *error;
+
+  if (bitu_whitelist_set_file (params[0]) != TA_OK)
+    {
+      error = malloc (256);
+      snprintf (error, 256, "Unable to read whitelist `%s': %s",
+                params[0], strerror (errno));
+      ta_log_error (app->logger, error);
+      return error;
+    }
+  ta_log_info (app->logger, "Whitelist %s loaded, %d entries", params[0],
+               bitu_whitelist_get_size ());
+  return NULL;
 }
 
 
+/* Keeps the environment in `path' from now on. Variables saved there
+ * by previous runs are restored and win over the ones already set. */
 static char *
-cmd_unset (bitu_app_t *app, char **params, int num_params)
+cmd_set_env_store (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
 {
   char *error;
-  if ((error = _validate_num_params ("unset", 1, num_params)) != NULL)
-    return error;
-  hashtable_del (app->environment, params[0]);
+  size_t discarded;
+
+  if (bitu_envstore_open (app->envstore, params[0]) != TA_OK)
+    {
+      error = malloc (256);
+      snprintf (error, 256, "Unable to open environment store `%s': %s",
+                params[0], strerror (errno));
+      ta_log_error (app->logger, error);
+      return error;
+    }
+  bitu_cache_invalidate (app->cache, BITU_CACHE_DEP_ENV);
+
+  if ((discarded = bitu_envstore_get_discarded (app->envstore)) > 0)
+    ta_log_warn (app->logger, "Environment store %s had %lu bytes of "
+                 "incomplete records, they were dropped", params[0],
+                 (unsigned long) discarded);
+  ta_log_info (app->logger, "Saving the environment to %s", params[0]);
   return NULL;
 }
 
 
 static char *
-cmd_env (bitu_app_t *app, char **TA_UNUSED(params), int num_params)
+cmd_env (bitu_app_t *app, char **TA_UNUSED(params), int TA_UNUSED(num_params))
 {
   void *iter;
-  char *error, *val, *tmp, *pos, *list = NULL;
+  chashtable_snapshot_t snapshot;
+  char *val, *tmp, *pos, *list = NULL;
   size_t val_size, current_size = 0, full_size = 0, step = 256, lastp = 0;
-  if ((error = _validate_num_params ("env", 0, num_params)) != NULL)
-    return error;
-  iter = hashtable_iter (app->environment);
+
+  /* Variables can be changed by other threads while we're listing */
+  chashtable_snapshot (app->environment, &snapshot);
+  iter = chashtable_snapshot_iter (&snapshot);
   if (iter == NULL)
-    return NULL;
+    {
+      chashtable_snapshot_release (&snapshot);
+      return NULL;
+    }
   do
     {
-      val = hashtable_iter_key (iter);
+      val = chashtable_iter_key (iter);
       val_size = strlen (val);
       current_size += val_size + 1;
       if (full_size < current_size)
@@ -312,6 +915,7 @@ cmd_env (bitu_app_t *app, char **TA_UNUSED(params), int num_params)
           full_size += step;
           if ((tmp = realloc (list, full_size)) == NULL)
             {
+              chashtable_snapshot_release (&snapshot);
               free (list);
               return NULL;
             }
@@ -323,112 +927,285 @@ cmd_env (bitu_app_t *app, char **TA_UNUSED(params), int num_params)
       memcpy (pos+val_size, "\n", 1);
       lastp += val_size + 1;
     }
-  while ((iter = hashtable_iter_next (app->environment, iter)));
+  while ((iter = chashtable_snapshot_iter_next (&snapshot, iter)));
+  chashtable_snapshot_release (&snapshot);
   list[current_size-1] = '\0';
   return list;
 }
 
 
 static char *
-cmd_transport (bitu_app_t *app, char **params, int num_params)
+cmd_transport_add (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
 {
-  char *error;
-  if ((error = _validate_min_num_params ("transport", 1, num_params)) != NULL)
-    return error;
+  bitu_transport_t *transport;
+  if ((transport = bitu_conn_manager_add (app->connections, params[0])) == NULL)
+    return strdup ("Could not add the transport");
+  bitu_transport_unref (transport);
+  return NULL;
+}
+
 
-  if (strcmp (params[0], "add") == 0)
+static char *
+cmd_transport_remove (bitu_app_t *app, char **params,
+                      int TA_UNUSED(num_params))
+{
+  switch (bitu_conn_manager_remove (app->connections, params[0]))
     {
-      if ((error = _validate_num_params ("transport add", 2, num_params)) != NULL)
-        return error;
-      bitu_conn_manager_add (app->connections, params[1]);
+    case BITU_CONN_STATUS_STILL_RUNNING:
+      return strdup ("You have to disconnect the transport before removing");
+    case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
+      return strdup ("Transport not found");
+    case BITU_CONN_STATUS_OK:
+    default:
       return NULL;
     }
-  else if (strcmp (params[0], "remove") == 0)
-    {
-      if ((error = _validate_num_params ("transport remove", 2, num_params)) != NULL)
-        return error;
-      switch (bitu_conn_manager_remove (app->connections, params[1]))
-        {
-        case BITU_CONN_STATUS_STILL_RUNNING:
-          return strdup ("You have to disconnect the transport before removing");
-        case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
-          return strdup ("Transport not found");
-        case BITU_CONN_STATUS_OK:
-        default:
-          return NULL;
-        }
-    }
-  else if (strcmp (params[0], "list") == 0)
-    {
-      ta_buf_t buf = TA_BUF_INIT;
-      ta_iri_t *uri;
-      ta_list_t *transports = NULL, *tmp = NULL;
-      bitu_transport_t *transport;
-      char *message;
-      char status[8];
+}
 
-      ta_buf_alloc (&buf, 32);
 
-      transports = bitu_conn_manager_get_transports (app->connections);
-      for (tmp = transports; tmp; tmp = tmp->next)
-        {
-          transport =
-            bitu_conn_manager_get_transport (app->connections, tmp->data);
-          if (transport == NULL)
-            continue;
-          uri = bitu_transport_get_uri (transport);
+static char *
+cmd_transport_list (bitu_app_t *app, char **TA_UNUSED(params),
+                    int TA_UNUSED(num_params))
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  ta_iri_t *uri;
+  ta_list_t *transports = NULL, *tmp = NULL;
+  bitu_transport_t *transport;
+  char *message;
 
-          if (bitu_transport_is_running (transport) == TA_OK)
-            strcpy (status, "running");
-          else
-            strcpy (status, "stopped");
-          ta_buf_catf (&buf, "[%s] %s", status, ta_iri_to_string (uri));
+  ta_buf_alloc (&buf, 32);
 
-          /* We don't want line breaks in the end of the string */
-          if (tmp->next != NULL)
-            ta_buf_catf (&buf, "\n");
-        }
-      message = strdup (ta_buf_cstr (&buf));
-      ta_buf_dealloc (&buf);
-      return message;
+  transports = bitu_conn_manager_get_transports (app->connections);
+  for (tmp = transports; tmp; tmp = tmp->next)
+    {
+      transport =
+        bitu_conn_manager_get_transport (app->connections, tmp->data);
+      if (transport == NULL)
+        continue;
+      uri = bitu_transport_get_uri (transport);
+
+      ta_buf_catf (&buf, "[%s] %s",
+                   bitu_transport_state_name (bitu_transport_get_state (transport)),
+                   ta_iri_to_string (uri));
+      bitu_transport_unref (transport);
+
+      /* We don't want line breaks in the end of the string */
+      if (tmp->next != NULL)
+        ta_buf_catf (&buf, "\n");
     }
-  else if (strcmp (params[0], "connect") == 0)
+  for (tmp = transports; tmp; tmp = tmp->next)
+    free (tmp->data);
+  ta_list_free (transports);
+  message = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return message;
+}
+
+
+static char *
+cmd_transport_queue (bitu_app_t *app, char **TA_UNUSED(params),
+                     int TA_UNUSED(num_params))
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  ta_list_t *transports = NULL, *tmp = NULL;
+  bitu_transport_t *transport;
+  char *message;
+
+  ta_buf_alloc (&buf, 32);
+
+  transports = bitu_conn_manager_get_transports (app->connections);
+  for (tmp = transports; tmp; tmp = tmp->next)
     {
-      bitu_conn_status_t status;
-      if ((error = _validate_num_params ("transport connect", 2, num_params)) != NULL)
-        return error;
-      status = bitu_conn_manager_run (app->connections, params[1]);
-      switch (status)
-        {
-        case BITU_CONN_STATUS_SPAWNED:
-          return NULL;
-        case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
-          return strdup ("Transport not found, stop wasting my time");
-        case BITU_CONN_STATUS_ALREADY_RUNNING:
-          return strdup ("Transport already running, can't you see it???");
-        default:
-          return strdup ("I really don't know wtf just happened");
-        }
+      transport =
+        bitu_conn_manager_get_transport (app->connections, tmp->data);
+      if (transport == NULL)
+        continue;
+
+      ta_buf_catf (&buf, "%d queued: %s",
+                   bitu_transport_get_queued (transport),
+                   ta_iri_to_string (bitu_transport_get_uri (transport)));
+      bitu_transport_unref (transport);
+
+      /* We don't want line breaks in the end of the string */
+      if (tmp->next != NULL)
+        ta_buf_catf (&buf, "\n");
     }
-  else if (strcmp (params[0], "disconnect") == 0)
+  for (tmp = transports; tmp; tmp = tmp->next)
+    free (tmp->data);
+  ta_list_free (transports);
+  message = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return message;
+}
+
+
+static char *
+cmd_transport_pool (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
+{
+  switch (bitu_conn_manager_pool (app->connections, params[0], params[1]))
     {
-      bitu_conn_status_t status;
-      if ((error = _validate_num_params ("transport disconnect", 2, num_params)) != NULL)
-        return error;
-      status = bitu_conn_manager_shutdown (app->connections, params[1]);
-      switch (status)
-        {
-        case BITU_CONN_STATUS_OK:
-          return NULL;
-        case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
-          return strdup ("Transport not found, stop wasting my time");
-        case BITU_CONN_STATUS_ALREADY_SHUTDOWN:
-          return strdup ("Transport already shutdown, do you want to kill it twice??");
-        default:
-          return strdup ("I really don't know wtf just happened");
-        }
+    case BITU_CONN_STATUS_OK:
+      return NULL;
+    case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
+      return strdup ("Transport not found");
+    default:
+      return strdup ("Could not add the connection to the pool");
     }
-  return NULL;
+}
+
+
+static char *
+cmd_transport_connect (bitu_app_t *app, char **params,
+                       int TA_UNUSED(num_params))
+{
+  switch (bitu_conn_manager_run (app->connections, params[0]))
+    {
+    case BITU_CONN_STATUS_SPAWNED:
+      return NULL;
+    case BITU_CONN_STATUS_CONNECTION_FAILED:
+      return strdup ("Failed to connect, retrying in the background");
+    case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
+      return strdup ("Transport not found, stop wasting my time");
+    case BITU_CONN_STATUS_ALREADY_RUNNING:
+      return strdup ("Transport already running, can't you see it???");
+    default:
+      return strdup ("I really don't know wtf just happened");
+    }
+}
+
+
+static char *
+cmd_transport_disconnect (bitu_app_t *app, char **params,
+                          int TA_UNUSED(num_params))
+{
+  switch (bitu_conn_manager_shutdown (app->connections, params[0]))
+    {
+    case BITU_CONN_STATUS_OK:
+      return NULL;
+    case BITU_CONN_STATUS_TRANSPORT_NOT_FOUND:
+      return strdup ("Transport not found, stop wasting my time");
+    case BITU_CONN_STATUS_ALREADY_SHUTDOWN:
+      return strdup ("Transport already shutdown, do you want to kill it twice??");
+    default:
+      return strdup ("I really don't know wtf just happened");
+    }
+}
+
+
+/* `transport join <uri> <room>' and `transport leave <uri> <room>' */
+static char *
+cmd_transport_room (bitu_app_t *app, char **params, int join)
+{
+  bitu_transport_t *transport;
+  char *message;
+  size_t len;
+  int status;
+
+  transport = bitu_conn_manager_get_transport (app->connections, params[0]);
+  if (transport == NULL)
+    return strdup ("Transport not found, stop wasting my time");
+  status = join
+    ? bitu_transport_join (transport, params[1])
+    : bitu_transport_leave (transport, params[1]);
+  bitu_transport_unref (transport);
+  if (status == TA_OK)
+    return NULL;
+  len = strlen (params[1]) + sizeof ("Could not leave ");
+  if ((message = malloc (len)) != NULL)
+    snprintf (message, len, "Could not %s %s", join ? "join" : "leave",
+              params[1]);
+  return message;
+}
+
+
+static char *
+cmd_transport_join (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
+{
+  return cmd_transport_room (app, params, 1);
+}
+
+
+static char *
+cmd_transport_leave (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
+{
+  return cmd_transport_room (app, params, 0);
+}
+
+
+/* Puts words of a command back together in a single line */
+static char *
+_join_params (char **params, int num_params)
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  char *cmdline;
+  int i;
+
+  ta_buf_alloc (&buf, 64);
+  for (i = 0; i < num_params; i++)
+    ta_buf_catf (&buf, "%s%s", i > 0 ? " " : "", params[i]);
+  cmdline = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return cmdline;
+}
+
+
+static char *
+cmd_probe_add (bitu_app_t *app, char **params, int num_params)
+{
+  bitu_command_t *command;
+  char *cmdline;
+  int harmless, changed;
+
+  if ((cmdline = _join_params (params, num_params)) == NULL)
+    return NULL;
+
+  /* Probes run over and over, only commands that just answer
+   * questions can be one */
+  if ((command = bitu_command_new (NULL, cmdline, NULL)) == NULL)
+    {
+      free (cmdline);
+      return NULL;
+    }
+  harmless = _command_is_idempotent (app, command);
+  bitu_command_free (command);
+  if (!harmless)
+    {
+      free (cmdline);
+      return strdup ("Only commands that don't change anything can be "
+                     "probes");
+    }
+
+  changed = _probe_change (app, cmdline, 1);
+  free (cmdline);
+  return changed ? NULL : strdup ("Probe already added");
+}
+
+
+static char *
+cmd_probe_remove (bitu_app_t *app, char **params, int num_params)
+{
+  char *cmdline = _join_params (params, num_params);
+  int changed = _probe_change (app, cmdline, 0);
+  free (cmdline);
+  return changed ? NULL : strdup ("Probe not found");
+}
+
+
+static char *
+cmd_probe_list (bitu_app_t *app, char **TA_UNUSED(params),
+                int TA_UNUSED(num_params))
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  ta_list_t *tmp;
+  char *message;
+
+  ta_buf_alloc (&buf, 32);
+  pthread_mutex_lock (&app->probes_mutex);
+  for (tmp = app->probes; tmp; tmp = tmp->next)
+    ta_buf_catf (&buf, "%s%s", (char *) tmp->data, tmp->next ? "\n" : "");
+  pthread_mutex_unlock (&app->probes_mutex);
+  message = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return message;
 }
 
 
@@ -436,39 +1213,57 @@ static char *
 cmd_load (bitu_app_t *app, char **params, int num_params)
 {
   size_t fullsize;
-  char *libname;
-  char *error;
+  char *libname, *name, *val;
+  int nworkers = 0, status;
 
-  if ((error = _validate_num_params ("load", 1, num_params)) != NULL)
-    return error;
+  /* `load --isolated <plugin>' runs the plugin in a pool of worker
+   * processes instead of inside of our own address space */
+  if (num_params == 2)
+    {
+      if (strcmp (params[0], "--isolated") != 0)
+        return strdup ("Usage: load [--isolated] <plugin>");
+      val = chashtable_get_copy (app->environment, "isolated-workers",
+                                 (copy_fn) strdup);
+      nworkers = val ? atoi (val) : DEFAULT_ISOLATED_WORKERS;
+      free (val);
+      nworkers = nworkers > 0 ? nworkers : DEFAULT_ISOLATED_WORKERS;
+      name = params[1];
+    }
+  else
+    name = params[0];
 
-  fullsize = strlen (params[0]) + 7; /* lib${bleh}.so\0 */
+  fullsize = strlen (name) + 7; /* lib${bleh}.so\0 */
   if ((libname = malloc (fullsize)) == NULL)
     return NULL;
 
-  snprintf (libname, fullsize, "lib%s.so", params[0]);
-  if (bitu_plugin_ctx_load (app->plugin_ctx, libname) == TA_OK)
+  snprintf (libname, fullsize, "lib%s.so", name);
+  status = bitu_plugin_ctx_load_isolated (app->plugin_ctx, libname, nworkers);
+  if (status == TA_OK)
     {
-      ta_log_info (app->logger, "Plugin %s loaded", libname);
+      bitu_cache_invalidate (app->cache, BITU_CACHE_DEP_PLUGINS);
+      if (nworkers > 0)
+        ta_log_info (app->logger, "Plugin %s loaded in %d workers",
+                     libname, nworkers);
+      else
+        ta_log_info (app->logger, "Plugin %s loaded", libname);
+      free (libname);
       return NULL;
     }
   else
     {
       ta_log_warn (app->logger, "Failed to load plugin %s", libname);
+      free (libname);
       return strdup ("Unable to load module");
     }
 }
 
 
 static char *
-cmd_unload (bitu_app_t *app, char **params, int num_params)
+cmd_unload (bitu_app_t *app, char **params, int TA_UNUSED(num_params))
 {
-  char *error;
-  if ((error = _validate_num_params ("unload", 1, num_params)) != NULL)
-    return error;
-
   if (bitu_plugin_ctx_unload (app->plugin_ctx, params[0]))
     {
+      bitu_cache_invalidate (app->cache, BITU_CACHE_DEP_PLUGINS);
       ta_log_info (app->logger, "Plugin %s unloaded", params[0]);
       return NULL;
     }
@@ -481,117 +1276,79 @@ cmd_unload (bitu_app_t *app, char **params, int num_params)
 
 
 static char *
-cmd_send (bitu_app_t *TA_UNUSED(app),
-          char **TA_UNUSED(params),
-          int TA_UNUSED(num_params))
+cmd_send (bitu_app_t *app, char **params, int num_params)
 {
-  /* const char *jid, *msg; */
-  /* iks *xmpp_msg; */
-  /* char *error; */
-  /* char *result = NULL; */
-
-  /* if ((error = _validate_num_params ("send", 2, num_params)) != NULL) */
-  /*   return error; */
-
-  /* jid = params[0]; */
-  /* msg = params[1]; */
+  bitu_transport_t *transport, *picked;
+  char *msg;
+  int status;
 
-  /* xmpp_msg = iks_make_msg (IKS_TYPE_CHAT, jid, msg); */
-  /* if (ta_xmpp_client_send (app->xmpp, xmpp_msg) != IKS_OK) */
-  /*   result = strdup ("Message not sent"); */
-  /* iks_delete (xmpp_msg); */
-  /* return result; */
-  return NULL;
+  transport = bitu_conn_manager_get_transport (app->connections, params[0]);
+  if (transport == NULL)
+    return strdup ("Transport not found, stop wasting my time");
+
+  /* Not an answer, any connection of the transport's pool can send
+   * it */
+  picked = bitu_transport_pool_pick (transport, params[1]);
+  bitu_transport_unref (transport);
+  msg = _join_params (params + 2, num_params - 2);
+  status = bitu_transport_send (picked, msg, params[1]);
+  bitu_transport_unref (picked);
+  free (msg);
+  return status == TA_OK ? NULL : strdup ("Message not sent");
 }
 
 
 static char *
-cmd_list (bitu_app_t *app, char **params, int num_params)
+cmd_list_plugins (bitu_app_t *app, char **TA_UNUSED(params),
+                  int TA_UNUSED(num_params))
 {
-  char *action, *ret;
-  char *error;
-  if ((error = _validate_num_params ("list", 1, num_params)) != NULL)
-    return error;
-
-  ret = NULL;
-  action = params[0];
-  if (strcmp (action, "plugins") == 0)
-    {
-      ta_list_t *plugins, *tmp;
-      char *val, *tmp_val, *current_pos_str;
-      size_t val_size, current_pos, full_size = 0;
-      plugins = bitu_plugin_ctx_get_list (app->plugin_ctx);
-      for (tmp = plugins; tmp; tmp = tmp->next)
-        {
-          val = tmp->data;
+  ta_list_t *plugins, *tmp;
+  char *val, *tmp_val, *current_pos_str, *ret = NULL;
+  size_t val_size, current_pos, full_size = 0;
 
-          /* This +1 means the \n at the end of each line. */
-          val_size = strlen (val) + 1;
+  plugins = bitu_plugin_ctx_get_list (app->plugin_ctx);
+  for (tmp = plugins; tmp; tmp = tmp->next)
+    {
+      val = tmp->data;
 
-          /* Remembering current end of the full string. */
-          current_pos = full_size;
-          full_size += val_size;
+      /* This +1 means the \n at the end of each line. */
+      val_size = strlen (val) + 1;
 
-          if ((tmp_val = realloc (ret, full_size)) == NULL)
-            {
-              free (ret);
-              return NULL;
-            }
-          else
-            ret = tmp_val;
+      /* Remembering current end of the full string. */
+      current_pos = full_size;
+      full_size += val_size;
 
-          current_pos_str = ret + current_pos;
-          memcpy (current_pos_str, val, val_size);
-          memcpy (current_pos_str + val_size - 1, "\n", 1);
-        }
-
-      /* Removing the last \n. It is not needed in the end of the
-       * string */
-      if (ret != NULL)
+      if ((tmp_val = realloc (ret, full_size)) == NULL)
         {
-          memcpy (ret + full_size - 1, "\0", 1);
-          ta_list_free (plugins);
+          free (ret);
+          return NULL;
         }
-    }
-  else if (strcmp (action, "commands") == 0)
-    {
-      void *iter;
-      char *val, *tmp, *current_pos_str;
-      size_t val_size, current_pos, full_size = 0;
-      iter = hashtable_iter (app->commands);
-      if (iter == NULL)
-        return NULL;
-      do
-        {
-          val = hashtable_iter_key (iter);
+      else
+        ret = tmp_val;
 
-          /* This +1 means the \n at the end of each line. */
-          val_size = strlen (val) + 1;
+      current_pos_str = ret + current_pos;
+      memcpy (current_pos_str, val, val_size);
+      memcpy (current_pos_str + val_size - 1, "\n", 1);
+    }
 
-          /* Remembering current end of the full string. */
-          current_pos = full_size;
-          full_size += val_size;
+  /* Removing the last \n. It is not needed in the end of the
+   * string */
+  if (ret != NULL)
+    memcpy (ret + full_size - 1, "\0", 1);
 
-          if ((tmp = realloc (ret, full_size)) == NULL)
-            {
-              free (ret);
-              return NULL;
-            }
-          else
-            ret = tmp;
+  /* The names are copies, the registry may change under our feet */
+  for (tmp = plugins; tmp; tmp = tmp->next)
+    free (tmp->data);
+  ta_list_free (plugins);
+  return ret;
+}
 
-          current_pos_str = ret + current_pos;
-          memcpy (current_pos_str, val, val_size);
-          memcpy (current_pos_str + val_size - 1, "\n", 1);
-        }
-      while ((iter = hashtable_iter_next (app->commands, iter)));
 
-      /* Removing the last \n. It is not needed in the end of the string */
-      ret[full_size-1] = '\0';
-    }
-  else
-    ret = strdup ("Possible values are `commands' or `plugins'");
-  return ret;
+static char *
+cmd_list_commands (bitu_app_t *TA_UNUSED(app), char **TA_UNUSED(params),
+                   int TA_UNUSED(num_params))
+{
+  return _builtin_list (NULL, "\n");
 }
 
 
@@ -602,65 +1359,79 @@ _log_handler (ta_log_t *TA_UNUSED(log),
               void *user_data)
 {
   bitu_app_t *app = (bitu_app_t *) user_data;
+  pthread_mutex_lock (&app->log_mutex);
   write (app->logfd, data, strlen (data));
   write (app->logfd, "\n", 1);
+  pthread_mutex_unlock (&app->log_mutex);
   return 0;
 }
 
 
-static char *
-cmd_set_log_file (bitu_app_t *app, char **params, int nparams)
+/* Tells whether the log currently goes to `path' */
+static int
+_log_file_is (bitu_app_t *app, const char *path)
 {
-  char *ret = NULL;
-  char *error, *logfile;
-  int logfd;
+  int same;
+  pthread_mutex_lock (&app->log_mutex);
+  same = app->logfile != NULL && strcmp (app->logfile, path) == 0;
+  pthread_mutex_unlock (&app->log_mutex);
+  return same;
+}
 
-  if ((error = _validate_num_params ("set-log-file", 1, nparams)) != NULL)
-    return error;
 
-  /* Cleaning possible old values */
+/* Other threads may be logging, the new file replaces the old one
+ * under the log lock and the old descriptor is closed after that */
+static char *
+cmd_set_log_file (bitu_app_t *app, char **params, int TA_UNUSED(nparams))
+{
+  char *error, *logfile, *oldfile;
+  int logfd, oldfd;
+  size_t bufsize;
 
-  logfile = strdup (params[0]);
-  logfd = open (logfile,
+  logfd = open (params[0],
                 O_WRONLY | O_CREAT | O_APPEND,
                 S_IRUSR | S_IWUSR | S_IRGRP);
-
-  if (logfd == -1)
+  if (logfd == -1 || (logfile = strdup (params[0])) == NULL)
     {
-      size_t bufsize = 128;
-      error = malloc (bufsize);
+      bufsize = strlen (params[0]) + 128;
+      if ((error = malloc (bufsize)) == NULL)
+        return NULL;
       snprintf (error, bufsize,
                 "Unable to open file log file `%s': %s",
-                app->logfile, strerror (errno));
+                params[0], strerror (errno));
+      if (logfd > -1)
+        close (logfd);
       ta_log_error (app->logger, error);
       return error;
     }
-  if (app->logfile)
-    free (app->logfile);
-  if (app->logfd > -1)
-    close (app->logfd);
 
+  pthread_mutex_lock (&app->log_mutex);
+  oldfile = app->logfile;
+  oldfd = app->logfd;
   app->logfile = logfile;
   app->logfd = logfd;
+  pthread_mutex_unlock (&app->log_mutex);
+
+  free (oldfile);
+  if (oldfd > -1)
+    close (oldfd);
 
-  ta_log_info (app->logger, "Setting log file to %s", app->logfile);
+  ta_log_info (app->logger, "Setting log file to %s", logfile);
   ta_log_set_handler (app->logger, (ta_log_handler_func_t) _log_handler, app);
+  ta_log_set_handler (bitu_plugin_ctx_get_logger (app->plugin_ctx),
+                      (ta_log_handler_func_t) _log_handler, app);
 
-  return ret;
+  return NULL;
 }
 
 
 static char *
-cmd_set_log_level (bitu_app_t *app, char **params, int nparams)
+cmd_set_log_level (bitu_app_t *app, char **params, int TA_UNUSED(nparams))
 {
   char *tok = NULL;
-  char *error = NULL;
   ta_log_level_t level;
   ta_list_t *transports = NULL, *tmp = NULL;
 
-  if ((error = _validate_min_num_params ("set-log-level", 1, nparams)) != NULL)
-    return error;
-
   tok = params[0];
 
   if (strcmp (tok, "DEBUG") == 0)
@@ -675,6 +1446,7 @@ cmd_set_log_level (bitu_app_t *app, char **params, int nparams)
     level = TA_LOG_CRITICAL;
 
   ta_log_set_level (app->logger, level);
+  ta_log_set_level (bitu_plugin_ctx_get_logger (app->plugin_ctx), level);
 
   /* Iterating over all the transports setting their logger
    * configuration (if available). */
@@ -683,97 +1455,523 @@ cmd_set_log_level (bitu_app_t *app, char **params, int nparams)
     {
       ta_log_t *logger;
       bitu_transport_t *transport;
-      if ((transport = bitu_conn_manager_get_transport (app->connections, tmp->data)) == NULL)
-        return NULL;
+      transport = bitu_conn_manager_get_transport (app->connections, tmp->data);
+      free (tmp->data);
+      if (transport == NULL)
+        continue;
       if ((logger = bitu_transport_get_logger (transport)) != NULL)
         ta_log_set_level (logger, level);
+      bitu_transport_unref (transport);
     }
+  ta_list_free (transports);
 
   return NULL;
 }
 
 
 static char *
-cmd_set_log_use_colors (bitu_app_t *app, char **params, int nparams)
+cmd_set_log_use_colors (bitu_app_t *app, char **params, int TA_UNUSED(nparams))
 {
-  char *error = NULL;
   ta_log_t *logger;
   int val;
   ta_list_t *transports = NULL, *tmp = NULL;
 
-  if ((error = _validate_num_params ("set-log-use-colors", 1, nparams))
-      != NULL)
-    return error;
-
   val = strcmp (params[0], "true") == 0;
 
   logger = app->logger;
   ta_log_set_use_colors (logger, val);
+  ta_log_set_use_colors (bitu_plugin_ctx_get_logger (app->plugin_ctx), val);
 
   /* Iterating over all the transports setting their logger
    * configuration (if available). */
   transports = bitu_conn_manager_get_transports (app->connections);
   for (tmp = transports; tmp; tmp = tmp->next)
     {
-      bitu_transport_t *transport = tmp->data;
-      if ((transport = bitu_conn_manager_get_transport (app->connections, tmp->data)) == NULL)
-        return NULL;
+      bitu_transport_t *transport;
+      transport = bitu_conn_manager_get_transport (app->connections, tmp->data);
+      free (tmp->data);
+      if (transport == NULL)
+        continue;
       if ((logger = bitu_transport_get_logger (transport)) != NULL)
         ta_log_set_use_colors (logger, val);
+      bitu_transport_unref (transport);
     }
+  ta_list_free (transports);
 
   return NULL;
 }
 
 
-/* -- Helper functions -- */
-
-
 static char *
-_validate_num_params (const char *cmd, int x, int y)
+cmd_cache (bitu_app_t *app, char **params, int nparams)
 {
-  if (x != y)
+  char *error;
+  uint64_t ttl = 0;
+  int per_sender = 0;
+  const _bitu_builtin_t *builtin;
+  bitu_cache_dep_t dep = BITU_CACHE_DEP_PLUGINS;
+
+  /* `cache stats' */
+  if (nparams == 1 && strcmp (params[0], "stats") == 0)
+    return bitu_cache_stats (app->cache);
+
+  /* `cache <command> <ttl|off> [per-sender]' */
+  if (nparams < 2)
+    return strdup ("Usage: cache stats | cache <command> <ttl|off> [per-sender]");
+  if (nparams == 3)
     {
-      char *error = malloc (128);
-      snprintf (error, 128, "Command `%s' takes %d param(s), %d given",
-                cmd, x, y);
-      return error;
+      if (strcmp (params[2], "per-sender") != 0)
+        return strdup ("The only option accepted is `per-sender'");
+      per_sender = 1;
+    }
+  if (strcmp (params[1], "off") != 0 &&
+      (bitu_util_parse_duration (params[1], &ttl) != TA_OK || ttl == 0))
+    return strdup ("Invalid TTL, try something like `5s' or `500ms'");
+
+  /* Built in commands must be in the white list. Anything else is
+   * considered a plugin. */
+  if ((builtin = _builtin_find (params[0], NULL)) != NULL)
+    {
+      if (builtin->cache == BUILTIN_CACHE_NEVER)
+        {
+          error = malloc (128);
+          snprintf (error, 128, "Command `%s' can't be cached", params[0]);
+          return error;
+        }
+      dep = builtin->cache;
     }
+
+  if (bitu_cache_set_policy (app->cache, params[0], ttl, per_sender, dep) != TA_OK)
+    return strdup ("Unable to change the cache policy");
   return NULL;
 }
 
 
 static char *
-_validate_min_num_params (const char *cmd, int x, int y)
+cmd_stats_commands (bitu_app_t *app, char **TA_UNUSED(params),
+                    int TA_UNUSED(num_params))
+{
+  return bitu_stats_report (app->stats);
+}
+
+
+static char *
+cmd_stats_plugins (bitu_app_t *app, char **TA_UNUSED(params),
+                   int TA_UNUSED(num_params))
+{
+  return bitu_stats_report (bitu_plugin_ctx_get_stats (app->plugin_ctx));
+}
+
+
+/* -- Reloading --
+ *
+ * A reloaded config is compared with what is running instead of being
+ * executed again, so unchanged transports keep their sessions and
+ * commands keep being processed meanwhile:
+ *
+ *  - transports, plugins and variables declared are added, loaded or
+ *    set only when they're missing or different;
+ *  - the ones declared by the previous config and not by the new one
+ *    are removed, unloaded or unset. Changes made from the shell to
+ *    anything the config never declared are left alone;
+ *  - `set-log-file' runs again, so log files can be rotated;
+ *  - any other command runs only when it's not in the previous
+ *    config. */
+
+
+static void
+_free_config (ta_list_t *config)
 {
-  if (y < x)
+  ta_list_t *tmp;
+  for (tmp = config; tmp; tmp = tmp->next)
+    bitu_command_free (tmp->data);
+  ta_list_free (config);
+}
+
+
+/* Checks the name and the number of params of a config command and
+ * returns its params */
+static const char **
+_config_match (bitu_command_t *command, const char *name, int nparams)
+{
+  const char *cname = bitu_command_get_name (command);
+  if (cname == NULL || strcmp (cname, name) != 0 ||
+      bitu_command_get_nparams (command) != nparams)
+    return NULL;
+  return bitu_command_get_params (command);
+}
+
+
+/* The uri of a `transport add' command, or of the connection added by
+ * a `transport pool' one */
+static const char *
+_config_transport (bitu_command_t *command)
+{
+  const char **params = _config_match (command, "transport", 2);
+  if (params && strcmp (params[0], "add") == 0)
+    return params[1];
+  params = _config_match (command, "transport", 3);
+  return params && strcmp (params[0], "pool") == 0 ? params[2] : NULL;
+}
+
+
+/* The plugin name of a `load [--isolated]' command */
+static const char *
+_config_plugin (bitu_command_t *command, int *isolated)
+{
+  const char **params;
+  *isolated = 0;
+  if ((params = _config_match (command, "load", 1)) != NULL)
+    return params[0];
+  if ((params = _config_match (command, "load", 2)) != NULL)
     {
-      char *error = malloc (128);
-      snprintf (error, 128, "Command `%s' takes %d param(s), %d given",
-                cmd, x, y);
-      return error;
+      *isolated = 1;
+      return params[1];
     }
   return NULL;
 }
 
 
-/* -- Entry point: add new commands here -- */
+/* Tells whether a config command is a `probe add' */
+static const char *
+_config_probe (bitu_command_t *command)
+{
+  const char *name = bitu_command_get_name (command);
+  const char **params = bitu_command_get_params (command);
+  if (name == NULL || strcmp (name, "probe") != 0 ||
+      bitu_command_get_nparams (command) < 2 || strcmp (params[0], "add") != 0)
+    return NULL;
+  return params[1];
+}
 
 
+/* Looks for a command in `config' that declares the same transport,
+ * plugin or variable of `command', or that is identical to it */
+static bitu_command_t *
+_config_find (ta_list_t *config, bitu_command_t *command)
+{
+  ta_list_t *tmp;
+  const char *key, *other;
+  const char **params;
+  int isolated;
+
+  for (tmp = config; tmp; tmp = tmp->next)
+    {
+      if ((key = _config_transport (command)) != NULL)
+        other = _config_transport (tmp->data);
+      else if ((key = _config_plugin (command, &isolated)) != NULL)
+        other = _config_plugin (tmp->data, &isolated);
+      else if ((params = _config_match (command, "set", 2)) != NULL)
+        {
+          key = params[0];
+          params = _config_match (tmp->data, "set", 2);
+          other = params ? params[0] : NULL;
+        }
+      else
+        {
+          key = bitu_command_get_cmd (command);
+          other = bitu_command_get_cmd (tmp->data);
+        }
+      if (other && strcmp (key, other) == 0)
+        return tmp->data;
+    }
+  return NULL;
+}
+
+
+/* Disconnecting is not immediate and a transport can't be removed
+ * while it's running */
 static void
-_register_commands (bitu_app_t *app)
-{
-  hashtable_set (app->commands, "help", cmd_help);
-  hashtable_set (app->commands, "set", cmd_set);
-  hashtable_set (app->commands, "get", cmd_get);
-  hashtable_set (app->commands, "unset", cmd_unset);
-  hashtable_set (app->commands, "env", cmd_env);
-  hashtable_set (app->commands, "transport", cmd_transport);
-  hashtable_set (app->commands, "load", cmd_load);
-  hashtable_set (app->commands, "unload", cmd_unload);
-  hashtable_set (app->commands, "send", cmd_send);
-  hashtable_set (app->commands, "list", cmd_list);
-  hashtable_set (app->commands, "set-log-file", cmd_set_log_file);
-  hashtable_set (app->commands, "set-log-level", cmd_set_log_level);
-  hashtable_set (app->commands, "set-log-use-colors", cmd_set_log_use_colors);
+_reload_remove_transport (bitu_app_t *app, const char *uri)
+{
+  bitu_transport_t *transport;
+
+  transport = bitu_conn_manager_get_transport (app->connections, uri);
+  if (transport == NULL)
+    return;
+  bitu_conn_manager_shutdown (app->connections, uri);
+  bitu_transport_wait_stopped (transport, 5000000);
+  bitu_transport_unref (transport);
+  if (bitu_conn_manager_remove (app->connections, uri) == BITU_CONN_STATUS_OK)
+    ta_log_info (app->logger, "Transport %s removed", uri);
+  else
+    ta_log_warn (app->logger, "Transport %s is still running, it was "
+                 "disconnected but not removed", uri);
+}
+
+
+/* Undoes what a command of the previous config did, if the new config
+ * doesn't declare it anymore. Returns 1 when something changed. */
+static int
+_reload_undo (bitu_app_t *app, bitu_command_t *command, ta_list_t *config)
+{
+  const char *key, **params;
+  char *value;
+  int isolated, changed = 0;
+
+  if (_config_find (config, command) != NULL)
+    return 0;
+
+  if ((key = _config_transport (command)) != NULL)
+    {
+      _reload_remove_transport (app, key);
+      changed = 1;
+    }
+  else if ((key = _config_plugin (command, &isolated)) != NULL)
+    {
+      if ((changed = bitu_plugin_ctx_unload (app->plugin_ctx, key)))
+        {
+          bitu_cache_invalidate (app->cache, BITU_CACHE_DEP_PLUGINS);
+          ta_log_info (app->logger, "Plugin %s unloaded", key);
+        }
+    }
+  else if ((params = _config_match (command, "set", 2)) != NULL)
+    {
+      /* Unless someone changed it after the config was applied */
+      value = chashtable_get_copy (app->environment, params[0],
+                                   (copy_fn) strdup);
+      if (value && strcmp (value, params[1]) == 0)
+        {
+          free (cmd_unset (app, (char **) params, 1));
+          changed = 1;
+        }
+      free (value);
+    }
+  else if (_config_match (command, "set-whitelist", 1) != NULL)
+    {
+      bitu_whitelist_set_file (NULL);
+      ta_log_info (app->logger, "Whitelist turned off");
+      changed = 1;
+    }
+  else if ((key = _config_probe (command)) != NULL)
+    {
+      params = bitu_command_get_params (command);
+      value = _join_params ((char **) params + 1,
+                              bitu_command_get_nparams (command) - 1);
+      if ((changed = _probe_change (app, value, 0)))
+        ta_log_info (app->logger, "Probe removed: %s", value);
+      free (value);
+    }
+  return changed;
+}
+
+
+/* Applies a command of the new config when the running state doesn't
+ * match it. Returns 1 when something changed. */
+static int
+_reload_apply (bitu_app_t *app, bitu_command_t *command,
+               ta_list_t **new_transports)
+{
+  bitu_transport_t *transport;
+  bitu_plugin_t *plugin;
+  const char *key, **params;
+  char *value;
+  int isolated, same;
+
+  if ((key = _config_transport (command)) != NULL)
+    {
+      if ((transport = bitu_conn_manager_get_transport (app->connections,
+                                                        key)) != NULL)
+        {
+          bitu_transport_unref (transport);
+          return 0;
+        }
+      _exec_config_command (app, command);
+      *new_transports = ta_list_append (*new_transports, (void *) key);
+      return 1;
+    }
+
+  if ((key = _config_plugin (command, &isolated)) != NULL)
+    {
+      /* Loading again replaces the plugin, with or without workers */
+      if ((plugin = bitu_plugin_ctx_find (app->plugin_ctx, key)) != NULL)
+        {
+          same = bitu_plugin_is_isolated (plugin) == isolated;
+          bitu_plugin_unref (plugin);
+          if (same)
+            return 0;
+        }
+      _exec_config_command (app, command);
+      return 1;
+    }
+
+  if ((params = _config_match (command, "set", 2)) != NULL)
+    {
+      value = chashtable_get_copy (app->environment, params[0],
+                                   (copy_fn) strdup);
+      same = value && strcmp (value, params[1]) == 0;
+      free (value);
+      if (same)
+        return 0;
+      _exec_config_command (app, command);
+      return 1;
+    }
+
+  /* The log file is opened again only when its path changed, the
+   * whitelist is read again anyway */
+  if ((params = _config_match (command, "set-log-file", 1)) != NULL)
+    {
+      if (_log_file_is (app, params[0]))
+        return 0;
+      _exec_config_command (app, command);
+      return 1;
+    }
+  if (_config_match (command, "set-whitelist", 1) != NULL ||
+      _config_find (app->config, command) == NULL)
+    {
+      _exec_config_command (app, command);
+      return 1;
+    }
+  return 0;
+}
+
+
+/* Takes ownership of the list and of its commands, like
+ * bitu_app_load_config() */
+int
+bitu_app_reload_config (bitu_app_t *app, ta_list_t *commands)
+{
+  ta_list_t *tmp, *new_transports = NULL;
+  int changes = 0;
+
+  ta_log_info (app->logger, "Reloading the configuration");
+
+  for (tmp = app->config; tmp; tmp = tmp->next)
+    changes += _reload_undo (app, tmp->data, commands);
+  for (tmp = commands; tmp; tmp = tmp->next)
+    changes += _reload_apply (app, tmp->data, &new_transports);
+
+  /* New transports connect together, like at startup. Nothing was
+   * consuming commands if no transport was running yet. */
+  if (_run_transports (app, new_transports) > 0)
+    _start_consumer (app);
+  ta_list_free (new_transports);
+
+  _free_config (app->config);
+  app->config = commands;
+  ta_log_info (app->logger, "Configuration reloaded, %d change(s) applied",
+               changes);
+  return TA_OK;
+}
+
+
+/* -- Built in commands table --
+ *
+ * Commands are declared in builtins.def. The slots of the perfect hash
+ * come from builtins-table.h, generated from the same file at build
+ * time, and hold the position of each command in the array below. */
+
+
+static const _bitu_builtin_t _builtins[] = {
+#define BUILTIN(name,sub,handler,min,max,cache) \
+  { name, sub, handler, min, max, BUILTIN_CACHE_##cache },
+#include "builtins.def"
+#undef BUILTIN
+};
+
+/* Fails to compile when builtins-table.h is older than builtins.def */
+typedef char _bitu_builtins_check[sizeof (_builtins) / sizeof (_builtins[0])
+                                  == BITU_BUILTINS_COUNT ? 1 : -1];
+
+
+static const _bitu_builtin_t *
+_builtin_find (const char *name, const char *sub)
+{
+  const _bitu_builtin_t *builtin;
+  uint32_t hash = bitu_builtin_hash (BITU_BUILTINS_SEED, name, sub);
+  int i = _bitu_builtin_slots[bitu_builtin_slot (hash, BITU_BUILTINS_BITS)];
+
+  if (i == -1)
+    return NULL;
+  builtin = &_builtins[i];
+  if (strcmp (builtin->name, name) != 0)
+    return NULL;
+  if (sub == NULL || builtin->sub == NULL)
+    return sub == builtin->sub ? builtin : NULL;
+  return strcmp (builtin->sub, sub) == 0 ? builtin : NULL;
+}
+
+
+/* Names of the commands with a handler, or only the subcommands of
+ * `name' when it's given, joined by `sep' */
+static char *
+_builtin_list (const char *name, const char *sep)
+{
+  char *list;
+  size_t i;
+  const char *prefix = "";
+  ta_buf_t buf = TA_BUF_INIT;
+
+  ta_buf_alloc (&buf, 128);
+  for (i = 0; i < BITU_BUILTINS_COUNT; i++)
+    {
+      if (_builtins[i].handler == NULL)
+        continue;
+      if (name != NULL)
+        {
+          if (strcmp (_builtins[i].name, name) != 0)
+            continue;
+          ta_buf_catf (&buf, "%s%s", prefix, _builtins[i].sub);
+        }
+      else if (_builtins[i].sub != NULL)
+        ta_buf_catf (&buf, "%s%s %s", prefix, _builtins[i].name,
+                     _builtins[i].sub);
+      else
+        ta_buf_catf (&buf, "%s%s", prefix, _builtins[i].name);
+      prefix = sep;
+    }
+  list = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return list;
+}
+
+
+static char *
+_builtin_run (bitu_app_t *app, const _bitu_builtin_t *builtin,
+              char **params, int num_params)
+{
+  const _bitu_builtin_t *sub;
+  char *error, *subs;
+
+  /* The first parameter chooses the subcommand to run */
+  if (builtin->handler == NULL)
+    {
+      if (num_params == 0 ||
+          (sub = _builtin_find (builtin->name, params[0])) == NULL)
+        {
+          subs = _builtin_list (builtin->name, " | ");
+          error = malloc (256);
+          snprintf (error, 256, "Usage: %s <%s>", builtin->name, subs);
+          free (subs);
+          return error;
+        }
+      builtin = sub;
+      params++;
+      num_params--;
+    }
+
+  if (num_params < builtin->min_params ||
+      (builtin->max_params != -1 && num_params > builtin->max_params))
+    {
+      error = malloc (128);
+      if (builtin->min_params == builtin->max_params)
+        snprintf (error, 128, "Command `%s%s%s' takes %d param(s), %d given",
+                  builtin->name, builtin->sub ? " " : "",
+                  builtin->sub ? builtin->sub : "",
+                  builtin->min_params, num_params);
+      else if (builtin->max_params == -1)
+        snprintf (error, 128,
+                  "Command `%s%s%s' takes at least %d param(s), %d given",
+                  builtin->name, builtin->sub ? " " : "",
+                  builtin->sub ? builtin->sub : "",
+                  builtin->min_params, num_params);
+      else
+        snprintf (error, 128,
+                  "Command `%s%s%s' takes %d to %d params, %d given",
+                  builtin->name, builtin->sub ? " " : "",
+                  builtin->sub ? builtin->sub : "",
+                  builtin->min_params, builtin->max_params, num_params);
+      return error;
+    }
+  return builtin->handler (app, params, num_params);
 }
@@ -19,24 +19,55 @@
 #ifndef BITU_APP_H_
 #define BITU_APP_H_ 1
 
+#include <pthread.h>
 #include <taningia/taningia.h>
 #include <bitu/transport.h>
 #include <bitu/loader.h>
 #include <bitu/server.h>
+#include <bitu/stats.h>
 
 #include "hashtable.h"
+#include "hashtable-concurrent.h"
+#include "cache.h"
+#include "envstore.h"
 
 typedef struct {
   /* The main components */
-  hashtable_t *environment;
-  hashtable_t *commands;
+  chashtable_t *environment;
   bitu_conn_manager_t *connections;
   bitu_plugin_ctx_t *plugin_ctx;
+  bitu_cache_t *cache;
+  bitu_stats_t *stats;
 
-  /* Logging stuff */
+  /* Changes to the environment go through it, so they're saved once
+   * set-env-store gives it a file */
+  bitu_envstore_t *envstore;
+
+  /* Commands of the config file last applied, see the reloading
+   * section in app.c */
+  ta_list_t *config;
+  int consuming;
+
+  /* Commands being executed, see the single flight section in app.c */
+  hashtable_t *flights;
+  pthread_mutex_t flights_mutex;
+
+  /* Probe commands and the thread that publishes their results as the
+   * bot's status, see the status publishing section in app.c */
+  ta_list_t *probes;
+  pthread_mutex_t probes_mutex;
+  pthread_cond_t probes_wakeup;
+  pthread_t publisher;
+  int publishing;
+  int probes_changed;
+  int probes_stop;
+
+  /* Logging stuff. The mutex protects the log file, that may change
+   * while other threads are logging. */
   ta_log_t *logger;
   char *logfile;
   int logfd;
+  pthread_mutex_t log_mutex;
   int logflags;
 } bitu_app_t;
 
@@ -44,6 +75,7 @@ typedef struct {
 bitu_app_t *bitu_app_new (void);
 void bitu_app_free (bitu_app_t *app);
 int bitu_app_load_config (bitu_app_t *app, ta_list_t *config);
+int bitu_app_reload_config (bitu_app_t *app, ta_list_t *config);
 int bitu_app_dump_config (bitu_app_t *app);
 int bitu_app_exec_command (bitu_app_t *app, bitu_command_t *command, char **output);
 int bitu_app_run_transports (bitu_app_t *app);
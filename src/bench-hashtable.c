@@ -0,0 +1,340 @@
+/* bench-hashtable.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+#include "intern.h"
+
+/* Times the main hashtable operations with string keys shaped like
+ * the ones we use (env var names, client ids and transport uris). Run
+ * it with a number of keys as its only argument to try other sizes. */
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report (const char *what, int n, double start)
+{
+  printf ("  %-12s %8.1f ns/op\n", what, (now () - start) / n);
+}
+
+/* What hash_string used to be, for comparison */
+static unsigned int
+hash_djb2 (const void *key)
+{
+  const char *str = (const char *) key;
+  unsigned int hash = 5381, c;
+  while ((c = (unsigned int) *str++))
+    hash = ((hash << 5) + hash) + c;
+  return hash;
+}
+
+static void
+bench_hash (void)
+{
+  static const int lengths[] = { 8, 32, 128, 1024, 0 };
+  char key[1025];
+  double start;
+  unsigned int sum = 0;
+  int i, j, n;
+
+  printf ("hash throughput\n");
+  for (i = 0; lengths[i]; i++)
+    {
+      memset (key, 'k', lengths[i]);
+      key[lengths[i]] = '\0';
+      n = 50000000 / lengths[i];
+
+      start = now ();
+      for (j = 0; j < n; j++)
+        {
+          key[0] = 'a' + (j & 15);
+          sum += hash_djb2 (key);
+        }
+      printf ("  djb2    %4d bytes %8.2f GB/s\n", lengths[i],
+              (double) n * lengths[i] / (now () - start));
+
+      start = now ();
+      for (j = 0; j < n; j++)
+        {
+          key[0] = 'a' + (j & 15);
+          sum += hash_string (key);
+        }
+      printf ("  siphash %4d bytes %8.2f GB/s\n", lengths[i],
+              (double) n * lengths[i] / (now () - start));
+    }
+
+  /* Keeps the compiler from throwing the loops away */
+  if (sum == 42)
+    printf ("\n");
+}
+
+/* "Aa" and "B@" have the same djb2 hash and so does any string made of
+ * them, which is what someone flooding the environment would send */
+static void
+bench_flood (int bits)
+{
+  static const char *blocks[] = { "Aa", "B@" };
+  key_hash_fn hashes[] = { hash_djb2, hash_string };
+  const char *names[] = { "djb2", "siphash" };
+  hashtable_t *table;
+  char **keys;
+  double start;
+  int i, j, h, n = 1 << bits;
+
+  keys = malloc (n * sizeof (char *));
+  for (i = 0; i < n; i++)
+    {
+      keys[i] = malloc (bits * 2 + 1);
+      for (j = 0; j < bits; j++)
+        memcpy (keys[i] + j * 2, blocks[(i >> j) & 1], 2);
+      keys[i][bits * 2] = '\0';
+    }
+
+  printf ("%d colliding keys\n", n);
+  for (h = 0; h < 2; h++)
+    {
+      table = hashtable_create (hashes[h], string_equal, NULL, NULL);
+      start = now ();
+      for (i = 0; i < n; i++)
+        hashtable_set (table, keys[i], keys[i]);
+      for (i = 0; i < n; i++)
+        hashtable_get (table, keys[i]);
+      printf ("  %-8s %10.1f ns/op\n", names[h], (now () - start) / n / 2);
+      hashtable_destroy (table);
+    }
+
+  for (i = 0; i < n; i++)
+    free (keys[i]);
+  free (keys);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Latency of each single insert while a table grows from empty. Growing
+ * shows up in the tail, not in the average. */
+static void
+bench_grow (int n)
+{
+  hashtable_t *table;
+  char **keys, buf[64];
+  double *times, start;
+  int i;
+
+  keys = malloc (n * sizeof (char *));
+  times = malloc (n * sizeof (double));
+  for (i = 0; i < n; i++)
+    {
+      snprintf (buf, sizeof (buf), "xmpp://bot%d@example.com/res", i);
+      keys[i] = strdup (buf);
+    }
+
+  table = hashtable_create (hash_string, string_equal, NULL, NULL);
+  for (i = 0; i < n; i++)
+    {
+      start = now ();
+      hashtable_set (table, keys[i], keys[i]);
+      times[i] = now () - start;
+    }
+  hashtable_destroy (table);
+
+  qsort (times, n, sizeof (double), compare_doubles);
+  printf ("growing to %d keys\n", n);
+  printf ("  p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f ns\n",
+          times[n / 2], times[n / 100 * 99], times[n / 1000 * 999],
+          times[n - 1]);
+
+  for (i = 0; i < n; i++)
+    free (keys[i]);
+  free (keys);
+  free (times);
+}
+
+/* Looking up command names the way the dispatcher does, with parsed
+ * names (fresh copies) and with interned ones carrying their hash */
+static void
+bench_interned (void)
+{
+  static const char *names[] = {
+    "help", "set", "get", "unset", "env", "transport", "load", "unload",
+    "send", "list", "set-log-file", "set-log-level", "set-log-use-colors",
+    "cache", "stats", NULL
+  };
+  hashtable_t *table;
+  const char *interned[16];
+  char *copies[16];
+  double start;
+  int i, n, found = 0;
+
+  table = hashtable_create (hash_string, string_equal, NULL, NULL);
+  for (n = 0; names[n]; n++)
+    {
+      interned[n] = bitu_intern (names[n]);
+      copies[n] = strdup (names[n]);
+      hashtable_set_hashed (table, (void *) interned[n],
+                            bitu_intern_hash (interned[n]), copies[n]);
+    }
+
+  printf ("command name lookups\n");
+  start = now ();
+  for (i = 0; i < 10000000; i++)
+    found += hashtable_get (table, copies[i % n]) != NULL;
+  report ("plain", 10000000, start);
+
+  start = now ();
+  for (i = 0; i < 10000000; i++)
+    found += hashtable_get_hashed (table, interned[i % n],
+                                   bitu_intern_hash (interned[i % n])) != NULL;
+  report ("interned", 10000000, start);
+  assert (found == 20000000);
+
+  hashtable_destroy (table);
+  for (i = 0; i < n; i++)
+    {
+      bitu_intern_release (interned[i]);
+      free (copies[i]);
+    }
+}
+
+static void
+bench (int n)
+{
+  hashtable_t *table;
+  char **keys, **missing, buf[64];
+  void *iter;
+  double start;
+  int *order, i, j, tmp, rounds, found = 0;
+
+  keys = malloc (n * sizeof (char *));
+  missing = malloc (n * sizeof (char *));
+  for (i = 0; i < n; i++)
+    {
+      snprintf (buf, sizeof (buf), "xmpp://bot%d@example.com/res", i);
+      keys[i] = strdup (buf);
+      snprintf (buf, sizeof (buf), "irc://bot%d@example.com/#chan", i);
+      missing[i] = strdup (buf);
+    }
+
+  /* Lookups don't follow the insertion order, otherwise tables that
+   * allocate one node per pair get them all in sequence */
+  order = malloc (n * sizeof (int));
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  srand (n);
+  for (i = n - 1; i > 0; i--)
+    {
+      j = rand () % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+
+  /* Small tables are timed many times to get meaningful numbers */
+  rounds = n < 1000000 ? 1000000 / n : 1;
+  printf ("%d keys (%d rounds)\n", n, rounds);
+
+  table = hashtable_create (hash_string, string_equal, NULL, NULL);
+  start = now ();
+  for (i = 0; i < n; i++)
+    hashtable_set (table, keys[i], keys[i]);
+  report ("insert", n, start);
+  hashtable_destroy (table);
+
+  table = hashtable_create (hash_string, string_equal, NULL, NULL);
+  for (i = 0; i < n; i++)
+    hashtable_set (table, missing[i], missing[i]);
+  for (i = 0; i < n; i++)
+    hashtable_set (table, keys[i], keys[i]);
+  for (i = 0; i < n; i++)
+    hashtable_del (table, missing[i]);
+
+  start = now ();
+  for (rounds = rounds ? rounds : 1, i = 0; i < n * rounds; i++)
+    found += hashtable_get (table, keys[order[i % n]]) != NULL;
+  report ("lookup hit", n * rounds, start);
+  assert (found == n * rounds);
+
+  start = now ();
+  for (i = 0; i < n * rounds; i++)
+    found -= hashtable_get (table, missing[order[i % n]]) == NULL;
+  report ("lookup miss", n * rounds, start);
+  assert (found == 0);
+
+  start = now ();
+  for (i = 0; i < rounds; i++)
+    if ((iter = hashtable_iter (table)) != NULL)
+      do
+        found++;
+      while ((iter = hashtable_iter_next (table, iter)));
+  report ("iterate", n * rounds, start);
+  assert (found == n * rounds);
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    hashtable_del (table, keys[i]);
+  report ("delete", n, start);
+  assert (table->size == 0);
+  hashtable_destroy (table);
+
+  for (i = 0; i < n; i++)
+    {
+      free (keys[i]);
+      free (missing[i]);
+    }
+  free (keys);
+  free (missing);
+  free (order);
+}
+
+int
+main (int argc, char **argv)
+{
+  /* The seed is read on the first call, keep it out of the numbers */
+  hash_string ("");
+
+  if (argc > 1)
+    {
+      bench (atoi (argv[1]));
+      return 0;
+    }
+  bench_hash ();
+  bench_flood (12);
+  bench_grow (1000000);
+  bench_interned ();
+  bench (16);
+  bench (1000);
+  bench (100000);
+  bench (1000000);
+  return 0;
+}
@@ -0,0 +1,53 @@
+/* builtins.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_BUILTINS_H_
+#define BITU_BUILTINS_H_ 1
+
+#include <stdint.h>
+
+/* Hash used to find built in commands. gen-builtins searches for a
+ * seed that gives each entry of builtins.def its own slot among the
+ * top `bits' bits of the hash, so a lookup is a single probe and a
+ * single string comparison. Subcommands are hashed as if they were
+ * written "command subcommand". */
+
+static inline uint32_t
+bitu_builtin_hash (uint32_t seed, const char *name, const char *sub)
+{
+  uint32_t h = 2166136261u ^ seed;
+
+  for (; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  if (sub != NULL)
+    {
+      h = (h ^ ' ') * 16777619u;
+      for (; *sub; sub++)
+        h = (h ^ (unsigned char) *sub) * 16777619u;
+    }
+
+  /* FNV leaves the high bits poorly mixed */
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+#define bitu_builtin_slot(hash,bits) ((hash) >> (32 - (bits)))
+
+#endif /* BITU_BUILTINS_H_ */
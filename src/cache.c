@@ -0,0 +1,433 @@
+/* cache.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <taningia/taningia.h>
+#include <bitu/util.h>
+#include <bitu/transport.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+#include "cache.h"
+
+/* Upper limit of answers kept at the same time. When it is reached,
+ * expired entries are dropped and, if that's not enough, new answers
+ * are just not cached. */
+#define CACHE_MAX_ENTRIES 1024
+
+
+typedef struct
+{
+  uint64_t ttl;
+  int per_sender;
+  bitu_cache_dep_t dep;
+  unsigned long hits;
+  unsigned long misses;
+} _bitu_cache_policy_t;
+
+
+typedef struct
+{
+  char *output;
+  uint64_t expires;
+  uint64_t generation;
+} _bitu_cache_entry_t;
+
+
+/* Variables are tracked with a clock that ticks on every change. Each
+ * one remembers when it last changed and an answer that read it is
+ * fresh while that's not after the answer's own tick. Variables not in
+ * the table last changed at `floor', that moves forward when the table
+ * is emptied to keep it small. */
+struct bitu_cache
+{
+  hashtable_t *policies;
+  hashtable_t *entries;
+  uint64_t generations[BITU_CACHE_DEP_MAX];
+  hashtable_t *variables;
+  uint64_t clock;
+  uint64_t floor;
+  unsigned long hits;
+  unsigned long misses;
+  pthread_mutex_t mutex;
+};
+
+
+static void
+_bitu_cache_entry_free (_bitu_cache_entry_t *entry)
+{
+  free (entry->output);
+  free (entry);
+}
+
+
+static hashtable_t *
+_bitu_cache_entries_new (void)
+{
+  return hashtable_create (hash_string, string_equal, free,
+                           (free_fn) _bitu_cache_entry_free);
+}
+
+
+bitu_cache_t *
+bitu_cache_new (void)
+{
+  bitu_cache_t *cache;
+  if ((cache = calloc (1, sizeof (bitu_cache_t))) == NULL)
+    return NULL;
+  cache->policies = hashtable_create (hash_string, string_equal, free, free);
+  cache->entries = _bitu_cache_entries_new ();
+  cache->variables = hashtable_create (hash_string, string_equal, free, free);
+  pthread_mutex_init (&cache->mutex, NULL);
+  return cache;
+}
+
+
+void
+bitu_cache_free (bitu_cache_t *cache)
+{
+  hashtable_destroy (cache->policies);
+  hashtable_destroy (cache->entries);
+  hashtable_destroy (cache->variables);
+  pthread_mutex_destroy (&cache->mutex);
+  free (cache);
+}
+
+
+/* A ttl of zero disables caching for the given command name */
+int
+bitu_cache_set_policy (bitu_cache_t *cache, const char *name, uint64_t ttl,
+                       int per_sender, bitu_cache_dep_t dep)
+{
+  _bitu_cache_policy_t *policy;
+  int status = TA_OK;
+
+  pthread_mutex_lock (&cache->mutex);
+
+  /* Answers cached under the old policy are not valid anymore */
+  hashtable_destroy (cache->entries);
+  cache->entries = _bitu_cache_entries_new ();
+
+  if (ttl == 0)
+    hashtable_del (cache->policies, name);
+  else if ((policy = calloc (1, sizeof (_bitu_cache_policy_t))) == NULL)
+    status = TA_ERROR;
+  else
+    {
+      policy->ttl = ttl;
+      policy->per_sender = per_sender;
+      policy->dep = dep;
+      if (hashtable_set (cache->policies, strdup (name), policy) == -1)
+        status = TA_ERROR;
+    }
+  pthread_mutex_unlock (&cache->mutex);
+  return status;
+}
+
+
+static char *
+_bitu_cache_key (_bitu_cache_policy_t *policy, bitu_command_t *command)
+{
+  const char *from = bitu_command_get_from (command);
+  const char *key = bitu_command_get_key (command);
+  size_t len;
+  char *full;
+
+  if (!policy->per_sender)
+    return strdup (key);
+
+  from = from ? from : "";
+  len = strlen (from) + strlen (key) + 2;
+  if ((full = malloc (len)) == NULL)
+    return NULL;
+  snprintf (full, len, "%s\n%s", from, key);
+  return full;
+}
+
+
+/* The variable read by a command of an ENV_VAR policy */
+static const char *
+_bitu_cache_variable (bitu_command_t *command)
+{
+  if (bitu_command_get_nparams (command) < 1)
+    return NULL;
+  return bitu_command_get_params (command)[0];
+}
+
+
+/* Tells whether an answer computed at `generation' still holds. Must
+ * be called with the lock held. */
+static int
+_bitu_cache_is_fresh (bitu_cache_t *cache, _bitu_cache_policy_t *policy,
+                      bitu_command_t *command, uint64_t generation)
+{
+  const char *name;
+  uint64_t *changed;
+
+  if (policy->dep != BITU_CACHE_DEP_ENV_VAR)
+    return generation == cache->generations[policy->dep];
+  if ((name = _bitu_cache_variable (command)) == NULL)
+    return 0;
+  changed = hashtable_get (cache->variables, name);
+  return (changed ? *changed : cache->floor) <= generation;
+}
+
+
+/* The generation an answer computed from now on belongs to. Must be
+ * called with the lock held. */
+static uint64_t
+_bitu_cache_generation (bitu_cache_t *cache, _bitu_cache_policy_t *policy)
+{
+  if (policy->dep == BITU_CACHE_DEP_ENV_VAR)
+    return cache->clock;
+  return cache->generations[policy->dep];
+}
+
+
+/* Tells whether answers to `command' depend on who sent it */
+int
+bitu_cache_is_per_sender (bitu_cache_t *cache, bitu_command_t *command)
+{
+  _bitu_cache_policy_t *policy;
+  const char *name;
+  int per_sender = 0;
+
+  if ((name = bitu_command_get_name (command)) == NULL)
+    return 0;
+  pthread_mutex_lock (&cache->mutex);
+  if ((policy = hashtable_get (cache->policies, name)) != NULL)
+    per_sender = policy->per_sender;
+  pthread_mutex_unlock (&cache->mutex);
+  return per_sender;
+}
+
+
+/* Returns TA_OK and fills `output' with a copy of the cached answer
+ * when there's a fresh one. Otherwise `generation' is set for the call
+ * to bitu_cache_put() with the answer computed after this. */
+int
+bitu_cache_get (bitu_cache_t *cache, bitu_command_t *command, char **output,
+                uint64_t *generation)
+{
+  _bitu_cache_policy_t *policy;
+  _bitu_cache_entry_t *entry;
+  const char *name;
+  char *key;
+  int status = TA_ERROR;
+
+  *generation = 0;
+  if ((name = bitu_command_get_name (command)) == NULL)
+    return TA_ERROR;
+
+  pthread_mutex_lock (&cache->mutex);
+  if ((policy = hashtable_get (cache->policies, name)) == NULL)
+    {
+      pthread_mutex_unlock (&cache->mutex);
+      return TA_ERROR;
+    }
+  *generation = _bitu_cache_generation (cache, policy);
+  if ((key = _bitu_cache_key (policy, command)) != NULL)
+    {
+      entry = hashtable_get (cache->entries, key);
+      if (entry &&
+          entry->expires > bitu_util_monotonic_time () &&
+          _bitu_cache_is_fresh (cache, policy, command, entry->generation))
+        {
+          *output = entry->output ? strdup (entry->output) : NULL;
+          status = TA_OK;
+        }
+      else if (entry)
+        hashtable_del (cache->entries, key);
+      free (key);
+    }
+
+  if (status == TA_OK)
+    {
+      policy->hits++;
+      cache->hits++;
+    }
+  else
+    {
+      policy->misses++;
+      cache->misses++;
+    }
+  pthread_mutex_unlock (&cache->mutex);
+  return status;
+}
+
+
+static void
+_bitu_cache_purge (bitu_cache_t *cache)
+{
+  void *iter;
+  _bitu_cache_entry_t *entry;
+  ta_list_t *expired = NULL, *tmp;
+  uint64_t now = bitu_util_monotonic_time ();
+
+  /* Collecting first and deleting later, the table can't be changed
+   * while we walk through it */
+  if ((iter = hashtable_iter (cache->entries)) == NULL)
+    return;
+  do
+    {
+      entry = hashtable_iter_value (iter);
+      if (entry->expires <= now)
+        expired = ta_list_prepend (expired, hashtable_iter_key (iter));
+    }
+  while ((iter = hashtable_iter_next (cache->entries, iter)));
+
+  for (tmp = expired; tmp; tmp = tmp->next)
+    hashtable_del (cache->entries, tmp->data);
+  ta_list_free (expired);
+}
+
+
+/* Keeps `output' unless the state it was computed from changed since
+ * `generation' was taken by bitu_cache_get() */
+void
+bitu_cache_put (bitu_cache_t *cache, bitu_command_t *command,
+                const char *output, uint64_t generation)
+{
+  _bitu_cache_policy_t *policy;
+  _bitu_cache_entry_t *entry;
+  const char *name;
+  char *key;
+
+  if ((name = bitu_command_get_name (command)) == NULL)
+    return;
+
+  pthread_mutex_lock (&cache->mutex);
+  if ((policy = hashtable_get (cache->policies, name)) == NULL ||
+      !_bitu_cache_is_fresh (cache, policy, command, generation))
+    goto out;
+
+  if (cache->entries->size >= CACHE_MAX_ENTRIES)
+    _bitu_cache_purge (cache);
+  if (cache->entries->size >= CACHE_MAX_ENTRIES)
+    goto out;
+
+  if ((key = _bitu_cache_key (policy, command)) == NULL)
+    goto out;
+  if ((entry = malloc (sizeof (_bitu_cache_entry_t))) == NULL)
+    {
+      free (key);
+      goto out;
+    }
+  entry->output = output ? strdup (output) : NULL;
+  entry->expires = bitu_util_monotonic_time () + policy->ttl;
+  entry->generation = generation;
+  if (hashtable_set (cache->entries, key, entry) == -1)
+    {
+      free (key);
+      _bitu_cache_entry_free (entry);
+    }
+
+ out:
+  pthread_mutex_unlock (&cache->mutex);
+}
+
+
+/* Invalidating the whole environment also reaches the answers that
+ * read a single variable */
+void
+bitu_cache_invalidate (bitu_cache_t *cache, bitu_cache_dep_t dep)
+{
+  pthread_mutex_lock (&cache->mutex);
+  cache->generations[dep]++;
+  if (dep == BITU_CACHE_DEP_ENV || dep == BITU_CACHE_DEP_ENV_VAR)
+    {
+      hashtable_destroy (cache->variables);
+      cache->variables = hashtable_create (hash_string, string_equal,
+                                           free, free);
+      cache->floor = ++cache->clock;
+    }
+  pthread_mutex_unlock (&cache->mutex);
+}
+
+
+/* The variable `name' changed. Answers that read just another variable
+ * stay, the ones that depend on the whole environment go. */
+void
+bitu_cache_invalidate_variable (bitu_cache_t *cache, const char *name)
+{
+  uint64_t *changed;
+  char *key;
+
+  pthread_mutex_lock (&cache->mutex);
+  cache->generations[BITU_CACHE_DEP_ENV]++;
+  cache->clock++;
+  if ((changed = hashtable_get (cache->variables, name)) != NULL)
+    *changed = cache->clock;
+  else if (cache->variables->size >= CACHE_MAX_ENTRIES)
+    {
+      hashtable_destroy (cache->variables);
+      cache->variables = hashtable_create (hash_string, string_equal,
+                                           free, free);
+      cache->floor = cache->clock;
+    }
+  else if ((changed = malloc (sizeof (uint64_t))) != NULL)
+    {
+      *changed = cache->clock;
+      if ((key = strdup (name)) == NULL ||
+          hashtable_set (cache->variables, key, changed) == -1)
+        {
+          /* Nothing is known about it, as if everything changed */
+          free (key);
+          free (changed);
+          cache->floor = cache->clock;
+        }
+    }
+  else
+    cache->floor = cache->clock;
+  pthread_mutex_unlock (&cache->mutex);
+}
+
+
+char *
+bitu_cache_stats (bitu_cache_t *cache)
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  _bitu_cache_policy_t *policy;
+  char *message;
+  void *iter;
+
+  ta_buf_alloc (&buf, 128);
+
+  pthread_mutex_lock (&cache->mutex);
+  ta_buf_catf (&buf, "%lu hits, %lu misses, %u entries",
+               cache->hits, cache->misses, cache->entries->size);
+  if ((iter = hashtable_iter (cache->policies)) != NULL)
+    do
+      {
+        policy = hashtable_iter_value (iter);
+        ta_buf_catf (&buf, "\n%s (ttl %llums%s): %lu hits, %lu misses",
+                     (char *) hashtable_iter_key (iter),
+                     (unsigned long long) policy->ttl / 1000,
+                     policy->per_sender ? ", per sender" : "",
+                     policy->hits, policy->misses);
+      }
+    while ((iter = hashtable_iter_next (cache->policies, iter)));
+  pthread_mutex_unlock (&cache->mutex);
+
+  message = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return message;
+}
@@ -0,0 +1,61 @@
+/* cache.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_CACHE_H_
+#define BITU_CACHE_H_ 1
+
+#include <stdint.h>
+#include <bitu/transport.h>
+
+/* Answers of idempotent commands, kept for a per command TTL and keyed
+ * by the normalized command line (and optionally by the sender). Each
+ * command may depend on one class of state. Changing that state bumps
+ * its generation and makes all the entries filled before stale.
+ * Commands that read a single variable, named by their first param,
+ * only go stale when that variable changes.
+ *
+ * bitu_cache_get() returns the generation the answer must be computed
+ * from, to be handed to bitu_cache_put(). An answer computed while its
+ * state changed is not kept. */
+
+typedef struct bitu_cache bitu_cache_t;
+
+typedef enum
+{
+  BITU_CACHE_DEP_NONE,
+  BITU_CACHE_DEP_ENV,
+  BITU_CACHE_DEP_ENV_VAR,
+  BITU_CACHE_DEP_PLUGINS,
+  BITU_CACHE_DEP_MAX,
+} bitu_cache_dep_t;
+
+bitu_cache_t *bitu_cache_new (void);
+void bitu_cache_free (bitu_cache_t *cache);
+int bitu_cache_set_policy (bitu_cache_t *cache, const char *name,
+                           uint64_t ttl, int per_sender,
+                           bitu_cache_dep_t dep);
+int bitu_cache_get (bitu_cache_t *cache, bitu_command_t *command,
+                    char **output, uint64_t *generation);
+void bitu_cache_put (bitu_cache_t *cache, bitu_command_t *command,
+                     const char *output, uint64_t generation);
+int bitu_cache_is_per_sender (bitu_cache_t *cache, bitu_command_t *command);
+void bitu_cache_invalidate (bitu_cache_t *cache, bitu_cache_dep_t dep);
+void bitu_cache_invalidate_variable (bitu_cache_t *cache, const char *name);
+char *bitu_cache_stats (bitu_cache_t *cache);
+
+#endif /* BITU_CACHE_H_ */
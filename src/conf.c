@@ -16,40 +16,684 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <taningia/taningia.h>
 #include <bitu/util.h>
 #include <bitu/conf.h>
 #include <bitu/transport.h>
 
-#define LINE_LEN_MAX 255
+/* Includes nested deeper than this are considered a mistake */
+#define CONF_MAX_DEPTH 16
 
+/* The snapshot starts with this magic. Then come the globs expanded
+ * while loading, with the files they matched, the files read, with
+ * what's needed to tell if they changed, and finally the commands.
+ * Integers are in host byte order and strings are prefixed by their
+ * length and followed by a '\0', so they can be used in place. */
+#define CONF_SNAPSHOT_MAGIC "BITUCFG2"
+#define CONF_SNAPSHOT_MAGIC_LEN 8
+
+
+typedef struct
+{
+  ta_list_t *head;
+  ta_list_t *tail;
+} _bitu_conf_list_t;
+
+
+typedef struct
+{
+  /* Output */
+  _bitu_conf_list_t commands;
+  _bitu_conf_list_t globs;      /* Pattern followed by its matches */
+  _bitu_conf_list_t sources;    /* Path followed by its stat info */
+  char *error;
+
+  /* Files being read, the innermost first */
+  ta_list_t *stack;
+  int depth;
+} _bitu_conf_loader_t;
+
+
+typedef struct
+{
+  char *path;
+  uint64_t mtime;       /* In nanoseconds */
+  uint64_t size;
+  uint64_t inode;
+} _bitu_conf_source_t;
+
+
+typedef struct
+{
+  char *pattern;
+  char **paths;
+  uint32_t npaths;
+} _bitu_conf_glob_t;
+
+
+static int _bitu_conf_read (_bitu_conf_loader_t *loader, const char *path);
+
+
+/* -- Helpers -- */
+
+
+/* Modification time with the nanoseconds, so a file changed twice in
+ * the same second is still seen as changed */
+static uint64_t
+_bitu_conf_mtime (struct stat *st)
+{
+  return (uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+/* Appends in constant time, ta_list_append() walks the whole list */
+static void
+_bitu_conf_list_append (_bitu_conf_list_t *list, void *data)
+{
+  if (list->tail == NULL)
+    list->head = list->tail = ta_list_append (NULL, data);
+  else
+    {
+      ta_list_append (list->tail, data);
+      list->tail = list->tail->next;
+    }
+}
+
+
+static void
+_bitu_conf_error (_bitu_conf_loader_t *loader, const char *fmt, ...)
+{
+  va_list args;
+  if (loader->error != NULL)
+    return;
+  va_start (args, fmt);
+  if (vasprintf (&loader->error, fmt, args) == -1)
+    loader->error = NULL;
+  va_end (args);
+}
+
+
+static void
+_bitu_conf_glob_free (_bitu_conf_glob_t *glob)
+{
+  uint32_t i;
+  for (i = 0; i < glob->npaths; i++)
+    free (glob->paths[i]);
+  free (glob->paths);
+  free (glob->pattern);
+  free (glob);
+}
+
+
+static void
+_bitu_conf_source_free (_bitu_conf_source_t *source)
+{
+  free (source->path);
+  free (source);
+}
+
+
+static void
+_bitu_conf_loader_free (_bitu_conf_loader_t *loader, int keep_commands)
+{
+  ta_list_t *tmp;
+  for (tmp = loader->globs.head; tmp; tmp = tmp->next)
+    _bitu_conf_glob_free (tmp->data);
+  ta_list_free (loader->globs.head);
+  for (tmp = loader->sources.head; tmp; tmp = tmp->next)
+    _bitu_conf_source_free (tmp->data);
+  ta_list_free (loader->sources.head);
+  if (!keep_commands)
+    {
+      for (tmp = loader->commands.head; tmp; tmp = tmp->next)
+        bitu_command_free (tmp->data);
+      ta_list_free (loader->commands.head);
+    }
+  free (loader->error);
+}
+
+
+/* Expands `pattern' in sorted order, matching nothing is not an
+ * error */
+static _bitu_conf_glob_t *
+_bitu_conf_glob (const char *pattern)
+{
+  _bitu_conf_glob_t *expansion;
+  glob_t globbuf;
+  size_t i;
+  int status;
+
+  if ((status = glob (pattern, GLOB_ERR, NULL, &globbuf)) != 0 &&
+      status != GLOB_NOMATCH)
+    return NULL;
+  if ((expansion = calloc (1, sizeof (_bitu_conf_glob_t))) == NULL)
+    {
+      globfree (&globbuf);
+      return NULL;
+    }
+  expansion->pattern = strdup (pattern);
+  if (status == 0)
+    {
+      expansion->npaths = globbuf.gl_pathc;
+      expansion->paths = malloc (sizeof (char *) * globbuf.gl_pathc);
+      for (i = 0; i < globbuf.gl_pathc; i++)
+        expansion->paths[i] = strdup (globbuf.gl_pathv[i]);
+    }
+  globfree (&globbuf);
+  return expansion;
+}
+
+
+/* -- Parser -- */
+
+
+/* Reads all the files matching `pattern'. Included globs may match
+ * nothing, the main one must match something. */
+static int
+_bitu_conf_include (_bitu_conf_loader_t *loader, const char *pattern,
+                    int required)
+{
+  _bitu_conf_glob_t *expansion;
+  uint32_t i;
+
+  if ((expansion = _bitu_conf_glob (pattern)) == NULL ||
+      (required && expansion->npaths == 0))
+    {
+      if (expansion)
+        _bitu_conf_glob_free (expansion);
+      _bitu_conf_error (loader, "Could not expand glob `%s'", pattern);
+      return TA_ERROR;
+    }
+  _bitu_conf_list_append (&loader->globs, expansion);
+  for (i = 0; i < expansion->npaths; i++)
+    if (_bitu_conf_read (loader, expansion->paths[i]) != TA_OK)
+      return TA_ERROR;
+  return TA_OK;
+}
+
+
+static int
+_bitu_conf_parse_line (_bitu_conf_loader_t *loader, const char *path,
+                       int lineno, char *line, size_t len)
+{
+  bitu_command_t *command;
+  char **tokens, *name;
+  int ntokens, status;
+
+  /* Stripping blanks and the line break */
+  while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' ||
+                     line[len-1] == ' ' || line[len-1] == '\t'))
+    line[--len] = '\0';
+  while (*line == ' ' || *line == '\t')
+    {
+      line++;
+      len--;
+    }
+
+  /* Skipping comments and empty lines */
+  if (line[0] == '#' || line[0] == '\0')
+    return TA_OK;
+
+  if (bitu_util_tokenize (line, &tokens, &ntokens) != TA_OK)
+    {
+      _bitu_conf_error (loader, "%s:%d: Unterminated quote", path, lineno);
+      return TA_ERROR;
+    }
+
+  /* Included files are read in place */
+  if (strcmp (tokens[0], "include") == 0)
+    {
+      if (ntokens != 2)
+        {
+          _bitu_conf_error (loader, "%s:%d: `include' takes 1 param",
+                            path, lineno);
+          status = TA_ERROR;
+        }
+      else
+        status = _bitu_conf_include (loader, tokens[1], 0);
+      while (ntokens > 0)
+        free (tokens[--ntokens]);
+      free (tokens);
+      return status;
+    }
+
+  /* The command copies the name, the rest become params */
+  name = tokens[0];
+  memmove (tokens, tokens + 1, sizeof (char *) * ntokens);
+  command = bitu_command_new_parsed (NULL, strndup (line, len), NULL,
+                                     name, tokens, ntokens - 1);
+  free (name);
+  if (command == NULL)
+    {
+      _bitu_conf_error (loader, "%s:%d: Out of memory", path, lineno);
+      return TA_ERROR;
+    }
+  _bitu_conf_list_append (&loader->commands, command);
+  return TA_OK;
+}
+
+
+static int
+_bitu_conf_read (_bitu_conf_loader_t *loader, const char *path)
+{
+  _bitu_conf_source_t *source;
+  struct stat st;
+  ta_list_t *tmp;
+  FILE *fp;
+  char *real, *line = NULL;
+  size_t allocated = 0;
+  ssize_t len;
+  int lineno = 0, status = TA_OK;
+
+  if (loader->depth >= CONF_MAX_DEPTH)
+    {
+      _bitu_conf_error (loader, "Includes nested too deep at `%s'", path);
+      return TA_ERROR;
+    }
+  if ((real = realpath (path, NULL)) == NULL)
+    {
+      _bitu_conf_error (loader, "Unable to read `%s': %s", path,
+                        strerror (errno));
+      return TA_ERROR;
+    }
+  for (tmp = loader->stack; tmp; tmp = tmp->next)
+    if (strcmp (tmp->data, real) == 0)
+      {
+        _bitu_conf_error (loader, "`%s' includes itself", path);
+        free (real);
+        return TA_ERROR;
+      }
+  if ((fp = fopen (real, "r")) == NULL || fstat (fileno (fp), &st) == -1)
+    {
+      _bitu_conf_error (loader, "Unable to read `%s': %s", path,
+                        strerror (errno));
+      if (fp != NULL)
+        fclose (fp);
+      free (real);
+      return TA_ERROR;
+    }
+
+  /* Remembering what was read, so snapshots can tell when they're
+   * stale */
+  if ((source = malloc (sizeof (_bitu_conf_source_t))) != NULL)
+    {
+      source->path = strdup (real);
+      source->mtime = _bitu_conf_mtime (&st);
+      source->size = st.st_size;
+      source->inode = st.st_ino;
+      _bitu_conf_list_append (&loader->sources, source);
+    }
+
+  loader->stack = ta_list_prepend (loader->stack, real);
+  loader->depth++;
+  while (status == TA_OK && (len = getline (&line, &allocated, fp)) != -1)
+    status = _bitu_conf_parse_line (loader, path, ++lineno, line, len);
+  if (status == TA_OK && ferror (fp))
+    {
+      _bitu_conf_error (loader, "Unable to read `%s': %s", path,
+                        strerror (errno));
+      status = TA_ERROR;
+    }
+  loader->depth--;
+  tmp = loader->stack;
+  loader->stack = tmp->next;
+  if (loader->stack)
+    loader->stack->prev = NULL;
+  tmp->next = NULL;
+  ta_list_free (tmp);
+
+  free (line);
+  free (real);
+  fclose (fp);
+  return status;
+}
+
+
+/* -- Snapshots -- */
+
+
+typedef struct
+{
+  const char *data;
+  size_t size;
+  size_t pos;
+} _bitu_conf_cursor_t;
+
+
+static int
+_bitu_conf_get_u32 (_bitu_conf_cursor_t *cursor, uint32_t *value)
+{
+  if (cursor->size - cursor->pos < sizeof (uint32_t))
+    return TA_ERROR;
+  memcpy (value, cursor->data + cursor->pos, sizeof (uint32_t));
+  cursor->pos += sizeof (uint32_t);
+  return TA_OK;
+}
+
+
+static int
+_bitu_conf_get_u64 (_bitu_conf_cursor_t *cursor, uint64_t *value)
+{
+  if (cursor->size - cursor->pos < sizeof (uint64_t))
+    return TA_ERROR;
+  memcpy (value, cursor->data + cursor->pos, sizeof (uint64_t));
+  cursor->pos += sizeof (uint64_t);
+  return TA_OK;
+}
+
+
+/* Returns a pointer to the string inside of the mapping */
+static const char *
+_bitu_conf_get_str (_bitu_conf_cursor_t *cursor)
+{
+  const char *str;
+  uint32_t len;
+  if (_bitu_conf_get_u32 (cursor, &len) != TA_OK ||
+      cursor->size - cursor->pos <= len ||
+      cursor->data[cursor->pos + len] != '\0')
+    return NULL;
+  str = cursor->data + cursor->pos;
+  cursor->pos += len + 1;
+  return str;
+}
+
+
+static int
+_bitu_conf_put_u32 (FILE *fp, uint32_t value)
+{
+  return fwrite (&value, sizeof (value), 1, fp) == 1 ? TA_OK : TA_ERROR;
+}
+
+
+static int
+_bitu_conf_put_u64 (FILE *fp, uint64_t value)
+{
+  return fwrite (&value, sizeof (value), 1, fp) == 1 ? TA_OK : TA_ERROR;
+}
+
+
+static int
+_bitu_conf_put_str (FILE *fp, const char *str)
+{
+  uint32_t len = strlen (str);
+  if (_bitu_conf_put_u32 (fp, len) != TA_OK)
+    return TA_ERROR;
+  return fwrite (str, 1, len + 1, fp) == len + 1 ? TA_OK : TA_ERROR;
+}
+
+
+/* Checks that the globs still match the same files and that none of
+ * the files read changed */
+static int
+_bitu_conf_snapshot_is_fresh (_bitu_conf_cursor_t *cursor)
+{
+  _bitu_conf_glob_t *expansion;
+  const char *str;
+  struct stat st;
+  uint32_t count, npaths, i, j;
+  uint64_t mtime, size, inode;
+  int fresh;
+
+  if (_bitu_conf_get_u32 (cursor, &count) != TA_OK)
+    return 0;
+  for (i = 0; i < count; i++)
+    {
+      if ((str = _bitu_conf_get_str (cursor)) == NULL ||
+          _bitu_conf_get_u32 (cursor, &npaths) != TA_OK ||
+          (expansion = _bitu_conf_glob (str)) == NULL)
+        return 0;
+      fresh = expansion->npaths == npaths;
+      for (j = 0; j < npaths; j++)
+        if ((str = _bitu_conf_get_str (cursor)) == NULL ||
+            (fresh && strcmp (str, expansion->paths[j]) != 0))
+          fresh = 0;
+      _bitu_conf_glob_free (expansion);
+      if (!fresh)
+        return 0;
+    }
+
+  if (_bitu_conf_get_u32 (cursor, &count) != TA_OK)
+    return 0;
+  for (i = 0; i < count; i++)
+    {
+      if ((str = _bitu_conf_get_str (cursor)) == NULL ||
+          _bitu_conf_get_u64 (cursor, &mtime) != TA_OK ||
+          _bitu_conf_get_u64 (cursor, &size) != TA_OK ||
+          _bitu_conf_get_u64 (cursor, &inode) != TA_OK ||
+          stat (str, &st) == -1)
+        return 0;
+      if (_bitu_conf_mtime (&st) != mtime || (uint64_t) st.st_size != size ||
+          (uint64_t) st.st_ino != inode)
+        return 0;
+    }
+  return 1;
+}
+
+
+/* Builds the commands straight from the mapped snapshot. Nothing is
+ * parsed, each string is copied once. */
+static int
+_bitu_conf_snapshot_load (const char *pattern, const char *snapshot,
+                          ta_list_t **commands)
+{
+  _bitu_conf_list_t list = { NULL, NULL };
+  _bitu_conf_cursor_t cursor;
+  bitu_command_t *command;
+  struct stat st;
+  const char *cmd, *name, *str;
+  char **params;
+  uint32_t count, nparams, i, j;
+  int fd, status = TA_ERROR;
+  void *map;
+
+  if ((fd = open (snapshot, O_RDONLY)) == -1)
+    return TA_ERROR;
+  if (fstat (fd, &st) == -1 || st.st_size < CONF_SNAPSHOT_MAGIC_LEN ||
+      (map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED)
+    {
+      close (fd);
+      return TA_ERROR;
+    }
+  close (fd);
+
+  cursor.data = map;
+  cursor.size = st.st_size;
+  cursor.pos = CONF_SNAPSHOT_MAGIC_LEN;
+  if (memcmp (map, CONF_SNAPSHOT_MAGIC, CONF_SNAPSHOT_MAGIC_LEN) != 0 ||
+      (str = _bitu_conf_get_str (&cursor)) == NULL ||
+      strcmp (str, pattern) != 0 ||
+      !_bitu_conf_snapshot_is_fresh (&cursor) ||
+      _bitu_conf_get_u32 (&cursor, &count) != TA_OK)
+    goto out;
+
+  for (i = 0; i < count; i++)
+    {
+      if ((cmd = _bitu_conf_get_str (&cursor)) == NULL ||
+          (name = _bitu_conf_get_str (&cursor)) == NULL ||
+          _bitu_conf_get_u32 (&cursor, &nparams) != TA_OK ||
+          nparams > cursor.size ||
+          (params = malloc (sizeof (char *) * (nparams + 1))) == NULL)
+        goto out;
+      for (j = 0; j < nparams; j++)
+        {
+          if ((str = _bitu_conf_get_str (&cursor)) == NULL)
+            {
+              while (j > 0)
+                free (params[--j]);
+              free (params);
+              goto out;
+            }
+          params[j] = strdup (str);
+        }
+      params[nparams] = NULL;
+      command = bitu_command_new_parsed (NULL, strdup (cmd), NULL, name,
+                                         params, nparams);
+      if (command == NULL)
+        goto out;
+      _bitu_conf_list_append (&list, command);
+    }
+  status = TA_OK;
+
+ out:
+  munmap (map, st.st_size);
+  if (status != TA_OK)
+    {
+      ta_list_t *tmp;
+      for (tmp = list.head; tmp; tmp = tmp->next)
+        bitu_command_free (tmp->data);
+      ta_list_free (list.head);
+    }
+  else
+    *commands = list.head;
+  return status;
+}
+
+
+/* Written to a temporary file first, a crash never leaves a broken
+ * snapshot behind */
+static int
+_bitu_conf_snapshot_save (_bitu_conf_loader_t *loader, const char *pattern,
+                          const char *snapshot)
+{
+  _bitu_conf_glob_t *expansion;
+  _bitu_conf_source_t *source;
+  bitu_command_t *command;
+  const char **params;
+  ta_list_t *tmp;
+  char *tmppath;
+  FILE *fp;
+  int status = TA_OK, nparams, i;
+  uint32_t j;
+
+  if (asprintf (&tmppath, "%s.tmp", snapshot) == -1)
+    return TA_ERROR;
+  if ((fp = fopen (tmppath, "w")) == NULL)
+    {
+      free (tmppath);
+      return TA_ERROR;
+    }
+
+  if (fwrite (CONF_SNAPSHOT_MAGIC, 1, CONF_SNAPSHOT_MAGIC_LEN, fp)
+      != CONF_SNAPSHOT_MAGIC_LEN)
+    status = TA_ERROR;
+  status |= _bitu_conf_put_str (fp, pattern);
+
+  status |= _bitu_conf_put_u32 (fp, ta_list_len (loader->globs.head));
+  for (tmp = loader->globs.head; tmp; tmp = tmp->next)
+    {
+      expansion = tmp->data;
+      status |= _bitu_conf_put_str (fp, expansion->pattern);
+      status |= _bitu_conf_put_u32 (fp, expansion->npaths);
+      for (j = 0; j < expansion->npaths; j++)
+        status |= _bitu_conf_put_str (fp, expansion->paths[j]);
+    }
+
+  status |= _bitu_conf_put_u32 (fp, ta_list_len (loader->sources.head));
+  for (tmp = loader->sources.head; tmp; tmp = tmp->next)
+    {
+      source = tmp->data;
+      status |= _bitu_conf_put_str (fp, source->path);
+      status |= _bitu_conf_put_u64 (fp, source->mtime);
+      status |= _bitu_conf_put_u64 (fp, source->size);
+      status |= _bitu_conf_put_u64 (fp, source->inode);
+    }
+
+  status |= _bitu_conf_put_u32 (fp, ta_list_len (loader->commands.head));
+  for (tmp = loader->commands.head; tmp; tmp = tmp->next)
+    {
+      command = tmp->data;
+      params = bitu_command_get_params (command);
+      nparams = bitu_command_get_nparams (command);
+      status |= _bitu_conf_put_str (fp, bitu_command_get_cmd (command));
+      status |= _bitu_conf_put_str (fp, bitu_command_get_name (command));
+      status |= _bitu_conf_put_u32 (fp, nparams);
+      for (i = 0; i < nparams; i++)
+        status |= _bitu_conf_put_str (fp, params[i]);
+    }
+
+  if (fflush (fp) != 0 || fsync (fileno (fp)) == -1)
+    status = TA_ERROR;
+  if (fclose (fp) != 0)
+    status = TA_ERROR;
+  if (status == TA_OK && rename (tmppath, snapshot) == -1)
+    status = TA_ERROR;
+  if (status != TA_OK)
+    unlink (tmppath);
+  free (tmppath);
+  return status;
+}
+
+
+/* -- Public API -- */
+
+
+/* Reads a single file, no globs involved. Its includes are still
+ * followed. */
 ta_list_t *
 bitu_conf_read_from_file (const char *file_path)
 {
-  FILE *fd;
-  char line[LINE_LEN_MAX];
-  ta_list_t *config = NULL;
+  _bitu_conf_loader_t loader;
+  ta_list_t *commands;
 
-  if ((fd = fopen (file_path, "r")) == NULL)
-    return NULL;
-  while (fgets (line, LINE_LEN_MAX, fd))
+  memset (&loader, 0, sizeof (loader));
+  if (_bitu_conf_read (&loader, file_path) != TA_OK)
     {
-      bitu_command_t *command;
+      _bitu_conf_loader_free (&loader, 0);
+      return NULL;
+    }
+  commands = loader.commands.head;
+  _bitu_conf_loader_free (&loader, 1);
+  return commands;
+}
 
-      /* Getting rid of the '\n' */
-      line[strlen (line) - 1] = '\0';
 
-      /* Skipping invalid commands */
-      if (line[0] == '#' || line[0] == '\0')
-        continue;
-      if ((command = bitu_command_new (NULL, line, NULL)) == NULL)
-        continue;
-      config = ta_list_append (config, command);
+/* Loads the commands of all files matching `pattern', in sorted
+ * order, reading `include <pattern>' lines in place. Includes can't
+ * form cycles nor be nested more than CONF_MAX_DEPTH levels.
+ *
+ * When `snapshot' is given and it's still fresh (the same globs match
+ * the same files and none of them changed), the commands are built
+ * from it instead. Otherwise the files are parsed and the snapshot is
+ * written again; failing to write it is not an error.
+ *
+ * On error, returns TA_ERROR and a message in `error' that must be
+ * freed by the caller. */
+int
+bitu_conf_load (const char *pattern, const char *snapshot,
+                ta_list_t **commands, char **error)
+{
+  _bitu_conf_loader_t loader;
+
+  *commands = NULL;
+  *error = NULL;
+  if (snapshot != NULL &&
+      _bitu_conf_snapshot_load (pattern, snapshot, commands) == TA_OK)
+    return TA_OK;
+
+  memset (&loader, 0, sizeof (loader));
+  if (_bitu_conf_include (&loader, pattern, 1) != TA_OK)
+    {
+      *error = loader.error;
+      loader.error = NULL;
+      _bitu_conf_loader_free (&loader, 0);
+      return TA_ERROR;
     }
-  fclose (fd);
 
-  return config;
+  if (snapshot != NULL)
+    _bitu_conf_snapshot_save (&loader, pattern, snapshot);
+  *commands = loader.commands.head;
+  _bitu_conf_loader_free (&loader, 1);
+  return TA_OK;
 }
@@ -0,0 +1,525 @@
+/* envstore.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <taningia/taningia.h>
+
+#include "hashtable.h"
+#include "hashtable-concurrent.h"
+#include "envstore.h"
+
+/* The log starts with this magic and is followed by records. Each
+ * record is a header, then the key and the value with no terminators.
+ * The header holds the CRC32 of everything else in the record and the
+ * lengths of the key and of the value, all in host byte order. Unsets
+ * have no value and ENVSTORE_UNSET as its length. */
+#define ENVSTORE_MAGIC "BITUENV1"
+#define ENVSTORE_MAGIC_LEN 8
+#define ENVSTORE_UNSET UINT32_MAX
+
+/* The log is compacted when it holds more than this many records and
+ * at least twice as many records as live variables */
+#define ENVSTORE_COMPACT_MIN 256
+
+
+typedef struct
+{
+  uint32_t crc;
+  uint32_t klen;
+  uint32_t vlen;
+} _bitu_envstore_record_t;
+
+
+struct bitu_envstore
+{
+  char *path;
+  int fd;
+  off_t size;
+  size_t records;
+  size_t discarded;
+  chashtable_t *env;
+  pthread_mutex_t mutex;
+};
+
+
+/* -- CRC32 (IEEE 802.3) -- */
+
+
+static uint32_t _crc_table[256];
+static pthread_once_t _crc_once = PTHREAD_ONCE_INIT;
+
+
+static void
+_crc_init (void)
+{
+  uint32_t c, i, j;
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      _crc_table[i] = c;
+    }
+}
+
+
+static uint32_t
+_crc_update (uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  while (len--)
+    crc = _crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+
+static uint32_t
+_record_crc (uint32_t klen, uint32_t vlen, const char *key,
+             const char *value)
+{
+  uint32_t crc = 0xffffffffu;
+  crc = _crc_update (crc, &klen, sizeof (klen));
+  crc = _crc_update (crc, &vlen, sizeof (vlen));
+  crc = _crc_update (crc, key, klen);
+  if (vlen != ENVSTORE_UNSET)
+    crc = _crc_update (crc, value, vlen);
+  return crc ^ 0xffffffffu;
+}
+
+
+/* -- Helpers -- */
+
+
+/* Serializes a record, an unset when `value' is NULL */
+static char *
+_record_new (const char *key, const char *value, size_t *size)
+{
+  _bitu_envstore_record_t header;
+  size_t klen = strlen (key), vlen = value ? strlen (value) : 0;
+  char *buf;
+
+  if (klen >= ENVSTORE_UNSET || vlen >= ENVSTORE_UNSET)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  header.klen = klen;
+  header.vlen = value ? vlen : ENVSTORE_UNSET;
+  header.crc = _record_crc (header.klen, header.vlen, key, value);
+
+  *size = sizeof (header) + klen + vlen;
+  if ((buf = malloc (*size)) == NULL)
+    return NULL;
+  memcpy (buf, &header, sizeof (header));
+  memcpy (buf + sizeof (header), key, klen);
+  if (value != NULL)
+    memcpy (buf + sizeof (header) + klen, value, vlen);
+  return buf;
+}
+
+
+static int
+_write_all (int fd, const char *buf, size_t size)
+{
+  ssize_t written;
+  while (size > 0)
+    {
+      if ((written = write (fd, buf, size)) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      buf += written;
+      size -= written;
+    }
+  return 0;
+}
+
+
+/* Makes a rename in the directory of `path' durable */
+static void
+_sync_dir (const char *path)
+{
+  char *dir, *slash;
+  int fd;
+
+  if ((dir = strdup (path)) == NULL)
+    return;
+  if ((slash = strrchr (dir, '/')) == NULL)
+    strcpy (dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+  if ((fd = open (dir, O_RDONLY)) != -1)
+    {
+      fsync (fd);
+      close (fd);
+    }
+  free (dir);
+}
+
+
+/* Applies all the valid records of the log to the environment. Stops
+ * at the first record that is incomplete or doesn't match its checksum
+ * and accounts everything after it as discarded. `size' is set to
+ * where the valid records end. */
+static int
+_replay (bitu_envstore_t *store, int fd, off_t *size)
+{
+  struct stat st;
+  _bitu_envstore_record_t header;
+  const char *map, *key, *value;
+  size_t len, offset, left, vlen;
+  char *k, *v;
+
+  if (fstat (fd, &st) == -1)
+    return -1;
+  len = st.st_size;
+
+  /* A new file, maybe one whose magic didn't make it to the disk */
+  if (len < ENVSTORE_MAGIC_LEN)
+    {
+      *size = 0;
+      store->discarded = len;
+      return 0;
+    }
+
+  map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  if (memcmp (map, ENVSTORE_MAGIC, ENVSTORE_MAGIC_LEN) != 0)
+    {
+      munmap ((void *) map, len);
+      errno = EINVAL;
+      return -1;
+    }
+
+  offset = ENVSTORE_MAGIC_LEN;
+  while (len - offset >= sizeof (header))
+    {
+      memcpy (&header, map + offset, sizeof (header));
+      left = len - offset - sizeof (header);
+      vlen = header.vlen == ENVSTORE_UNSET ? 0 : header.vlen;
+      if (header.klen > left || vlen > left - header.klen)
+        break;
+      key = map + offset + sizeof (header);
+      value = key + header.klen;
+      if (_record_crc (header.klen, header.vlen, key, value) != header.crc)
+        break;
+
+      /* Stopping here would silently lose the records after this one */
+      if ((k = strndup (key, header.klen)) == NULL)
+        goto error;
+      if (header.vlen == ENVSTORE_UNSET)
+        {
+          chashtable_del (store->env, k);
+          free (k);
+        }
+      else if ((v = strndup (value, vlen)) == NULL)
+        {
+          free (k);
+          goto error;
+        }
+      else
+        chashtable_set (store->env, k, v);
+
+      store->records++;
+      offset += sizeof (header) + header.klen + vlen;
+    }
+  *size = offset;
+  store->discarded = len - offset;
+
+  munmap ((void *) map, len);
+  return 0;
+
+ error:
+  munmap ((void *) map, len);
+  errno = ENOMEM;
+  return -1;
+}
+
+
+/* Writes the live variables to a new log and puts it in the place of
+ * the current one */
+static int
+_compact (bitu_envstore_t *store)
+{
+  chashtable_snapshot_t snapshot;
+  size_t len, records = 0;
+  off_t size = ENVSTORE_MAGIC_LEN;
+  char *tmppath, *record;
+  void *iter;
+  int fd, saved_errno;
+
+  len = strlen (store->path) + 5;
+  if ((tmppath = malloc (len)) == NULL)
+    return -1;
+  snprintf (tmppath, len, "%s.tmp", store->path);
+
+  fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd == -1)
+    goto error;
+  if (_write_all (fd, ENVSTORE_MAGIC, ENVSTORE_MAGIC_LEN) == -1)
+    goto error;
+
+  chashtable_snapshot (store->env, &snapshot);
+  for (iter = chashtable_snapshot_iter (&snapshot); iter;
+       iter = chashtable_snapshot_iter_next (&snapshot, iter))
+    {
+      record = _record_new (chashtable_iter_key (iter),
+                            chashtable_iter_value (iter), &len);
+      if (record == NULL || _write_all (fd, record, len) == -1)
+        {
+          free (record);
+          chashtable_snapshot_release (&snapshot);
+          goto error;
+        }
+      free (record);
+      size += len;
+      records++;
+    }
+  chashtable_snapshot_release (&snapshot);
+
+  if (fsync (fd) == -1 || rename (tmppath, store->path) == -1)
+    goto error;
+  _sync_dir (store->path);
+  free (tmppath);
+
+  /* The new file is already open for appending */
+  if (store->fd != -1)
+    close (store->fd);
+  store->fd = fd;
+  store->size = size;
+  store->records = records;
+  return 0;
+
+ error:
+  saved_errno = errno;
+  if (fd != -1)
+    {
+      close (fd);
+      unlink (tmppath);
+    }
+  free (tmppath);
+  errno = saved_errno;
+  return -1;
+}
+
+
+/* Appends a record and only returns after it reaches the disk. A
+ * partial write is cut off, otherwise it would hide everything
+ * appended after it. If even that fails, the log is rebuilt. */
+static int
+_append (bitu_envstore_t *store, const char *key, const char *value)
+{
+  char *record;
+  size_t len;
+
+  if ((record = _record_new (key, value, &len)) == NULL)
+    return TA_ERROR;
+  if (_write_all (store->fd, record, len) == -1 || fsync (store->fd) == -1)
+    {
+      free (record);
+      if (ftruncate (store->fd, store->size) == -1)
+        _compact (store);
+      return TA_ERROR;
+    }
+  free (record);
+  store->size += len;
+  store->records++;
+  return TA_OK;
+}
+
+
+static int
+_needs_compact (bitu_envstore_t *store)
+{
+  return store->records > ENVSTORE_COMPACT_MIN &&
+    store->records > 2 * chashtable_size (store->env);
+}
+
+
+/* Failing to compact costs space, not data. The next change tries
+ * again. */
+static void
+_maybe_compact (bitu_envstore_t *store)
+{
+  if (_needs_compact (store))
+    _compact (store);
+}
+
+
+/* -- Public API -- */
+
+
+bitu_envstore_t *
+bitu_envstore_new (chashtable_t *env)
+{
+  bitu_envstore_t *store;
+
+  pthread_once (&_crc_once, _crc_init);
+
+  if ((store = calloc (1, sizeof (bitu_envstore_t))) == NULL)
+    return NULL;
+  store->fd = -1;
+  store->env = env;
+  pthread_mutex_init (&store->mutex, NULL);
+  return store;
+}
+
+
+void
+bitu_envstore_free (bitu_envstore_t *store)
+{
+  if (store->fd != -1)
+    close (store->fd);
+  pthread_mutex_destroy (&store->mutex);
+  free (store->path);
+  free (store);
+}
+
+
+/* Replays the log in `path' into the environment, creating it when it
+ * doesn't exist, and keeps changes there from now on. The log is
+ * rewritten when it has too many stale records or when the environment
+ * had variables already set, so it holds them too. Otherwise a torn
+ * tail is cut off and new records go after the valid ones.
+ *
+ * Returns TA_ERROR and sets errno on failure. The file open before, if
+ * any, is still used then, but the environment may already hold some
+ * of the variables read from `path'. */
+int
+bitu_envstore_open (bitu_envstore_t *store, const char *path)
+{
+  char *oldpath, *newpath;
+  int fd, oldfd, saved_errno, rewrite;
+  size_t oldrecords, olddiscarded;
+  off_t size;
+
+  if ((newpath = strdup (path)) == NULL)
+    return TA_ERROR;
+  if ((fd = open (path, O_RDWR | O_CREAT | O_APPEND, 0600)) == -1)
+    {
+      free (newpath);
+      return TA_ERROR;
+    }
+
+  pthread_mutex_lock (&store->mutex);
+  oldpath = store->path;
+  oldfd = store->fd;
+  oldrecords = store->records;
+  olddiscarded = store->discarded;
+  store->path = newpath;
+  store->fd = -1;
+  store->records = 0;
+
+  rewrite = chashtable_size (store->env) > 0;
+  if (_replay (store, fd, &size) == -1)
+    goto error;
+  if (rewrite || size < ENVSTORE_MAGIC_LEN || _needs_compact (store))
+    {
+      if (_compact (store) == -1)
+        goto error;
+      close (fd);
+    }
+  else
+    {
+      if (store->discarded > 0 && ftruncate (fd, size) == -1)
+        goto error;
+      store->fd = fd;
+      store->size = size;
+    }
+  pthread_mutex_unlock (&store->mutex);
+
+  if (oldfd != -1)
+    close (oldfd);
+  free (oldpath);
+  return TA_OK;
+
+ error:
+  saved_errno = errno;
+  close (fd);
+  store->path = oldpath;
+  store->fd = oldfd;
+  store->records = oldrecords;
+  store->discarded = olddiscarded;
+  pthread_mutex_unlock (&store->mutex);
+  free (newpath);
+  errno = saved_errno;
+  return TA_ERROR;
+}
+
+
+/* Both functions below change the environment only when the change
+ * was saved */
+int
+bitu_envstore_set (bitu_envstore_t *store, const char *key,
+                   const char *value)
+{
+  int status = TA_OK;
+  pthread_mutex_lock (&store->mutex);
+  if (store->fd == -1 || (status = _append (store, key, value)) == TA_OK)
+    {
+      chashtable_set (store->env, strdup (key), strdup (value));
+      if (store->fd != -1)
+        _maybe_compact (store);
+    }
+  pthread_mutex_unlock (&store->mutex);
+  return status;
+}
+
+
+int
+bitu_envstore_unset (bitu_envstore_t *store, const char *key)
+{
+  int status = TA_OK;
+  pthread_mutex_lock (&store->mutex);
+  if (store->fd == -1 || (status = _append (store, key, NULL)) == TA_OK)
+    {
+      chashtable_del (store->env, key);
+      if (store->fd != -1)
+        _maybe_compact (store);
+    }
+  pthread_mutex_unlock (&store->mutex);
+  return status;
+}
+
+
+/* Bytes of the log that were dropped when it was last opened because
+ * they didn't hold a valid record, usually the last write before a
+ * crash */
+size_t
+bitu_envstore_get_discarded (bitu_envstore_t *store)
+{
+  size_t discarded;
+  pthread_mutex_lock (&store->mutex);
+  discarded = store->discarded;
+  pthread_mutex_unlock (&store->mutex);
+  return discarded;
+}
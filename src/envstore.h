@@ -0,0 +1,44 @@
+/* envstore.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_ENVSTORE_H_
+#define BITU_ENVSTORE_H_ 1
+
+#include <stddef.h>
+
+#include "hashtable-concurrent.h"
+
+/* Persistent backend of the environment. Every change is appended to a
+ * log file as a checksummed record, so `set' and `unset' cost a single
+ * write. When opened, the log is mapped and replayed into the
+ * environment; a torn record left by a crash ends the replay and is
+ * cut off. The log is rewritten with only the live variables once it
+ * holds too many stale records. Until a file is opened, changes only
+ * go to the environment. */
+
+typedef struct bitu_envstore bitu_envstore_t;
+
+bitu_envstore_t *bitu_envstore_new (chashtable_t *env);
+void bitu_envstore_free (bitu_envstore_t *store);
+int bitu_envstore_open (bitu_envstore_t *store, const char *path);
+int bitu_envstore_set (bitu_envstore_t *store, const char *key,
+                       const char *value);
+int bitu_envstore_unset (bitu_envstore_t *store, const char *key);
+size_t bitu_envstore_get_discarded (bitu_envstore_t *store);
+
+#endif /* BITU_ENVSTORE_H_ */
@@ -0,0 +1,205 @@
+/* epoch.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+/* Readers increment the counter of the current phase. Writers flip the
+ * phase and wait for the counter of the previous one to drain. Doing
+ * it twice makes sure that a reader that sampled the phase right
+ * before the first flip is also waited for. */
+struct bitu_epoch
+{
+  volatile unsigned long readers[2];
+  volatile unsigned int phase;
+  pthread_mutex_t mutex;
+
+  /* Deferred frees, oldest first */
+  struct _bitu_epoch_deferred *deferred;
+  struct _bitu_epoch_deferred *last;
+};
+
+
+/* Something unpublished while the phase was `phase'. Readers that
+ * could see it are gone once the phase moved twice. */
+typedef struct _bitu_epoch_deferred
+{
+  struct _bitu_epoch_deferred *next;
+  bitu_epoch_callback_t callback;
+  void *ptr;
+  void *data;
+  unsigned int phase;
+} _bitu_epoch_deferred_t;
+
+
+static void
+_bitu_epoch_run (_bitu_epoch_deferred_t *deferred)
+{
+  _bitu_epoch_deferred_t *next;
+  for (; deferred; deferred = next)
+    {
+      next = deferred->next;
+      deferred->callback (deferred->ptr, deferred->data);
+      free (deferred);
+    }
+}
+
+
+bitu_epoch_t *
+bitu_epoch_new (void)
+{
+  bitu_epoch_t *epoch;
+  if ((epoch = malloc (sizeof (bitu_epoch_t))) == NULL)
+    return NULL;
+  epoch->readers[0] = epoch->readers[1] = 0;
+  epoch->phase = 0;
+  epoch->deferred = epoch->last = NULL;
+  pthread_mutex_init (&epoch->mutex, NULL);
+  return epoch;
+}
+
+
+void
+bitu_epoch_free (bitu_epoch_t *epoch)
+{
+  /* No readers are left by now */
+  _bitu_epoch_run (epoch->deferred);
+  pthread_mutex_destroy (&epoch->mutex);
+  free (epoch);
+}
+
+
+int
+bitu_epoch_enter (bitu_epoch_t *epoch)
+{
+  int token = __atomic_load_n (&epoch->phase, __ATOMIC_ACQUIRE) & 1;
+
+  /* This is a full barrier, nothing read inside of the critical
+   * section can be loaded before the counter is incremented. */
+  __sync_fetch_and_add (&epoch->readers[token], 1);
+  return token;
+}
+
+
+void
+bitu_epoch_exit (bitu_epoch_t *epoch, int token)
+{
+  __sync_fetch_and_sub (&epoch->readers[token], 1);
+}
+
+
+static void
+_bitu_epoch_flip_and_wait (bitu_epoch_t *epoch)
+{
+  int old = epoch->phase & 1;
+  __sync_fetch_and_add (&epoch->phase, 1);
+  while (__atomic_load_n (&epoch->readers[old], __ATOMIC_ACQUIRE) != 0)
+    sched_yield ();
+  __sync_synchronize ();
+}
+
+
+void
+bitu_epoch_synchronize (bitu_epoch_t *epoch)
+{
+  pthread_mutex_lock (&epoch->mutex);
+  __sync_synchronize ();
+  _bitu_epoch_flip_and_wait (epoch);
+  _bitu_epoch_flip_and_wait (epoch);
+  pthread_mutex_unlock (&epoch->mutex);
+}
+
+
+/* Moves to the next phase if the readers of the phase before the
+ * current one are gone. It never waits, unlike the flips above. Must
+ * be called with the mutex held. */
+static void
+_bitu_epoch_try_advance (bitu_epoch_t *epoch)
+{
+  __sync_synchronize ();
+  if (__atomic_load_n (&epoch->readers[(epoch->phase + 1) & 1],
+                       __ATOMIC_ACQUIRE) == 0)
+    __sync_fetch_and_add (&epoch->phase, 1);
+}
+
+
+/* Calls `callback' with `ptr' and `data' when no reader can see `ptr'
+ * anymore. It must be unpublished already. */
+void
+bitu_epoch_defer (bitu_epoch_t *epoch, bitu_epoch_callback_t callback,
+                  void *ptr, void *data)
+{
+  _bitu_epoch_deferred_t *deferred;
+
+  /* Without memory to remember it, we wait */
+  if ((deferred = malloc (sizeof (_bitu_epoch_deferred_t))) == NULL)
+    {
+      bitu_epoch_synchronize (epoch);
+      callback (ptr, data);
+      return;
+    }
+  deferred->next = NULL;
+  deferred->callback = callback;
+  deferred->ptr = ptr;
+  deferred->data = data;
+
+  pthread_mutex_lock (&epoch->mutex);
+  deferred->phase = epoch->phase;
+  if (epoch->last)
+    epoch->last->next = deferred;
+  else
+    epoch->deferred = deferred;
+  epoch->last = deferred;
+  pthread_mutex_unlock (&epoch->mutex);
+
+  bitu_epoch_reclaim (epoch);
+}
+
+
+/* Frees what was deferred and can't be seen by readers anymore,
+ * without waiting for the ones still around */
+void
+bitu_epoch_reclaim (bitu_epoch_t *epoch)
+{
+  _bitu_epoch_deferred_t *ready = NULL, **tail = &ready;
+
+  pthread_mutex_lock (&epoch->mutex);
+  if (epoch->deferred == NULL)
+    {
+      pthread_mutex_unlock (&epoch->mutex);
+      return;
+    }
+  _bitu_epoch_try_advance (epoch);
+  _bitu_epoch_try_advance (epoch);
+  while (epoch->deferred && epoch->phase - epoch->deferred->phase >= 2)
+    {
+      *tail = epoch->deferred;
+      tail = &epoch->deferred->next;
+      epoch->deferred = epoch->deferred->next;
+    }
+  *tail = NULL;
+  if (epoch->deferred == NULL)
+    epoch->last = NULL;
+  pthread_mutex_unlock (&epoch->mutex);
+
+  /* Callbacks may take locks of their own */
+  _bitu_epoch_run (ready);
+}
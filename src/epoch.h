@@ -0,0 +1,53 @@
+/* epoch.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_EPOCH_H_
+#define BITU_EPOCH_H_ 1
+
+/* Read-mostly synchronization in the spirit of RCU. Readers wrap their
+ * accesses to a shared pointer between `bitu_epoch_enter()' and
+ * `bitu_epoch_exit()' and never block. Writers publish a new version
+ * of the data, call `bitu_epoch_synchronize()' to wait for all readers
+ * that could still be looking at the old version and only then free
+ * it.
+ *
+ * Writers that can't afford to wait hand what they unpublished to
+ * `bitu_epoch_defer()' instead. It's freed by a later call to
+ * `bitu_epoch_defer()' or `bitu_epoch_reclaim()' once no reader can
+ * see it anymore, or by `bitu_epoch_free()'. */
+
+typedef struct bitu_epoch bitu_epoch_t;
+typedef void (*bitu_epoch_callback_t) (void *ptr, void *data);
+
+bitu_epoch_t *bitu_epoch_new (void);
+void bitu_epoch_free (bitu_epoch_t *epoch);
+int bitu_epoch_enter (bitu_epoch_t *epoch);
+void bitu_epoch_exit (bitu_epoch_t *epoch, int token);
+void bitu_epoch_synchronize (bitu_epoch_t *epoch);
+void bitu_epoch_defer (bitu_epoch_t *epoch, bitu_epoch_callback_t callback,
+                       void *ptr, void *data);
+void bitu_epoch_reclaim (bitu_epoch_t *epoch);
+
+/* Helpers to publish and read pointers protected by an epoch */
+#define bitu_epoch_publish(ptr, val) \
+  do { __sync_synchronize (); \
+    __atomic_store_n (&(ptr), (val), __ATOMIC_SEQ_CST); } while (0)
+#define bitu_epoch_dereference(ptr) \
+  __atomic_load_n (&(ptr), __ATOMIC_ACQUIRE)
+
+#endif /* BITU_EPOCH_H_ */
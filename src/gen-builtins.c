@@ -0,0 +1,114 @@
+/* gen-builtins.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generates the perfect hash table of the built in commands declared
+ * in builtins.def. The output is a C header with the seed found and
+ * the slots, each one holding the position of an entry in builtins.def
+ * or -1. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "builtins.h"
+
+/* Keeping the table at most half full makes the search for a seed
+ * quick, a few hundred tries at most for the current set of
+ * commands */
+#define MAX_SLOTS 256
+#define MAX_TRIES 1000000
+
+static const struct {
+  const char *name;
+  const char *sub;
+} builtins[] = {
+#define BUILTIN(name,sub,handler,min,max,cache) { name, sub },
+#include "builtins.def"
+#undef BUILTIN
+};
+
+#define COUNT (sizeof (builtins) / sizeof (builtins[0]))
+
+
+static int
+same_entry (unsigned int a, unsigned int b)
+{
+  if (strcmp (builtins[a].name, builtins[b].name) != 0)
+    return 0;
+  if (builtins[a].sub == NULL || builtins[b].sub == NULL)
+    return builtins[a].sub == builtins[b].sub;
+  return strcmp (builtins[a].sub, builtins[b].sub) == 0;
+}
+
+
+int
+main (void)
+{
+  signed char slots[MAX_SLOTS];
+  unsigned int bits, size, seed, i, j;
+  uint32_t slot;
+
+  for (bits = 1; (1u << bits) < COUNT * 2; bits++);
+  size = 1u << bits;
+  if (size > MAX_SLOTS)
+    {
+      fprintf (stderr, "gen-builtins: too many built in commands\n");
+      return 1;
+    }
+
+  /* No seed would ever separate two identical entries */
+  for (i = 0; i < COUNT; i++)
+    for (j = i + 1; j < COUNT; j++)
+      if (same_entry (i, j))
+        {
+          fprintf (stderr, "gen-builtins: duplicated entry `%s %s'\n",
+                   builtins[i].name, builtins[i].sub ? builtins[i].sub : "");
+          return 1;
+        }
+
+  for (seed = 0; seed < MAX_TRIES; seed++)
+    {
+      memset (slots, -1, size);
+      for (i = 0; i < COUNT; i++)
+        {
+          slot = bitu_builtin_slot (bitu_builtin_hash (seed,
+                                                       builtins[i].name,
+                                                       builtins[i].sub),
+                                    bits);
+          if (slots[slot] != -1)
+            break;
+          slots[slot] = i;
+        }
+      if (i == COUNT)
+        break;
+    }
+  if (seed == MAX_TRIES)
+    {
+      fprintf (stderr, "gen-builtins: no perfect hash found\n");
+      return 1;
+    }
+
+  printf ("/* Generated by gen-builtins from builtins.def, don't edit */\n\n");
+  printf ("#define BITU_BUILTINS_COUNT %u\n", (unsigned int) COUNT);
+  printf ("#define BITU_BUILTINS_SEED %uu\n", seed);
+  printf ("#define BITU_BUILTINS_BITS %u\n\n", bits);
+  printf ("static const signed char _bitu_builtin_slots[%u] = {", size);
+  for (i = 0; i < size; i++)
+    printf ("%s%d%s", i % 16 ? " " : "\n  ", slots[i], i < size - 1 ? "," : "");
+  printf ("\n};\n");
+  return ferror (stdout) ? 1 : 0;
+}
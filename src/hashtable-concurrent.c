@@ -0,0 +1,461 @@
+/* hashtable-concurrent.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <taningia/taningia.h>
+
+#include "hashtable.h"
+#include "hashtable-concurrent.h"
+#include "epoch.h"
+
+/* Stripes start with this many buckets and double when they hold more
+ * pairs than buckets */
+#define CHASHTABLE_MIN_BUCKETS 8
+
+/* Pairs are never changed once published, except for `next', so
+ * readers walking a chain always find a consistent pair */
+typedef struct _chashtable_node
+{
+  void *key;
+  void *value;
+  unsigned int hash;
+  struct _chashtable_node *next;
+} _chashtable_node_t;
+
+typedef struct
+{
+  unsigned int mask;
+  _chashtable_node_t *buckets[];
+} _chashtable_buckets_t;
+
+typedef struct {
+  pthread_mutex_t writer;
+  _chashtable_buckets_t *buckets;
+  unsigned int size;
+} _chashtable_stripe_t;
+
+struct chashtable
+{
+  _chashtable_stripe_t stripes[CHASHTABLE_STRIPES];
+  bitu_epoch_t *epoch;
+  volatile unsigned int size;
+
+  key_hash_fn hash_key;
+  key_cmp_fn cmp_keys;
+  free_fn free_key;
+  free_fn free_value;
+};
+
+
+static _chashtable_stripe_t *
+_chashtable_stripe (chashtable_t *table, unsigned int hash)
+{
+  /* Buckets are chosen by the low bits, stripes use the high ones */
+  return &table->stripes[(hash * 0x9e3779b1) >> 28];
+}
+
+
+static _chashtable_buckets_t *
+_chashtable_buckets_new (unsigned int nbuckets)
+{
+  _chashtable_buckets_t *buckets;
+  buckets = calloc (1, sizeof (_chashtable_buckets_t) +
+                    nbuckets * sizeof (_chashtable_node_t *));
+  if (buckets != NULL)
+    buckets->mask = nbuckets - 1;
+  return buckets;
+}
+
+
+/* Deferred frees. A pair that was replaced or deleted takes its key
+ * and value with it, buckets left behind by growing only take their
+ * own copies of the pairs. */
+static void
+_chashtable_node_reclaim (void *ptr, void *data)
+{
+  _chashtable_node_t *node = ptr;
+  chashtable_t *table = data;
+  if (table->free_key)
+    table->free_key (node->key);
+  if (table->free_value)
+    table->free_value (node->value);
+  free (node);
+}
+
+
+static void
+_chashtable_buckets_reclaim (void *ptr, void *TA_UNUSED(data))
+{
+  _chashtable_buckets_t *buckets = ptr;
+  _chashtable_node_t *node, *next;
+  unsigned int i;
+
+  for (i = 0; i <= buckets->mask; i++)
+    for (node = buckets->buckets[i]; node; node = next)
+      {
+        next = node->next;
+        free (node);
+      }
+  free (buckets);
+}
+
+
+chashtable_t *
+chashtable_create (key_hash_fn hash_key, key_cmp_fn cmp_keys,
+                   free_fn free_key, free_fn free_value)
+{
+  chashtable_t *table;
+  int i;
+
+  if ((table = calloc (1, sizeof (chashtable_t))) == NULL)
+    return NULL;
+  table->hash_key = hash_key;
+  table->cmp_keys = cmp_keys;
+  table->free_key = free_key;
+  table->free_value = free_value;
+
+  if ((table->epoch = bitu_epoch_new ()) == NULL)
+    {
+      free (table);
+      return NULL;
+    }
+  for (i = 0; i < CHASHTABLE_STRIPES; i++)
+    {
+      pthread_mutex_init (&table->stripes[i].writer, NULL);
+      table->stripes[i].buckets =
+        _chashtable_buckets_new (CHASHTABLE_MIN_BUCKETS);
+      if (table->stripes[i].buckets == NULL)
+        {
+          chashtable_destroy (table);
+          return NULL;
+        }
+    }
+  return table;
+}
+
+
+void
+chashtable_destroy (chashtable_t *table)
+{
+  _chashtable_buckets_t *buckets;
+  _chashtable_node_t *node;
+  unsigned int j;
+  int i;
+
+  /* What's still deferred needs the free functions of the table */
+  bitu_epoch_free (table->epoch);
+
+  for (i = 0; i < CHASHTABLE_STRIPES; i++)
+    {
+      if ((buckets = table->stripes[i].buckets) == NULL)
+        continue;
+      for (j = 0; j <= buckets->mask; j++)
+        for (node = buckets->buckets[j]; node; node = node->next)
+          {
+            if (table->free_key)
+              table->free_key (node->key);
+            if (table->free_value)
+              table->free_value (node->value);
+          }
+      _chashtable_buckets_reclaim (buckets, NULL);
+      pthread_mutex_destroy (&table->stripes[i].writer);
+    }
+  free (table);
+}
+
+
+unsigned int
+chashtable_size (chashtable_t *table)
+{
+  return __atomic_load_n (&table->size, __ATOMIC_RELAXED);
+}
+
+
+/* Doubles the buckets of a stripe. Readers may be walking the current
+ * chains, so they're copied instead of relinked and the old ones are
+ * freed later. Growing is rare, each pair is copied once for every
+ * time the stripe doubles. The stripe lock must be held. */
+static void
+_chashtable_stripe_grow (chashtable_t *table, _chashtable_stripe_t *stripe)
+{
+  _chashtable_buckets_t *old = stripe->buckets, *buckets;
+  _chashtable_node_t *node, *copy;
+  unsigned int i;
+
+  /* Not growing only makes chains longer */
+  if ((buckets = _chashtable_buckets_new ((old->mask + 1) * 2)) == NULL)
+    return;
+  for (i = 0; i <= old->mask; i++)
+    for (node = old->buckets[i]; node; node = node->next)
+      {
+        if ((copy = malloc (sizeof (_chashtable_node_t))) == NULL)
+          {
+            _chashtable_buckets_reclaim (buckets, NULL);
+            return;
+          }
+        *copy = *node;
+        copy->next = buckets->buckets[copy->hash & buckets->mask];
+        buckets->buckets[copy->hash & buckets->mask] = copy;
+      }
+
+  bitu_epoch_publish (stripe->buckets, buckets);
+  bitu_epoch_defer (table->epoch, _chashtable_buckets_reclaim, old, NULL);
+}
+
+
+/* The work horse of all writes. A NULL value deletes the key. Pairs
+ * are added, replaced and removed in place and only the replaced pair
+ * is freed later, so writes never wait for readers. */
+static int
+_chashtable_write (chashtable_t *table, void *key, unsigned int hash,
+                   void *value, int replace)
+{
+  _chashtable_stripe_t *stripe;
+  _chashtable_buckets_t *buckets;
+  _chashtable_node_t **link, *node, *added = NULL;
+
+  stripe = _chashtable_stripe (table, hash);
+  pthread_mutex_lock (&stripe->writer);
+  buckets = stripe->buckets;
+
+  for (link = &buckets->buckets[hash & buckets->mask]; (node = *link);
+       link = &node->next)
+    if (node->hash == hash &&
+        (node->key == key || table->cmp_keys (node->key, key)))
+      break;
+
+  if ((node && !replace) || (!node && !value))
+    {
+      pthread_mutex_unlock (&stripe->writer);
+      return node ? 1 : -1;
+    }
+
+  if (value)
+    {
+      if ((added = malloc (sizeof (_chashtable_node_t))) == NULL)
+        {
+          pthread_mutex_unlock (&stripe->writer);
+          return -1;
+        }
+      added->key = key;
+      added->value = value;
+      added->hash = hash;
+      added->next = node ? node->next : buckets->buckets[hash & buckets->mask];
+    }
+
+  /* Replacing takes the place of the old pair in its chain, adding
+   * goes to the head of the chain and deleting skips the old pair */
+  if (node)
+    bitu_epoch_publish (*link, added ? added : node->next);
+  else
+    bitu_epoch_publish (buckets->buckets[hash & buckets->mask], added);
+
+  if (!node)
+    {
+      __sync_fetch_and_add (&table->size, 1);
+      if (++stripe->size > buckets->mask + 1)
+        _chashtable_stripe_grow (table, stripe);
+    }
+  else if (!value)
+    {
+      __sync_fetch_and_sub (&table->size, 1);
+      stripe->size--;
+    }
+  pthread_mutex_unlock (&stripe->writer);
+
+  /* Someone might still be looking at the old pair */
+  if (node)
+    bitu_epoch_defer (table->epoch, _chashtable_node_reclaim, node, table);
+  return 0;
+}
+
+
+int
+chashtable_set (chashtable_t *table, void *key, void *value)
+{
+  return _chashtable_write (table, key, table->hash_key (key), value, 1);
+}
+
+
+int
+chashtable_set_hashed (chashtable_t *table, void *key, unsigned int hash,
+                       void *value)
+{
+  return _chashtable_write (table, key, hash, value, 1);
+}
+
+
+int
+chashtable_add (chashtable_t *table, void *key, void *value)
+{
+  return _chashtable_write (table, key, table->hash_key (key), value, 0);
+}
+
+
+int
+chashtable_add_hashed (chashtable_t *table, void *key, unsigned int hash,
+                       void *value)
+{
+  return _chashtable_write (table, key, hash, value, 0);
+}
+
+
+int
+chashtable_del (chashtable_t *table, const void *key)
+{
+  return _chashtable_write (table, (void *) key, table->hash_key (key),
+                            NULL, 1);
+}
+
+
+int
+chashtable_del_hashed (chashtable_t *table, const void *key,
+                       unsigned int hash)
+{
+  return _chashtable_write (table, (void *) key, hash, NULL, 1);
+}
+
+
+int
+chashtable_read_begin (chashtable_t *table)
+{
+  return bitu_epoch_enter (table->epoch);
+}
+
+
+void
+chashtable_read_end (chashtable_t *table, int token)
+{
+  bitu_epoch_exit (table->epoch, token);
+}
+
+
+void *
+chashtable_get (chashtable_t *table, const void *key)
+{
+  return chashtable_get_hashed (table, key, table->hash_key (key));
+}
+
+
+void *
+chashtable_get_hashed (chashtable_t *table, const void *key,
+                       unsigned int hash)
+{
+  _chashtable_stripe_t *stripe = _chashtable_stripe (table, hash);
+  _chashtable_buckets_t *buckets;
+  _chashtable_node_t *node;
+
+  buckets = bitu_epoch_dereference (stripe->buckets);
+  for (node = bitu_epoch_dereference (buckets->buckets[hash & buckets->mask]);
+       node; node = bitu_epoch_dereference (node->next))
+    if (node->hash == hash &&
+        (node->key == key || table->cmp_keys (node->key, key)))
+      return node->value;
+  return NULL;
+}
+
+
+void *
+chashtable_get_copy (chashtable_t *table, const void *key, copy_fn copy)
+{
+  void *value;
+  int token;
+
+  token = chashtable_read_begin (table);
+  if ((value = chashtable_get (table, key)) != NULL)
+    value = copy (value);
+  chashtable_read_end (table, token);
+  return value;
+}
+
+
+void
+chashtable_snapshot (chashtable_t *table, chashtable_snapshot_t *snapshot)
+{
+  int i;
+
+  snapshot->table = table;
+  snapshot->current = 0;
+  snapshot->bucket = 0;
+  snapshot->token = chashtable_read_begin (table);
+  for (i = 0; i < CHASHTABLE_STRIPES; i++)
+    snapshot->stripes[i] = bitu_epoch_dereference (table->stripes[i].buckets);
+}
+
+
+void
+chashtable_snapshot_release (chashtable_snapshot_t *snapshot)
+{
+  chashtable_read_end (snapshot->table, snapshot->token);
+}
+
+
+/* The first pair found from the current bucket on */
+static void *
+_chashtable_snapshot_advance (chashtable_snapshot_t *snapshot)
+{
+  _chashtable_buckets_t *buckets;
+  _chashtable_node_t *node;
+
+  for (; snapshot->current < CHASHTABLE_STRIPES;
+       snapshot->current++, snapshot->bucket = 0)
+    {
+      buckets = snapshot->stripes[snapshot->current];
+      for (; snapshot->bucket <= buckets->mask; snapshot->bucket++)
+        if ((node = bitu_epoch_dereference
+             (buckets->buckets[snapshot->bucket])) != NULL)
+          return node;
+    }
+  return NULL;
+}
+
+
+void *
+chashtable_snapshot_iter (chashtable_snapshot_t *snapshot)
+{
+  snapshot->current = 0;
+  snapshot->bucket = 0;
+  return _chashtable_snapshot_advance (snapshot);
+}
+
+
+void *
+chashtable_snapshot_iter_next (chashtable_snapshot_t *snapshot, void *iter)
+{
+  _chashtable_node_t *node = iter;
+  if ((node = bitu_epoch_dereference (node->next)) != NULL)
+    return node;
+  snapshot->bucket++;
+  return _chashtable_snapshot_advance (snapshot);
+}
+
+
+void *
+chashtable_iter_key (void *iter)
+{
+  return ((_chashtable_node_t *) iter)->key;
+}
+
+
+void *
+chashtable_iter_value (void *iter)
+{
+  return ((_chashtable_node_t *) iter)->value;
+}
@@ -0,0 +1,95 @@
+/* hashtable-concurrent.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BITU_HASHTABLE_CONCURRENT_H_
+#define BITU_HASHTABLE_CONCURRENT_H_ 1
+
+#include "hashtable.h"
+#include "epoch.h"
+
+/* A hashtable shared among threads. Keys are spread over a few stripes,
+ * each one with its own writer lock and chains of pairs that writers
+ * change in place. Readers never lock, they just need to be inside of
+ * a read section (see `chashtable_read_begin()') while they use what
+ * they found, since replaced keys and values are only freed after all
+ * readers that could see them leave. Writers don't wait for that, it
+ * happens during later writes.
+ *
+ * Writing to the table from inside of a read section (or while holding
+ * a snapshot) of the same table is fine, but what it replaces is only
+ * freed after the section ends. */
+
+#define CHASHTABLE_STRIPES 16
+
+typedef struct chashtable chashtable_t;
+
+/* A view of the whole table to iterate over. Writers keep going while
+ * it's held, pairs they add or remove may or may not be seen, and the
+ * others are seen once with either their old or their new value. What
+ * they replace isn't freed while it's held, so don't hold it for
+ * long. */
+typedef struct {
+  chashtable_t *table;
+  int token;
+  int current;
+  unsigned int bucket;
+  void *stripes[CHASHTABLE_STRIPES];
+} chashtable_snapshot_t;
+
+typedef void *(*copy_fn) (const void *value);
+
+chashtable_t *chashtable_create (key_hash_fn hash_key, key_cmp_fn cmp_keys,
+                                 free_fn free_key, free_fn free_value);
+void chashtable_destroy (chashtable_t *table);
+unsigned int chashtable_size (chashtable_t *table);
+
+/* Writes. `chashtable_set()' replaces existing values while
+ * `chashtable_add()' returns 1 (and takes nothing) when the key is
+ * already there. They return -1 when out of memory. The _hashed
+ * variants take what hash_key would return for the key, see
+ * `hashtable_get_hashed()'. */
+int chashtable_set (chashtable_t *table, void *key, void *value);
+int chashtable_add (chashtable_t *table, void *key, void *value);
+int chashtable_del (chashtable_t *table, const void *key);
+int chashtable_set_hashed (chashtable_t *table, void *key, unsigned int hash,
+                           void *value);
+int chashtable_add_hashed (chashtable_t *table, void *key, unsigned int hash,
+                           void *value);
+int chashtable_del_hashed (chashtable_t *table, const void *key,
+                           unsigned int hash);
+
+/* Reads */
+int chashtable_read_begin (chashtable_t *table);
+void chashtable_read_end (chashtable_t *table, int token);
+void *chashtable_get (chashtable_t *table, const void *key);
+void *chashtable_get_hashed (chashtable_t *table, const void *key,
+                             unsigned int hash);
+void *chashtable_get_copy (chashtable_t *table, const void *key, copy_fn copy);
+
+/* Iteration. Keys and values are read with `chashtable_iter_key()'
+ * and `chashtable_iter_value()'. */
+void chashtable_snapshot (chashtable_t *table, chashtable_snapshot_t *snapshot);
+void chashtable_snapshot_release (chashtable_snapshot_t *snapshot);
+void *chashtable_snapshot_iter (chashtable_snapshot_t *snapshot);
+void *chashtable_snapshot_iter_next (chashtable_snapshot_t *snapshot,
+                                     void *iter);
+void *chashtable_iter_key (void *iter);
+void *chashtable_iter_value (void *iter);
+
+#endif /* BITU_HASHTABLE_CONCURRENT_H_ */
@@ -5,21 +5,116 @@
  * it under the terms of the MIT license. See LICENSE for details.
  */
 
+#include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
-unsigned int hash_string(const void *key)
+/* Keys of some tables (like the environment) come straight from remote
+ * users, so string keys are hashed with SipHash-1-3 and a key chosen
+ * at random when the process starts. Nobody can predict which keys
+ * collide and flood a single probe sequence. */
+
+static uint64_t seed[2];
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+
+static void seed_init(void)
 {
-    const char *str = (const char *)key;
-    unsigned int hash = 5381;
-    unsigned int c;
+    FILE *urandom;
+    size_t nread = 0;
+
+    if((urandom = fopen("/dev/urandom", "rb")) != NULL)
+    {
+        nread = fread(seed, sizeof(seed), 1, urandom);
+        fclose(urandom);
+    }
+
+    /* Not as good, but better than a fixed key */
+    if(nread != 1)
+    {
+        seed[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        seed[1] = (uint64_t)(uintptr_t)&seed ^ (uint64_t)clock();
+    }
+}
+
+#define ROTL(x_, b_)  (((x_) << (b_)) | ((x_) >> (64 - (b_))))
+
+#define SIPROUND                                        \
+    do {                                                \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0;          \
+        v0 = ROTL(v0, 32);                              \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;          \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;          \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2;          \
+        v2 = ROTL(v2, 32);                              \
+    } while(0)
+
+/* Little endian load that doesn't care about alignment. Compilers turn
+ * it into a single move. */
+static inline uint64_t load64(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static uint64_t siphash13(const unsigned char *in, size_t len)
+{
+    uint64_t v0 = seed[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = seed[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = seed[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = seed[1] ^ 0x7465646279746573ULL;
+    uint64_t m, last = (uint64_t)len << 56;
+    const unsigned char *end = in + (len & ~(size_t)7);
+
+    /* Whole words first, the tail is packed with the length */
+    for(; in != end; in += 8)
+    {
+        m = load64(in);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
 
-    while((c = (unsigned int)*str))
+    switch(len & 7)
     {
-        hash = ((hash << 5) + hash) + c;
-        str++;
+        case 7: last |= (uint64_t)in[6] << 48; /* fall through */
+        case 6: last |= (uint64_t)in[5] << 40; /* fall through */
+        case 5: last |= (uint64_t)in[4] << 32; /* fall through */
+        case 4: last |= (uint64_t)in[3] << 24; /* fall through */
+        case 3: last |= (uint64_t)in[2] << 16; /* fall through */
+        case 2: last |= (uint64_t)in[1] << 8;  /* fall through */
+        case 1: last |= (uint64_t)in[0];
     }
 
-    return hash;
+    v3 ^= last;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+unsigned int hash_string(const void *key)
+{
+    const char *str = (const char *)key;
+    uint64_t hash;
+
+    pthread_once(&seed_once, seed_init);
+
+    /* strlen() is vectorized by the C library, so knowing the length
+     * up front lets us consume the key a word at a time */
+    hash = siphash13((const unsigned char *)str, strlen(str));
+    return (unsigned int)(hash ^ (hash >> 32));
 }
 
 int string_equal(const void *key1, const void *key2)
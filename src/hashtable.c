@@ -8,161 +8,214 @@
 #include <stdlib.h>
 #include "hashtable.h"
 
-typedef struct hashtable_list list_t;
 typedef struct hashtable_pair pair_t;
-typedef struct hashtable_bucket bucket_t;
 
-#define container_of(ptr_, type_, member_)                      \
-    ((type_ *)((char *)ptr_ - (size_t)&((type_ *)0)->member_))
+#define INITIAL_SIZE 8
 
-#define list_to_pair(list_)  container_of(list_, pair_t, list)
+/* Grow when more than 4/5 of the slots are taken. Robin Hood keeps
+ * probe sequences short even this full. */
+#define MAX_LOAD(size_)  ((size_) - (size_) / 5)
 
-static inline void list_init(list_t *list)
-{
-    list->next = list;
-    list->prev = list;
-}
+/* Old slots moved to the new table on each change while growing. Any
+ * step of two or more finishes moving before the new table reaches its
+ * load limit, and small steps keep every single change cheap. */
+#define REHASH_STEP 4
 
-static inline void list_insert(list_t *list, list_t *node)
+/* The table is indexed by the low bits of the hash and not every key
+ * hash function spreads them well, so it's mixed first (murmur3's
+ * finalizer). */
+static inline unsigned int hash_mix(unsigned int hash)
 {
-    node->next = list;
-    node->prev = list->prev;
-    list->prev->next = node;
-    list->prev = node;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
 }
 
-static inline void list_remove(list_t *list)
+static inline unsigned int num_slots(hashtable_t *hashtable)
 {
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
+    return hashtable->mask + 1;
 }
 
-static inline int bucket_is_empty(hashtable_t *hashtable, bucket_t *bucket)
+static inline int is_rehashing(hashtable_t *hashtable)
 {
-    return bucket->first == &hashtable->list && bucket->first == bucket->last;
+    return hashtable->old_pairs != NULL;
 }
 
-static void insert_to_bucket(hashtable_t *hashtable, bucket_t *bucket,
-                             list_t *list)
+/* Walks a probe sequence from index, where the wanted pair would be at
+ * distance dist from its home slot */
+static pair_t *find_in(hashtable_t *hashtable, pair_t *pairs,
+                       unsigned int mask, unsigned int index,
+                       unsigned int dist, const void *key, unsigned int hash)
 {
-    if(bucket_is_empty(hashtable, bucket))
-    {
-        list_insert(&hashtable->list, list);
-        bucket->first = bucket->last = list;
-    }
-    else
+    pair_t *pair;
+
+    for(; ; dist++)
     {
-        list_insert(bucket->first, list);
-        bucket->first = list;
+        pair = &pairs[index];
+
+        /* The key would have taken this slot if it was here */
+        if(pair->dist < dist)
+            return NULL;
+
+        if(pair->hash == hash &&
+           (pair->key == key || hashtable->cmp_keys(pair->key, key)))
+            return pair;
+
+        index = (index + 1) & mask;
     }
 }
 
-static unsigned int primes[] = {
-    5, 13, 23, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593,
-    49157, 98317, 196613, 393241, 786433, 1572869, 3145739, 6291469,
-    12582917, 25165843, 50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741
-};
-static const unsigned int num_primes = sizeof(primes) / sizeof(unsigned int);
-
-static inline unsigned int num_buckets(hashtable_t *hashtable)
+/* Moving starts at an empty slot, so no probe sequence left in the old
+ * slots crosses the moved ones. A sequence starting among them has
+ * lost its beginning and goes on right after the last moved slot. */
+static pair_t *find_in_old(hashtable_t *hashtable, const void *key,
+                           unsigned int hash)
 {
-    return primes[hashtable->num_buckets];
-}
+    unsigned int mask = hashtable->old_mask;
+    unsigned int home = hash & mask;
+    unsigned int index;
 
+    if(((home - hashtable->rehash_start) & mask) >= hashtable->rehash_done)
+        return find_in(hashtable, hashtable->old_pairs, mask,
+                       home, 1, key, hash);
+
+    index = (hashtable->rehash_start + hashtable->rehash_done) & mask;
+    return find_in(hashtable, hashtable->old_pairs, mask,
+                   index, ((index - home) & mask) + 1, key, hash);
+}
 
-static pair_t *hashtable_find_pair(hashtable_t *hashtable, bucket_t *bucket,
+static pair_t *hashtable_find_pair(hashtable_t *hashtable,
                                    const void *key, unsigned int hash)
 {
-    list_t *list;
     pair_t *pair;
 
-    if(bucket_is_empty(hashtable, bucket))
-        return NULL;
-
-    list = bucket->first;
-    while(1)
-    {
-        pair = list_to_pair(list);
-        if(pair->hash == hash && hashtable->cmp_keys(pair->key, key))
-            return pair;
-
-        if(list == bucket->last)
-            break;
-
-        list = list->next;
-    }
-
-    return NULL;
+    pair = find_in(hashtable, hashtable->pairs, hashtable->mask,
+                   hash & hashtable->mask, 1, key, hash);
+    if(!pair && is_rehashing(hashtable))
+        pair = find_in_old(hashtable, key, hash);
+    return pair;
 }
 
-/* returns 0 on success, -1 if key was not found */
-static int hashtable_do_del(hashtable_t *hashtable,
-                            const void *key, unsigned int hash)
+/* Places a pair known not to be in the table yet. Richer pairs (closer
+ * to their home slot) give their place to the poorer one being
+ * inserted, which then goes on looking for a slot. */
+static void insert_pair(hashtable_t *hashtable, pair_t pair)
 {
-    pair_t *pair;
-    bucket_t *bucket;
+    pair_t *slot, tmp;
     unsigned int index;
 
-    index = hash % num_buckets(hashtable);
-    bucket = &hashtable->buckets[index];
-
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
-    if(!pair)
-        return -1;
-
-    if(&pair->list == bucket->first && &pair->list == bucket->last)
-        bucket->first = bucket->last = &hashtable->list;
-
-    else if(&pair->list == bucket->first)
-        bucket->first = pair->list.next;
-
-    else if(&pair->list == bucket->last)
-        bucket->last = pair->list.prev;
+    index = pair.hash & hashtable->mask;
+    for(pair.dist = 1; ; pair.dist++)
+    {
+        slot = &hashtable->pairs[index];
+        if(slot->dist == 0)
+        {
+            *slot = pair;
+            return;
+        }
+        if(slot->dist < pair.dist)
+        {
+            tmp = *slot;
+            *slot = pair;
+            pair = tmp;
+        }
+        index = (index + 1) & hashtable->mask;
+    }
+}
 
-    list_remove(&pair->list);
+static void hashtable_remove_pair(hashtable_t *hashtable, pair_t *pair)
+{
+    pair_t *pairs, *next;
+    unsigned int index, mask;
 
     if(hashtable->free_key)
         hashtable->free_key(pair->key);
     if(hashtable->free_value)
         hashtable->free_value(pair->value);
 
-    free(pair);
-    hashtable->size--;
+    if(pair >= hashtable->pairs && pair <= &hashtable->pairs[hashtable->mask])
+    {
+        pairs = hashtable->pairs;
+        mask = hashtable->mask;
+    }
+    else
+    {
+        pairs = hashtable->old_pairs;
+        mask = hashtable->old_mask;
+    }
 
-    return 0;
+    /* Backward shift: pairs displaced by the removed one move one slot
+     * closer to home, so no tombstones are needed. The moved slots of
+     * an old table are empty, so nothing is shifted into them. */
+    index = pair - pairs;
+    while(1)
+    {
+        next = &pairs[(index + 1) & mask];
+        if(next->dist <= 1)
+            break;
+        pairs[index] = *next;
+        pairs[index].dist--;
+        index = (index + 1) & mask;
+    }
+    pairs[index].dist = 0;
+
+    hashtable->size--;
 }
 
-static int hashtable_do_rehash(hashtable_t *hashtable)
+/* Moves up to count old slots to the new table */
+static void hashtable_rehash_step(hashtable_t *hashtable, unsigned int count)
 {
-    list_t *list, *next;
     pair_t *pair;
-    unsigned int i, index, new_size;
+    unsigned int old_size = hashtable->old_mask + 1;
 
-    free(hashtable->buckets);
-
-    hashtable->num_buckets++;
-    new_size = num_buckets(hashtable);
-
-    hashtable->buckets = malloc(new_size * sizeof(bucket_t));
-    if(!hashtable->buckets)
-        return -1;
+    while(count-- && hashtable->rehash_done < old_size)
+    {
+        pair = &hashtable->old_pairs[(hashtable->rehash_start +
+                                      hashtable->rehash_done) &
+                                     hashtable->old_mask];
+        if(pair->dist)
+        {
+            insert_pair(hashtable, *pair);
+            pair->dist = 0;
+        }
+        hashtable->rehash_done++;
+    }
 
-    for(i = 0; i < num_buckets(hashtable); i++)
+    if(hashtable->rehash_done == old_size)
     {
-        hashtable->buckets[i].first = hashtable->buckets[i].last =
-            &hashtable->list;
+        free(hashtable->old_pairs);
+        hashtable->old_pairs = NULL;
     }
+}
 
-    list = hashtable->list.next;
-    list_init(&hashtable->list);
+static int hashtable_do_rehash(hashtable_t *hashtable)
+{
+    pair_t *new_pairs;
+    unsigned int i, new_size;
 
-    for(; list != &hashtable->list; list = next) {
-        next = list->next;
-        pair = list_to_pair(list);
-        index = pair->hash % new_size;
-        insert_to_bucket(hashtable, &hashtable->buckets[index], &pair->list);
-    }
+    /* Growing again before the last one finished, which only happens
+     * with tiny tables */
+    if(is_rehashing(hashtable))
+        hashtable_rehash_step(hashtable, hashtable->old_mask + 1);
+
+    new_size = num_slots(hashtable) * 2;
+    new_pairs = calloc(new_size, sizeof(pair_t));
+    if(!new_pairs)
+        return -1;
+
+    /* There's always an empty slot below the load limit */
+    for(i = 0; hashtable->pairs[i].dist; i++)
+        ;
+
+    hashtable->old_pairs = hashtable->pairs;
+    hashtable->old_mask = hashtable->mask;
+    hashtable->rehash_start = i;
+    hashtable->rehash_done = 0;
+    hashtable->pairs = new_pairs;
+    hashtable->mask = new_size - 1;
 
     return 0;
 }
@@ -194,125 +247,180 @@ int hashtable_init(hashtable_t *hashtable,
                    key_hash_fn hash_key, key_cmp_fn cmp_keys,
                    free_fn free_key, free_fn free_value)
 {
-    unsigned int i;
-
     hashtable->size = 0;
-    hashtable->num_buckets = 0;  /* index to primes[] */
-    hashtable->buckets = malloc(num_buckets(hashtable) * sizeof(bucket_t));
-    if(!hashtable->buckets)
+    hashtable->mask = INITIAL_SIZE - 1;
+    hashtable->pairs = calloc(INITIAL_SIZE, sizeof(pair_t));
+    if(!hashtable->pairs)
         return -1;
-
-    list_init(&hashtable->list);
+    hashtable->old_pairs = NULL;
+    hashtable->old_mask = 0;
+    hashtable->rehash_start = 0;
+    hashtable->rehash_done = 0;
 
     hashtable->hash_key = hash_key;
     hashtable->cmp_keys = cmp_keys;
     hashtable->free_key = free_key;
     hashtable->free_value = free_value;
 
-    for(i = 0; i < num_buckets(hashtable); i++)
-    {
-        hashtable->buckets[i].first = hashtable->buckets[i].last =
-            &hashtable->list;
-    }
-
     return 0;
 }
 
-void hashtable_close(hashtable_t *hashtable)
+static void close_pairs(hashtable_t *hashtable, pair_t *pairs,
+                        unsigned int size)
 {
-    list_t *list, *next;
-    pair_t *pair;
-    for(list = hashtable->list.next; list != &hashtable->list; list = next)
+    unsigned int i;
+
+    for(i = 0; i < size; i++)
     {
-        next = list->next;
-        pair = list_to_pair(list);
+        if(!pairs[i].dist)
+            continue;
         if(hashtable->free_key)
-            hashtable->free_key(pair->key);
+            hashtable->free_key(pairs[i].key);
         if(hashtable->free_value)
-            hashtable->free_value(pair->value);
-        free(pair);
+            hashtable->free_value(pairs[i].value);
     }
 
-    free(hashtable->buckets);
+    free(pairs);
 }
 
-int hashtable_set(hashtable_t *hashtable, void *key, void *value)
+void hashtable_close(hashtable_t *hashtable)
 {
-    pair_t *pair;
-    bucket_t *bucket;
-    unsigned int hash, index;
+    if(is_rehashing(hashtable))
+        close_pairs(hashtable, hashtable->old_pairs, hashtable->old_mask + 1);
+    close_pairs(hashtable, hashtable->pairs, num_slots(hashtable));
+}
+
+int hashtable_set_hashed(hashtable_t *hashtable, void *key, unsigned int hash,
+                         void *value)
+{
+    pair_t *pair, new_pair;
 
-    hash = hashtable->hash_key(key);
+    hash = hash_mix(hash);
 
-    /* if the key already exists, delete it */
-    hashtable_do_del(hashtable, key, hash);
+    if(is_rehashing(hashtable))
+        hashtable_rehash_step(hashtable, REHASH_STEP);
 
-    /* rehash if the load ratio exceeds 1 */
-    if(hashtable->size >= num_buckets(hashtable))
+    /* if the key already exists, replace it in place */
+    pair = hashtable_find_pair(hashtable, key, hash);
+    if(pair)
+    {
+        if(hashtable->free_key)
+            hashtable->free_key(pair->key);
+        if(hashtable->free_value)
+            hashtable->free_value(pair->value);
+        pair->key = key;
+        pair->value = value;
+        return 0;
+    }
+
+    if(hashtable->size + 1 > MAX_LOAD(num_slots(hashtable)))
         if(hashtable_do_rehash(hashtable))
             return -1;
 
-    pair = malloc(sizeof(pair_t));
-    if(!pair)
-        return -1;
+    new_pair.key = key;
+    new_pair.value = value;
+    new_pair.hash = hash;
+    insert_pair(hashtable, new_pair);
+
+    hashtable->size++;
+    return 0;
+}
 
-    pair->key = key;
-    pair->value = value;
-    pair->hash = hash;
-    list_init(&pair->list);
+int hashtable_set(hashtable_t *hashtable, void *key, void *value)
+{
+    return hashtable_set_hashed(hashtable, key, hashtable->hash_key(key),
+                                value);
+}
 
-    index = hash % num_buckets(hashtable);
-    bucket = &hashtable->buckets[index];
+void *hashtable_get_hashed(hashtable_t *hashtable, const void *key,
+                           unsigned int hash)
+{
+    pair_t *pair;
 
-    insert_to_bucket(hashtable, bucket, &pair->list);
+    pair = hashtable_find_pair(hashtable, key, hash_mix(hash));
+    if(!pair)
+        return NULL;
 
-    hashtable->size++;
-    return 0;
+    return pair->value;
 }
 
 void *hashtable_get(hashtable_t *hashtable, const void *key)
+{
+    return hashtable_get_hashed(hashtable, key, hashtable->hash_key(key));
+}
+
+int hashtable_del_hashed(hashtable_t *hashtable, const void *key,
+                         unsigned int hash)
 {
     pair_t *pair;
-    unsigned int hash;
-    bucket_t *bucket;
 
-    hash = hashtable->hash_key(key);
-    bucket = &hashtable->buckets[hash % num_buckets(hashtable)];
+    hash = hash_mix(hash);
+
+    if(is_rehashing(hashtable))
+        hashtable_rehash_step(hashtable, REHASH_STEP);
 
-    pair = hashtable_find_pair(hashtable, bucket, key, hash);
+    pair = hashtable_find_pair(hashtable, key, hash);
     if(!pair)
-        return NULL;
+        return -1;
 
-    return pair->value;
+    hashtable_remove_pair(hashtable, pair);
+    return 0;
 }
 
 int hashtable_del(hashtable_t *hashtable, const void *key)
 {
-    unsigned int hash = hashtable->hash_key(key);
-    return hashtable_do_del(hashtable, key, hash);
+    return hashtable_del_hashed(hashtable, key, hashtable->hash_key(key));
+}
+
+/* Pairs still in the old slots come first, then the new ones */
+static void *hashtable_iter_from(hashtable_t *hashtable, pair_t *pairs,
+                                 unsigned int index)
+{
+    if(pairs == hashtable->old_pairs)
+    {
+        for(; index <= hashtable->old_mask; index++)
+        {
+            if(pairs[index].dist)
+                return &pairs[index];
+        }
+        pairs = hashtable->pairs;
+        index = 0;
+    }
+
+    for(; index < num_slots(hashtable); index++)
+    {
+        if(pairs[index].dist)
+            return &pairs[index];
+    }
+    return NULL;
 }
 
 void *hashtable_iter(hashtable_t *hashtable)
 {
-    return hashtable_iter_next(hashtable, &hashtable->list);
+    if(is_rehashing(hashtable))
+        return hashtable_iter_from(hashtable, hashtable->old_pairs, 0);
+    return hashtable_iter_from(hashtable, hashtable->pairs, 0);
 }
 
 void *hashtable_iter_next(hashtable_t *hashtable, void *iter)
 {
-    list_t *list = (list_t *)iter;
-    if(list->next == &hashtable->list)
-        return NULL;
-    return list->next;
+    pair_t *pair = (pair_t *)iter;
+
+    if(pair >= hashtable->pairs && pair <= &hashtable->pairs[hashtable->mask])
+        return hashtable_iter_from(hashtable, hashtable->pairs,
+                                   pair - hashtable->pairs + 1);
+    return hashtable_iter_from(hashtable, hashtable->old_pairs,
+                               pair - hashtable->old_pairs + 1);
 }
 
 void *hashtable_iter_key(void *iter)
 {
-    pair_t *pair = list_to_pair((list_t *)iter);
+    pair_t *pair = (pair_t *)iter;
     return pair->key;
 }
 
 void *hashtable_iter_value(void *iter)
 {
-    pair_t *pair = list_to_pair((list_t *)iter);
+    pair_t *pair = (pair_t *)iter;
     return pair->value;
 }
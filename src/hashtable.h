@@ -12,28 +12,28 @@ typedef unsigned int (*key_hash_fn)(const void *key);
 typedef int (*key_cmp_fn)(const void *key1, const void *key2);
 typedef void (*free_fn)(void *key);
 
-struct hashtable_list {
-  struct hashtable_list *prev;
-  struct hashtable_list *next;
-};
-
+/* Open addressing with Robin Hood probing: a pair lives in the slot
+ * array itself and `dist' is the distance from its home slot plus one,
+ * so zero means the slot is empty. */
 struct hashtable_pair {
     void *key;
     void *value;
     unsigned int hash;
-    struct hashtable_list list;
-};
-
-struct hashtable_bucket {
-    struct hashtable_list *first;
-    struct hashtable_list *last;
+    unsigned int dist;
 };
 
 typedef struct hashtable {
     unsigned int size;
-    struct hashtable_bucket *buckets;
-    unsigned int num_buckets;  /* index to primes[] */
-    struct hashtable_list list;
+    struct hashtable_pair *pairs;
+    unsigned int mask;  /* number of slots - 1, always a power of two */
+
+    /* While growing, pairs are moved a few slots at a time from the
+     * old slots, starting at rehash_start. rehash_done slots have been
+     * moved so far. */
+    struct hashtable_pair *old_pairs;
+    unsigned int old_mask;
+    unsigned int rehash_start;
+    unsigned int rehash_done;
 
     key_hash_fn hash_key;
     key_cmp_fn cmp_keys;  /* returns non-zero for equal keys */
@@ -120,7 +120,8 @@ int hashtable_set(hashtable_t *hashtable, void *key, void *value);
  * @hashtable: The hashtable object
  * @key: The key
  *
- * Returns value if it is found, or NULL otherwise.
+ * Returns value if it is found, or NULL otherwise. It never changes
+ * the table, growing only moves pairs around on set and del.
  */
 void *hashtable_get(hashtable_t *hashtable, const void *key);
 
@@ -134,6 +135,23 @@ void *hashtable_get(hashtable_t *hashtable, const void *key);
  */
 int hashtable_del(hashtable_t *hashtable, const void *key);
 
+/**
+ * hashtable_set_hashed, hashtable_get_hashed, hashtable_del_hashed -
+ * Same as above with a precomputed hash
+ *
+ * @hash: What the hashtable's hash_key function returns for @key
+ *
+ * Useful when the key carries its hash around, like interned strings.
+ * Keys are compared by pointer before calling cmp_keys, so looking up
+ * with the very same pointer that was stored is the fastest path.
+ */
+int hashtable_set_hashed(hashtable_t *hashtable, void *key, unsigned int hash,
+                         void *value);
+void *hashtable_get_hashed(hashtable_t *hashtable, const void *key,
+                           unsigned int hash);
+int hashtable_del_hashed(hashtable_t *hashtable, const void *key,
+                         unsigned int hash);
+
 /**
  * hashtable_iter - Iterate over hashtable
  *
@@ -144,10 +162,9 @@ int hashtable_del(hashtable_t *hashtable, const void *key);
  * The hashtable items are not iterated over in any particular order.
  *
  * There's no need to free the iterator in any way. The iterator is
- * valid as long as the item that is referenced by the iterator is not
- * deleted. Other values may be added or deleted. In particular,
- * hashtable_iter_next() may be called on an iterator, and after that
- * the key/value pair pointed by the old iterator may be deleted.
+ * only valid while the hashtable is not changed: adding or deleting
+ * values moves other pairs around, so collect the keys first when they
+ * have to be deleted while iterating.
  */
 void *hashtable_iter(hashtable_t *hashtable);
 
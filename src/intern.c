@@ -0,0 +1,120 @@
+/* intern.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+#include "intern.h"
+
+typedef struct {
+  unsigned int hash;
+  volatile int refcount;
+  char str[1];
+} _bitu_interned_t;
+
+#define INTERNED(s) \
+  ((_bitu_interned_t *) ((char *) (s) - offsetof (_bitu_interned_t, str)))
+
+static hashtable_t *_pool = NULL;
+static pthread_mutex_t _pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Returns the interned copy of `str' holding a new reference to it */
+const char *
+bitu_intern (const char *str)
+{
+  _bitu_interned_t *interned;
+  unsigned int hash = hash_string (str);
+  size_t len;
+
+  pthread_mutex_lock (&_pool_mutex);
+  if (_pool == NULL &&
+      (_pool = hashtable_create (hash_string, string_equal, NULL, NULL)) == NULL)
+    {
+      pthread_mutex_unlock (&_pool_mutex);
+      return NULL;
+    }
+
+  if ((interned = hashtable_get_hashed (_pool, str, hash)) != NULL)
+    {
+      __sync_fetch_and_add (&interned->refcount, 1);
+      pthread_mutex_unlock (&_pool_mutex);
+      return interned->str;
+    }
+
+  len = strlen (str);
+  if ((interned = malloc (offsetof (_bitu_interned_t, str) + len + 1)) == NULL)
+    {
+      pthread_mutex_unlock (&_pool_mutex);
+      return NULL;
+    }
+  interned->hash = hash;
+  interned->refcount = 1;
+  memcpy (interned->str, str, len + 1);
+  if (hashtable_set_hashed (_pool, interned->str, hash, interned) == -1)
+    {
+      pthread_mutex_unlock (&_pool_mutex);
+      free (interned);
+      return NULL;
+    }
+  pthread_mutex_unlock (&_pool_mutex);
+  return interned->str;
+}
+
+
+/* A new reference to something that is already interned. It doesn't
+ * touch the pool since the caller's reference keeps it alive. */
+const char *
+bitu_intern_ref (const char *interned)
+{
+  __sync_fetch_and_add (&INTERNED (interned)->refcount, 1);
+  return interned;
+}
+
+
+void
+bitu_intern_release (const char *str)
+{
+  _bitu_interned_t *interned;
+
+  if (str == NULL)
+    return;
+  interned = INTERNED (str);
+
+  /* The pool lock keeps `bitu_intern()' from reviving a string that
+   * is about to be freed */
+  pthread_mutex_lock (&_pool_mutex);
+  if (__sync_sub_and_fetch (&interned->refcount, 1) == 0)
+    hashtable_del_hashed (_pool, interned->str, interned->hash);
+  else
+    interned = NULL;
+  pthread_mutex_unlock (&_pool_mutex);
+  free (interned);
+}
+
+
+unsigned int
+bitu_intern_hash (const char *interned)
+{
+  return INTERNED (interned)->hash;
+}
@@ -0,0 +1,33 @@
+/* intern.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BITU_INTERN_H_
+#define BITU_INTERN_H_ 1
+
+/* Process wide pool of unique, reference counted strings. Interning
+ * the same contents twice returns the same pointer, so interned keys
+ * can be compared by pointer and they carry their `hash_string()'
+ * value to be used with the hashtable's _hashed functions. */
+
+const char *bitu_intern (const char *str);
+const char *bitu_intern_ref (const char *interned);
+void bitu_intern_release (const char *interned);
+unsigned int bitu_intern_hash (const char *interned);
+
+#endif /* BITU_INTERN_H_ */
@@ -16,30 +16,49 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <bitu/util.h>
 #include <bitu/loader.h>
 #include <bitu/transport.h>
+#include <bitu/stats.h>
 
 #include "hashtable.h"
 #include "hashtable-utils.h"
+#include "worker.h"
+#include "epoch.h"
 
 #define LINELEN_MAX 255
 
 struct bitu_plugin
 {
   void *handle;
+  char *path;
+  ta_log_t *logger;
   const char *(*name) (void);
   char *(*execute) (bitu_command_t *);
   int (*match) (const char *);
+  bitu_worker_pool_t *pool;
+  bitu_stats_t *stats;
+  volatile int refcount;
 };
 
+/* The table of plugins is never changed after being published. Load and
+ * unload build a new copy, swap the pointer and wait for the readers of
+ * the old copy to leave before freeing it. This way lookups never take
+ * a lock and never see a plugin being freed. */
 struct bitu_plugin_ctx
 {
   hashtable_t *plugins;
+  bitu_epoch_t *epoch;
+  bitu_stats_t *stats;
+  ta_log_t *logger;
+  pthread_mutex_t writer;
 };
 
 const char *
@@ -51,30 +70,94 @@ bitu_plugin_name (bitu_plugin_t *plugin)
 char *
 bitu_plugin_execute (bitu_plugin_t *plugin, bitu_command_t *command)
 {
-  return plugin->execute (command);
+  char *output;
+  uint64_t start = bitu_util_monotonic_time ();
+
+  /* Isolated plugins run in one of the workers of their pool */
+  if (plugin->pool)
+    output = bitu_worker_pool_execute (plugin->pool, command);
+  else
+    output = plugin->execute (command);
+
+  if (plugin->stats)
+    bitu_stats_record (plugin->stats, bitu_plugin_name (plugin),
+                       bitu_util_monotonic_time () - start);
+  return output;
+}
+
+int
+bitu_plugin_is_isolated (bitu_plugin_t *plugin)
+{
+  return plugin->pool != NULL;
+}
+
+int
+bitu_plugin_isolate (bitu_plugin_t *plugin, int nworkers)
+{
+  if (plugin->pool)
+    return TA_OK;
+
+  /* The workers load the very same file we've just loaded */
+  plugin->pool = bitu_worker_pool_new (bitu_plugin_name (plugin),
+                                       plugin->path, nworkers,
+                                       plugin->logger);
+  return plugin->pool ? TA_OK : TA_ERROR;
+}
+
+bitu_plugin_t *
+bitu_plugin_ref (bitu_plugin_t *plugin)
+{
+  __sync_fetch_and_add (&plugin->refcount, 1);
+  return plugin;
+}
+
+void
+bitu_plugin_unref (bitu_plugin_t *plugin)
+{
+  /* The last one to leave closes the library. It might be the consumer
+   * finishing an execution that started before the plugin got
+   * unloaded. */
+  if (__sync_sub_and_fetch (&plugin->refcount, 1) == 0)
+    bitu_plugin_free (plugin);
 }
 
 void
 bitu_plugin_free (bitu_plugin_t *plugin)
 {
-  dlclose (plugin->handle);
+  if (plugin->pool)
+    bitu_worker_pool_free (plugin->pool);
+  if (plugin->handle)
+    dlclose (plugin->handle);
+  if (plugin->stats)
+    bitu_stats_unref (plugin->stats);
+  ta_object_unref (plugin->logger);
+  free (plugin->path);
   free (plugin);
 }
 
+/* Errors are reported to `logger', the plugin keeps a reference to it
+ * for the ones that happen later */
 bitu_plugin_t *
-bitu_plugin_load (const char *lib)
+bitu_plugin_load (const char *lib, ta_log_t *logger)
 {
   bitu_plugin_t *plugin;
+  Dl_info info;
+
   if ((plugin = malloc (sizeof (bitu_plugin_t))) == NULL)
     return NULL;
 
   plugin->handle = dlopen (lib, RTLD_LAZY);
   if (!plugin->handle)
     {
-      fprintf (stderr, "%s\n", dlerror ());
+      ta_log_error (logger, "Unable to load plugin %s: %s", lib, dlerror ());
       free (plugin);
       return NULL;
     }
+  plugin->path = NULL;
+  plugin->logger = ta_object_ref (logger);
+  plugin->pool = NULL;
+  plugin->stats = NULL;
+  plugin->refcount = 1;
 
   /* Loading two required symbols and one optional */
   if ((plugin->name = dlsym (plugin->handle, "plugin_name")) == NULL)
@@ -83,54 +166,174 @@ bitu_plugin_load (const char *lib)
     goto error;
   plugin->match = dlsym (plugin->handle, "plugin_match");
 
+  /* Where the library was found, for the workers to load it too */
+  if (dladdr ((void *) plugin->execute, &info) != 0 && info.dli_fname)
+    plugin->path = strdup (info.dli_fname);
+  else
+    plugin->path = strdup (lib);
+  if (plugin->path == NULL)
+    {
+      bitu_plugin_free (plugin);
+      return NULL;
+    }
+
   return plugin;
 
  error:
-  fprintf (stderr, "Error while loading plugin: %s\n", dlerror ());
+  ta_log_error (logger, "Error while loading plugin %s: %s", lib, dlerror ());
   bitu_plugin_free (plugin);
   return NULL;
 }
 
+/* Both the table and its keys belong to a single version of the
+ * registry. The plugins are shared among versions and hold one
+ * reference for the registry as a whole. */
+static hashtable_t *
+_bitu_plugin_ctx_copy (hashtable_t *plugins, const char *skip)
+{
+  void *iter;
+  hashtable_t *copy;
+  const char *name;
+
+  if ((copy = hashtable_create (hash_string, string_equal, free, NULL)) == NULL)
+    return NULL;
+  if (plugins == NULL || (iter = hashtable_iter (plugins)) == NULL)
+    return copy;
+  do
+    {
+      name = hashtable_iter_key (iter);
+      if (skip && strcmp (name, skip) == 0)
+        continue;
+      if (hashtable_set (copy, strdup (name), hashtable_iter_value (iter)) == -1)
+        {
+          hashtable_destroy (copy);
+          return NULL;
+        }
+    }
+  while ((iter = hashtable_iter_next (plugins, iter)));
+  return copy;
+}
+
+/* Must be called with the writer lock held. Frees the old version only
+ * after all lookups that could be using it are done. */
+static void
+_bitu_plugin_ctx_publish (bitu_plugin_ctx_t *plugin_ctx, hashtable_t *plugins)
+{
+  hashtable_t *old = plugin_ctx->plugins;
+  bitu_epoch_publish (plugin_ctx->plugins, plugins);
+  bitu_epoch_synchronize (plugin_ctx->epoch);
+  hashtable_destroy (old);
+}
+
 bitu_plugin_ctx_t *
 bitu_plugin_ctx_new (void)
 {
   bitu_plugin_ctx_t *plugin_ctx;
-  if ((plugin_ctx = malloc (sizeof (plugin_ctx))) == NULL)
+  if ((plugin_ctx = malloc (sizeof (bitu_plugin_ctx_t))) == NULL)
     {
       return NULL;
     }
 
-  plugin_ctx->plugins = hashtable_create (hash_string, string_equal, free,
-                                          (void *) bitu_plugin_free);
+  plugin_ctx->plugins = _bitu_plugin_ctx_copy (NULL, NULL);
   if (plugin_ctx->plugins == NULL)
     {
       free (plugin_ctx);
       return NULL;
     }
+  if ((plugin_ctx->epoch = bitu_epoch_new ()) == NULL)
+    {
+      hashtable_destroy (plugin_ctx->plugins);
+      free (plugin_ctx);
+      return NULL;
+    }
+  if ((plugin_ctx->stats = bitu_stats_new ()) == NULL)
+    {
+      bitu_epoch_free (plugin_ctx->epoch);
+      hashtable_destroy (plugin_ctx->plugins);
+      free (plugin_ctx);
+      return NULL;
+    }
+  plugin_ctx->logger = ta_log_new ("bitu-loader");
+  pthread_mutex_init (&plugin_ctx->writer, NULL);
   return plugin_ctx;
 }
 
 void
 bitu_plugin_ctx_free (bitu_plugin_ctx_t *plugin_ctx)
 {
+  void *iter;
+  if ((iter = hashtable_iter (plugin_ctx->plugins)) != NULL)
+    do
+      bitu_plugin_unref (hashtable_iter_value (iter));
+    while ((iter = hashtable_iter_next (plugin_ctx->plugins, iter)));
   hashtable_destroy (plugin_ctx->plugins);
+  bitu_epoch_free (plugin_ctx->epoch);
+  bitu_stats_unref (plugin_ctx->stats);
+  ta_object_unref (plugin_ctx->logger);
+  pthread_mutex_destroy (&plugin_ctx->writer);
   free (plugin_ctx);
 }
 
+bitu_stats_t *
+bitu_plugin_ctx_get_stats (bitu_plugin_ctx_t *plugin_ctx)
+{
+  return plugin_ctx->stats;
+}
+
+ta_log_t *
+bitu_plugin_ctx_get_logger (bitu_plugin_ctx_t *plugin_ctx)
+{
+  return plugin_ctx->logger;
+}
+
 int
 bitu_plugin_ctx_load (bitu_plugin_ctx_t *plugin_ctx, const char *lib)
 {
-  bitu_plugin_t *plugin;
-  if ((plugin = bitu_plugin_load (lib)) == NULL)
+  return bitu_plugin_ctx_load_isolated (plugin_ctx, lib, 0);
+}
+
+int
+bitu_plugin_ctx_load_isolated (bitu_plugin_ctx_t *plugin_ctx, const char *lib,
+                               int nworkers)
+{
+  bitu_plugin_t *plugin, *old;
+  hashtable_t *plugins;
+  const char *name;
+
+  if ((plugin = bitu_plugin_load (lib, plugin_ctx->logger)) == NULL)
     return TA_ERROR;
 
-  if (hashtable_set (plugin_ctx->plugins,
-                     strdup (bitu_plugin_name (plugin)),
-                     plugin) == -1)
+  if (nworkers > 0 && bitu_plugin_isolate (plugin, nworkers) != TA_OK)
+    {
+      ta_log_error (plugin_ctx->logger, "Unable to start workers for "
+                    "plugin %s", lib);
+      bitu_plugin_free (plugin);
+      return TA_ERROR;
+    }
+
+  /* An execution may still be running when the plugin is unloaded and
+   * even after the context is gone */
+  plugin->stats = bitu_stats_ref (plugin_ctx->stats);
+  pthread_mutex_lock (&plugin_ctx->writer);
+
+  /* Loading a plugin with the same name of an existing one replaces
+   * it. The old one is closed after its running executions finish. */
+  name = bitu_plugin_name (plugin);
+  old = hashtable_get (plugin_ctx->plugins, name);
+  if ((plugins = _bitu_plugin_ctx_copy (plugin_ctx->plugins, name)) == NULL ||
+      hashtable_set (plugins, strdup (name), plugin) == -1)
     {
+      pthread_mutex_unlock (&plugin_ctx->writer);
+      if (plugins)
+        hashtable_destroy (plugins);
       bitu_plugin_free (plugin);
       return TA_ERROR;
     }
+  _bitu_plugin_ctx_publish (plugin_ctx, plugins);
+  pthread_mutex_unlock (&plugin_ctx->writer);
+
+  if (old)
+    bitu_plugin_unref (old);
   return TA_OK;
 }
 
@@ -138,19 +341,36 @@ int
 bitu_plugin_ctx_unload (bitu_plugin_ctx_t *plugin_ctx, const char *lib)
 {
   bitu_plugin_t *plugin;
-  plugin = hashtable_get (plugin_ctx->plugins, lib);
-  if (plugin == NULL)
-    return 0;
+  hashtable_t *plugins;
+
+  pthread_mutex_lock (&plugin_ctx->writer);
+  if ((plugin = hashtable_get (plugin_ctx->plugins, lib)) == NULL ||
+      (plugins = _bitu_plugin_ctx_copy (plugin_ctx->plugins, lib)) == NULL)
+    {
+      pthread_mutex_unlock (&plugin_ctx->writer);
+      return 0;
+    }
+  _bitu_plugin_ctx_publish (plugin_ctx, plugins);
+  pthread_mutex_unlock (&plugin_ctx->writer);
 
-  /* This line will call `bitu_plugin_free()'. Don't do it again! */
-  hashtable_del (plugin_ctx->plugins, lib);
+  /* Dropping the registry reference. The library is closed right now
+   * or when the last execution using it returns. */
+  bitu_plugin_unref (plugin);
   return 1;
 }
 
 bitu_plugin_t *
 bitu_plugin_ctx_find (bitu_plugin_ctx_t *plugin_ctx, const char *name)
 {
-  return hashtable_get (plugin_ctx->plugins, name);
+  bitu_plugin_t *plugin;
+  int token;
+
+  token = bitu_epoch_enter (plugin_ctx->epoch);
+  plugin = hashtable_get (bitu_epoch_dereference (plugin_ctx->plugins), name);
+  if (plugin)
+    bitu_plugin_ref (plugin);
+  bitu_epoch_exit (plugin_ctx->epoch, token);
+  return plugin;
 }
 
 bitu_plugin_t *
@@ -158,40 +378,60 @@ bitu_plugin_ctx_find_for_cmdline (bitu_plugin_ctx_t *plugin_ctx,
                                   const char *cmdline)
 {
   void *iter;
+  hashtable_t *plugins;
   bitu_plugin_t *plugin = NULL;
+  char *name = NULL, **params = NULL;
+  int token, nparams = 0, i;
 
   /* Iterating over all loaded plugins and looking for one that matches
    * the received command line. The first one that matches will be
    * returned. */
-  if ((iter = hashtable_iter (plugin_ctx->plugins)) == NULL)
-    return NULL;
-  do
-    {
-      plugin = hashtable_iter_value (iter);
-      if (plugin && plugin->match && plugin->match (cmdline))
-        return plugin;
-    }
-  while ((iter = hashtable_iter_next (plugin_ctx->plugins, iter)));
+  token = bitu_epoch_enter (plugin_ctx->epoch);
+  plugins = bitu_epoch_dereference (plugin_ctx->plugins);
+  if ((iter = hashtable_iter (plugins)) != NULL)
+    do
+      {
+        plugin = hashtable_iter_value (iter);
+        if (plugin && plugin->match && plugin->match (cmdline))
+          {
+            bitu_plugin_ref (plugin);
+            bitu_epoch_exit (plugin_ctx->epoch, token);
+            return plugin;
+          }
+      }
+    while ((iter = hashtable_iter_next (plugins, iter)));
+  bitu_epoch_exit (plugin_ctx->epoch, token);
 
   /* It was not possible to match the command line in any plugin. We'll
    * have to parse the command line, get the plugin name and try to
    * execute it. */
-  if (bitu_util_extract_params (cmdline, NULL, NULL, NULL) == TA_OK)
-    if ((plugin = bitu_plugin_ctx_find (plugin_ctx, cmdline)) != NULL)
-      return plugin;
-  return NULL;
+  plugin = NULL;
+  if (bitu_util_extract_params (cmdline, &name, &params, &nparams) == TA_OK)
+    {
+      if (name)
+        plugin = bitu_plugin_ctx_find (plugin_ctx, name);
+      for (i = 0; i < nparams; i++)
+        free (params[i]);
+      free (params);
+      free (name);
+    }
+  return plugin;
 }
 
 ta_list_t *
 bitu_plugin_ctx_get_list (bitu_plugin_ctx_t *plugin_ctx)
 {
   void *iter;
+  hashtable_t *plugins;
   ta_list_t *ret = NULL;
-  iter = hashtable_iter (plugin_ctx->plugins);
-  if (iter == NULL)
-    return NULL;
-  do
-    ret = ta_list_append (ret, hashtable_iter_key (iter));
-  while ((iter = hashtable_iter_next (plugin_ctx->plugins, iter)));
+  int token;
+
+  token = bitu_epoch_enter (plugin_ctx->epoch);
+  plugins = bitu_epoch_dereference (plugin_ctx->plugins);
+  if ((iter = hashtable_iter (plugins)) != NULL)
+    do
+      ret = ta_list_append (ret, strdup (hashtable_iter_key (iter)));
+    while ((iter = hashtable_iter_next (plugins, iter)));
+  bitu_epoch_exit (plugin_ctx->epoch, token);
   return ret;
 }
@@ -36,7 +36,6 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <glob.h>
 #include <taningia/taningia.h>
 #include <bitu/util.h>
 #include <bitu/loader.h>
@@ -60,6 +59,8 @@ usage (const char *prname)
   printf ("  password to start bitU.\n\n");
   printf ("General Options:\n");
   printf ("  -c,--config-file=FILE\t\t: Path to the config file\n");
+  printf ("  -s,--config-snapshot=FILE\t: Compiled copy of the config files, "
+          "loaded instead of them while none changes\n");
   printf ("  -v,--version\t\t\t: Show current version and exit\n");
   printf ("  -h,--help\t\t\t: Shows this help\n\n");
   printf ("Connection Options:\n");
@@ -106,6 +107,10 @@ _save_pid (bitu_app_t *app, const char *pid_file)
 }
 
 
+/* Set by SIGHUP, the main loop reloads the config when it sees it */
+static volatile sig_atomic_t _reload_requested = 0;
+
+
 static void
 _signal_handler (int sig, siginfo_t *TA_UNUSED(si), void *TA_UNUSED(data))
 {
@@ -116,6 +121,10 @@ _signal_handler (int sig, siginfo_t *TA_UNUSED(si), void *TA_UNUSED(data))
        * kills the program. */
       break;
 
+    case SIGHUP:
+      _reload_requested = 1;
+      break;
+
       /* Add more signals here to handle them when needed. */
 
     default:
@@ -133,7 +142,72 @@ _setup_sigaction (bitu_app_t *app)
   sigemptyset (&sa.sa_mask);
 
   if (sigaction (SIGPIPE, &sa, NULL) == -1)
-    ta_log_warn (app->logger, "Unable to install sigaction to catch SIGPIPE");
+    fprintf (stderr, "Unable to install sigaction to catch SIGPIPE\n");
+  if (sigaction (SIGHUP, &sa, NULL) == -1)
+    fprintf (stderr, "Unable to install sigaction to catch SIGHUP\n");
+}
+
+
+/* Reads configuration from all the files matching the given glob and
+ * the ones they include. The `pid-file' command is handled here, the
+ * first one found wins unless `pid_file' is already set. It's ignored
+ * when `pid_file' is NULL. */
+static int
+_read_config (const char *config_file, const char *config_snapshot,
+              char **pid_file, ta_list_t **commands, char **error)
+{
+  ta_list_t *conf = NULL, *tmp;
+
+  *commands = NULL;
+  if (bitu_conf_load (config_file, config_snapshot, &conf, error) != TA_OK)
+    return TA_ERROR;
+
+  for (tmp = conf; tmp; tmp = tmp->next)
+    {
+      const char *name;
+      bitu_command_t *command;
+
+      command = tmp->data;
+      name = bitu_command_get_name (command);
+
+      if (strcmp (name, "pid-file") == 0)
+        {
+          if (pid_file && *pid_file == NULL &&
+              bitu_command_get_nparams (command) == 1)
+            *pid_file = strdup ((bitu_command_get_params (command))[0]);
+          bitu_command_free (command);
+        }
+      else
+        *commands = ta_list_append (*commands, command);
+    }
+  ta_list_free (conf);
+  return TA_OK;
+}
+
+
+/* The pid file can't change while running, it's ignored here */
+static void
+_reload_config (bitu_app_t *app, const char *config_file,
+                const char *config_snapshot)
+{
+  ta_list_t *commands;
+  char *error = NULL;
+
+  if (config_file == NULL)
+    {
+      ta_log_warn (app->logger, "No config file to reload");
+      return;
+    }
+  if (_read_config (config_file, config_snapshot, NULL, &commands,
+                    &error) != TA_OK)
+    {
+      ta_log_error (app->logger, "Keeping the current configuration, "
+                    "unable to reload it: %s",
+                    error ? error : strerror (errno));
+      free (error);
+      return;
+    }
+  bitu_app_reload_config (app, commands);
 }
 
 
@@ -141,9 +215,10 @@ int
 main (int argc, char **argv)
 {
   bitu_app_t *app;
-  ta_list_t *conf = NULL;
-  ta_list_t *commands = NULL, *tmp = NULL;
+  ta_list_t *commands = NULL;
   char *config_file = NULL;
+  char *config_snapshot = NULL;
+  char *error = NULL;
   char *pid_file = NULL;
   int daemonize = 0;
   int c;
@@ -151,6 +226,7 @@ main (int argc, char **argv)
     { "transport", required_argument, NULL, 't' },
     { "pid-file", required_argument, NULL, 'i' },
     { "config-file", required_argument, NULL, 'c' },
+    { "config-snapshot", required_argument, NULL, 's' },
     { "daemonize", no_argument, NULL, 'd' },
     { "version", no_argument, NULL, 'v' },
     { "help", no_argument, NULL, 'h' },
@@ -161,7 +237,7 @@ main (int argc, char **argv)
 
   _setup_sigaction (NULL);
 
-  while ((c = getopt_long (argc, argv, "t:c:dhvi:",
+  while ((c = getopt_long (argc, argv, "t:c:s:dhvi:",
                            long_options, NULL)) != -1)
     {
       switch (c)
@@ -174,6 +250,10 @@ main (int argc, char **argv)
           config_file = strdup (optarg);
           break;
 
+        case 's':
+          config_snapshot = strdup (optarg);
+          break;
+
         case 'i':
           pid_file = strdup (optarg);
           break;
@@ -199,47 +279,15 @@ main (int argc, char **argv)
         }
     }
 
-  /* Reading configuration from file */
-  while (config_file != NULL)
+  /* Reading configuration from all the files matching the given glob
+   * and the ones they include. They're read again on SIGHUP. */
+  if (config_file != NULL &&
+      _read_config (config_file, config_snapshot, &pid_file, &commands,
+                    &error) != TA_OK)
     {
-      glob_t globbuf;
-      size_t globi;
-      if (glob (config_file, GLOB_NOSORT | GLOB_ERR, NULL, &globbuf) != 0)
-        {
-          fprintf (stderr, "Warn while loading config file: ");
-          fprintf (stderr, "Could not expand glob `%s'\n", config_file);
-          free (config_file);
-          config_file = NULL;
-          break;
-        }
-      else
-        {
-          for (globi = 0; globi < globbuf.gl_pathc; globi++)
-            {
-              char *single_file = globbuf.gl_pathv[globi];
-              if ((conf = bitu_conf_read_from_file (single_file)) == NULL)
-                exit (EXIT_FAILURE);
-            }
-        }
-      globfree (&globbuf);
-      free (config_file);
-      config_file = NULL;
-
-      for (tmp = conf; tmp; tmp = tmp->next)
-        {
-          const char *name;
-          bitu_command_t *command;
-
-          command = tmp->data;
-          name = bitu_command_get_name (command);
-
-          if (strcmp (name, "pid-file") == 0 && pid_file == NULL)
-            pid_file = strdup ((bitu_command_get_params (command))[0]);
-          else if (strcmp (name, "include") == 0)
-            config_file = strdup ((bitu_command_get_params (command))[0]);
-          else
-            commands = ta_list_append (commands, command);
-        }
+      fprintf (stderr, "Error while loading config file: %s\n",
+               error ? error : strerror (errno));
+      exit (EXIT_FAILURE);
     }
 
   /* Creating the app. We'll need a logger sooner than the rest of the
@@ -249,7 +297,6 @@ main (int argc, char **argv)
   /* Loading the configuration file into the app. It's going to execute
    * all the commands declared in the config file. */
   bitu_app_load_config (app, commands);
-  ta_list_free (commands);
 
   /* Running the transports */
   int rolou = bitu_app_run_transports (app);
@@ -270,10 +317,18 @@ main (int argc, char **argv)
   if (pid_file != NULL)
     _save_pid (app, pid_file);
 
-  /* Our current main loop is this crap, sorry. */
+  /* Our current main loop is this crap, sorry. At least it reloads
+   * the config when asked to. */
   if (rolou == TA_OK)
     while (1)
-      sleep (1);
+      {
+        sleep (1);
+        if (_reload_requested)
+          {
+            _reload_requested = 0;
+            _reload_config (app, config_file, config_snapshot);
+          }
+      }
 
   /* Cleaning things up after shutting the server down */
   if (pid_file != NULL && access (pid_file, X_OK) == 0)
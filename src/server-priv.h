@@ -21,13 +21,14 @@
 
 #include <taningia/taningia.h>
 #include "hashtable.h"
+#include "hashtable-concurrent.h"
 
 struct bitu_server
 {
   ta_log_t *logger;
   char *sock_path;
   int sock;
-  hashtable_t *clients;
+  chashtable_t *clients;
   bitu_server_callbacks_t callbacks;
   const char *data;
   int can_run;
@@ -36,7 +37,7 @@ struct bitu_server
 
 typedef struct
 {
-  char *id;
+  const char *id;  /* interned */
   int socket;
 } bitu_client_t;
 
@@ -34,6 +34,8 @@
 #include "server-priv.h"
 #include "hashtable.h"
 #include "hashtable-utils.h"
+#include "hashtable-concurrent.h"
+#include "intern.h"
 
 #define LISTEN_BACKLOG 1
 
@@ -45,10 +47,16 @@ bitu_client_t *
 bitu_client_new (int socket)
 {
   bitu_client_t *client;
+  char *id;
   if ((client = malloc (sizeof (bitu_client_t))) == NULL)
     return NULL;
-  client->id = bitu_util_uuid4 ();
+
+  /* Interned, so commands coming from this client carry the same
+   * pointer in their sender field */
+  id = bitu_util_uuid4 ();
+  client->id = bitu_intern (id);
   client->socket = socket;
+  free (id);
   return client;
 }
 
@@ -56,7 +64,7 @@ bitu_client_new (int socket)
 void
 bitu_client_free (bitu_client_t *client)
 {
-  free (client->id);
+  bitu_intern_release (client->id);
   free (client);
 }
 
@@ -86,9 +94,9 @@ bitu_server_new (const char *sock_path, bitu_server_callbacks_t callbacks)
     return NULL;
   server->logger = ta_log_new ("bitu-server");
   server->sock_path = strdup (sock_path);
-  server->clients = hashtable_create (hash_string, string_equal,
-                                      NULL, /* No need to free keys */
-                                      (free_fn) bitu_client_free);
+  server->clients = chashtable_create (hash_string, string_equal,
+                                       NULL, /* No need to free keys */
+                                       (free_fn) bitu_client_free);
   server->can_run = 1;
   server->callbacks = callbacks;
   return server;
@@ -100,7 +108,7 @@ bitu_server_free (bitu_server_t *server)
 {
   ta_log_info (server->logger, "Gracefully exiting, see you!");
   ta_object_unref (server->logger);
-  hashtable_destroy (server->clients);
+  chashtable_destroy (server->clients);
   server->can_run = 0;
   close (server->sock);
   unlink (server->sock_path);
@@ -235,9 +243,16 @@ bitu_server_send (bitu_server_t *server, const char *msg, const char *to)
   size_t bufsize;
   size_t sent = 0;
   char *message;
+  int token, status = TA_OK;
 
-  if ((client = hashtable_get (server->clients, to)) == NULL)
-    return TA_ERROR;
+  /* The client can't be freed until we're done with its socket, even
+   * if it disconnects in the mean time */
+  token = chashtable_read_begin (server->clients);
+  if ((client = chashtable_get (server->clients, to)) == NULL)
+    {
+      chashtable_read_end (server->clients, token);
+      return TA_ERROR;
+    }
 
   /* Sending a terminator character just to notify the client that the
    * command finished executing and the client can move on. */
@@ -262,13 +277,15 @@ bitu_server_send (bitu_server_t *server, const char *msg, const char *to)
       if (n == -1)
         {
           ta_log_error (server->logger, "Error in send(): %s", strerror (errno));
-          return TA_ERROR;
+          status = TA_ERROR;
+          break;
         }
       sent += n;
     }
+  chashtable_read_end (server->clients, token);
 
   free (message);
-  return TA_OK;
+  return status;
 }
 
 
@@ -313,7 +330,8 @@ bitu_server_run (bitu_server_t *server)
        * messages to this client in the future */
       client = bitu_client_new (sock);
       client_id = bitu_client_get_id (client);
-      hashtable_set (server->clients, (void *) client_id, client);
+      chashtable_set_hashed (server->clients, (void *) client_id,
+                             bitu_intern_hash (client_id), client);
 
       while (1)
         {
@@ -365,7 +383,11 @@ bitu_server_run (bitu_server_t *server)
               (str && strcmp (str, "exit") == 0) ||
               (str && strlen (str) < 2))
             {
-              hashtable_del (server->clients, client_id);
+              /* Someone stuck sending to this client would make the
+               * removal wait forever */
+              shutdown (sock, SHUT_RDWR);
+              chashtable_del_hashed (server->clients, client_id,
+                                     bitu_intern_hash (client_id));
               close (sock);
               break;
             }
@@ -0,0 +1,502 @@
+/* srv.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <taningia/taningia.h>
+#include <bitu/util.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+#include "srv.h"
+
+/* Upper limit of names kept at the same time */
+#define SRV_MAX_ENTRIES 256
+
+/* Seconds to remember that a name has no SRV records */
+#define SRV_NEGATIVE_TTL 60
+
+/* Seconds to wait before asking the resolver again after it failed.
+ * Meanwhile the last good answer, if any, keeps being used. */
+#define SRV_RETRY_TTL 5
+
+/* Longest TTL honored, in seconds */
+#define SRV_MAX_TTL 86400
+
+
+typedef struct
+{
+  bitu_srv_target_t *targets;
+  int ntargets;
+  int status;
+  uint64_t expires;
+} _bitu_srv_entry_t;
+
+
+/* A name being resolved. Lookups of the same name that miss the cache
+ * meanwhile wait for the first one instead of asking the resolver
+ * too, and take a copy of the answer it got, cached or not. The last
+ * one to leave frees it. */
+typedef struct
+{
+  _bitu_srv_entry_t answer;
+  int done;
+  int waiters;
+} _bitu_srv_flight_t;
+
+
+static pthread_mutex_t _srv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _srv_landed = PTHREAD_COND_INITIALIZER;
+static hashtable_t *_srv_entries = NULL;
+static hashtable_t *_srv_flights = NULL;
+static bitu_srv_resolver_t _srv_resolver = NULL;
+static void *_srv_resolver_data = NULL;
+static unsigned int _srv_seed = 0;
+
+
+void
+bitu_srv_targets_free (bitu_srv_target_t *targets, int ntargets)
+{
+  int i;
+  for (i = 0; i < ntargets; i++)
+    free (targets[i].host);
+  free (targets);
+}
+
+
+static void
+_bitu_srv_entry_free (_bitu_srv_entry_t *entry)
+{
+  bitu_srv_targets_free (entry->targets, entry->ntargets);
+  free (entry);
+}
+
+
+/* Asks the system resolver. res_ninit() reads resolv.conf again every
+ * time, so changes to it are seen without restarting bitU. */
+static int
+_bitu_srv_resolve (const char *name, bitu_srv_target_t **targets,
+                   int *ntargets, uint32_t *ttl, void *TA_UNUSED(data))
+{
+  struct __res_state state;
+  unsigned char *answer;
+  char host[NS_MAXDNAME];
+  const unsigned char *rdata;
+  ns_msg msg;
+  ns_rr rr;
+  int len, count, i, n = 0;
+
+  *targets = NULL;
+  *ntargets = 0;
+  *ttl = SRV_NEGATIVE_TTL;
+
+  memset (&state, 0, sizeof (state));
+  if (res_ninit (&state) != 0)
+    return TA_ERROR;
+  if ((answer = malloc (NS_MAXMSG)) == NULL)
+    {
+      res_nclose (&state);
+      return TA_ERROR;
+    }
+
+  len = res_nquery (&state, name, ns_c_in, ns_t_srv, answer, NS_MAXMSG);
+  if (len < 0)
+    {
+      /* The name exists but has no SRV records, or doesn't exist at
+       * all. Both are answers, not failures. */
+      i = state.res_h_errno;
+      res_nclose (&state);
+      free (answer);
+      return i == HOST_NOT_FOUND || i == NO_DATA ? TA_OK : TA_ERROR;
+    }
+  res_nclose (&state);
+
+  if (ns_initparse (answer, len, &msg) < 0)
+    {
+      free (answer);
+      return TA_ERROR;
+    }
+  count = ns_msg_count (msg, ns_s_an);
+  if (count > 0 &&
+      (*targets = calloc (count, sizeof (bitu_srv_target_t))) == NULL)
+    {
+      free (answer);
+      return TA_ERROR;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      if (ns_parserr (&msg, ns_s_an, i, &rr) < 0 ||
+          ns_rr_type (rr) != ns_t_srv || ns_rr_rdlen (rr) < 7)
+        continue;
+      rdata = ns_rr_rdata (rr);
+      if (dn_expand (ns_msg_base (msg), ns_msg_end (msg), rdata + 6,
+                     host, sizeof (host)) < 0)
+        continue;
+
+      /* A single target named `.' means the service is decidedly not
+       * available at this domain */
+      if (host[0] == '\0' || strcmp (host, ".") == 0)
+        continue;
+
+      if (n == 0 || ns_rr_ttl (rr) < *ttl)
+        *ttl = ns_rr_ttl (rr);
+      (*targets)[n].priority = ns_get16 (rdata);
+      (*targets)[n].weight = ns_get16 (rdata + 2);
+      (*targets)[n].port = ns_get16 (rdata + 4);
+      if (((*targets)[n].host = strdup (host)) == NULL)
+        break;
+      n++;
+    }
+  free (answer);
+
+  if (n == 0)
+    {
+      free (*targets);
+      *targets = NULL;
+    }
+  *ntargets = n;
+  return TA_OK;
+}
+
+
+/* Lower priorities first. Inside of a priority, targets with weight
+ * zero come first, as RFC 2782 asks before the weighted pick. */
+static int
+_bitu_srv_target_cmp (const void *a, const void *b)
+{
+  const bitu_srv_target_t *ta = a, *tb = b;
+  if (ta->priority != tb->priority)
+    return ta->priority - tb->priority;
+  return (ta->weight != 0) - (tb->weight != 0);
+}
+
+
+/* Puts `targets' in the order they should be tried. Each position of
+ * a priority group is filled by picking one of the remaining targets
+ * with chance proportional to its weight. */
+static void
+_bitu_srv_order (bitu_srv_target_t *targets, int ntargets)
+{
+  bitu_srv_target_t picked;
+  unsigned long sum, running, r;
+  int first, last, i, j;
+
+  qsort (targets, ntargets, sizeof (bitu_srv_target_t),
+         _bitu_srv_target_cmp);
+
+  for (first = 0; first < ntargets; first = last)
+    {
+      for (last = first + 1; last < ntargets; last++)
+        if (targets[last].priority != targets[first].priority)
+          break;
+
+      for (i = first; i < last - 1; i++)
+        {
+          sum = 0;
+          for (j = i; j < last; j++)
+            sum += targets[j].weight;
+          r = sum ? (unsigned long) rand_r (&_srv_seed) % (sum + 1) : 0;
+
+          running = 0;
+          for (j = i; j < last - 1; j++)
+            {
+              running += targets[j].weight;
+              if (running >= r)
+                break;
+            }
+
+          /* Moving the pick to the front keeps the others in order */
+          picked = targets[j];
+          memmove (targets + i + 1, targets + i,
+                   (j - i) * sizeof (bitu_srv_target_t));
+          targets[i] = picked;
+        }
+    }
+}
+
+
+/* Copies the targets of `entry' to `targets', already in order */
+static int
+_bitu_srv_copy (_bitu_srv_entry_t *entry, bitu_srv_target_t **targets,
+                int *ntargets)
+{
+  bitu_srv_target_t *copy = NULL;
+  int i;
+
+  *targets = NULL;
+  *ntargets = 0;
+  if (entry->ntargets == 0)
+    return entry->status;
+
+  if ((copy = calloc (entry->ntargets, sizeof (bitu_srv_target_t))) == NULL)
+    return TA_ERROR;
+  for (i = 0; i < entry->ntargets; i++)
+    {
+      copy[i] = entry->targets[i];
+      if ((copy[i].host = strdup (entry->targets[i].host)) == NULL)
+        {
+          bitu_srv_targets_free (copy, i);
+          return TA_ERROR;
+        }
+    }
+  _bitu_srv_order (copy, entry->ntargets);
+  *targets = copy;
+  *ntargets = entry->ntargets;
+  return TA_OK;
+}
+
+
+static void
+_bitu_srv_purge (void)
+{
+  void *iter;
+  _bitu_srv_entry_t *entry;
+  ta_list_t *expired = NULL, *tmp;
+  uint64_t now = bitu_util_monotonic_time ();
+
+  if ((iter = hashtable_iter (_srv_entries)) == NULL)
+    return;
+  do
+    {
+      entry = hashtable_iter_value (iter);
+      if (entry->expires <= now)
+        expired = ta_list_prepend (expired, hashtable_iter_key (iter));
+    }
+  while ((iter = hashtable_iter_next (_srv_entries, iter)));
+
+  for (tmp = expired; tmp; tmp = tmp->next)
+    hashtable_del (_srv_entries, tmp->data);
+  ta_list_free (expired);
+}
+
+
+/* Must be called with the lock held. Lands `flight' with the answer
+ * its leader got, which stays with the leader. */
+static void
+_bitu_srv_land (const char *name, _bitu_srv_flight_t *flight, int status,
+                bitu_srv_target_t *targets, int ntargets)
+{
+  _bitu_srv_entry_t answer;
+
+  hashtable_del (_srv_flights, name);
+  if (flight->waiters == 0)
+    {
+      free (flight);
+      return;
+    }
+  answer.targets = targets;
+  answer.ntargets = ntargets;
+  answer.status = status;
+  flight->answer.status = _bitu_srv_copy (&answer, &flight->answer.targets,
+                                          &flight->answer.ntargets);
+  flight->done = 1;
+  pthread_cond_broadcast (&_srv_landed);
+}
+
+
+/* Waits for the lookup resolving the same name. Must be called with
+ * the lock held. */
+static int
+_bitu_srv_wait (_bitu_srv_flight_t *flight, bitu_srv_target_t **targets,
+                int *ntargets)
+{
+  int status;
+
+  flight->waiters++;
+  while (!flight->done)
+    pthread_cond_wait (&_srv_landed, &_srv_mutex);
+  status = _bitu_srv_copy (&flight->answer, targets, ntargets);
+  if (--flight->waiters == 0)
+    {
+      bitu_srv_targets_free (flight->answer.targets, flight->answer.ntargets);
+      free (flight);
+    }
+  return status;
+}
+
+
+/* Must be called with the lock held */
+static void
+_bitu_srv_init (void)
+{
+  if (_srv_flights == NULL)
+    _srv_flights = hashtable_create (hash_string, string_equal, free, NULL);
+  if (_srv_entries != NULL)
+    return;
+  _srv_entries = hashtable_create (hash_string, string_equal, free,
+                                   (free_fn) _bitu_srv_entry_free);
+  _srv_seed = (unsigned int) time (NULL) ^ (unsigned int) getpid ();
+}
+
+
+/* Replaces the resolver used on cache misses and drops everything
+ * cached so far. NULL goes back to the system resolver. */
+void
+bitu_srv_set_resolver (bitu_srv_resolver_t resolver, void *data)
+{
+  pthread_mutex_lock (&_srv_mutex);
+  _srv_resolver = resolver;
+  _srv_resolver_data = data;
+  pthread_mutex_unlock (&_srv_mutex);
+  bitu_srv_flush ();
+}
+
+
+void
+bitu_srv_flush (void)
+{
+  pthread_mutex_lock (&_srv_mutex);
+  if (_srv_entries != NULL)
+    {
+      hashtable_destroy (_srv_entries);
+      _srv_entries = NULL;
+    }
+  pthread_mutex_unlock (&_srv_mutex);
+}
+
+
+/* Fills `targets' with the targets of `service' (e.g.
+ * `_xmpp-client._tcp') at `domain', in the order they should be tried.
+ * Returns TA_OK with no targets when the domain has no such records
+ * and TA_ERROR when the resolver failed and nothing was cached. The
+ * array must be freed with bitu_srv_targets_free(). */
+int
+bitu_srv_lookup (const char *service, const char *domain,
+                 bitu_srv_target_t **targets, int *ntargets)
+{
+  _bitu_srv_entry_t *entry;
+  _bitu_srv_flight_t *flight;
+  bitu_srv_resolver_t resolver;
+  bitu_srv_target_t *found = NULL;
+  void *data;
+  uint32_t ttl = 0;
+  uint64_t now;
+  size_t len;
+  char *name, *key;
+  int status, nfound = 0, cached = 0;
+
+  *targets = NULL;
+  *ntargets = 0;
+
+  len = strlen (service) + strlen (domain) + 2;
+  if ((name = malloc (len)) == NULL)
+    return TA_ERROR;
+  snprintf (name, len, "%s.%s", service, domain);
+
+  pthread_mutex_lock (&_srv_mutex);
+  _bitu_srv_init ();
+  entry = hashtable_get (_srv_entries, name);
+  if (entry && entry->expires > bitu_util_monotonic_time ())
+    {
+      status = _bitu_srv_copy (entry, targets, ntargets);
+      pthread_mutex_unlock (&_srv_mutex);
+      free (name);
+      return status;
+    }
+
+  /* Someone is already asking for it */
+  if ((flight = hashtable_get (_srv_flights, name)) != NULL)
+    {
+      status = _bitu_srv_wait (flight, targets, ntargets);
+      pthread_mutex_unlock (&_srv_mutex);
+      free (name);
+      return status;
+    }
+  if ((flight = calloc (1, sizeof (_bitu_srv_flight_t))) != NULL &&
+      ((key = strdup (name)) == NULL ||
+       hashtable_set (_srv_flights, key, flight) == -1))
+    {
+      /* Resolving alone then */
+      free (flight);
+      flight = NULL;
+    }
+  resolver = _srv_resolver ? _srv_resolver : _bitu_srv_resolve;
+  data = _srv_resolver_data;
+  pthread_mutex_unlock (&_srv_mutex);
+
+  /* Not holding the lock while the resolver works, other names may be
+   * looked up meanwhile */
+  status = resolver (name, &found, &nfound, &ttl, data);
+
+  pthread_mutex_lock (&_srv_mutex);
+  _bitu_srv_init ();
+  now = bitu_util_monotonic_time ();
+  entry = hashtable_get (_srv_entries, name);
+
+  if (status != TA_OK && entry && entry->status == TA_OK)
+    {
+      /* Better an old answer than none while the resolver is down */
+      entry->expires = now + SRV_RETRY_TTL * 1000000ULL;
+      status = _bitu_srv_copy (entry, targets, ntargets);
+      goto out;
+    }
+
+  if (entry == NULL && _srv_entries->size >= SRV_MAX_ENTRIES)
+    _bitu_srv_purge ();
+  if ((entry == NULL && _srv_entries->size >= SRV_MAX_ENTRIES) ||
+      (entry = malloc (sizeof (_bitu_srv_entry_t))) == NULL)
+    {
+      /* Not cached, just handing the answer over */
+      if (status == TA_OK)
+        {
+          _bitu_srv_order (found, nfound);
+          *targets = found;
+          *ntargets = nfound;
+        }
+      else
+        bitu_srv_targets_free (found, nfound);
+      goto out;
+    }
+
+  if (status != TA_OK)
+    {
+      bitu_srv_targets_free (found, nfound);
+      found = NULL;
+      nfound = 0;
+      ttl = SRV_RETRY_TTL;
+    }
+  entry->targets = found;
+  entry->ntargets = nfound;
+  entry->status = status;
+  entry->expires = now + (ttl < SRV_MAX_TTL ? ttl : SRV_MAX_TTL) * 1000000ULL;
+  if (hashtable_set (_srv_entries, name, entry) == -1)
+    {
+      _bitu_srv_entry_free (entry);
+      status = TA_ERROR;
+      goto out;
+    }
+  cached = 1;
+  status = _bitu_srv_copy (entry, targets, ntargets);
+
+ out:
+  if (flight)
+    _bitu_srv_land (name, flight, status, *targets, *ntargets);
+  pthread_mutex_unlock (&_srv_mutex);
+  if (!cached)
+    free (name);
+  return status;
+}
@@ -0,0 +1,55 @@
+/* srv.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_SRV_H_
+#define BITU_SRV_H_ 1
+
+#include <stdint.h>
+
+/* Process wide cache of DNS SRV answers. Answers are kept for as long
+ * as their TTL says and failed lookups for a little while, so a bunch
+ * of transports reconnecting at once don't flood the resolver, and
+ * lookups of a name that is being resolved wait for that answer. Every
+ * lookup returns the targets in the order RFC 2782 says they should be
+ * tried: lowest priority first and, among the ones with the same
+ * priority, a random order weighted by their weights. */
+
+typedef struct
+{
+  char *host;
+  int port;
+  int priority;
+  int weight;
+} bitu_srv_target_t;
+
+/* Resolves `name' (e.g. `_xmpp-client._tcp.example.com'). On success,
+ * `targets' points to a new array that the cache takes and `ttl' holds
+ * the smallest TTL of the answer, in seconds. A name without SRV
+ * records is not an error, it just has no targets. */
+typedef int (*bitu_srv_resolver_t) (const char *name,
+                                    bitu_srv_target_t **targets,
+                                    int *ntargets, uint32_t *ttl,
+                                    void *data);
+
+void bitu_srv_set_resolver (bitu_srv_resolver_t resolver, void *data);
+int bitu_srv_lookup (const char *service, const char *domain,
+                     bitu_srv_target_t **targets, int *ntargets);
+void bitu_srv_targets_free (bitu_srv_target_t *targets, int ntargets);
+void bitu_srv_flush (void);
+
+#endif /* BITU_SRV_H_ */
@@ -0,0 +1,339 @@
+/* stats.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <taningia/taningia.h>
+#include <bitu/stats.h>
+
+/* Names tracked per shard. Records for new names are dropped after
+ * this limit is reached. */
+#define STATS_MAX_NAMES 64
+
+#define STATS_NAME_LEN 64
+
+/* Histogram buckets are log-linear, like in HDR histograms: each power
+ * of two is split in 4 linear sub buckets, so the error of a reported
+ * value is always under 25%. 256 buckets cover the whole 64bit range. */
+#define STATS_SUB_BITS 2
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS 256
+
+#define LOAD(x) __atomic_load_n (&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n (&(x), (v), __ATOMIC_RELAXED)
+
+
+typedef struct
+{
+  char name[STATS_NAME_LEN];
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t buckets[STATS_BUCKETS];
+} _bitu_stats_entry_t;
+
+
+/* Only the owner thread writes to a shard, so counters are updated with
+ * plain (but untorn) stores. Readers may see a slightly old view. */
+typedef struct _bitu_stats_shard
+{
+  bitu_stats_t *stats;
+  int nentries;
+  _bitu_stats_entry_t *entries[STATS_MAX_NAMES];
+  struct _bitu_stats_shard *next;
+} _bitu_stats_shard_t;
+
+
+struct bitu_stats
+{
+  volatile int refcount;
+  pthread_key_t key;
+  pthread_mutex_t mutex;
+  _bitu_stats_shard_t *shards;
+
+  /* Shards of threads that are gone are merged here */
+  _bitu_stats_shard_t retired;
+};
+
+
+static unsigned int
+_bitu_stats_bucket (uint64_t value)
+{
+  unsigned int exp;
+  if (value < STATS_SUB_COUNT)
+    return value;
+  exp = 63 - __builtin_clzll (value);
+  return (exp - STATS_SUB_BITS + 1) * STATS_SUB_COUNT +
+    ((value >> (exp - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1));
+}
+
+
+/* Highest value that falls in the given bucket */
+static uint64_t
+_bitu_stats_bucket_value (unsigned int bucket)
+{
+  unsigned int exp, sub;
+  if (bucket < STATS_SUB_COUNT)
+    return bucket;
+  exp = bucket / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+  sub = bucket % STATS_SUB_COUNT;
+  return (((uint64_t) (STATS_SUB_COUNT + sub + 1)) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+
+/* Names are kept truncated, longer ones match on what was kept */
+static _bitu_stats_entry_t *
+_bitu_stats_shard_find (_bitu_stats_shard_t *shard, const char *name)
+{
+  int i, n = __atomic_load_n (&shard->nentries, __ATOMIC_ACQUIRE);
+  for (i = 0; i < n; i++)
+    if (strncmp (shard->entries[i]->name, name, STATS_NAME_LEN - 1) == 0)
+      return shard->entries[i];
+  return NULL;
+}
+
+
+static _bitu_stats_entry_t *
+_bitu_stats_shard_add (_bitu_stats_shard_t *shard, const char *name)
+{
+  _bitu_stats_entry_t *entry;
+  if (shard->nentries >= STATS_MAX_NAMES)
+    return NULL;
+  if ((entry = calloc (1, sizeof (_bitu_stats_entry_t))) == NULL)
+    return NULL;
+  strncpy (entry->name, name, STATS_NAME_LEN - 1);
+  shard->entries[shard->nentries] = entry;
+
+  /* Readers must see the whole entry before the new size */
+  __atomic_store_n (&shard->nentries, shard->nentries + 1, __ATOMIC_RELEASE);
+  return entry;
+}
+
+
+static void
+_bitu_stats_merge (_bitu_stats_shard_t *dst, _bitu_stats_shard_t *src)
+{
+  _bitu_stats_entry_t *from, *to;
+  int i, j, n = __atomic_load_n (&src->nentries, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < n; i++)
+    {
+      from = src->entries[i];
+      if ((to = _bitu_stats_shard_find (dst, from->name)) == NULL &&
+          (to = _bitu_stats_shard_add (dst, from->name)) == NULL)
+        continue;
+      to->count += LOAD (from->count);
+      to->total += LOAD (from->total);
+      if (LOAD (from->max) > to->max)
+        to->max = LOAD (from->max);
+      for (j = 0; j < STATS_BUCKETS; j++)
+        to->buckets[j] += LOAD (from->buckets[j]);
+    }
+}
+
+
+static void
+_bitu_stats_shard_clear (_bitu_stats_shard_t *shard)
+{
+  int i;
+  for (i = 0; i < shard->nentries; i++)
+    free (shard->entries[i]);
+  shard->nentries = 0;
+}
+
+
+/* Called when a thread that recorded something exits */
+static void
+_bitu_stats_shard_retire (void *data)
+{
+  _bitu_stats_shard_t *shard = data, **tmp;
+  bitu_stats_t *stats = shard->stats;
+
+  pthread_mutex_lock (&stats->mutex);
+  _bitu_stats_merge (&stats->retired, shard);
+  for (tmp = &stats->shards; *tmp; tmp = &(*tmp)->next)
+    if (*tmp == shard)
+      {
+        *tmp = shard->next;
+        break;
+      }
+  pthread_mutex_unlock (&stats->mutex);
+
+  _bitu_stats_shard_clear (shard);
+  free (shard);
+}
+
+
+bitu_stats_t *
+bitu_stats_new (void)
+{
+  bitu_stats_t *stats;
+  if ((stats = calloc (1, sizeof (bitu_stats_t))) == NULL)
+    return NULL;
+  if (pthread_key_create (&stats->key, _bitu_stats_shard_retire) != 0)
+    {
+      free (stats);
+      return NULL;
+    }
+  pthread_mutex_init (&stats->mutex, NULL);
+  stats->retired.stats = stats;
+  stats->refcount = 1;
+  return stats;
+}
+
+
+static void
+_bitu_stats_free (bitu_stats_t *stats)
+{
+  _bitu_stats_shard_t *shard, *next;
+  pthread_key_delete (stats->key);
+  for (shard = stats->shards; shard; shard = next)
+    {
+      next = shard->next;
+      _bitu_stats_shard_clear (shard);
+      free (shard);
+    }
+  _bitu_stats_shard_clear (&stats->retired);
+  pthread_mutex_destroy (&stats->mutex);
+  free (stats);
+}
+
+
+bitu_stats_t *
+bitu_stats_ref (bitu_stats_t *stats)
+{
+  __sync_fetch_and_add (&stats->refcount, 1);
+  return stats;
+}
+
+
+void
+bitu_stats_unref (bitu_stats_t *stats)
+{
+  if (__sync_sub_and_fetch (&stats->refcount, 1) == 0)
+    _bitu_stats_free (stats);
+}
+
+
+void
+bitu_stats_record (bitu_stats_t *stats, const char *name, uint64_t usec)
+{
+  _bitu_stats_shard_t *shard;
+  _bitu_stats_entry_t *entry;
+  unsigned int bucket;
+
+  /* First record of this thread, creating its shard */
+  if ((shard = pthread_getspecific (stats->key)) == NULL)
+    {
+      if ((shard = calloc (1, sizeof (_bitu_stats_shard_t))) == NULL)
+        return;
+      shard->stats = stats;
+      pthread_setspecific (stats->key, shard);
+      pthread_mutex_lock (&stats->mutex);
+      shard->next = stats->shards;
+      stats->shards = shard;
+      pthread_mutex_unlock (&stats->mutex);
+    }
+
+  if ((entry = _bitu_stats_shard_find (shard, name)) == NULL &&
+      (entry = _bitu_stats_shard_add (shard, name)) == NULL)
+    return;
+
+  bucket = _bitu_stats_bucket (usec);
+  STORE (entry->count, entry->count + 1);
+  STORE (entry->total, entry->total + usec);
+  STORE (entry->buckets[bucket], entry->buckets[bucket] + 1);
+  if (usec > entry->max)
+    STORE (entry->max, usec);
+}
+
+
+static void
+_bitu_stats_format_time (char *buf, size_t size, uint64_t usec)
+{
+  if (usec < 1000)
+    snprintf (buf, size, "%lluus", (unsigned long long) usec);
+  else if (usec < 1000000)
+    snprintf (buf, size, "%.1fms", usec / 1000.0);
+  else
+    snprintf (buf, size, "%.2fs", usec / 1000000.0);
+}
+
+
+static uint64_t
+_bitu_stats_percentile (_bitu_stats_entry_t *entry, double percentile)
+{
+  uint64_t target, seen = 0;
+  int i;
+
+  target = (uint64_t) (entry->count * percentile + 0.5);
+  target = target ? target : 1;
+  for (i = 0; i < STATS_BUCKETS; i++)
+    if ((seen += entry->buckets[i]) >= target)
+      {
+        /* The bucket boundary may be past the highest value seen */
+        uint64_t value = _bitu_stats_bucket_value (i);
+        return value > entry->max ? entry->max : value;
+      }
+  return entry->max;
+}
+
+
+char *
+bitu_stats_report (bitu_stats_t *stats)
+{
+  _bitu_stats_shard_t merged, *shard;
+  _bitu_stats_entry_t *entry;
+  ta_buf_t buf = TA_BUF_INIT;
+  char avg[16], p50[16], p90[16], p99[16], max[16];
+  char *message;
+  int i;
+
+  memset (&merged, 0, sizeof (merged));
+
+  pthread_mutex_lock (&stats->mutex);
+  _bitu_stats_merge (&merged, &stats->retired);
+  for (shard = stats->shards; shard; shard = shard->next)
+    _bitu_stats_merge (&merged, shard);
+  pthread_mutex_unlock (&stats->mutex);
+
+  if (merged.nentries == 0)
+    return strdup ("Nothing recorded yet");
+
+  ta_buf_alloc (&buf, 128);
+  for (i = 0; i < merged.nentries; i++)
+    {
+      entry = merged.entries[i];
+      _bitu_stats_format_time (avg, sizeof (avg), entry->total / entry->count);
+      _bitu_stats_format_time (p50, sizeof (p50), _bitu_stats_percentile (entry, 0.5));
+      _bitu_stats_format_time (p90, sizeof (p90), _bitu_stats_percentile (entry, 0.9));
+      _bitu_stats_format_time (p99, sizeof (p99), _bitu_stats_percentile (entry, 0.99));
+      _bitu_stats_format_time (max, sizeof (max), entry->max);
+      ta_buf_catf (&buf, "%s%s: %llu calls, avg %s, p50 %s, p90 %s, p99 %s, max %s",
+                   i ? "\n" : "", entry->name,
+                   (unsigned long long) entry->count,
+                   avg, p50, p90, p99, max);
+    }
+  _bitu_stats_shard_clear (&merged);
+
+  message = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return message;
+}
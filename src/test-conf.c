@@ -18,33 +18,182 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <taningia/taningia.h>
 #include <bitu/conf.h>
 #include <bitu/transport.h>
 
-int
-main ()
+static char dir[] = "/tmp/test-conf-XXXXXX";
+
+static void
+write_file (const char *name, const char *contents)
 {
-  ta_list_t *conf, *tmp;
-  if ((conf = bitu_conf_read_from_file ("bitu.conf.dist")) == NULL)
-    {
-      printf ("Error!\n");
-      exit (EXIT_FAILURE);
-    }
+  char path[256];
+  FILE *fp;
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  fp = fopen (path, "w");
+  assert (fp != NULL);
+  fputs (contents, fp);
+  fclose (fp);
+}
+
+static void
+remove_file (const char *name)
+{
+  char path[256];
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  unlink (path);
+}
+
+static void
+free_conf (ta_list_t *conf)
+{
+  ta_list_t *tmp;
+  for (tmp = conf; tmp; tmp = tmp->next)
+    bitu_command_free (tmp->data);
+  ta_list_free (conf);
+}
+
+static void
+print_conf (ta_list_t *conf)
+{
+  ta_list_t *tmp;
   for (tmp = conf; tmp; tmp = tmp->next)
     {
-      int i = 0;
+      int i;
       bitu_command_t *command;
-      const char *param;
       const char **params;
-      const char *cmd;
 
       command = tmp->data;
-      cmd = bitu_command_get_name (command);
       params = bitu_command_get_params (command);
-      printf ("Cmd: %s\n", cmd);
-      while ((param = params[i++]) != NULL)
-        printf (" * %s\n", param);
+      printf ("Cmd: %s\n", bitu_command_get_name (command));
+      for (i = 0; i < bitu_command_get_nparams (command); i++)
+        printf (" * %s\n", params[i]);
+    }
+}
+
+/* Returns the first param of the nth command */
+static const char *
+param_of (ta_list_t *conf, int n)
+{
+  while (n-- > 0)
+    conf = conf->next;
+  return bitu_command_get_params (conf->data)[0];
+}
+
+void
+test_dist (void)
+{
+  ta_list_t *conf;
+  if ((conf = bitu_conf_read_from_file ("bitu.conf.dist")) == NULL)
+    {
+      printf ("Error!\n");
+      exit (EXIT_FAILURE);
+    }
+  print_conf (conf);
+  free_conf (conf);
+}
+
+void
+test_includes_and_snapshot (void)
+{
+  ta_list_t *conf;
+  char pattern[256], snapshot[256], line[2048], *error;
+  struct stat st;
+  int status;
+
+  /* A line longer than any fixed buffer and an include in the middle
+   * of the file, matching two files read in order */
+  memset (line, 'x', sizeof (line));
+  memcpy (line, "set long ", 9);
+  line[sizeof (line) - 2] = '\n';
+  line[sizeof (line) - 1] = '\0';
+  snprintf (pattern, sizeof (pattern), "%s/conf.d", dir);
+  status = mkdir (pattern, 0700);
+  assert (status == 0);
+  snprintf (pattern, sizeof (pattern), "set a 1\ninclude %s/conf.d/*.conf\n",
+            dir);
+  write_file ("main.conf", pattern);
+  write_file ("conf.d/1.conf", "  set b \"two words\"  \n# comment\n\n");
+  write_file ("conf.d/2.conf", line);
+
+  snprintf (pattern, sizeof (pattern), "%s/main.conf", dir);
+  snprintf (snapshot, sizeof (snapshot), "%s/snapshot", dir);
+  status = bitu_conf_load (pattern, snapshot, &conf, &error);
+  assert (status == TA_OK);
+  assert (ta_list_len (conf) == 3);
+  assert (strcmp (param_of (conf, 0), "a") == 0);
+  assert (strcmp (bitu_command_get_params (conf->next->data)[1],
+                  "two words") == 0);
+  assert (strlen (bitu_command_get_params (conf->next->next->data)[1])
+          == sizeof (line) - 11);
+  free_conf (conf);
+  status = stat (snapshot, &st);
+  assert (status == 0);
+  printf ("Includes: ok, snapshot with %ld bytes\n", (long) st.st_size);
+
+  /* Loaded from the snapshot now */
+  status = bitu_conf_load (pattern, snapshot, &conf, &error);
+  assert (status == TA_OK);
+  assert (ta_list_len (conf) == 3);
+  assert (strcmp (bitu_command_get_cmd (conf->next->data),
+                  "set b \"two words\"") == 0);
+  free_conf (conf);
+
+  /* Changing an included file makes the snapshot stale */
+  write_file ("conf.d/2.conf", "set c 3\nset d 4\n");
+  status = bitu_conf_load (pattern, snapshot, &conf, &error);
+  assert (status == TA_OK);
+  assert (ta_list_len (conf) == 4);
+  assert (strcmp (param_of (conf, 3), "d") == 0);
+  free_conf (conf);
+
+  /* Even when it keeps its size and changes within the same second */
+  write_file ("conf.d/2.conf", "set c 3\nset e 4\n");
+  status = bitu_conf_load (pattern, snapshot, &conf, &error);
+  assert (status == TA_OK);
+  assert (strcmp (param_of (conf, 3), "e") == 0);
+  free_conf (conf);
+  printf ("Snapshot: ok\n");
+
+  /* Cycles and broken lines are errors */
+  snprintf (line, sizeof (line), "include %s/loop.conf\n", dir);
+  write_file ("loop.conf", line);
+  snprintf (pattern, sizeof (pattern), "%s/loop.conf", dir);
+  status = bitu_conf_load (pattern, NULL, &conf, &error);
+  assert (status == TA_ERROR);
+  printf ("Cycle: %s\n", error);
+  free (error);
+  write_file ("quote.conf", "set a \"b\n");
+  snprintf (pattern, sizeof (pattern), "%s/quote.conf", dir);
+  status = bitu_conf_load (pattern, NULL, &conf, &error);
+  assert (status == TA_ERROR);
+  printf ("Quote: %s\n", error);
+  free (error);
+
+  remove_file ("main.conf");
+  remove_file ("conf.d/1.conf");
+  remove_file ("conf.d/2.conf");
+  remove_file ("loop.conf");
+  remove_file ("quote.conf");
+  remove_file ("snapshot");
+  snprintf (pattern, sizeof (pattern), "%s/conf.d", dir);
+  rmdir (pattern);
+}
+
+int
+main ()
+{
+  test_dist ();
+  if (mkdtemp (dir) == NULL)
+    {
+      perror ("mkdtemp");
+      return EXIT_FAILURE;
     }
+  test_includes_and_snapshot ();
+  rmdir (dir);
   return 0;
 }
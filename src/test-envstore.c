@@ -0,0 +1,211 @@
+/* test-envstore.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <taningia/taningia.h>
+
+#include "hashtable-utils.h"
+#include "hashtable-concurrent.h"
+#include "envstore.h"
+
+static char dir[] = "/tmp/test-envstore-XXXXXX";
+static char path[256];
+
+static chashtable_t *env;
+static bitu_envstore_t *store;
+
+
+/* Starts over with an empty environment and replays the log in it */
+static void
+reopen (void)
+{
+  int status;
+
+  if (store)
+    {
+      bitu_envstore_free (store);
+      chashtable_destroy (env);
+    }
+  env = chashtable_create (hash_string, string_equal, free, free);
+  store = bitu_envstore_new (env);
+  assert (store != NULL);
+  status = bitu_envstore_open (store, path);
+  assert (status == TA_OK);
+}
+
+/* Tells whether `key' holds `value', or is not set when it's NULL */
+static int
+has (const char *key, const char *value)
+{
+  char *found;
+  int same;
+
+  found = chashtable_get_copy (env, key, (copy_fn) strdup);
+  same = value ? found && strcmp (found, value) == 0 : found == NULL;
+  free (found);
+  return same;
+}
+
+static off_t
+file_size (void)
+{
+  struct stat st;
+  int status;
+
+  status = stat (path, &st);
+  assert (status == 0);
+  return st.st_size;
+}
+
+void
+test_replay (void)
+{
+  int status;
+
+  reopen ();
+  assert (bitu_envstore_get_discarded (store) == 0);
+  status = bitu_envstore_set (store, "a", "1");
+  assert (status == TA_OK);
+  status = bitu_envstore_set (store, "b", "two words");
+  assert (status == TA_OK);
+  status = bitu_envstore_unset (store, "a");
+  assert (status == TA_OK);
+  status = bitu_envstore_set (store, "c", "3");
+  assert (status == TA_OK);
+
+  reopen ();
+  assert (has ("a", NULL));
+  assert (has ("b", "two words"));
+  assert (has ("c", "3"));
+  assert (bitu_envstore_get_discarded (store) == 0);
+  printf ("Replay: ok, %ld bytes\n", (long) file_size ());
+}
+
+void
+test_torn_tail (void)
+{
+  off_t size;
+  int status;
+
+  /* The last record lost a few bytes in a crash */
+  size = file_size ();
+  status = truncate (path, size - 3);
+  assert (status == 0);
+  reopen ();
+  assert (has ("b", "two words"));
+  assert (has ("c", NULL));
+  assert (bitu_envstore_get_discarded (store) > 0);
+
+  /* What's left of it was cut off, records appended now are found */
+  status = bitu_envstore_set (store, "d", "4");
+  assert (status == TA_OK);
+  reopen ();
+  assert (has ("b", "two words"));
+  assert (has ("d", "4"));
+  assert (bitu_envstore_get_discarded (store) == 0);
+  printf ("Torn tail: ok\n");
+}
+
+void
+test_corrupted_record (void)
+{
+  off_t size;
+  char byte;
+  int fd, status;
+
+  /* The value of the last record changes on the disk */
+  status = bitu_envstore_set (store, "e", "5");
+  assert (status == TA_OK);
+  size = file_size ();
+  fd = open (path, O_WRONLY);
+  assert (fd != -1);
+  byte = '6';
+  status = pwrite (fd, &byte, 1, size - 1);
+  assert (status == 1);
+  close (fd);
+
+  /* Its checksum doesn't match anymore, everything before it stays */
+  reopen ();
+  assert (has ("e", NULL));
+  assert (has ("d", "4"));
+  assert (bitu_envstore_get_discarded (store) > 0);
+  printf ("Corrupted record: ok\n");
+}
+
+void
+test_compaction (void)
+{
+  char value[16];
+  off_t size;
+  int i, status;
+
+  /* Rewriting a variable over and over leaves many stale records */
+  size = file_size ();
+  for (i = 0; i < 1000; i++)
+    {
+      snprintf (value, sizeof (value), "%d", i);
+      status = bitu_envstore_set (store, "counter", value);
+      assert (status == TA_OK);
+    }
+  assert (file_size () < size + 1000 * 12);
+
+  reopen ();
+  assert (has ("counter", "999"));
+  assert (has ("b", "two words"));
+  assert (has ("d", "4"));
+  printf ("Compaction: ok, %ld bytes\n", (long) file_size ());
+
+  /* Variables set before opening are saved too */
+  bitu_envstore_free (store);
+  store = bitu_envstore_new (env);
+  status = bitu_envstore_set (store, "f", "6");
+  assert (status == TA_OK);
+  status = bitu_envstore_open (store, path);
+  assert (status == TA_OK);
+  reopen ();
+  assert (has ("f", "6"));
+  assert (has ("counter", "999"));
+}
+
+int
+main ()
+{
+  if (mkdtemp (dir) == NULL)
+    {
+      perror ("mkdtemp");
+      return EXIT_FAILURE;
+    }
+  snprintf (path, sizeof (path), "%s/environment", dir);
+
+  test_replay ();
+  test_torn_tail ();
+  test_corrupted_record ();
+  test_compaction ();
+
+  bitu_envstore_free (store);
+  chashtable_destroy (env);
+  unlink (path);
+  rmdir (dir);
+  return 0;
+}
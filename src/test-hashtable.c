@@ -0,0 +1,339 @@
+/* test-hashtable.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <taningia/taningia.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+
+#define NKEYS 1000
+
+
+/* All keys share a single home slot and probe sequence */
+static unsigned int
+hash_collide (const void *TA_UNUSED(key))
+{
+  return 42;
+}
+
+static hashtable_t *
+new_table (key_hash_fn hash)
+{
+  hashtable_t *table;
+
+  table = hashtable_create (hash, string_equal, free, free);
+  assert (table != NULL);
+  return table;
+}
+
+static char *
+key_for (int i)
+{
+  char key[32];
+
+  snprintf (key, sizeof (key), "key-%d", i);
+  return strdup (key);
+}
+
+static void
+set (hashtable_t *table, int i)
+{
+  int *value;
+  int status;
+
+  value = malloc (sizeof (int));
+  assert (value != NULL);
+  *value = i;
+  status = hashtable_set (table, key_for (i), value);
+  assert (status == 0);
+}
+
+static void
+del (hashtable_t *table, int i)
+{
+  char *key = key_for (i);
+  int status;
+
+  status = hashtable_del (table, key);
+  assert (status == 0);
+  free (key);
+}
+
+/* Tells whether `i' is found and holds its own value */
+static int
+has (hashtable_t *table, int i)
+{
+  char *key = key_for (i);
+  int *value;
+
+  value = hashtable_get (table, key);
+  free (key);
+  return value != NULL && *value == i;
+}
+
+static int
+is_rehashing (hashtable_t *table)
+{
+  return table->old_pairs != NULL;
+}
+
+/* Every pair sits `dist - 1' slots after its home and a probe sequence
+ * never has holes nor pairs richer than the one before them, that's
+ * what lookups stop at. Slots already moved out of an old table are
+ * holes on purpose, only the current one is checked that way. Returns
+ * the number of pairs found. */
+static unsigned int
+check_pairs (struct hashtable_pair *pairs, unsigned int mask, int strict)
+{
+  struct hashtable_pair *pair, *prev;
+  unsigned int i, count = 0;
+
+  for (i = 0; i <= mask; i++)
+    {
+      pair = &pairs[i];
+      if (pair->dist == 0)
+        continue;
+      count++;
+      assert (((pair->hash & mask) + pair->dist - 1) % (mask + 1) == i);
+      if (!strict || pair->dist == 1)
+        continue;
+      prev = &pairs[(i - 1) & mask];
+      assert (prev->dist != 0);
+      assert (prev->dist + 1 >= pair->dist);
+    }
+  return count;
+}
+
+static void
+check_table (hashtable_t *table)
+{
+  unsigned int count;
+
+  count = check_pairs (table->pairs, table->mask, 1);
+  if (is_rehashing (table))
+    count += check_pairs (table->old_pairs, table->old_mask, 0);
+  assert (count == table->size);
+}
+
+/* Walks the whole table and checks each of the keys [0, n) that are
+ * expected to be there shows up once and nothing else does */
+static void
+check_iter (hashtable_t *table, int n, const char *present)
+{
+  char *seen;
+  void *iter;
+  int *value, i;
+
+  seen = calloc (n, 1);
+  assert (seen != NULL);
+  for (iter = hashtable_iter (table); iter;
+       iter = hashtable_iter_next (table, iter))
+    {
+      value = hashtable_iter_value (iter);
+      assert (*value >= 0 && *value < n);
+      assert (present[*value]);
+      assert (!seen[*value]);
+      seen[*value] = 1;
+    }
+  for (i = 0; i < n; i++)
+    assert (seen[i] == present[i]);
+  free (seen);
+}
+
+
+void
+test_insert_delete (void)
+{
+  hashtable_t *table = new_table (hash_string);
+  int i, *value;
+  char *key;
+
+  for (i = 0; i < NKEYS; i++)
+    set (table, i);
+  check_table (table);
+  assert (table->size == NKEYS);
+  for (i = 0; i < NKEYS; i++)
+    assert (has (table, i));
+
+  /* Replacing keeps a single pair */
+  key = key_for (7);
+  value = malloc (sizeof (int));
+  *value = 70;
+  assert (hashtable_set (table, key, value) == 0);
+  assert (table->size == NKEYS);
+  key = key_for (7);
+  assert (*(int *) hashtable_get (table, key) == 70);
+  free (key);
+  set (table, 7);
+
+  /* Every other key goes, the rest shift back and are still found */
+  for (i = 0; i < NKEYS; i += 2)
+    del (table, i);
+  check_table (table);
+  assert (table->size == NKEYS / 2);
+  for (i = 0; i < NKEYS; i++)
+    assert (has (table, i) == (i % 2 == 1));
+
+  key = key_for (0);
+  assert (hashtable_del (table, key) == -1);
+  assert (hashtable_get (table, key) == NULL);
+  free (key);
+
+  hashtable_destroy (table);
+  printf ("Insert and delete: ok\n");
+}
+
+
+void
+test_collisions (void)
+{
+  hashtable_t *table = new_table (hash_collide);
+  const int n = 200;
+  int i;
+
+  for (i = 0; i < n; i++)
+    set (table, i);
+  check_table (table);
+  for (i = 0; i < n; i++)
+    assert (has (table, i));
+
+  /* Holes in the middle of the one long probe sequence are closed, so
+   * keys past them are still reachable */
+  for (i = 0; i < n; i += 3)
+    {
+      del (table, i);
+      check_table (table);
+    }
+  for (i = 0; i < n; i++)
+    assert (has (table, i) == (i % 3 != 0));
+
+  /* Deleting from the front and the back of the sequence */
+  del (table, 1);
+  del (table, n - 1);
+  check_table (table);
+  for (i = 0; i < n; i++)
+    assert (has (table, i) == (i % 3 != 0 && i != 1 && i != n - 1));
+
+  hashtable_destroy (table);
+  printf ("Colliding keys: ok\n");
+}
+
+
+/* Lookups look at both the old and the new slots while pairs are being
+ * moved, whatever changes happen in the middle */
+static void
+rehash_with (key_hash_fn hash, int nkeys)
+{
+  hashtable_t *table = new_table (hash);
+  char present[NKEYS];
+  int i, n = 0, steps = 0, grows = 0;
+
+  memset (present, 0, sizeof (present));
+  while (n < nkeys)
+    {
+      set (table, n);
+      present[n++] = 1;
+      if (!is_rehashing (table))
+        continue;
+
+      /* Changing the table in the middle of a rehash */
+      grows++;
+      if (n % 2 == 0 && present[n / 2])
+        {
+          del (table, n / 2);
+          present[n / 2] = 0;
+        }
+      while (is_rehashing (table) && n < nkeys)
+        {
+          check_table (table);
+          for (i = 0; i < n; i++)
+            assert (has (table, i) == present[i]);
+          check_iter (table, n, (const char *) present);
+
+          set (table, n);
+          present[n++] = 1;
+          if (present[n / 3])
+            {
+              del (table, n / 3);
+              present[n / 3] = 0;
+            }
+          steps++;
+        }
+    }
+  check_table (table);
+  for (i = 0; i < nkeys; i++)
+    assert (has (table, i) == present[i]);
+  check_iter (table, nkeys, (const char *) present);
+  assert (grows > 3 && steps > 0);
+
+  hashtable_destroy (table);
+}
+
+void
+test_rehash (void)
+{
+  rehash_with (hash_string, NKEYS);
+  rehash_with (hash_collide, 200);
+  printf ("Lookups and iteration while growing: ok\n");
+}
+
+
+void
+test_string_hash (void)
+{
+  char key[41], other[41];
+  unsigned int hash;
+  int len, i;
+
+  /* Every length goes through the whole words and the packed tail,
+   * changing any byte or just the length gives another hash */
+  memset (key, 'a', sizeof (key));
+  for (len = 0; len < 40; len++)
+    {
+      key[len] = '\0';
+      hash = hash_string (key);
+      strcpy (other, key);
+      assert (hash_string (other) == hash);
+      for (i = 0; i < len; i++)
+        {
+          other[i] = 'b';
+          assert (hash_string (other) != hash);
+          other[i] = 'a';
+        }
+      other[len] = 'a';
+      other[len + 1] = '\0';
+      assert (hash_string (other) != hash);
+      key[len] = 'a';
+    }
+  printf ("String hash: ok\n");
+}
+
+
+int
+main ()
+{
+  test_insert_delete ();
+  test_collisions ();
+  test_rehash ();
+  test_string_hash ();
+  return 0;
+}
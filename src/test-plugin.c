@@ -61,6 +61,10 @@ main ()
               bitu_plugin_name (plugin),
               message);
       free (message);
+
+      /* Plugins found through the context are referenced, so they can't
+       * go away while we're using them. Let's give it back. */
+      bitu_plugin_unref (plugin);
     }
 
   /* This call will free the loaded plugin too. `dlclose()' will be
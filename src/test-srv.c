@@ -0,0 +1,268 @@
+/* test-srv.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <taningia/taningia.h>
+
+#include "srv.h"
+
+/* A stub resolver, answers whatever is in `_answer' and counts how
+ * many times it was asked */
+
+typedef struct
+{
+  const char *host;
+  int port;
+  int priority;
+  int weight;
+} _answer_t;
+
+static const _answer_t *_answer = NULL;
+static int _nanswer = 0;
+static uint32_t _ttl = 300;
+static int _fail = 0;
+static int _queries = 0;
+
+
+static int
+_stub_resolve (const char *name, bitu_srv_target_t **targets,
+               int *ntargets, uint32_t *ttl, void *data)
+{
+  int i;
+
+  _queries++;
+  assert (strcmp (name, "_xmpp-client._tcp.example.com") == 0);
+  assert (data == &_queries);
+  if (_fail)
+    return TA_ERROR;
+
+  *targets = _nanswer ? calloc (_nanswer, sizeof (bitu_srv_target_t)) : NULL;
+  for (i = 0; i < _nanswer; i++)
+    {
+      (*targets)[i].host = strdup (_answer[i].host);
+      (*targets)[i].port = _answer[i].port;
+      (*targets)[i].priority = _answer[i].priority;
+      (*targets)[i].weight = _answer[i].weight;
+    }
+  *ntargets = _nanswer;
+  *ttl = _ttl;
+  return TA_OK;
+}
+
+
+static int
+_lookup (bitu_srv_target_t **targets, int *ntargets)
+{
+  return bitu_srv_lookup ("_xmpp-client._tcp", "example.com",
+                          targets, ntargets);
+}
+
+
+static void
+_reset (const _answer_t *answer, int nanswer, uint32_t ttl)
+{
+  bitu_srv_set_resolver (_stub_resolve, &_queries);
+  _answer = answer;
+  _nanswer = nanswer;
+  _ttl = ttl;
+  _fail = 0;
+  _queries = 0;
+}
+
+
+void
+test_order (void)
+{
+  static const _answer_t answer[] = {
+    { "backup.example.com", 5222, 20, 10 },
+    { "c.example.com", 5223, 10, 0 },
+    { "b.example.com", 5224, 10, 20 },
+    { "a.example.com", 5225, 10, 60 },
+  };
+  bitu_srv_target_t *targets;
+  int ntargets, i, a = 0, b = 0, c = 0;
+
+  printf ("Ordering targets by priority and weight: ");
+  _reset (answer, 4, 300);
+
+  for (i = 0; i < 1000; i++)
+    {
+      assert (_lookup (&targets, &ntargets) == TA_OK);
+      assert (ntargets == 4);
+
+      /* The other priority is only tried after all of the first one */
+      assert (strcmp (targets[3].host, "backup.example.com") == 0);
+      assert (targets[3].port == 5222);
+      if (strcmp (targets[0].host, "a.example.com") == 0)
+        a++;
+      else if (strcmp (targets[0].host, "b.example.com") == 0)
+        b++;
+      else
+        c++;
+      bitu_srv_targets_free (targets, ntargets);
+    }
+
+  /* Weights are 60, 20 and 0, so about 75%, 25% and almost never */
+  printf ("a first %d times, b %d, c %d: ", a, b, c);
+  assert (a > 650 && a < 850);
+  assert (b > 150 && b < 350);
+  assert (c < 30);
+
+  /* And the resolver was asked a single time */
+  assert (_queries == 1);
+  printf ("ok\n");
+}
+
+
+void
+test_ttl (void)
+{
+  static const _answer_t answer[] = {
+    { "a.example.com", 5222, 0, 0 },
+  };
+  bitu_srv_target_t *targets;
+  int ntargets;
+
+  printf ("Honoring TTLs: ");
+  _reset (answer, 1, 0);
+
+  /* Nothing is fresh with a zero TTL */
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  bitu_srv_targets_free (targets, ntargets);
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  bitu_srv_targets_free (targets, ntargets);
+  assert (_queries == 2);
+
+  /* The resolver failing doesn't make the last answer go away */
+  _fail = 1;
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  assert (ntargets == 1 && strcmp (targets[0].host, "a.example.com") == 0);
+  bitu_srv_targets_free (targets, ntargets);
+  assert (_queries == 3);
+
+  /* And it isn't asked again right away */
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  bitu_srv_targets_free (targets, ntargets);
+  assert (_queries == 3);
+
+  /* Until the cache is flushed */
+  bitu_srv_flush ();
+  assert (_lookup (&targets, &ntargets) == TA_ERROR);
+  assert (targets == NULL && ntargets == 0);
+  assert (_lookup (&targets, &ntargets) == TA_ERROR);
+  assert (_queries == 4);
+  printf ("ok\n");
+}
+
+
+void
+test_no_records (void)
+{
+  bitu_srv_target_t *targets;
+  int ntargets;
+
+  printf ("Caching names without records: ");
+  _reset (NULL, 0, 60);
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  assert (targets == NULL && ntargets == 0);
+  assert (_lookup (&targets, &ntargets) == TA_OK);
+  assert (_queries == 1);
+  printf ("ok\n");
+}
+
+
+/* Takes its time, so all the lookups below find it still resolving */
+static int
+_slow_resolve (const char *name, bitu_srv_target_t **targets,
+               int *ntargets, uint32_t *ttl, void *data)
+{
+  usleep (200000);
+  return _stub_resolve (name, targets, ntargets, ttl, data);
+}
+
+
+static void *
+_lookup_thread (void *data)
+{
+  bitu_srv_target_t *targets;
+  int ntargets, *status = data;
+
+  *status = _lookup (&targets, &ntargets);
+  if (*status == TA_OK &&
+      (ntargets != 1 || strcmp (targets[0].host, "a.example.com") != 0))
+    *status = TA_ERROR;
+  bitu_srv_targets_free (targets, ntargets);
+  return NULL;
+}
+
+
+void
+test_single_flight (void)
+{
+  static const _answer_t answer[] = {
+    { "a.example.com", 5222, 0, 0 },
+  };
+  pthread_t threads[8];
+  int statuses[8], i;
+
+  printf ("Sharing a query among concurrent lookups: ");
+
+  /* A zero TTL caches nothing, waiting ones get the answer anyway */
+  _reset (answer, 1, 0);
+  bitu_srv_set_resolver (_slow_resolve, &_queries);
+  for (i = 0; i < 8; i++)
+    assert (pthread_create (&threads[i], NULL, _lookup_thread,
+                            &statuses[i]) == 0);
+  for (i = 0; i < 8; i++)
+    {
+      pthread_join (threads[i], NULL);
+      assert (statuses[i] == TA_OK);
+    }
+  assert (_queries == 1);
+
+  /* So do failures */
+  _fail = 1;
+  bitu_srv_flush ();
+  for (i = 0; i < 8; i++)
+    assert (pthread_create (&threads[i], NULL, _lookup_thread,
+                            &statuses[i]) == 0);
+  for (i = 0; i < 8; i++)
+    {
+      pthread_join (threads[i], NULL);
+      assert (statuses[i] == TA_ERROR);
+    }
+  assert (_queries == 2);
+  printf ("ok\n");
+}
+
+
+int
+main ()
+{
+  test_order ();
+  test_ttl ();
+  test_no_records ();
+  test_single_flight ();
+  bitu_srv_flush ();
+  return 0;
+}
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <taningia/error.h>
 #include <bitu/util.h>
 
 void
@@ -34,6 +35,14 @@ test_strstrip (void)
   printf ("`%s'\n", stripped);
 
   free (stripped);
+
+  /* Nothing is left of empty and blank strings */
+  stripped = bitu_util_strstrip ("");
+  assert (strcmp (stripped, "") == 0);
+  free (stripped);
+  stripped = bitu_util_strstrip (" \t\n ");
+  assert (strcmp (stripped, "") == 0);
+  free (stripped);
 }
 
 void
@@ -42,24 +51,83 @@ test_extract_params (void)
   char *line = "cmd param3 param4 \"single param with spaces\" blehxx";
   char *cmd;
   char **params;
-  int len, i;
+  int len, i, status;
 
   printf ("line: %s\n", line);
-  if (bitu_util_extract_params (line, &cmd, &params, &len))
-    {
-      printf ("cmd: %s, num params: %d, params: \n", cmd, len);
-      for (i = 0; i < len; i++)
-        printf (" - %s\n", params[i]);
-
-      /* To free all collected data, you have to free all array
-       * elements and then the char **param itself. Don't forget to
-       * free the cmd var too */
-      for (i = 0; i < len; i++)
-        free (params[i]);
-      free (params);
-
-      free (cmd);
-    }
+  status = bitu_util_extract_params (line, &cmd, &params, &len);
+  assert (status == TA_OK);
+  printf ("cmd: %s, num params: %d, params: \n", cmd, len);
+  for (i = 0; i < len; i++)
+    printf (" - %s\n", params[i]);
+  assert (strcmp (cmd, "cmd") == 0);
+  assert (len == 4);
+  assert (strcmp (params[2], "single param with spaces") == 0);
+  assert (params[len] == NULL);
+
+  /* To free all collected data, you have to free all array
+   * elements and then the char **param itself. Don't forget to
+   * free the cmd var too */
+  for (i = 0; i < len; i++)
+    free (params[i]);
+  free (params);
+  free (cmd);
+
+  /* Tabs separate too, a backslash takes the next char literally and
+   * quotes are stripped, like in the config file */
+  line = "  say\tsome\\ thing \\\"quoted\\\" \"a\tb\"  ";
+  status = bitu_util_extract_params (line, &cmd, &params, &len);
+  assert (status == TA_OK);
+  assert (strcmp (cmd, "say") == 0);
+  assert (len == 3);
+  assert (strcmp (params[0], "some thing") == 0);
+  assert (strcmp (params[1], "\"quoted\"") == 0);
+  assert (strcmp (params[2], "a\tb") == 0);
+  for (i = 0; i < len; i++)
+    free (params[i]);
+  free (params);
+  free (cmd);
+
+  /* Nothing to run */
+  status = bitu_util_extract_params ("", &cmd, &params, &len);
+  assert (status == TA_ERROR);
+  status = bitu_util_extract_params (" \t ", &cmd, &params, &len);
+  assert (status == TA_ERROR);
+  status = bitu_util_extract_params ("say \"hi", &cmd, &params, &len);
+  assert (status == TA_ERROR);
+}
+
+void
+test_is_mention (void)
+{
+  const char *nick = "bitu";
+  size_t len = strlen (nick);
+
+  printf ("Looking for mentions of `%s'\n", nick);
+
+  /* Whole word at the start, in the middle and at the end */
+  assert (bitu_util_is_mention ("bitu status please", nick, len));
+  assert (bitu_util_is_mention ("hey bitu what's up", nick, len));
+  assert (bitu_util_is_mention ("ping bitu", nick, len));
+  assert (bitu_util_is_mention ("bitu", nick, len));
+
+  /* Usual addressing punctuation ends the nick */
+  assert (bitu_util_is_mention ("bitu: status", nick, len));
+  assert (bitu_util_is_mention ("bitu, status", nick, len));
+
+  /* Part of a longer word isn't a mention */
+  assert (!bitu_util_is_mention ("bitumen is black", nick, len));
+  assert (!bitu_util_is_mention ("habitual", nick, len));
+  assert (!bitu_util_is_mention ("xbitu", nick, len));
+  assert (!bitu_util_is_mention ("bitu_bot: hi", nick, len));
+
+  /* Nicknames are compared ignoring case */
+  assert (bitu_util_is_mention ("BITU: status", nick, len));
+  assert (bitu_util_is_mention ("hi Bitu", nick, len));
+
+  /* Nothing to look at */
+  assert (!bitu_util_is_mention ("", nick, len));
+  assert (!bitu_util_is_mention (NULL, nick, len));
+  assert (!bitu_util_is_mention ("bitu", nick, 0));
 }
 
 int
@@ -67,5 +135,6 @@ main ()
 {
   test_strstrip ();
   test_extract_params ();
+  test_is_mention ();
   return 0;
 }
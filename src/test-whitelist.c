@@ -0,0 +1,99 @@
+/* test-whitelist.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <taningia/taningia.h>
+
+#include "whitelist.h"
+
+static char _path[] = "/tmp/bitu-whitelist-XXXXXX";
+
+
+static void
+_write (const char *contents)
+{
+  FILE *file = fopen (_path, "w");
+  assert (file != NULL);
+  fputs (contents, file);
+  fclose (file);
+}
+
+
+void
+test_lookup (void)
+{
+  printf ("Looking jids up: ");
+  _write ("# Friends\n"
+          "alice@example.com\n"
+          "  Bob@Example.COM/laptop  \n"
+          "\n"
+          "*@friends.org\n"
+          "not a jid\n");
+  assert (bitu_whitelist_set_file (_path) == TA_OK);
+  assert (bitu_whitelist_is_enabled ());
+  assert (bitu_whitelist_get_size () == 3);
+
+  assert (bitu_whitelist_contains ("alice@example.com"));
+  assert (bitu_whitelist_contains ("ALICE@example.com/phone"));
+  assert (bitu_whitelist_contains ("bob@example.com"));
+  assert (bitu_whitelist_contains ("anyone@friends.org/home"));
+  assert (!bitu_whitelist_contains ("carol@example.com"));
+  assert (!bitu_whitelist_contains ("friends.org"));
+  assert (!bitu_whitelist_contains ("@example.com"));
+  assert (!bitu_whitelist_contains (""));
+  assert (!bitu_whitelist_contains (NULL));
+  printf ("ok\n");
+}
+
+
+void
+test_reload (void)
+{
+  printf ("Reloading the list: ");
+  _write ("carol@example.com\n");
+  assert (bitu_whitelist_reload () == TA_OK);
+  assert (bitu_whitelist_get_size () == 1);
+  assert (bitu_whitelist_contains ("carol@example.com"));
+  assert (!bitu_whitelist_contains ("alice@example.com"));
+
+  /* A file that can't be read keeps the list we have */
+  assert (bitu_whitelist_set_file ("/nonexistent/whitelist") == TA_ERROR);
+  assert (bitu_whitelist_contains ("carol@example.com"));
+
+  assert (bitu_whitelist_set_file (NULL) == TA_OK);
+  assert (!bitu_whitelist_is_enabled ());
+  assert (!bitu_whitelist_contains ("carol@example.com"));
+  printf ("ok\n");
+}
+
+
+int
+main ()
+{
+  int fd = mkstemp (_path);
+  assert (fd != -1);
+  close (fd);
+  test_lookup ();
+  test_reload ();
+  unlink (_path);
+  return 0;
+}
@@ -0,0 +1,347 @@
+/* test-xmpp-sm.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <iksemel.h>
+#include <taningia/taningia.h>
+
+#include "xmpp-sm.h"
+
+/* A stand-in for the server side of the stream. It keeps every node
+ * the client sends and builds the nodes the server would answer. */
+
+#define MAX_RECEIVED 32
+
+static iks *_received[MAX_RECEIVED];
+static int _nreceived = 0;
+
+
+static int
+_server_receive (iks *node, void *data)
+{
+  assert (data == _received);
+  assert (_nreceived < MAX_RECEIVED);
+  _received[_nreceived++] = iks_copy (node);
+  return TA_OK;
+}
+
+
+static void
+_server_forget (void)
+{
+  while (_nreceived > 0)
+    iks_delete (_received[--_nreceived]);
+}
+
+
+static iks *
+_server_node (const char *name, const char *attr, const char *value)
+{
+  iks *node = iks_new (name);
+  iks_insert_attrib (node, "xmlns", BITU_XMPP_SM_NS);
+  if (attr)
+    iks_insert_attrib (node, attr, value);
+  return node;
+}
+
+
+static bitu_xmpp_sm_result_t
+_server_says (bitu_xmpp_sm_t *sm, iks *node)
+{
+  bitu_xmpp_sm_result_t result;
+  result = bitu_xmpp_sm_handle (sm, node, _server_receive, _received);
+  iks_delete (node);
+  return result;
+}
+
+
+/* The client sends a message, counted by stream management */
+static void
+_client_says (bitu_xmpp_sm_t *sm, const char *body)
+{
+  iks *msg = iks_make_msg (IKS_TYPE_CHAT, "admin@localhost", body);
+  assert (bitu_xmpp_sm_queue (sm, msg) == 0);
+  if (bitu_xmpp_sm_is_enabled (sm))
+    _server_receive (msg, _received);
+  iks_delete (msg);
+}
+
+
+static const char *
+_received_body (int i)
+{
+  return iks_find_cdata (_received[i], "body");
+}
+
+
+void
+test_negotiation (void)
+{
+  bitu_xmpp_sm_t *sm = bitu_xmpp_sm_new (8);
+  iks *features, *node;
+
+  printf ("Enabling stream management: ");
+
+  features = iks_new ("stream:features");
+  iks_insert (features, "bind");
+  assert (bitu_xmpp_sm_supported (features) == 0);
+  iks_insert_attrib (iks_insert (features, "sm"), "xmlns", BITU_XMPP_SM_NS);
+  assert (bitu_xmpp_sm_supported (features) == 1);
+  iks_delete (features);
+
+  /* Nothing to resume yet */
+  assert (bitu_xmpp_sm_resume (sm) == NULL);
+
+  node = bitu_xmpp_sm_enable (sm);
+  assert (strcmp (iks_name (node), "enable") == 0);
+  assert (strcmp (iks_find_attrib (node, "resume"), "true") == 0);
+  iks_delete (node);
+
+  assert (_server_says (sm, _server_node ("enabled", "resume", "true"))
+          == BITU_XMPP_SM_ENABLED);
+  assert (bitu_xmpp_sm_get_id (sm) == NULL);
+
+  /* Elements from other namespaces are not ours */
+  node = iks_new ("success");
+  assert (bitu_xmpp_sm_handle (sm, node, _server_receive, _received)
+          == BITU_XMPP_SM_IGNORED);
+  iks_delete (node);
+
+  bitu_xmpp_sm_free (sm);
+  printf ("ok\n");
+}
+
+
+void
+test_acks_and_resumption (void)
+{
+  bitu_xmpp_sm_t *sm = bitu_xmpp_sm_new (8);
+  iks *node;
+
+  printf ("Acking and resuming: ");
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  node = _server_node ("enabled", "resume", "true");
+  iks_insert_attrib (node, "id", "session-1");
+  assert (_server_says (sm, node) == BITU_XMPP_SM_ENABLED);
+  assert (strcmp (bitu_xmpp_sm_get_id (sm), "session-1") == 0);
+
+  /* Three answers go out and a single ack request is pending */
+  _client_says (sm, "one");
+  _client_says (sm, "two");
+  _client_says (sm, "three");
+  assert (bitu_xmpp_sm_get_unacked (sm) == 3);
+  node = bitu_xmpp_sm_request (sm);
+  assert (node && strcmp (iks_name (node), "r") == 0);
+  iks_delete (node);
+  assert (bitu_xmpp_sm_request (sm) == NULL);
+
+  /* The server got two of them */
+  assert (_server_says (sm, _server_node ("a", "h", "2"))
+          == BITU_XMPP_SM_HANDLED);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 1);
+
+  /* Two commands come in and the server wants to know about them */
+  bitu_xmpp_sm_inbound (sm);
+  bitu_xmpp_sm_inbound (sm);
+  _server_forget ();
+  assert (_server_says (sm, _server_node ("r", NULL, NULL))
+          == BITU_XMPP_SM_HANDLED);
+  assert (_nreceived == 1);
+  assert (strcmp (iks_name (_received[0]), "a") == 0);
+  assert (strcmp (iks_find_attrib (_received[0], "h"), "2") == 0);
+  _server_forget ();
+
+  /* The connection drops and one more answer waits for it */
+  bitu_xmpp_sm_suspend (sm);
+  _client_says (sm, "four");
+  assert (_nreceived == 0);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 2);
+
+  /* The new stream resumes the old session instead of binding */
+  node = bitu_xmpp_sm_resume (sm);
+  assert (strcmp (iks_name (node), "resume") == 0);
+  assert (strcmp (iks_find_attrib (node, "previd"), "session-1") == 0);
+  assert (strcmp (iks_find_attrib (node, "h"), "2") == 0);
+  iks_delete (node);
+
+  /* The server had got `three' before the drop, only `four' goes
+   * again */
+  node = _server_node ("resumed", "h", "3");
+  iks_insert_attrib (node, "previd", "session-1");
+  assert (_server_says (sm, node) == BITU_XMPP_SM_RESUMED);
+  assert (_nreceived == 1);
+  assert (strcmp (_received_body (0), "four") == 0);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 1);
+  _server_forget ();
+
+  assert (_server_says (sm, _server_node ("a", "h", "4"))
+          == BITU_XMPP_SM_HANDLED);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 0);
+  assert (bitu_xmpp_sm_get_inbound (sm) == 2);
+
+  bitu_xmpp_sm_free (sm);
+  printf ("ok\n");
+}
+
+
+void
+test_failed_resumption (void)
+{
+  bitu_xmpp_sm_t *sm = bitu_xmpp_sm_new (8);
+  iks *node;
+
+  printf ("Falling back to a new session: ");
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  node = _server_node ("enabled", "resume", "true");
+  iks_insert_attrib (node, "id", "session-2");
+  _server_says (sm, node);
+  _client_says (sm, "lost");
+  _server_forget ();
+
+  /* The server forgot about the session */
+  bitu_xmpp_sm_suspend (sm);
+  iks_delete (bitu_xmpp_sm_resume (sm));
+  assert (_server_says (sm, _server_node ("failed", NULL, NULL))
+          == BITU_XMPP_SM_FAILED);
+  assert (bitu_xmpp_sm_get_id (sm) == NULL);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 1);
+
+  /* After binding again, the answer not acked is sent in the new
+   * session, counted from zero */
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  assert (bitu_xmpp_sm_replay (sm, _server_receive, _received) == 1);
+  assert (strcmp (_received_body (0), "lost") == 0);
+  _server_forget ();
+  _server_says (sm, _server_node ("a", "h", "1"));
+  assert (bitu_xmpp_sm_get_unacked (sm) == 0);
+
+  /* A server refusing <enable/> gets nothing tracked */
+  bitu_xmpp_sm_reset (sm);
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  _client_says (sm, "untracked");
+  assert (_server_says (sm, _server_node ("failed", NULL, NULL))
+          == BITU_XMPP_SM_FAILED);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 0);
+  assert (bitu_xmpp_sm_is_enabled (sm) == 0);
+  _server_forget ();
+
+  bitu_xmpp_sm_free (sm);
+  printf ("ok\n");
+}
+
+
+void
+test_full_queue (void)
+{
+  bitu_xmpp_sm_t *sm = bitu_xmpp_sm_new (2);
+  iks *msg;
+
+  printf ("Giving up the oldest stanzas: ");
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  msg = iks_make_msg (IKS_TYPE_CHAT, "admin@localhost", "hi");
+  assert (bitu_xmpp_sm_queue (sm, msg) == 0);
+  assert (bitu_xmpp_sm_queue (sm, msg) == 0);
+  assert (bitu_xmpp_sm_queue (sm, msg) == 1);
+  iks_delete (msg);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 2);
+
+  /* The one given up still counts */
+  _server_says (sm, _server_node ("a", "h", "2"));
+  assert (bitu_xmpp_sm_get_unacked (sm) == 1);
+  _server_says (sm, _server_node ("a", "h", "3"));
+  assert (bitu_xmpp_sm_get_unacked (sm) == 0);
+
+  bitu_xmpp_sm_free (sm);
+  printf ("ok\n");
+}
+
+
+void
+test_full_queue_and_resumption (void)
+{
+  bitu_xmpp_sm_t *sm = bitu_xmpp_sm_new (2);
+  iks *node, *msg;
+
+  printf ("Resuming after giving stanzas up: ");
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  node = _server_node ("enabled", "resume", "true");
+  iks_insert_attrib (node, "id", "session-3");
+  _server_says (sm, node);
+
+  /* `one' is given up while the stream is up, it was sent already */
+  _client_says (sm, "one");
+  _client_says (sm, "two");
+  msg = iks_make_msg (IKS_TYPE_CHAT, "admin@localhost", "three");
+  assert (bitu_xmpp_sm_queue (sm, msg) == 1);
+  _server_receive (msg, _received);
+  iks_delete (msg);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 2);
+  _server_forget ();
+
+  /* Without a stream, the new stanza is the one given up */
+  bitu_xmpp_sm_suspend (sm);
+  msg = iks_make_msg (IKS_TYPE_CHAT, "admin@localhost", "four");
+  assert (bitu_xmpp_sm_queue (sm, msg) == 1);
+  iks_delete (msg);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 2);
+
+  /* The server only got `one', the two others go again */
+  iks_delete (bitu_xmpp_sm_resume (sm));
+  node = _server_node ("resumed", "h", "1");
+  iks_insert_attrib (node, "previd", "session-3");
+  assert (_server_says (sm, node) == BITU_XMPP_SM_RESUMED);
+  assert (_nreceived == 2);
+  assert (strcmp (_received_body (0), "two") == 0);
+  assert (strcmp (_received_body (1), "three") == 0);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 2);
+  _server_forget ();
+  _server_says (sm, _server_node ("a", "h", "3"));
+  assert (bitu_xmpp_sm_get_unacked (sm) == 0);
+
+  /* A failed resumption may tell what got through before the drop */
+  _client_says (sm, "five");
+  _client_says (sm, "six");
+  _server_forget ();
+  bitu_xmpp_sm_suspend (sm);
+  iks_delete (bitu_xmpp_sm_resume (sm));
+  assert (_server_says (sm, _server_node ("failed", "h", "4"))
+          == BITU_XMPP_SM_FAILED);
+  assert (bitu_xmpp_sm_get_unacked (sm) == 1);
+  iks_delete (bitu_xmpp_sm_enable (sm));
+  assert (bitu_xmpp_sm_replay (sm, _server_receive, _received) == 1);
+  assert (strcmp (_received_body (0), "six") == 0);
+  _server_forget ();
+
+  bitu_xmpp_sm_free (sm);
+  printf ("ok\n");
+}
+
+
+int
+main ()
+{
+  test_negotiation ();
+  test_acks_and_resumption ();
+  test_failed_resumption ();
+  test_full_queue ();
+  test_full_queue_and_resumption ();
+  return 0;
+}
@@ -16,15 +16,152 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <regex.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <libircclient/libircclient.h>
 #include <bitu/errors.h>
 #include <bitu/transport.h>
+#include <bitu/util.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
 
 #define IRC_PORT 6667
+#define IRC_NICK "bitU"
+
+/* Flood control. Servers let a client send a few lines in a row and
+ * then about one line every two seconds, more than that and the client
+ * gets kicked out. Lines are sent from a token bucket with those
+ * numbers. */
+#define IRC_BURST 5
+#define IRC_LINE_INTERVAL 2000000 /* usec */
+#define IRC_QUEUE_MAX 1000
+
+/* A line has at most 512 bytes, CR-LF included. When relaying our
+ * message the server adds ":nick!user@host " in front of it, so some
+ * room is kept for that prefix too. */
+#define IRC_LINE_MAX 510
+#define IRC_PREFIX_RESERVE 80
+#define IRC_MERGE_SEPARATOR " | "
+
+/* Channels are joined and left through the same queue as messages, so
+ * they're paced too. Those lines have a comma separated list of
+ * channels in `to', no text, and `len' is the length of `to'. */
+typedef enum
+{
+  IRC_LINE_MSG,
+  IRC_LINE_JOIN,
+  IRC_LINE_PART
+} _irc_line_kind_t;
+
+typedef struct _irc_line
+{
+  _irc_line_kind_t kind;
+  char *to;
+  char *text;
+  size_t len;
+  struct _irc_line *next;
+} _irc_line_t;
+
+/* One connection to a server with a nick, shared by all the transports
+ * with the same server and nick in their uris. Each transport joins
+ * its own channels, messages sent to a channel go to the transport
+ * that joined it and private ones go to the first transport attached.
+ *
+ * The mutex protects everything below it. `runner' is the thread
+ * running the session's main loop, `welcomed' is set when the server
+ * accepts us and `dead' when the loop returns. The outgoing queue is
+ * shared by all the transports, so the flood budget is counted per
+ * connection like servers do, and is drained by the `sender' thread. */
+typedef struct
+{
+  char *key;
+  char *host;
+  int port;
+  char *nick;
+  size_t nick_len;
+  int refcount;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  irc_session_t *session;
+  pthread_t runner;
+  int welcomed;
+  int dead;
+  ta_list_t *members;
+
+  pthread_cond_t wakeup;
+  pthread_t sender;
+  int stop;
+  _irc_line_t *head;
+  _irc_line_t *tail;
+  int queued;
+  uint64_t credit;
+  uint64_t refilled;
+} _irc_network_t;
+
+/* Data saved in the transport. `attached' tells if the transport is in
+ * the network's member list, it's protected by the network's mutex. */
+typedef struct
+{
+  _irc_network_t *network;
+  bitu_transport_t *transport;
+  char **channels;
+  int nchannels;
+  int attached;
+} _bitu_irc_t;
+
+static pthread_mutex_t _irc_networks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hashtable_t *_irc_networks = NULL;
+
+
+static int
+_irc_has_channel (_bitu_irc_t *irc, const char *channel)
+{
+  int i;
+  for (i = 0; i < irc->nchannels; i++)
+    if (strcasecmp (irc->channels[i], channel) == 0)
+      return 1;
+  return 0;
+}
+
+
+/* Tells if a transport other than `irc' still wants the channel. Must
+ * be called with the lock held. */
+static int
+_irc_channel_shared (_irc_network_t *network, _bitu_irc_t *irc,
+                     const char *channel)
+{
+  ta_list_t *tmp;
+  for (tmp = network->members; tmp; tmp = tmp->next)
+    if (tmp->data != irc && _irc_has_channel (tmp->data, channel))
+      return 1;
+  return 0;
+}
+
+
+/* Finds the transport that receives messages sent to `target', which
+ * is either one of the joined channels or our nick. Must be called
+ * with the lock held. */
+static _bitu_irc_t *
+_irc_network_route (_irc_network_t *network, const char *target)
+{
+  ta_list_t *tmp;
+
+  if (strcasecmp (target, network->nick) == 0)
+    return network->members ? network->members->data : NULL;
+  for (tmp = network->members; tmp; tmp = tmp->next)
+    if (_irc_has_channel (tmp->data, target))
+      return tmp->data;
+  return NULL;
+}
 
 
 void _irc_event_notice (irc_session_t *session,
@@ -33,60 +170,318 @@ void _irc_event_notice (irc_session_t *session,
                         const char **params,
                         unsigned int count)
 {
-  regex_t re;
   char origin_nick[128];
-  char pattern[128];
-  const char *cmd;
+  const char *reply_to;
+  int private;
 
   bitu_command_t *command = NULL;
-  bitu_transport_t *transport = (bitu_transport_t *) irc_get_ctx (session);
-  const char *nick = ta_iri_get_user (bitu_transport_get_uri (transport));
-  const char *channel = ta_iri_get_fragment (bitu_transport_get_uri (transport));
+  bitu_transport_t *transport;
+  _irc_network_t *network = (_irc_network_t *) irc_get_ctx (session);
+  _bitu_irc_t *irc;
 
-  /* Is this message to me? */
-  snprintf (pattern, sizeof (pattern), "[[:<:]]%s[[:>:]]", nick);
-  if (regcomp (&re, pattern, REG_EXTENDED) != 0)
-    return;
-  if (regexec (&re, &params[1][0], 0, NULL, REG_ENHANCED | REG_NOSUB) != 0)
+  if (count < 2 || params[0] == NULL)
     return;
 
   /* Getting the origin nickname */
   if (origin)
     irc_target_get_nick (origin, origin_nick, sizeof (origin_nick));
   else
-    strncpy (origin_nick, channel, sizeof (origin_nick));
-
-  /* XXX: Debug trash */
-  {
-    unsigned int cnt;
-    char buf[512];
-    buf[0] = '\0';
-
-    for (cnt = 0; cnt < count; cnt++)
-      {
-        if (cnt)
-          strcat (buf, "|");
-        strcat (buf, params[cnt]);
-      }
-
-    fprintf (stderr,
-             "Event: %s, origin: %s, params: %d [%s]\n",
-             event, origin_nick, cnt, buf);
-  }
-
-  /* Sending the command to the queue */
-  cmd = params[1];
-  command = bitu_command_new (transport, cmd, params[0]);
+    snprintf (origin_nick, sizeof (origin_nick), "%s", params[0]);
+
+  pthread_mutex_lock (&network->mutex);
+  if ((irc = _irc_network_route (network, params[0])) == NULL)
+    {
+      pthread_mutex_unlock (&network->mutex);
+      return;
+    }
+  transport = irc->transport;
+
+  /* Is this message to me? Private messages always are, in channels
+   * we only answer when someone mentions our nick. */
+  private = strcasecmp (params[0], network->nick) == 0;
+  if (!private &&
+      !bitu_util_is_mention (params[1], network->nick, network->nick_len))
+    {
+      pthread_mutex_unlock (&network->mutex);
+      return;
+    }
+  reply_to = private ? origin_nick : params[0];
+
+  ta_log_debug (bitu_transport_get_logger (transport),
+                "Event: %s, origin: %s, target: %s, message: %s",
+                event, origin_nick, params[0], params[1]);
+
+  /* Sending the command to the queue. The transport can't go away
+   * while we hold the lock, it has to be detached first. */
+  command = bitu_command_new (transport, params[1], reply_to);
   if (bitu_transport_queue_command (transport, command) == TA_ERROR)
     {
       bitu_command_free (command);
+      pthread_mutex_unlock (&network->mutex);
       bitu_transport_send (transport,
                            "Sorry sir, I couldn't queue your command",
-                           params[0]);
+                           reply_to);
+      return;
+    }
+  pthread_mutex_unlock (&network->mutex);
+}
+
+
+/* Flood control */
+
+/* Must be called with the lock held */
+static void
+_irc_refill (_irc_network_t *network)
+{
+  uint64_t now = bitu_util_monotonic_time ();
+  network->credit += now - network->refilled;
+  if (network->credit > IRC_BURST * (uint64_t) IRC_LINE_INTERVAL)
+    network->credit = IRC_BURST * (uint64_t) IRC_LINE_INTERVAL;
+  network->refilled = now;
+}
+
+
+/* Sleeps for `delay' usec, until someone signals the condition or sets
+ * `stop'. Must be called with the lock held. */
+static void
+_irc_wait (_irc_network_t *network, uint64_t delay)
+{
+  struct timespec deadline;
+
+  bitu_util_deadline (&deadline, delay);
+  if (!network->stop)
+    pthread_cond_timedwait (&network->wakeup, &network->mutex, &deadline);
+}
+
+
+static void
+_irc_line_free (_irc_line_t *line)
+{
+  free (line->to);
+  free (line->text);
+  free (line);
+}
+
+
+/* Sends queued lines as fast as the bucket allows. Lines wait in the
+ * queue while the session is not connected. */
+static void *
+_irc_sender (_irc_network_t *network)
+{
+  _irc_line_t *line;
+
+  pthread_mutex_lock (&network->mutex);
+  while (!network->stop)
+    {
+      if (network->head == NULL)
+        {
+          pthread_cond_wait (&network->wakeup, &network->mutex);
+          continue;
+        }
+      if (!network->welcomed || network->dead)
+        {
+          _irc_wait (network, IRC_LINE_INTERVAL);
+          continue;
+        }
+      _irc_refill (network);
+      if (network->credit < IRC_LINE_INTERVAL)
+        {
+          _irc_wait (network, IRC_LINE_INTERVAL - network->credit);
+          continue;
+        }
+
+      line = network->head;
+      network->head = line->next;
+      if (network->head == NULL)
+        network->tail = NULL;
+      network->queued--;
+      network->credit -= IRC_LINE_INTERVAL;
+
+      /* libircclient only appends the line to the session's output
+       * buffer, it doesn't block here */
+      switch (line->kind)
+        {
+        case IRC_LINE_JOIN:
+          irc_cmd_join (network->session, line->to, 0);
+          break;
+        case IRC_LINE_PART:
+          irc_cmd_part (network->session, line->to);
+          break;
+        default:
+          irc_cmd_msg (network->session, line->to, line->text);
+          break;
+        }
+      _irc_line_free (line);
+    }
+  pthread_mutex_unlock (&network->mutex);
+  return NULL;
+}
+
+
+/* How many bytes of text fit in a line sent to `to' */
+static size_t
+_irc_line_max (_irc_network_t *network, const char *to)
+{
+  size_t overhead = strlen ("PRIVMSG  :") + strlen (to)
+    + network->nick_len + IRC_PREFIX_RESERVE;
+  return overhead < IRC_LINE_MAX / 2
+    ? IRC_LINE_MAX - overhead : IRC_LINE_MAX / 2;
+}
+
+
+/* Finds where to cut `len' bytes of `text' so the first piece fits in
+ * `max' bytes. Prefers cutting at a space and never cuts an UTF-8
+ * sequence in half. */
+static size_t
+_irc_line_cut (const char *text, size_t len, size_t max)
+{
+  size_t cut;
+
+  if (len <= max)
+    return len;
+  for (cut = max; cut > max / 2; cut--)
+    if (text[cut] == ' ')
+      return cut;
+  for (cut = max; cut > 0 && ((unsigned char) text[cut] & 0xC0) == 0x80; cut--)
+    ;
+  return cut ? cut : max;
+}
+
+
+/* Queues one line, merging it to the last queued one when both go to
+ * the same target, fit in one line and would have to wait for the
+ * bucket anyway. Must be called with the lock held. */
+static void
+_irc_queue_line (_irc_network_t *network, const char *to, const char *text,
+                 size_t len, size_t max)
+{
+  _irc_line_t *line, *tail = network->tail;
+  size_t sep = strlen (IRC_MERGE_SEPARATOR);
+
+  _irc_refill (network);
+  if (tail && tail->kind == IRC_LINE_MSG && strcmp (tail->to, to) == 0 &&
+      tail->len + sep + len <= max &&
+      (uint64_t) network->queued * IRC_LINE_INTERVAL >= network->credit)
+    {
+      tail->text = realloc (tail->text, tail->len + sep + len + 1);
+      memcpy (tail->text + tail->len, IRC_MERGE_SEPARATOR, sep);
+      memcpy (tail->text + tail->len + sep, text, len);
+      tail->len += sep + len;
+      tail->text[tail->len] = '\0';
+      return;
+    }
+
+  line = malloc (sizeof (_irc_line_t));
+  line->kind = IRC_LINE_MSG;
+  line->to = strdup (to);
+  line->text = strndup (text, len);
+  line->len = len;
+  line->next = NULL;
+  if (tail)
+    tail->next = line;
+  else
+    network->head = line;
+  network->tail = line;
+  network->queued++;
+}
+
+
+/* Queues JOIN or PART lines for `channels', as many in each line as
+ * fit. They go before everything else when `first' is set. Must be
+ * called with the lock held. */
+static void
+_irc_queue_channels (_irc_network_t *network, _irc_line_kind_t kind,
+                     char **channels, int nchannels, int first)
+{
+  _irc_line_t *line, *lines = NULL, *last = NULL;
+  size_t len, max = IRC_LINE_MAX - strlen ("JOIN ");
+  int i;
+
+  for (i = 0; i < nchannels; i++)
+    {
+      len = strlen (channels[i]);
+      if (last && last->len + 1 + len <= max)
+        {
+          last->to = realloc (last->to, last->len + 1 + len + 1);
+          last->to[last->len++] = ',';
+          memcpy (last->to + last->len, channels[i], len + 1);
+          last->len += len;
+          continue;
+        }
+      line = malloc (sizeof (_irc_line_t));
+      line->kind = kind;
+      line->to = strdup (channels[i]);
+      line->text = NULL;
+      line->len = len;
+      line->next = NULL;
+      if (last)
+        last->next = line;
+      else
+        lines = line;
+      last = line;
+      network->queued++;
     }
+  if (lines == NULL)
+    return;
+
+  if (first)
+    {
+      last->next = network->head;
+      network->head = lines;
+      if (network->tail == NULL)
+        network->tail = last;
+    }
+  else
+    {
+      if (network->tail)
+        network->tail->next = lines;
+      else
+        network->head = lines;
+      network->tail = last;
+    }
+  pthread_cond_signal (&network->wakeup);
 }
 
 
+/* JOIN and PART lines left from a session that dropped mean nothing to
+ * the new one. Must be called with the lock held. */
+static void
+_irc_forget_channels (_irc_network_t *network)
+{
+  _irc_line_t **line = &network->head, *tmp;
+
+  network->tail = NULL;
+  while (*line)
+    {
+      if ((*line)->kind == IRC_LINE_MSG)
+        {
+          network->tail = *line;
+          line = &(*line)->next;
+          continue;
+        }
+      tmp = *line;
+      *line = tmp->next;
+      network->queued--;
+      _irc_line_free (tmp);
+    }
+}
+
+
+/* Must be called with the lock held */
+static void
+_irc_join (_irc_network_t *network, _bitu_irc_t *irc)
+{
+  int i;
+  for (i = 0; i < irc->nchannels; i++)
+    ta_log_info (bitu_transport_get_logger (irc->transport), "Joining %s",
+                 irc->channels[i]);
+  _irc_queue_channels (network, IRC_LINE_JOIN, irc->channels,
+                       irc->nchannels, 0);
+}
+
+
+/* Joins the channels of all the transports attached, before the lines
+ * that were waiting for the connection */
 void
 _irc_event_connect (irc_session_t *session,
                     const char *TA_UNUSED(event),
@@ -94,15 +489,51 @@ _irc_event_connect (irc_session_t *session,
                     const char **TA_UNUSED(params),
                     unsigned int TA_UNUSED(count))
 {
-  bitu_transport_t *transport = (bitu_transport_t *) irc_get_ctx (session);
-  const char *channel = ta_iri_get_fragment (bitu_transport_get_uri (transport));
-  printf ("Channel: %s\n", channel);
-  irc_cmd_join (session, channel, 0);
+  _irc_network_t *network = (_irc_network_t *) irc_get_ctx (session);
+  _bitu_irc_t *irc;
+  ta_list_t *tmp;
+  char **channels = NULL;
+  int i, j, nchannels = 0;
+
+  pthread_mutex_lock (&network->mutex);
+  if (network->session == session)
+    network->welcomed = 1;
+
+  _irc_forget_channels (network);
+  for (tmp = network->members; tmp; tmp = tmp->next)
+    {
+      irc = tmp->data;
+      bitu_transport_notify_ready (irc->transport);
+      channels = realloc (channels,
+                          (nchannels + irc->nchannels) * sizeof (char *));
+      for (i = 0; i < irc->nchannels; i++)
+        {
+          for (j = 0; j < nchannels; j++)
+            if (strcasecmp (channels[j], irc->channels[i]) == 0)
+              break;
+          if (j < nchannels)
+            continue;
+          ta_log_info (bitu_transport_get_logger (irc->transport),
+                       "Joining %s", irc->channels[i]);
+          channels[nchannels++] = irc->channels[i];
+        }
+    }
+  _irc_queue_channels (network, IRC_LINE_JOIN, channels, nchannels, 1);
+  free (channels);
+
+  /* A new connection starts with a full bucket, lines kept while we
+   * were away can go now. */
+  network->credit = IRC_BURST * (uint64_t) IRC_LINE_INTERVAL;
+  network->refilled = bitu_util_monotonic_time ();
+  pthread_cond_signal (&network->wakeup);
+  pthread_mutex_unlock (&network->mutex);
 }
 
 
+/* Networks */
+
 static irc_session_t *
-_irc_get_session (bitu_transport_t *transport)
+_irc_get_session (_irc_network_t *network)
 {
   irc_callbacks_t callbacks;
   irc_session_t *session;
@@ -121,84 +552,535 @@ _irc_get_session (bitu_transport_t *transport)
       return NULL;
     }
 
-  irc_set_ctx (session, (void *) transport);
+  irc_set_ctx (session, (void *) network);
   return session;
 }
 
 
+/* Runs the session's main loop and tells the attached transports when
+ * it returns */
+static void *
+_irc_network_run (irc_session_t *session)
+{
+  _irc_network_t *network = (_irc_network_t *) irc_get_ctx (session);
+
+  irc_run (session);
+
+  pthread_mutex_lock (&network->mutex);
+  if (network->session == session)
+    network->dead = 1;
+  pthread_cond_broadcast (&network->changed);
+  pthread_mutex_unlock (&network->mutex);
+  return NULL;
+}
+
+
+/* Drops the current session. Must be called with the lock held, but
+ * releases it while waiting for the main loop to return. */
+static void
+_irc_network_close (_irc_network_t *network)
+{
+  irc_session_t *session = network->session;
+  pthread_t runner = network->runner;
+
+  if (session == NULL)
+    return;
+  network->session = NULL;
+  network->welcomed = 0;
+  network->dead = 0;
+  pthread_cond_broadcast (&network->changed);
+  pthread_mutex_unlock (&network->mutex);
+
+  irc_disconnect (session);
+  pthread_join (runner, NULL);
+  irc_destroy_session (session);
+
+  pthread_mutex_lock (&network->mutex);
+}
+
+
+static _irc_network_t *
+_irc_network_new (const char *key, const char *host, int port,
+                  const char *nick)
+{
+  _irc_network_t *network;
+
+  if ((network = malloc (sizeof (_irc_network_t))) == NULL)
+    return NULL;
+  network->key = strdup (key);
+  network->host = strdup (host ? host : "");
+  network->port = port;
+  network->nick = strdup (nick);
+  network->nick_len = strlen (nick);
+  network->refcount = 0;
+
+  pthread_mutex_init (&network->mutex, NULL);
+  pthread_cond_init (&network->changed, NULL);
+  network->session = NULL;
+  network->welcomed = 0;
+  network->dead = 0;
+  network->members = NULL;
+
+  bitu_util_cond_init (&network->wakeup);
+  network->stop = 0;
+  network->head = network->tail = NULL;
+  network->queued = 0;
+  network->credit = IRC_BURST * (uint64_t) IRC_LINE_INTERVAL;
+  network->refilled = bitu_util_monotonic_time ();
+  if (bitu_util_create_thread (&network->sender, (bitu_util_callback_t)
+                               _irc_sender, network) != 0)
+    {
+      pthread_cond_destroy (&network->wakeup);
+      pthread_cond_destroy (&network->changed);
+      pthread_mutex_destroy (&network->mutex);
+      free (network->key);
+      free (network->host);
+      free (network->nick);
+      free (network);
+      return NULL;
+    }
+  return network;
+}
+
+
+static void
+_irc_network_free (_irc_network_t *network)
+{
+  _irc_line_t *line;
+
+  pthread_mutex_lock (&network->mutex);
+  network->stop = 1;
+  pthread_cond_signal (&network->wakeup);
+  pthread_mutex_unlock (&network->mutex);
+  pthread_join (network->sender, NULL);
+
+  pthread_mutex_lock (&network->mutex);
+  _irc_network_close (network);
+  pthread_mutex_unlock (&network->mutex);
+
+  while ((line = network->head) != NULL)
+    {
+      network->head = line->next;
+      _irc_line_free (line);
+    }
+  ta_list_free (network->members);
+  pthread_cond_destroy (&network->wakeup);
+  pthread_cond_destroy (&network->changed);
+  pthread_mutex_destroy (&network->mutex);
+  free (network->key);
+  free (network->host);
+  free (network->nick);
+  free (network);
+}
+
+
+/* Returns the network for the server and nick in the uri, creating it
+ * when no other transport uses it yet */
+static _irc_network_t *
+_irc_network_get (ta_iri_t *uri)
+{
+  _irc_network_t *network;
+  const char *host, *nick;
+  char key[512];
+  int port;
+
+  host = ta_iri_get_host (uri);
+  nick = ta_iri_get_user (uri);
+  nick = nick ? nick : IRC_NICK;
+  port = ta_iri_get_port (uri);
+  port = port ? port : IRC_PORT;
+  snprintf (key, sizeof (key), "%s@%s:%d", nick, host ? host : "", port);
+
+  pthread_mutex_lock (&_irc_networks_mutex);
+  if (_irc_networks == NULL)
+    _irc_networks = hashtable_create (hash_string, string_equal, free, NULL);
+  if ((network = hashtable_get (_irc_networks, key)) == NULL)
+    {
+      if ((network = _irc_network_new (key, host, port, nick)) == NULL ||
+          hashtable_set (_irc_networks, strdup (key), network) == -1)
+        {
+          if (network)
+            _irc_network_free (network);
+          pthread_mutex_unlock (&_irc_networks_mutex);
+          return NULL;
+        }
+    }
+  network->refcount++;
+  pthread_mutex_unlock (&_irc_networks_mutex);
+  return network;
+}
+
+
+static void
+_irc_network_release (_irc_network_t *network)
+{
+  pthread_mutex_lock (&_irc_networks_mutex);
+  if (--network->refcount > 0)
+    {
+      pthread_mutex_unlock (&_irc_networks_mutex);
+      return;
+    }
+  hashtable_del (_irc_networks, network->key);
+  pthread_mutex_unlock (&_irc_networks_mutex);
+  _irc_network_free (network);
+}
+
+
+/* Transport callbacks */
+
+/* Channels come in the uri fragment, separated by commas, like
+ * irc://bitU@irc.freenode.net##bitu,#bitu-dev */
+static _bitu_irc_t *
+_irc_get_data (bitu_transport_t *transport)
+{
+  _bitu_irc_t *irc;
+  const char *fragment, *p, *end;
+
+  if ((irc = bitu_transport_get_data (transport)) != NULL)
+    return irc;
+
+  if ((irc = malloc (sizeof (_bitu_irc_t))) == NULL)
+    return NULL;
+  irc->network = _irc_network_get (bitu_transport_get_uri (transport));
+  if (irc->network == NULL)
+    {
+      free (irc);
+      return NULL;
+    }
+  irc->transport = transport;
+  irc->channels = NULL;
+  irc->nchannels = 0;
+  irc->attached = 0;
+
+  fragment = ta_iri_get_fragment (bitu_transport_get_uri (transport));
+  for (p = fragment; p && *p; p = *end ? end + 1 : end)
+    {
+      if ((end = strchr (p, ',')) == NULL)
+        end = p + strlen (p);
+      if (end == p)
+        continue;
+      irc->channels = realloc (irc->channels,
+                               (irc->nchannels + 1) * sizeof (char *));
+      irc->channels[irc->nchannels++] = strndup (p, end - p);
+    }
+
+  bitu_transport_set_data (transport, irc);
+  return irc;
+}
+
+
 static int
 _irc_connect (bitu_transport_t *transport)
 {
-  int port;
-  char *host, *nick;
-  ta_iri_t *uri;
+  _bitu_irc_t *irc;
+  _irc_network_t *network;
   irc_session_t *session;
+  int status;
 
-  if ((session = bitu_transport_get_data (transport)) == NULL)
-    if ((session = _irc_get_session (transport)) == NULL)
-      return BITU_CONN_STATUS_CONNECTION_FAILED;
+  if ((irc = _irc_get_data (transport)) == NULL)
+    return BITU_CONN_STATUS_CONNECTION_FAILED;
+  network = irc->network;
 
-  uri = bitu_transport_get_uri (transport);
+  pthread_mutex_lock (&network->mutex);
 
-  /* Getting important info, like the host, user and port */
-  host = (char *) ta_iri_get_host (uri);
-  nick = (char *) ta_iri_get_user (uri);
-  nick = nick ? nick : "bitU";
-  port = ta_iri_get_port (uri);
-  port = port ? port : IRC_PORT;
+  /* What's left of a session that dropped while other transports
+   * were still attached to it */
+  if (network->session && network->dead)
+    _irc_network_close (network);
 
-  /* Finally, connecting to the IRC server */
-  if (irc_connect (session, host, port, NULL, nick, 0, 0) != 0)
+  if (!irc->attached)
+    {
+      network->members = ta_list_append (network->members, irc);
+      irc->attached = 1;
+    }
+
+  /* Another transport already connected to this network, we just join
+   * our channels. If it's still connecting, they're joined with the
+   * others when the server accepts the connection. */
+  if (network->session != NULL)
     {
-      ta_error_set (BITU_ERROR_TRANSPORT_IRC_CONN, irc_strerror (irc_errno (session)));
+      if (network->welcomed)
+        _irc_join (network, irc);
+      pthread_mutex_unlock (&network->mutex);
+      return BITU_CONN_STATUS_OK;
+    }
+
+  if ((session = _irc_get_session (network)) == NULL)
+    {
+      pthread_mutex_unlock (&network->mutex);
       return BITU_CONN_STATUS_CONNECTION_FAILED;
     }
 
-  /* Saving the session to use it in the is_running(), disconnect() and
-   * run() methods */
-  bitu_transport_set_data (transport, session);
+  /* Finally, connecting to the IRC server */
+  if (irc_connect (session, network->host, network->port, NULL,
+                   network->nick, 0, 0) != 0)
+    {
+      ta_error_set (BITU_ERROR_TRANSPORT_IRC_CONN,
+                    irc_strerror (irc_errno (session)));
+      irc_destroy_session (session);
+      pthread_mutex_unlock (&network->mutex);
+      return BITU_CONN_STATUS_CONNECTION_FAILED;
+    }
 
+  if ((status = bitu_util_create_thread (&network->runner,
+                                         (bitu_util_callback_t)
+                                         _irc_network_run, session)) != 0)
+    {
+      ta_error_set (BITU_ERROR_TRANSPORT_IRC_CONN, strerror (status));
+      irc_destroy_session (session);
+      pthread_mutex_unlock (&network->mutex);
+      return BITU_CONN_STATUS_CONNECTION_FAILED;
+    }
+  network->session = session;
+  network->welcomed = 0;
+  network->dead = 0;
+  pthread_mutex_unlock (&network->mutex);
   return BITU_CONN_STATUS_OK;
 }
 
+/* Leaves the transport's channels and drops the session when no other
+ * transport uses it. Queued lines are kept for the next session. */
 static int
 _irc_disconnect (bitu_transport_t *transport)
 {
-  irc_session_t *session = bitu_transport_get_data (transport);
-  irc_disconnect (session);
-  irc_destroy_session (session);
-  bitu_transport_set_data (transport, NULL);
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  _irc_network_t *network;
+  char **channels;
+  int i, nchannels = 0;
+
+  if (irc == NULL)
+    return BITU_CONN_STATUS_ALREADY_SHUTDOWN;
+  network = irc->network;
+
+  pthread_mutex_lock (&network->mutex);
+  if (!irc->attached)
+    {
+      pthread_mutex_unlock (&network->mutex);
+      return BITU_CONN_STATUS_ALREADY_SHUTDOWN;
+    }
+  network->members = ta_list_remove (network->members, irc);
+  irc->attached = 0;
+  pthread_cond_broadcast (&network->changed);
+
+  if (network->members == NULL)
+    _irc_network_close (network);
+  else if (network->welcomed && !network->dead)
+    {
+      /* Channels also joined by other transports are kept */
+      if (irc->nchannels > 0 &&
+          (channels = malloc (irc->nchannels * sizeof (char *))) != NULL)
+        {
+          for (i = 0; i < irc->nchannels; i++)
+            if (!_irc_channel_shared (network, irc, irc->channels[i]))
+              channels[nchannels++] = irc->channels[i];
+          _irc_queue_channels (network, IRC_LINE_PART, channels, nchannels, 0);
+          free (channels);
+        }
+    }
+  pthread_mutex_unlock (&network->mutex);
   return BITU_CONN_STATUS_OK;
 }
 
 static int
 _irc_is_running (bitu_transport_t *transport)
 {
-  irc_session_t *session = bitu_transport_get_data (transport);
-  if (session == NULL)
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  int running;
+
+  if (irc == NULL)
     return TA_ERROR;
-  return irc_is_connected (session) ? TA_OK : TA_ERROR;
+  pthread_mutex_lock (&irc->network->mutex);
+  running = irc->attached && irc->network->welcomed && !irc->network->dead;
+  pthread_mutex_unlock (&irc->network->mutex);
+  return running ? TA_OK : TA_ERROR;
 }
 
+/* The session's main loop runs in its own thread, shared by all the
+ * transports attached to it. This one only waits until the session
+ * drops or the transport is detached from it. */
 static int
 _irc_run (bitu_transport_t *transport)
 {
-  if (irc_run (bitu_transport_get_data (transport)) != 0)
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  _irc_network_t *network = irc->network;
+  int dropped;
+
+  pthread_mutex_lock (&network->mutex);
+  while (irc->attached && network->session && !network->dead)
+    pthread_cond_wait (&network->changed, &network->mutex);
+  dropped = irc->attached;
+  pthread_mutex_unlock (&network->mutex);
+
+  if (dropped)
     {
       ta_error_set (BITU_ERROR_TRANSPORT_IRC_RUN,
-                    irc_strerror (irc_errno (bitu_transport_get_data (transport))));
+                    "The connection to the irc server was lost");
       return TA_ERROR;
     }
   return TA_OK;
 }
 
 
+/* Splits `msg' in lines that fit in `max' bytes, one or more for each
+ * of its own lines, and queues them when `queue' is set. Returns how
+ * many lines it takes. Must be called with the lock held. */
+static int
+_irc_split (_irc_network_t *network, const char *to, const char *msg,
+            size_t max, int queue)
+{
+  const char *line, *end;
+  size_t len, cut;
+  int nlines = 0;
+
+  for (line = msg; *line; line = *end ? end + 1 : end)
+    {
+      if ((end = strchr (line, '\n')) == NULL)
+        end = line + strlen (line);
+      len = end - line;
+      if (len && line[len - 1] == '\r')
+        len--;
+      while (len > 0)
+        {
+          cut = _irc_line_cut (line, len, max);
+          if (queue)
+            _irc_queue_line (network, to, line, cut, max);
+          nlines++;
+          for (; cut < len && line[cut] == ' '; cut++)
+            ;
+          line += cut;
+          len -= cut;
+        }
+    }
+  return nlines;
+}
+
+
+/* Queues the message for the sender thread, one line for each line of
+ * the message, split where it's longer than what IRC accepts. The
+ * whole message is refused when its lines don't fit in the queue. */
 static int
 _irc_send (bitu_transport_t *transport, const char *msg, const char *to)
 {
-  irc_session_t *session = bitu_transport_get_data (transport);
-  printf ("msg: %s: %s\n", to, msg);
-  return irc_cmd_msg (session, to, msg) == 0 ? TA_OK : TA_ERROR;
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  _irc_network_t *network;
+  size_t max;
+
+  if (irc == NULL)
+    return TA_ERROR;
+  network = irc->network;
+
+  pthread_mutex_lock (&network->mutex);
+  if (!irc->attached || network->session == NULL)
+    {
+      pthread_mutex_unlock (&network->mutex);
+      return TA_ERROR;
+    }
+  max = _irc_line_max (network, to);
+  if (network->queued + _irc_split (network, to, msg, max, 0) > IRC_QUEUE_MAX)
+    {
+      pthread_mutex_unlock (&network->mutex);
+      ta_log_warn (bitu_transport_get_logger (transport),
+                   "Too many lines waiting to be sent, dropping message to %s",
+                   to);
+      return TA_ERROR;
+    }
+
+  ta_log_debug (bitu_transport_get_logger (transport),
+                "Sending to %s: %s", to, msg);
+  _irc_split (network, to, msg, max, 1);
+  pthread_cond_signal (&network->wakeup);
+  pthread_mutex_unlock (&network->mutex);
+  return TA_OK;
+}
+
+
+/* Lines waiting in the connection's queue, shared with the other
+ * transports attached to it */
+static int
+_irc_queued (bitu_transport_t *transport)
+{
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  int queued;
+
+  if (irc == NULL)
+    return 0;
+  pthread_mutex_lock (&irc->network->mutex);
+  queued = irc->network->queued;
+  pthread_mutex_unlock (&irc->network->mutex);
+  return queued;
+}
+
+
+static int
+_irc_join_room (bitu_transport_t *transport, const char *channel)
+{
+  _bitu_irc_t *irc = _irc_get_data (transport);
+  _irc_network_t *network;
+
+  if (irc == NULL)
+    return TA_ERROR;
+  network = irc->network;
+
+  pthread_mutex_lock (&network->mutex);
+  if (!_irc_has_channel (irc, channel))
+    {
+      irc->channels = realloc (irc->channels,
+                               (irc->nchannels + 1) * sizeof (char *));
+      irc->channels[irc->nchannels++] = strdup (channel);
+      if (irc->attached && network->welcomed && !network->dead)
+        _irc_queue_channels (network, IRC_LINE_JOIN,
+                             &irc->channels[irc->nchannels - 1], 1, 0);
+    }
+  pthread_mutex_unlock (&network->mutex);
+  return TA_OK;
+}
+
+
+static int
+_irc_leave_room (bitu_transport_t *transport, const char *channel)
+{
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  _irc_network_t *network;
+  int i;
+
+  if (irc == NULL)
+    return TA_ERROR;
+  network = irc->network;
+
+  pthread_mutex_lock (&network->mutex);
+  for (i = 0; i < irc->nchannels; i++)
+    if (strcasecmp (irc->channels[i], channel) == 0)
+      break;
+  if (i == irc->nchannels)
+    {
+      pthread_mutex_unlock (&network->mutex);
+      return TA_ERROR;
+    }
+  if (irc->attached && network->welcomed && !network->dead &&
+      !_irc_channel_shared (network, irc, channel))
+    _irc_queue_channels (network, IRC_LINE_PART, &irc->channels[i], 1, 0);
+  free (irc->channels[i]);
+  irc->channels[i] = irc->channels[--irc->nchannels];
+  pthread_mutex_unlock (&network->mutex);
+  return TA_OK;
+}
+
+
+static void
+_irc_free (bitu_transport_t *transport)
+{
+  _bitu_irc_t *irc = bitu_transport_get_data (transport);
+  int i;
+
+  if (irc == NULL)
+    return;
+  _irc_disconnect (transport);
+  _irc_network_release (irc->network);
+  for (i = 0; i < irc->nchannels; i++)
+    free (irc->channels[i]);
+  free (irc->channels);
+  free (irc);
+  bitu_transport_set_data (transport, NULL);
 }
 
 
@@ -210,5 +1092,9 @@ _bitu_irc_transport (bitu_transport_t *transport)
   bitu_transport_set_callback_is_running (transport, _irc_is_running);
   bitu_transport_set_callback_run (transport, _irc_run);
   bitu_transport_set_callback_send (transport, _irc_send);
+  bitu_transport_set_callback_free (transport, _irc_free);
+  bitu_transport_set_callback_queued (transport, _irc_queued);
+  bitu_transport_set_callback_join (transport, _irc_join_room);
+  bitu_transport_set_callback_leave (transport, _irc_leave_room);
   return TA_OK;
 }
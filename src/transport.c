@@ -16,10 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <taningia/taningia.h>
 #include <bitu/util.h>
@@ -28,10 +30,35 @@
 
 #include "hashtable.h"
 #include "hashtable-utils.h"
+#include "hashtable-concurrent.h"
+#include "intern.h"
 
 
 #define COMMAND_QUEUE_SIZE 10
 
+/* Reconnecting waits RECONNECT_BASE after the first failure and twice
+ * as long after each failure that follows, up to RECONNECT_MAX. Each
+ * wait is randomized between half and all of that, so transports that
+ * dropped together don't come back together. Times in usec. */
+#define RECONNECT_BASE 1000000ULL
+#define RECONNECT_MAX (300 * 1000000ULL)
+
+/* After this many failures in a row the circuit opens: the transport
+ * is marked as broken and tries again only once in a while */
+#define RECONNECT_MAX_FAILURES 10
+#define RECONNECT_COOLDOWN (900 * 1000000ULL)
+
+/* A session that lasts this long resets the failure count */
+#define RECONNECT_STABLE (60 * 1000000ULL)
+
+/* Messages kept while a transport reconnects. The oldest ones are
+ * dropped when there's no more room. */
+#define OUTBOX_SIZE 100
+
+/* How long a reconnected transport has to become ready to receive the
+ * messages kept for it */
+#define OUTBOX_WAIT (30 * 1000000ULL)
+
 
 struct bitu_queue
 {
@@ -41,12 +68,14 @@ struct bitu_queue
   pthread_mutex_t *mutex;
   pthread_cond_t *not_full;
   pthread_cond_t *not_empty;
+  bitu_queue_callback_admit_t admit;
+  void *admit_data;
 };
 
 
 struct bitu_conn_manager
 {
-  hashtable_t *transports;
+  chashtable_t *transports;
   bitu_queue_t *commands;
 };
 
@@ -57,12 +86,48 @@ typedef struct {
 } _bitu_consumer_params_t;
 
 
+typedef struct
+{
+  char *msg;
+  char *to;
+} _bitu_outbox_msg_t;
+
+
 struct bitu_transport
 {
+  int refcount;
   ta_log_t *logger;
   bitu_queue_t *commands;
   ta_iri_t *uri;
   void *data;
+
+  /* Supervision. The mutex protects everything below it. While
+   * `supervised' is set, a thread runs the transport and brings it
+   * back when the session drops, until `stop' is set. `down' is set
+   * when a send fails because the session is gone, before the
+   * supervisor notices it. `ready' counts the times the transport said
+   * it became ready to send. */
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  bitu_transport_state_t state;
+  int supervised;
+  int stop;
+  int down;
+  int flushing;
+  unsigned int ready;
+  unsigned int seed;
+  ta_list_t *outbox;
+  int outbox_len;
+  bitu_show_t show;
+  char *status;
+
+  /* Other transports whose connections send for this one, see the
+   * pools section. Protected by `_bitu_pools_mutex', not by the
+   * mutex above. */
+  bitu_transport_t **pool;
+  int pool_size;
+  int pooled;
+
   int (*connect) (bitu_transport_t *transport);
   int (*disconnect) (bitu_transport_t *transport);
   int (*is_running) (bitu_transport_t *transport);
@@ -70,9 +135,20 @@ struct bitu_transport
   int (*send) (bitu_transport_t *transport,
                const char *msg,
                const char *to);
+  void (*free) (bitu_transport_t *transport);
+  int (*queued) (bitu_transport_t *transport);
+  int (*join) (bitu_transport_t *transport, const char *room);
+  int (*leave) (bitu_transport_t *transport, const char *room);
+  int (*set_status) (bitu_transport_t *transport, bitu_show_t show,
+                     const char *status);
 };
 
 
+/* Guards the pools of all transports. Pools change rarely and are
+ * only read to pick a connection, one lock is enough. */
+static pthread_mutex_t _bitu_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 struct bitu_command
 {
   bitu_transport_t *transport;
@@ -81,13 +157,41 @@ struct bitu_command
   char *name;
   char **params;
   int nparams;
+  char *key;
 };
 
 
+static void
+_bitu_outbox_free (ta_list_t *outbox)
+{
+  ta_list_t *tmp;
+  _bitu_outbox_msg_t *msg;
+  for (tmp = outbox; tmp; tmp = tmp->next)
+    {
+      msg = tmp->data;
+      free (msg->msg);
+      free (msg->to);
+      free (msg);
+    }
+  ta_list_free (outbox);
+}
+
+
 static void
 _bitu_transport_free (bitu_transport_t *transport)
 {
+  int i;
+
+  if (transport->free)
+    transport->free (transport);
+  for (i = 0; i < transport->pool_size; i++)
+    bitu_transport_unref (transport->pool[i]);
   ta_object_unref (transport->uri);
+  _bitu_outbox_free (transport->outbox);
+  free (transport->status);
+  free (transport->pool);
+  pthread_cond_destroy (&transport->wakeup);
+  pthread_mutex_destroy (&transport->mutex);
   free (transport);
 }
 
@@ -98,10 +202,10 @@ bitu_conn_manager_new (void)
   bitu_conn_manager_t *manager = malloc (sizeof (bitu_conn_manager_t));
   manager->commands = bitu_queue_new ();
   manager->transports =
-    hashtable_create (hash_string,
-                      string_equal,
-                      (free_fn) free,
-                      (free_fn) _bitu_transport_free);
+    chashtable_create (hash_string,
+                       string_equal,
+                       (free_fn) bitu_intern_release,
+                       (free_fn) bitu_transport_unref);
   return manager;
 }
 
@@ -110,9 +214,11 @@ bitu_transport_t *
 bitu_conn_manager_add (bitu_conn_manager_t *manager, const char *uri)
 {
   bitu_transport_t *transport;
+  const char *key;
+  int status;
 
   /* We cannot override the current */
-  if ((transport = hashtable_get (manager->transports, uri)) != NULL)
+  if ((transport = bitu_conn_manager_get_transport (manager, uri)) != NULL)
     return transport;
 
   if ((transport = bitu_transport_new (uri)) == NULL)
@@ -121,26 +227,163 @@ bitu_conn_manager_add (bitu_conn_manager_t *manager, const char *uri)
   /* All transports write to the same command queue */
   transport->commands = manager->commands;
 
-  /* Saving the transport to the manager */
-  hashtable_set (manager->transports, strdup (uri), transport);
+  /* Saving the transport to the manager, which holds a reference of
+   * its own. Someone else might have added the same uri in the mean
+   * time, theirs wins. */
+  if ((key = bitu_intern (uri)) == NULL)
+    {
+      bitu_transport_unref (transport);
+      return NULL;
+    }
+  bitu_transport_ref (transport);
+  status = chashtable_add_hashed (manager->transports, (void *) key,
+                                  bitu_intern_hash (key), transport);
+  if (status != 0)
+    {
+      bitu_intern_release (key);
+      bitu_transport_unref (transport);
+      bitu_transport_unref (transport);
+      return status == 1 ? bitu_conn_manager_get_transport (manager, uri) : NULL;
+    }
   return transport;
 }
 
 
+/* -- Pools --
+ *
+ * A transport may own a pool of other transports, usually more
+ * accounts on the same server. Each of them is a transport of its own
+ * in the manager, connected, supervised and answering its own
+ * commands. Messages that aren't answers, like notifications, can be
+ * sent through any connection of the pool, see
+ * bitu_transport_pool_pick(). */
+
+
+/* Makes a transport about to be removed leave the pool it belongs to,
+ * or dissolves the pool it owns */
+static void
+_bitu_pool_detach (bitu_conn_manager_t *manager, bitu_transport_t *transport)
+{
+  chashtable_snapshot_t snapshot;
+  bitu_transport_t *owner, **members;
+  void *iter;
+  int i, nmembers, left = 0;
+
+  pthread_mutex_lock (&_bitu_pools_mutex);
+  members = transport->pool;
+  nmembers = transport->pool_size;
+  for (i = 0; i < nmembers; i++)
+    members[i]->pooled = 0;
+  transport->pool = NULL;
+  transport->pool_size = 0;
+
+  if (transport->pooled)
+    {
+      chashtable_snapshot (manager->transports, &snapshot);
+      if ((iter = chashtable_snapshot_iter (&snapshot)) != NULL)
+        do
+          {
+            owner = chashtable_iter_value (iter);
+            for (i = 0; i < owner->pool_size; i++)
+              if (owner->pool[i] == transport)
+                {
+                  memmove (&owner->pool[i], &owner->pool[i + 1],
+                           (owner->pool_size - i - 1) * sizeof (owner->pool[0]));
+                  owner->pool_size--;
+                  left = 1;
+                  break;
+                }
+          }
+        while ((iter = chashtable_snapshot_iter_next (&snapshot, iter)) != NULL);
+      chashtable_snapshot_release (&snapshot);
+      transport->pooled = 0;
+    }
+  pthread_mutex_unlock (&_bitu_pools_mutex);
+
+  /* Dropping the references pools hold, out of the lock since it may
+   * be the last one */
+  for (i = 0; i < nmembers; i++)
+    bitu_transport_unref (members[i]);
+  free (members);
+  if (left)
+    bitu_transport_unref (transport);
+}
+
+
+/* Adds the transport `member' to the manager, if it's not there yet,
+ * and to the pool of the transport `uri'. Pools don't nest and a
+ * transport belongs to a single pool. */
+bitu_conn_status_t
+bitu_conn_manager_pool (bitu_conn_manager_t *manager, const char *uri,
+                        const char *member)
+{
+  bitu_transport_t *owner, *transport, **pool;
+  bitu_conn_status_t status = BITU_CONN_STATUS_OK;
+  int i;
+
+  if ((owner = bitu_conn_manager_get_transport (manager, uri)) == NULL)
+    return BITU_CONN_STATUS_TRANSPORT_NOT_FOUND;
+  if ((transport = bitu_conn_manager_add (manager, member)) == NULL)
+    {
+      bitu_transport_unref (owner);
+      return BITU_CONN_STATUS_ERROR;
+    }
+
+  pthread_mutex_lock (&_bitu_pools_mutex);
+  for (i = 0; i < owner->pool_size; i++)
+    if (owner->pool[i] == transport)
+      goto done;
+
+  if (transport == owner || owner->pooled || transport->pooled ||
+      transport->pool_size > 0)
+    {
+      ta_error_set (BITU_ERROR_TRANSPORT_NOT_SUPPORTED,
+                    "Pools can't be nested and a transport can only "
+                    "belong to one of them");
+      status = BITU_CONN_STATUS_ERROR;
+      goto done;
+    }
+
+  pool = realloc (owner->pool, (owner->pool_size + 1) * sizeof (owner->pool[0]));
+  if (pool == NULL)
+    {
+      status = BITU_CONN_STATUS_ERROR;
+      goto done;
+    }
+  owner->pool = pool;
+  owner->pool[owner->pool_size++] = bitu_transport_ref (transport);
+  transport->pooled = 1;
+
+ done:
+  pthread_mutex_unlock (&_bitu_pools_mutex);
+  bitu_transport_unref (transport);
+  bitu_transport_unref (owner);
+  return status;
+}
+
+
 bitu_conn_status_t
 bitu_conn_manager_remove (bitu_conn_manager_t *manager, const char *uri)
 {
   bitu_transport_t *transport;
-  if ((transport = hashtable_get (manager->transports, uri)) == NULL)
+  if ((transport = bitu_conn_manager_get_transport (manager, uri)) == NULL)
     return BITU_CONN_STATUS_TRANSPORT_NOT_FOUND;
 
-  /* We can't disconnect while the transport is running */
-  if (bitu_transport_is_running (transport) == TA_OK)
-    return BITU_CONN_STATUS_STILL_RUNNING;
+  /* We can't disconnect while the transport is running or while its
+   * supervisor is still around */
+  if (bitu_transport_is_running (transport) == TA_OK ||
+      bitu_transport_get_state (transport) != BITU_TRANSPORT_STATE_STOPPED)
+    {
+      bitu_transport_unref (transport);
+      return BITU_CONN_STATUS_STILL_RUNNING;
+    }
 
-  /* This will also free the transport using the _bitu_transport_free()
-   * function, assigned in the creation of the hash table. */
-  hashtable_del (manager->transports, uri);
+  _bitu_pool_detach (manager, transport);
+
+  /* The manager's reference is dropped once no reader of the table can
+   * see it anymore. Whoever holds one of the others frees it. */
+  chashtable_del (manager->transports, uri);
+  bitu_transport_unref (transport);
   return BITU_CONN_STATUS_OK;
 }
 
@@ -148,7 +391,7 @@ bitu_conn_manager_remove (bitu_conn_manager_t *manager, const char *uri)
 int
 bitu_conn_manager_get_n_transports (bitu_conn_manager_t *manager)
 {
-  return manager->transports->size;
+  return chashtable_size (manager->transports);
 }
 
 
@@ -157,76 +400,497 @@ bitu_conn_manager_get_transports (bitu_conn_manager_t *manager)
 {
   void *iter = NULL;
   ta_list_t *keys = NULL;
-
-  if ((iter = hashtable_iter (manager->transports)) == NULL)
-    return NULL;
-  do
-    keys = ta_list_append (keys, hashtable_iter_key (iter));
-  while ((iter = hashtable_iter_next (manager->transports, iter)) != NULL);
+  chashtable_snapshot_t snapshot;
+
+  /* Copies of the uris, a transport might be removed while the caller
+   * still walks through the list */
+  chashtable_snapshot (manager->transports, &snapshot);
+  if ((iter = chashtable_snapshot_iter (&snapshot)) != NULL)
+    do
+      keys = ta_list_append (keys, strdup (chashtable_iter_key (iter)));
+    while ((iter = chashtable_snapshot_iter_next (&snapshot, iter)) != NULL);
+  chashtable_snapshot_release (&snapshot);
   return keys;
 }
 
 
+/* Returns a new reference to the transport of `uri', to be released
+ * with bitu_transport_unref() */
 bitu_transport_t *
 bitu_conn_manager_get_transport (bitu_conn_manager_t *manager, const char *uri)
 {
   bitu_transport_t *transport;
-  transport = hashtable_get (manager->transports, uri);
+  int token;
+
+  token = chashtable_read_begin (manager->transports);
+  if ((transport = chashtable_get (manager->transports, uri)) != NULL)
+    bitu_transport_ref (transport);
+  chashtable_read_end (manager->transports, token);
   return transport;
 }
 
 
-/* This function is just a thin wrapper to log stuff if the */
+/* Sends the messages kept while the transport was reconnecting, as
+ * soon as it is ready. Started by the supervisor, which waits for it
+ * before leaving. */
+static void *
+_bitu_transport_flush (bitu_transport_t *transport)
+{
+  _bitu_outbox_msg_t *msg;
+  ta_list_t *outbox;
+  struct timespec deadline;
+  unsigned int ready;
+  int sent = 0, running, timedout = 0;
+
+  /* The implementation is asked without holding the lock, it may take
+   * its own. bitu_transport_notify_ready() wakes us up to ask again. */
+  bitu_util_deadline (&deadline, OUTBOX_WAIT);
+  pthread_mutex_lock (&transport->mutex);
+  while (!timedout && !transport->stop && !transport->down &&
+         transport->state == BITU_TRANSPORT_STATE_RUNNING)
+    {
+      ready = transport->ready;
+      pthread_mutex_unlock (&transport->mutex);
+      running = bitu_transport_is_running (transport) == TA_OK;
+      pthread_mutex_lock (&transport->mutex);
+      if (running)
+        break;
+      while (transport->ready == ready && !transport->stop &&
+             !transport->down &&
+             transport->state == BITU_TRANSPORT_STATE_RUNNING)
+        if (pthread_cond_timedwait (&transport->wakeup, &transport->mutex,
+                                    &deadline) == ETIMEDOUT)
+          {
+            timedout = 1;
+            break;
+          }
+    }
+
+  while (transport->outbox && !transport->down &&
+         transport->state == BITU_TRANSPORT_STATE_RUNNING)
+    {
+      /* Taking one at a time, new messages are appended to the outbox
+       * until it is empty, so they don't jump the line */
+      outbox = transport->outbox;
+      msg = outbox->data;
+      transport->outbox = outbox->next;
+      if (transport->outbox)
+        transport->outbox->prev = NULL;
+      transport->outbox_len--;
+      outbox->next = NULL;
+      ta_list_free (outbox);
+      pthread_mutex_unlock (&transport->mutex);
+
+      if (transport->send (transport, msg->msg, msg->to) == TA_OK)
+        sent++;
+      else if (transport->logger)
+        ta_log_warn (transport->logger, "Dropping a message kept for %s",
+                     msg->to);
+      free (msg->msg);
+      free (msg->to);
+      free (msg);
+
+      pthread_mutex_lock (&transport->mutex);
+    }
+  transport->flushing = 0;
+  pthread_cond_broadcast (&transport->wakeup);
+  pthread_mutex_unlock (&transport->mutex);
+
+  if (sent && transport->logger)
+    ta_log_info (transport->logger, "%d kept message(s) sent", sent);
+  return NULL;
+}
+
+
+/* How long to wait before the next attempt. Must be called with the
+ * lock held, it also tells whether the circuit is open. */
+static uint64_t
+_bitu_transport_backoff (bitu_transport_t *transport, int failures)
+{
+  uint64_t delay = RECONNECT_BASE;
+  int i;
+
+  if (failures >= RECONNECT_MAX_FAILURES)
+    {
+      transport->state = BITU_TRANSPORT_STATE_BROKEN;
+      return RECONNECT_COOLDOWN;
+    }
+  transport->state = BITU_TRANSPORT_STATE_RECONNECTING;
+  for (i = 0; i < failures && delay < RECONNECT_MAX; i++)
+    delay *= 2;
+  delay = delay < RECONNECT_MAX ? delay : RECONNECT_MAX;
+  return delay / 2 + (uint64_t) rand_r (&transport->seed) % (delay / 2 + 1);
+}
+
+
+/* Sleeps for `delay' usec or until someone sets `stop'. Must be called
+ * with the lock held. */
 static void
-_bitu_conn_manager_run_transport (bitu_transport_t *transport)
+_bitu_transport_wait (bitu_transport_t *transport, uint64_t delay)
+{
+  struct timespec deadline;
+
+  bitu_util_deadline (&deadline, delay);
+  while (!transport->stop)
+    if (pthread_cond_timedwait (&transport->wakeup, &transport->mutex,
+                                &deadline) == ETIMEDOUT)
+      break;
+}
+
+
+/* Connects the transport again after `failures' failed attempts,
+ * waiting longer after each one. Must be called with the lock held,
+ * which is dropped while waiting and connecting. Returns TA_OK with
+ * the transport running, or TA_ERROR when someone asked it to stop. */
+static int
+_bitu_transport_reconnect (bitu_transport_t *transport, int failures)
+{
+  uint64_t delay;
+  int status;
+
+  do
+    {
+      delay = _bitu_transport_backoff (transport, failures);
+      if (transport->logger)
+        ta_log_info (transport->logger, "%s in %.1fs",
+                     transport->state == BITU_TRANSPORT_STATE_BROKEN
+                     ? "Too many failures, trying again"
+                     : "Reconnecting", delay / 1e6);
+      _bitu_transport_wait (transport, delay);
+      transport->state = BITU_TRANSPORT_STATE_CONNECTING;
+      pthread_mutex_unlock (&transport->mutex);
+
+      /* Dropping what's left of the old session before trying again,
+       * or the session that failed to come back */
+      bitu_transport_disconnect (transport);
+
+      pthread_mutex_lock (&transport->mutex);
+      if (transport->stop)
+        return TA_ERROR;
+      pthread_mutex_unlock (&transport->mutex);
+
+      status = bitu_transport_connect (transport);
+
+      pthread_mutex_lock (&transport->mutex);
+      if (transport->stop)
+        {
+          pthread_mutex_unlock (&transport->mutex);
+          bitu_transport_disconnect (transport);
+          pthread_mutex_lock (&transport->mutex);
+          return TA_ERROR;
+        }
+      if (status != BITU_CONN_STATUS_OK)
+        failures++;
+    }
+  while (status != BITU_CONN_STATUS_OK);
+
+  if (transport->logger)
+    ta_log_info (transport->logger, "Connected");
+  transport->state = BITU_TRANSPORT_STATE_RUNNING;
+  transport->down = 0;
+  if (transport->outbox && !transport->flushing)
+    {
+      transport->flushing = 1;
+      bitu_util_start_new_thread ((bitu_util_callback_t) _bitu_transport_flush,
+                                  transport);
+    }
+  return TA_OK;
+}
+
+
+/* Runs the transport and, every time its main loop returns without
+ * anyone asking it to stop, connects it again. A transport that failed
+ * its first connection starts here too, with the same backoff. Owns
+ * the session while the transport is not running,
+ * bitu_conn_manager_shutdown() only disconnects running ones. */
+static void *
+_bitu_transport_supervise (bitu_transport_t *transport)
 {
-  if ((bitu_transport_run (transport) == TA_ERROR))
-    if (transport->logger)
-      ta_log_warn (transport->logger, "Failed to run the transport");
+  uint64_t started;
+  int failures = 0;
+
+  pthread_mutex_lock (&transport->mutex);
+  if (transport->state != BITU_TRANSPORT_STATE_RUNNING && !transport->stop &&
+      _bitu_transport_reconnect (transport, ++failures) != TA_OK)
+    goto out;
+  pthread_mutex_unlock (&transport->mutex);
+
+  for (;;)
+    {
+      pthread_mutex_lock (&transport->mutex);
+      if (transport->stop)
+        goto out;
+      pthread_mutex_unlock (&transport->mutex);
+
+      started = bitu_util_monotonic_time ();
+      if (bitu_transport_run (transport) == TA_ERROR && transport->logger)
+        ta_log_warn (transport->logger, "Failed to run the transport");
+
+      pthread_mutex_lock (&transport->mutex);
+      if (transport->stop)
+        break;
+      if (transport->logger)
+        ta_log_warn (transport->logger, "Connection lost");
+
+      /* Sessions that drop right after connecting count as failures,
+       * or a flapping server would be hammered every second */
+      if (bitu_util_monotonic_time () - started >= RECONNECT_STABLE)
+        failures = 0;
+      else
+        failures++;
+
+      if (_bitu_transport_reconnect (transport, failures) != TA_OK)
+        goto out;
+      pthread_mutex_unlock (&transport->mutex);
+    }
+
+ out:
+  while (transport->flushing)
+    pthread_cond_wait (&transport->wakeup, &transport->mutex);
+  transport->state = BITU_TRANSPORT_STATE_STOPPED;
+  transport->supervised = 0;
+  pthread_cond_broadcast (&transport->wakeup);
+  pthread_mutex_unlock (&transport->mutex);
+  bitu_transport_unref (transport);
+  return NULL;
 }
 
 
+/* Connects and runs the transport under a supervisor. When the first
+ * connection fails, BITU_CONN_STATUS_CONNECTION_FAILED is returned but
+ * the supervisor keeps trying with the usual backoff, until
+ * bitu_conn_manager_shutdown() is called. */
 bitu_conn_status_t
 bitu_conn_manager_run (bitu_conn_manager_t *manager, const char *uri)
 {
-  int status;
+  bitu_conn_status_t status;
   bitu_transport_t *transport;
   if ((transport = bitu_conn_manager_get_transport (manager, uri)) == NULL)
     return BITU_CONN_STATUS_TRANSPORT_NOT_FOUND;
 
-  /* Connecting && running the client */
-  if ((status = bitu_transport_connect (transport)) == BITU_CONN_STATUS_OK)
+  /* Only one supervisor per transport */
+  pthread_mutex_lock (&transport->mutex);
+  if (transport->state != BITU_TRANSPORT_STATE_STOPPED)
     {
-      bitu_util_start_new_thread ((bitu_util_callback_t) _bitu_conn_manager_run_transport,
-                                  transport);
-      return BITU_CONN_STATUS_SPAWNED;
+      pthread_mutex_unlock (&transport->mutex);
+      bitu_transport_unref (transport);
+      return BITU_CONN_STATUS_ALREADY_RUNNING;
     }
+  transport->state = BITU_TRANSPORT_STATE_CONNECTING;
+  transport->stop = 0;
+  transport->supervised = 1;
+  pthread_mutex_unlock (&transport->mutex);
+
+  /* Connecting && running the client. The supervisor keeps our
+   * reference. */
+  if (bitu_transport_connect (transport) == BITU_CONN_STATUS_OK)
+    status = BITU_CONN_STATUS_SPAWNED;
   else
     {
-      /* We couldn't run the transport, let's disconnect it */
       if (transport->logger)
         ta_log_warn (transport->logger, "Failed to connect");
-      bitu_conn_manager_shutdown (manager, uri);
-      return BITU_CONN_STATUS_CONNECTION_FAILED;
+      status = BITU_CONN_STATUS_CONNECTION_FAILED;
     }
+
+  /* Shut down while connecting, the supervisor only has to leave */
+  pthread_mutex_lock (&transport->mutex);
+  if (transport->stop && status == BITU_CONN_STATUS_SPAWNED)
+    {
+      pthread_mutex_unlock (&transport->mutex);
+      bitu_transport_disconnect (transport);
+      pthread_mutex_lock (&transport->mutex);
+    }
+  else if (status == BITU_CONN_STATUS_SPAWNED)
+    transport->state = BITU_TRANSPORT_STATE_RUNNING;
+  pthread_mutex_unlock (&transport->mutex);
+  bitu_util_start_new_thread ((bitu_util_callback_t) _bitu_transport_supervise,
+                              transport);
   return status;
 }
 
 
+/* State shared between bitu_conn_manager_run_all() and the threads it
+ * starts. The caller may give up waiting before all the connections
+ * finish, so whoever drops the last reference frees it. */
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+  int pending;
+  int refcount;
+  bitu_conn_status_t *statuses;
+} _bitu_conn_batch_t;
+
+typedef struct
+{
+  _bitu_conn_batch_t *batch;
+  bitu_conn_manager_t *manager;
+  char *uri;
+  int index;
+} _bitu_conn_job_t;
+
+
+static void
+_bitu_conn_batch_unref (_bitu_conn_batch_t *batch)
+{
+  int refcount;
+  pthread_mutex_lock (&batch->mutex);
+  refcount = --batch->refcount;
+  pthread_mutex_unlock (&batch->mutex);
+  if (refcount > 0)
+    return;
+  pthread_cond_destroy (&batch->done);
+  pthread_mutex_destroy (&batch->mutex);
+  free (batch->statuses);
+  free (batch);
+}
+
+
+static void *
+_bitu_conn_manager_run_job (_bitu_conn_job_t *job)
+{
+  _bitu_conn_batch_t *batch = job->batch;
+  bitu_conn_status_t status;
+
+  status = bitu_conn_manager_run (job->manager, job->uri);
+
+  pthread_mutex_lock (&batch->mutex);
+  batch->statuses[job->index] = status;
+  batch->pending--;
+  pthread_cond_signal (&batch->done);
+  pthread_mutex_unlock (&batch->mutex);
+
+  _bitu_conn_batch_unref (batch);
+  free (job->uri);
+  free (job);
+  return NULL;
+}
+
+
+/* Connects and runs all the transports in `uris' at the same time and
+ * waits at most `timeout' microseconds (or forever, when it is zero)
+ * for them. The status of each uri is written to the same position of
+ * `statuses'. Transports still connecting when the time is over get
+ * BITU_CONN_STATUS_TIMED_OUT and keep trying in the background, they
+ * start running as soon as they manage to connect. */
+void
+bitu_conn_manager_run_all (bitu_conn_manager_t *manager, ta_list_t *uris,
+                           uint64_t timeout, bitu_conn_status_t *statuses)
+{
+  _bitu_conn_batch_t *batch;
+  _bitu_conn_job_t *job;
+  ta_list_t *tmp;
+  struct timespec deadline;
+  pthread_t thread;
+  int i, n = ta_list_len (uris);
+
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    statuses[i] = BITU_CONN_STATUS_ERROR;
+
+  if ((batch = malloc (sizeof (_bitu_conn_batch_t))) == NULL)
+    return;
+  if ((batch->statuses = malloc (n * sizeof (bitu_conn_status_t))) == NULL)
+    {
+      free (batch);
+      return;
+    }
+  pthread_mutex_init (&batch->mutex, NULL);
+  bitu_util_cond_init (&batch->done);
+  batch->pending = 0;
+  batch->refcount = 1;
+
+  for (tmp = uris, i = 0; tmp; tmp = tmp->next, i++)
+    {
+      batch->statuses[i] = BITU_CONN_STATUS_TIMED_OUT;
+      if ((job = malloc (sizeof (_bitu_conn_job_t))) == NULL)
+        {
+          batch->statuses[i] = BITU_CONN_STATUS_ERROR;
+          continue;
+        }
+      if ((job->uri = strdup (tmp->data)) == NULL)
+        {
+          batch->statuses[i] = BITU_CONN_STATUS_ERROR;
+          free (job);
+          continue;
+        }
+      job->batch = batch;
+      job->manager = manager;
+      job->index = i;
+
+      pthread_mutex_lock (&batch->mutex);
+      batch->pending++;
+      batch->refcount++;
+      pthread_mutex_unlock (&batch->mutex);
+      if (bitu_util_create_thread (&thread, (bitu_util_callback_t)
+                                   _bitu_conn_manager_run_job, job) == 0)
+        {
+          pthread_detach (thread);
+          continue;
+        }
+
+      /* Nobody is going to finish this one */
+      pthread_mutex_lock (&batch->mutex);
+      batch->pending--;
+      batch->refcount--;
+      batch->statuses[i] = BITU_CONN_STATUS_ERROR;
+      pthread_mutex_unlock (&batch->mutex);
+      free (job->uri);
+      free (job);
+    }
+
+  bitu_util_deadline (&deadline, timeout);
+
+  pthread_mutex_lock (&batch->mutex);
+  while (batch->pending > 0)
+    {
+      if (timeout == 0)
+        pthread_cond_wait (&batch->done, &batch->mutex);
+      else if (pthread_cond_timedwait (&batch->done, &batch->mutex,
+                                       &deadline) == ETIMEDOUT)
+        break;
+    }
+  memcpy (statuses, batch->statuses, n * sizeof (bitu_conn_status_t));
+  pthread_mutex_unlock (&batch->mutex);
+
+  _bitu_conn_batch_unref (batch);
+}
+
+
 bitu_conn_status_t
 bitu_conn_manager_shutdown (bitu_conn_manager_t *manager, const char *uri)
 {
   bitu_transport_t *transport;
+  bitu_conn_status_t status = BITU_CONN_STATUS_OK;
+
   if ((transport = bitu_conn_manager_get_transport (manager, uri)) == NULL)
     return BITU_CONN_STATUS_TRANSPORT_NOT_FOUND;
 
   /* Really shutting down */
   if (transport->logger)
     ta_log_info (transport->logger, "Shutting down");
-  if (bitu_transport_disconnect (transport) == TA_OK)
-    return BITU_CONN_STATUS_OK;
 
-  return BITU_CONN_STATUS_ALREADY_SHUTDOWN;
+  /* A supervised transport that is not running belongs to its
+   * supervisor, waking it up is enough to make it clean up and leave */
+  pthread_mutex_lock (&transport->mutex);
+  if (transport->supervised)
+    {
+      transport->stop = 1;
+      pthread_cond_broadcast (&transport->wakeup);
+      if (transport->state != BITU_TRANSPORT_STATE_RUNNING)
+        {
+          pthread_mutex_unlock (&transport->mutex);
+          bitu_transport_unref (transport);
+          return BITU_CONN_STATUS_OK;
+        }
+    }
+  pthread_mutex_unlock (&transport->mutex);
+
+  if (bitu_transport_disconnect (transport) != TA_OK)
+    status = BITU_CONN_STATUS_ALREADY_SHUTDOWN;
+  bitu_transport_unref (transport);
+  return status;
 }
 
 
@@ -240,6 +904,15 @@ _do_bitu_conn_manager_consume (void *data)
 }
 
 
+void
+bitu_conn_manager_set_callback_admit (bitu_conn_manager_t *manager,
+                                      bitu_queue_callback_admit_t callback,
+                                      void *data)
+{
+  bitu_queue_set_callback_admit (manager->commands, callback, data);
+}
+
+
 void
 bitu_conn_manager_consume (bitu_conn_manager_t *manager,
                            bitu_queue_callback_consume_t callback,
@@ -278,9 +951,31 @@ bitu_transport_new (const char *uri)
 
   /* Allocating memory for the new transport */
   transport = malloc (sizeof (bitu_transport_t));
+  transport->refcount = 1;
   transport->data = NULL;
+  transport->free = NULL;
+  transport->queued = NULL;
+  transport->join = NULL;
+  transport->leave = NULL;
+  transport->set_status = NULL;
   transport->uri = uri_obj;
   transport->logger = ta_log_new (uri);
+  pthread_mutex_init (&transport->mutex, NULL);
+  bitu_util_cond_init (&transport->wakeup);
+  transport->state = BITU_TRANSPORT_STATE_STOPPED;
+  transport->supervised = 0;
+  transport->stop = 0;
+  transport->down = 0;
+  transport->flushing = 0;
+  transport->ready = 0;
+  transport->seed = (unsigned int) time (NULL) ^ (unsigned int) (uintptr_t) transport;
+  transport->outbox = NULL;
+  transport->outbox_len = 0;
+  transport->show = BITU_SHOW_AVAILABLE;
+  transport->status = strdup ("Online");
+  transport->pool = NULL;
+  transport->pool_size = 0;
+  transport->pooled = 0;
 
   /* Looking for the right transport. Possible values hardcoded by
    * now */
@@ -306,6 +1001,7 @@ bitu_transport_new (const char *uri)
 
  error:
   ta_object_unref (uri_obj);
+  free (transport->status);
   ta_error_set (BITU_ERROR_TRANSPORT_NOT_SUPPORTED,
                 "There is no transport to handle the protocol %s",
                 scheme);
@@ -327,6 +1023,25 @@ bitu_transport_queue_command (bitu_transport_t *transport, bitu_command_t *cmd)
 }
 
 
+/* Transports are freed when their last reference is dropped. The
+ * manager holds one for each transport it knows about, and so do
+ * supervisors, pools and queued commands. */
+bitu_transport_t *
+bitu_transport_ref (bitu_transport_t *transport)
+{
+  __sync_fetch_and_add (&transport->refcount, 1);
+  return transport;
+}
+
+
+void
+bitu_transport_unref (bitu_transport_t *transport)
+{
+  if (__sync_sub_and_fetch (&transport->refcount, 1) == 0)
+    _bitu_transport_free (transport);
+}
+
+
 ta_iri_t *
 bitu_transport_get_uri (bitu_transport_t *transport)
 {
@@ -392,6 +1107,47 @@ bitu_transport_set_callback_send (bitu_transport_t *transport,
   transport->send = callback;
 }
 
+/* Called when the transport is destroyed, to release what the
+ * transport keeps in its data */
+void
+bitu_transport_set_callback_free (bitu_transport_t *transport,
+                                  bitu_transport_callback_free_t callback)
+{
+  transport->free = callback;
+}
+
+/* Tells how many messages the transport itself holds before they
+ * reach the wire, like the ones waiting for IRC's flood control */
+void
+bitu_transport_set_callback_queued (bitu_transport_t *transport,
+                                    bitu_transport_callback_queued_t callback)
+{
+  transport->queued = callback;
+}
+
+/* For transports with group conversations, like IRC channels or XMPP
+ * rooms. Rooms joined are joined again after reconnecting. */
+void
+bitu_transport_set_callback_join (bitu_transport_t *transport,
+                                  bitu_transport_callback_room_t callback)
+{
+  transport->join = callback;
+}
+
+void
+bitu_transport_set_callback_leave (bitu_transport_t *transport,
+                                   bitu_transport_callback_room_t callback)
+{
+  transport->leave = callback;
+}
+
+void
+bitu_transport_set_callback_status (bitu_transport_t *transport,
+                                    bitu_transport_callback_status_t callback)
+{
+  transport->set_status = callback;
+}
+
 int
 bitu_transport_connect (bitu_transport_t *transport)
 {
@@ -414,10 +1170,309 @@ bitu_transport_is_running (bitu_transport_t *transport)
   return transport->is_running (transport);
 }
 
+/* Appends a message to the outbox, dropping the oldest one when it's
+ * full. Must be called with the lock held. */
+static int
+_bitu_outbox_keep (bitu_transport_t *transport, const char *msg,
+                   const char *to)
+{
+  _bitu_outbox_msg_t *kept, *oldest;
+  ta_list_t *head;
+
+  if ((kept = malloc (sizeof (_bitu_outbox_msg_t))) == NULL)
+    return TA_ERROR;
+  kept->msg = strdup (msg);
+  kept->to = to ? strdup (to) : NULL;
+
+  if (transport->outbox_len >= OUTBOX_SIZE)
+    {
+      head = transport->outbox;
+      oldest = head->data;
+      transport->outbox = head->next;
+      transport->outbox->prev = NULL;
+      head->next = NULL;
+      ta_list_free (head);
+      transport->outbox_len--;
+      if (transport->logger)
+        ta_log_warn (transport->logger, "Too many messages kept, dropping "
+                     "the oldest one, for %s", oldest->to);
+      free (oldest->msg);
+      free (oldest->to);
+      free (oldest);
+    }
+  transport->outbox = ta_list_append (transport->outbox, kept);
+  transport->outbox_len++;
+  return TA_OK;
+}
+
+/* Messages sent while the transport reconnects are kept and sent once
+ * it is back. So is a message that fails to go because the session
+ * just dropped, the transport is taken as down from then on, before
+ * its supervisor even notices. */
 int
 bitu_transport_send (bitu_transport_t *transport, const char *msg, const char *to)
 {
-  return transport->send (transport, msg, to);
+  int status;
+
+  pthread_mutex_lock (&transport->mutex);
+  if (!transport->supervised ||
+      (transport->state == BITU_TRANSPORT_STATE_RUNNING &&
+       !transport->down && transport->outbox == NULL))
+    {
+      pthread_mutex_unlock (&transport->mutex);
+      status = transport->send (transport, msg, to);
+
+      /* A refusal from a session that is still up is final, it's up to
+       * the transport to say why */
+      if (status == TA_OK || bitu_transport_is_running (transport) == TA_OK)
+        return status;
+
+      pthread_mutex_lock (&transport->mutex);
+      if (!transport->supervised || transport->stop)
+        {
+          pthread_mutex_unlock (&transport->mutex);
+          return status;
+        }
+      if (transport->state == BITU_TRANSPORT_STATE_RUNNING &&
+          !transport->down)
+        {
+          if (transport->logger)
+            ta_log_warn (transport->logger, "Failed to send, keeping "
+                         "messages until the connection is back");
+          transport->down = 1;
+        }
+    }
+
+  status = _bitu_outbox_keep (transport, msg, to);
+  pthread_mutex_unlock (&transport->mutex);
+  return status;
+}
+
+/* Tells whoever waits for the transport to be able to send that it may
+ * be now, e.g. when a server welcomes it. Only takes the transport's
+ * own lock, so it can be called with the implementation's held. */
+void
+bitu_transport_notify_ready (bitu_transport_t *transport)
+{
+  pthread_mutex_lock (&transport->mutex);
+  transport->ready++;
+  pthread_cond_broadcast (&transport->wakeup);
+  pthread_mutex_unlock (&transport->mutex);
+}
+
+int
+bitu_transport_join (bitu_transport_t *transport, const char *room)
+{
+  if (transport->join == NULL)
+    {
+      ta_error_set (BITU_ERROR_TRANSPORT_NOT_SUPPORTED,
+                    "This transport has no rooms to join");
+      return TA_ERROR;
+    }
+  return transport->join (transport, room);
+}
+
+int
+bitu_transport_leave (bitu_transport_t *transport, const char *room)
+{
+  if (transport->leave == NULL)
+    {
+      ta_error_set (BITU_ERROR_TRANSPORT_NOT_SUPPORTED,
+                    "This transport has no rooms to leave");
+      return TA_ERROR;
+    }
+  return transport->leave (transport, room);
+}
+
+/* Takes the messages kept for `to' out of the outbox, in order */
+static ta_list_t *
+_bitu_outbox_take (bitu_transport_t *transport, const char *to)
+{
+  ta_list_t *tmp, *next, *taken = NULL;
+  _bitu_outbox_msg_t *msg;
+
+  pthread_mutex_lock (&transport->mutex);
+  for (tmp = transport->outbox; tmp; tmp = next)
+    {
+      next = tmp->next;
+      msg = tmp->data;
+      if (msg->to == NULL || strcmp (msg->to, to) != 0)
+        continue;
+      transport->outbox = ta_list_remove (transport->outbox, msg);
+      transport->outbox_len--;
+      taken = ta_list_append (taken, msg);
+    }
+  pthread_mutex_unlock (&transport->mutex);
+  return taken;
+}
+
+
+/* Chooses the connection of the pool of `transport' that sends a
+ * message to `to'. Recipients are spread among connections by the hash
+ * of their address, so each one always hears from the same connection
+ * and gets its messages in order. When that connection is down the
+ * next running one in the pool takes over, and the messages it kept
+ * for `to' go first through the new one. Answers should not use this:
+ * they go through the connection that got the command. Returns a new
+ * reference. */
+bitu_transport_t *
+bitu_transport_pool_pick (bitu_transport_t *transport, const char *to)
+{
+  bitu_transport_t *picked = transport, *home = transport, *node;
+  _bitu_outbox_msg_t *msg;
+  ta_list_t *kept = NULL, *tmp;
+  unsigned int start, n, i;
+
+  pthread_mutex_lock (&_bitu_pools_mutex);
+  if (transport->pool_size > 0)
+    {
+      n = transport->pool_size + 1;
+      start = (to ? hash_string (to) : 0) % n;
+      for (i = 0; i < n; i++)
+        {
+          node = (start + i) % n == 0
+            ? transport
+            : transport->pool[(start + i) % n - 1];
+          if (i == 0)
+            home = picked = node;
+          if (bitu_transport_get_state (node) == BITU_TRANSPORT_STATE_RUNNING)
+            {
+              picked = node;
+              break;
+            }
+        }
+    }
+  bitu_transport_ref (picked);
+  if (picked != home && to != NULL)
+    kept = _bitu_outbox_take (home, to);
+  pthread_mutex_unlock (&_bitu_pools_mutex);
+
+  for (tmp = kept; tmp; tmp = tmp->next)
+    {
+      msg = tmp->data;
+      if (bitu_transport_send (picked, msg->msg, msg->to) != TA_OK &&
+          picked->logger)
+        ta_log_warn (picked->logger, "Dropping a message kept for %s",
+                     msg->to);
+      free (msg->msg);
+      free (msg->to);
+      free (msg);
+    }
+  ta_list_free (kept);
+  return picked;
+}
+
+
+/* Changes what the transport tells its contacts about the bot. The
+ * value is kept even when the transport is not connected, so it can
+ * be announced when it connects, and the transport is only told about
+ * it when it actually changes. */
+int
+bitu_transport_set_status (bitu_transport_t *transport, bitu_show_t show,
+                           const char *status)
+{
+  char *copy;
+
+  if (status == NULL)
+    status = "";
+
+  pthread_mutex_lock (&transport->mutex);
+  if (transport->show == show && strcmp (transport->status, status) == 0)
+    {
+      pthread_mutex_unlock (&transport->mutex);
+      return TA_OK;
+    }
+  if ((copy = strdup (status)) == NULL)
+    {
+      pthread_mutex_unlock (&transport->mutex);
+      return TA_ERROR;
+    }
+  free (transport->status);
+  transport->status = copy;
+  transport->show = show;
+  pthread_mutex_unlock (&transport->mutex);
+
+  if (transport->set_status)
+    return transport->set_status (transport, show, status);
+  return TA_OK;
+}
+
+/* Returns a copy of the status text that must be freed */
+char *
+bitu_transport_get_status (bitu_transport_t *transport, bitu_show_t *show)
+{
+  char *status;
+  pthread_mutex_lock (&transport->mutex);
+  if (show)
+    *show = transport->show;
+  status = strdup (transport->status);
+  pthread_mutex_unlock (&transport->mutex);
+  return status;
+}
+
+bitu_transport_state_t
+bitu_transport_get_state (bitu_transport_t *transport)
+{
+  bitu_transport_state_t state;
+  pthread_mutex_lock (&transport->mutex);
+  state = transport->state;
+  if (state == BITU_TRANSPORT_STATE_RUNNING && transport->down)
+    state = BITU_TRANSPORT_STATE_RECONNECTING;
+  pthread_mutex_unlock (&transport->mutex);
+  return state;
+}
+
+/* Waits up to `timeout' usec for the supervisor to give up on the
+ * transport after bitu_conn_manager_shutdown(). Returns TA_OK when
+ * it's stopped. */
+int
+bitu_transport_wait_stopped (bitu_transport_t *transport, uint64_t timeout)
+{
+  struct timespec deadline;
+  int stopped;
+
+  bitu_util_deadline (&deadline, timeout);
+  pthread_mutex_lock (&transport->mutex);
+  while (transport->state != BITU_TRANSPORT_STATE_STOPPED)
+    if (pthread_cond_timedwait (&transport->wakeup, &transport->mutex,
+                                &deadline) == ETIMEDOUT)
+      break;
+  stopped = transport->state == BITU_TRANSPORT_STATE_STOPPED;
+  pthread_mutex_unlock (&transport->mutex);
+  return stopped ? TA_OK : TA_ERROR;
+}
+
+/* Messages waiting to be sent, both the ones kept while the transport
+ * is away and the ones queued by the transport itself */
+int
+bitu_transport_get_queued (bitu_transport_t *transport)
+{
+  int queued;
+  pthread_mutex_lock (&transport->mutex);
+  queued = transport->outbox_len;
+  pthread_mutex_unlock (&transport->mutex);
+  if (transport->queued)
+    queued += transport->queued (transport);
+  return queued;
+}
+
+const char *
+bitu_transport_state_name (bitu_transport_state_t state)
+{
+  switch (state)
+    {
+    case BITU_TRANSPORT_STATE_CONNECTING:
+      return "connecting";
+    case BITU_TRANSPORT_STATE_RUNNING:
+      return "running";
+    case BITU_TRANSPORT_STATE_RECONNECTING:
+      return "reconnecting";
+    case BITU_TRANSPORT_STATE_BROKEN:
+      return "broken";
+    case BITU_TRANSPORT_STATE_STOPPED:
+    default:
+      return "stopped";
+    }
 }
 
 int
@@ -436,25 +1491,18 @@ bitu_command_t *
 bitu_command_new (bitu_transport_t *transport, const char *cmd, const char *from)
 {
   bitu_command_t *command;
-  char *name;
-  char **params;
-  int nparams;
 
   if ((command = malloc (sizeof (bitu_command_t))) == NULL)
     return NULL;
 
-  command->transport = transport;
+  command->transport = transport ? bitu_transport_ref (transport) : NULL;
   command->cmd = bitu_util_strstrip (cmd);
   command->from = from ? strdup (from) : NULL;
+  command->key = NULL;
 
   /* Filling out some optional arguments after parsing a command */
-  if (bitu_util_extract_params (cmd, &name, &params, &nparams) == TA_OK)
-    {
-      command->name = name;
-      command->params = params;
-      command->nparams = nparams;
-    }
-  else
+  if (bitu_util_extract_params (cmd, &command->name, &command->params,
+                                &command->nparams) != TA_OK)
     {
       command->name = NULL;
       command->params = NULL;
@@ -465,12 +1513,51 @@ bitu_command_new (bitu_transport_t *transport, const char *cmd, const char *from
 }
 
 
+/* For callers that already split the command line, like the config
+ * parser. Takes ownership of `cmd' and of `params', a NULL terminated
+ * array with `nparams' strings. */
+bitu_command_t *
+bitu_command_new_parsed (bitu_transport_t *transport, char *cmd,
+                         const char *from, const char *name, char **params,
+                         int nparams)
+{
+  bitu_command_t *command;
+
+  if (cmd == NULL || (command = malloc (sizeof (bitu_command_t))) == NULL)
+    {
+      free (cmd);
+      while (nparams > 0)
+        free (params[--nparams]);
+      free (params);
+      return NULL;
+    }
+
+  command->transport = transport ? bitu_transport_ref (transport) : NULL;
+  command->cmd = cmd;
+  command->from = from ? strdup (from) : NULL;
+  command->key = NULL;
+  command->name = strdup (name);
+  command->params = params;
+  command->nparams = nparams;
+  return command;
+}
+
+
 void
 bitu_command_free (bitu_command_t *command)
 {
+  int i;
+
+  for (i = 0; i < command->nparams; i++)
+    free (command->params[i]);
+  free (command->params);
   free (command->cmd);
-  if (command->from)
-    free (command->from);
+  free (command->from);
+  if (command->key)
+    free (command->key);
+  free (command->name);
+  if (command->transport)
+    bitu_transport_unref (command->transport);
   free (command);
 }
 
@@ -484,7 +1571,7 @@ bitu_command_get_transport (bitu_command_t *command)
 const char *
 bitu_command_get_from (bitu_command_t *command)
 {
-  return (const char *) command->from;
+  return command->from;
 }
 
 const char *
@@ -511,6 +1598,43 @@ bitu_command_get_nparams (bitu_command_t *command)
   return command->nparams;
 }
 
+/* Normalized version of the command line, built lazily from the parsed
+ * name and params. Commands that differ only in spacing or quoting
+ * share the same key. */
+const char *
+bitu_command_get_key (bitu_command_t *command)
+{
+  ta_buf_t buf = TA_BUF_INIT;
+  const char *c;
+  int i;
+
+  if (command->key)
+    return command->key;
+  if (command->name == NULL)
+    return (command->key = strdup (command->cmd));
+
+  ta_buf_alloc (&buf, strlen (command->cmd) + 1);
+  ta_buf_cat (&buf, command->name);
+  for (i = 0; i < command->nparams; i++)
+    {
+      ta_buf_cat (&buf, " ");
+      if (command->params[i][strcspn (command->params[i], " \"\\")] == '\0')
+        {
+          ta_buf_cat (&buf, command->params[i]);
+          continue;
+        }
+
+      /* Params with spaces, quotes or backslashes are quoted back */
+      ta_buf_cat (&buf, "\"");
+      for (c = command->params[i]; *c; c++)
+        ta_buf_catf (&buf, (*c == '"' || *c == '\\') ? "\\%c" : "%c", *c);
+      ta_buf_cat (&buf, "\"");
+    }
+  command->key = strdup (ta_buf_cstr (&buf));
+  ta_buf_dealloc (&buf);
+  return command->key;
+}
+
 
 /* -- Queue api -- */
 
@@ -525,6 +1649,8 @@ bitu_queue_new (void)
   queue->maxsize = COMMAND_QUEUE_SIZE;
   queue->running = 0;
   queue->list = NULL;
+  queue->admit = NULL;
+  queue->admit_data = NULL;
   queue->mutex = malloc (sizeof (pthread_mutex_t));
   pthread_mutex_init (queue->mutex, NULL);
   queue->not_full = malloc (sizeof (pthread_cond_t));
@@ -552,9 +1678,25 @@ bitu_queue_free (bitu_queue_t *queue)
 }
 
 
+/* The admit callback sees every entry before it gets into the queue.
+ * When it returns anything but TA_OK the entry is considered taken
+ * over by the callback and is not queued. */
+void
+bitu_queue_set_callback_admit (bitu_queue_t *queue,
+                               bitu_queue_callback_admit_t callback,
+                               void *data)
+{
+  queue->admit = callback;
+  queue->admit_data = data;
+}
+
+
 void
 bitu_queue_add (bitu_queue_t *queue, void *data)
 {
+  if (queue->admit && queue->admit (data, queue->admit_data) != TA_OK)
+    return;
+
   /* Exclusive access */
   pthread_mutex_lock (queue->mutex);
 
@@ -609,10 +1751,14 @@ bitu_queue_consume (bitu_queue_t *queue,
         pthread_cond_wait (queue->not_empty, queue->mutex);
 
       /* Popping the last element out of the list */
-      if ((data = _bitu_queue_pop (queue)) != NULL)
-        callback (data, extra_data);
+      data = _bitu_queue_pop (queue);
 
+      /* The lock is not held while running the callback, producers
+       * shouldn't wait for a command to finish to queue another one */
       pthread_mutex_unlock (queue->mutex);
       pthread_cond_signal (queue->not_full);
+
+      if (data != NULL)
+        callback (data, extra_data);
     }
 }
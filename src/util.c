@@ -18,8 +18,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <uuid/uuid.h>
 #include <taningia/error.h>
 #include <bitu/util.h>
@@ -31,126 +34,134 @@ bitu_util_strstrip (const char *string)
   char *s = (char *) string;
   int len = strlen (s);
 
-  while (isspace (s[len - 1]))
+  while (len > 0 && isspace (s[len - 1]))
     --len;
-  while (*s && isspace (*s))
+  while (len > 0 && isspace (*s))
     ++s, --len;
   return strndup (s, len);
 }
 
+/* Splits a command line in a single pass. Tokens are separated by
+ * blanks, double quotes group blanks into a token and a backslash
+ * takes the next char literally. The returned array is NULL
+ * terminated. Fails on unterminated quotes. */
 int
-bitu_util_extract_params (const char *line, char **cmd,
-                          char ***params, int *len)
+bitu_util_tokenize (const char *line, char ***tokens, int *ntokens)
 {
-  size_t i;
-  char *s;
-  int bufsize = 128;
-  int inside_quotes = 0;
-
-  char *ecmd = NULL;
-  char **tmp, **eparams = NULL;
-  int counter = 0;
+  char **list = NULL, **tmp, *scratch;
+  int count = 0, allocated = 0, quoted;
+  size_t len;
 
-  size_t full_len;
-  int iter = 0, tok_size = 0;
-  int allocated = 0;
-  char *tok = NULL;
+  if ((scratch = malloc (strlen (line) + 1)) == NULL)
+    return TA_ERROR;
 
-  s = bitu_util_strstrip (line);
-
-  full_len = strlen (s);
-  if (full_len == 0)
+  while (*line)
     {
-      free (s);
-      return TA_ERROR;
-    }
-  for (i = 0; i <= full_len; i++)
-    {
-      if (s[i] == '\"' && s[i-1] != '\\')
+      if (*line == ' ' || *line == '\t')
         {
-          /* starting/ending quotes */
-          inside_quotes = !inside_quotes;
+          line++;
+          continue;
         }
-
-      if (((!inside_quotes && s[i] == ' ' && s[i-1] != '\\') || i == full_len)
-          && tok != NULL)
+      for (len = 0, quoted = 0; *line; line++)
         {
-          size_t elen = (sizeof (char *) * (counter+1));
-
-          /* Preparing tok to be stored in the param array. */
-          tok[tok_size] = '\0';
-
-          /* Seems to be the first token, so it is the command. The
-           * rest is going to be the parameter list */
-          if (ecmd == NULL)
-            ecmd = strdup (tok);
+          if (*line == '\\' && line[1] != '\0')
+            scratch[len++] = *++line;
+          else if (*line == '"')
+            quoted = !quoted;
+          else if (!quoted && (*line == ' ' || *line == '\t'))
+            break;
           else
-            {
-              if ((tmp = realloc (eparams, elen)) == NULL)
-                {
-                  /* TODO: free eparams and its items */
-                  return TA_ERROR;
-                }
-              else
-                eparams = tmp;
-              eparams[counter] = strdup (tok);
-
-              /* Setting number of params */
-              counter++;
-            }
-
-          /* Freeing already collected token. */
-          free (tok);
-          tok = NULL;
-
-          /* Resseting counters. */
-          tok_size = 0;
-          iter = 0;
+            scratch[len++] = *line;
         }
-      else
+      if (quoted)
+        goto error;
+      scratch[len] = '\0';
+
+      if (count + 1 >= allocated)
         {
-          if (tok_size == 0 || tok_size > allocated)
-            {
-              char *tmp;
-              while (allocated < tok_size)
-                allocated += bufsize;
-              if ((tmp = realloc (tok, allocated)) == NULL)
-                {
-                  free (tok);
-                  return TA_ERROR;
-                }
-              else
-                tok = tmp;
-            }
-
-          /* Making sure that escape char will not be catched */
-          if ((s[i] == '\\' && s[i-1] != '\\') ||
-              (s[i] == '\"' && s[i-1] != '\\'))
-            continue;
-
-          tok[iter++] = s[i];
-          tok_size++;
+          allocated = allocated ? allocated * 2 : 8;
+          if ((tmp = realloc (list, sizeof (char *) * allocated)) == NULL)
+            goto error;
+          list = tmp;
         }
+      if ((list[count] = strdup (scratch)) == NULL)
+        goto error;
+      list[++count] = NULL;
+    }
+
+  free (scratch);
+  *tokens = list;
+  *ntokens = count;
+  return TA_OK;
+
+ error:
+  while (count > 0)
+    free (list[--count]);
+  free (list);
+  free (scratch);
+  return TA_ERROR;
+}
+
+/* Splits a command line like bitu_util_tokenize(), the first token is
+ * the command and the others its params. Fails on empty lines. */
+int
+bitu_util_extract_params (const char *line, char **cmd,
+                          char ***params, int *len)
+{
+  char **tokens;
+  int ntokens, i;
+
+  if (bitu_util_tokenize (line, &tokens, &ntokens) != TA_OK)
+    return TA_ERROR;
+  if (ntokens == 0)
+    {
+      free (tokens);
+      return TA_ERROR;
     }
 
-  /* Filling all out params */
+  /* The array stays NULL terminated, the command leaves room for it */
   if (cmd)
-    *cmd = ecmd;
-  if (params)
-    *params = eparams;
+    *cmd = tokens[0];
+  else
+    free (tokens[0]);
+  memmove (tokens, tokens + 1, sizeof (char *) * ntokens);
   if (len)
-    *len = counter;
-
-  free (s);
+    *len = ntokens - 1;
+  if (params)
+    *params = tokens;
+  else
+    {
+      for (i = 0; i < ntokens - 1; i++)
+        free (tokens[i]);
+      free (tokens);
+    }
   return TA_OK;
 }
 
+/* Starts a thread that never sees SIGHUP, the main thread is the one
+ * that reloads the config. New threads inherit the signal mask of the
+ * thread creating them, so it's blocked just while creating it. */
+int
+bitu_util_create_thread (pthread_t *thread, bitu_util_callback_t callback,
+                         void *data)
+{
+  sigset_t block, old;
+  int ret;
+
+  sigemptyset (&block);
+  sigaddset (&block, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &block, &old);
+  ret = pthread_create (thread, NULL, callback, data);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  return ret;
+}
+
 void
 bitu_util_start_new_thread (bitu_util_callback_t callback, void *data)
 {
   pthread_t thread;
-  pthread_create (&thread, NULL, callback, data);
-  pthread_detach (thread);
+  if (bitu_util_create_thread (&thread, callback, data) == 0)
+    pthread_detach (thread);
 }
 
 char *
@@ -164,3 +175,109 @@ bitu_util_uuid4 (void)
   uuid_unparse (uuid, buf);
   return buf;
 }
+
+/* Microseconds since an arbitrary point in the past. Only useful to
+ * measure intervals, it never goes backwards. */
+uint64_t
+bitu_util_monotonic_time (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Initializes a condition variable whose timed waits are measured
+ * against the monotonic clock, so setting the wall clock neither
+ * shortens nor stretches them. Use bitu_util_deadline() to compute
+ * the deadlines passed to pthread_cond_timedwait(). */
+void
+bitu_util_cond_init (pthread_cond_t *cond)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (cond, &attr);
+  pthread_condattr_destroy (&attr);
+}
+
+/* Fills `deadline' with the monotonic time `usec' microseconds from
+ * now. Only meaningful for conditions set up by bitu_util_cond_init(). */
+void
+bitu_util_deadline (struct timespec *deadline, uint64_t usec)
+{
+  clock_gettime (CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += usec / 1000000;
+  deadline->tv_nsec += (usec % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000)
+    {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* Parses durations like `500ms', `5s', `2m' or `1h'. A number without
+ * unit is taken as seconds. */
+int
+bitu_util_parse_duration (const char *str, uint64_t *usec)
+{
+  char *end;
+  double val;
+  uint64_t unit;
+
+  if (str == NULL || *str == '\0')
+    return TA_ERROR;
+  val = strtod (str, &end);
+  if (end == str || val < 0)
+    return TA_ERROR;
+
+  if (*end == '\0' || strcmp (end, "s") == 0)
+    unit = 1000000;
+  else if (strcmp (end, "ms") == 0)
+    unit = 1000;
+  else if (strcmp (end, "us") == 0)
+    unit = 1;
+  else if (strcmp (end, "m") == 0)
+    unit = 60000000;
+  else if (strcmp (end, "h") == 0)
+    unit = 3600000000ULL;
+  else
+    return TA_ERROR;
+
+  *usec = (uint64_t) (val * unit);
+  return TA_OK;
+}
+
+
+/* Characters allowed in a nickname (RFC 2812, section 2.3.1), used to
+ * tell where a mention starts and ends. */
+static int
+_bitu_util_is_nick_char (char c)
+{
+  return c != '\0'
+    && (isalnum ((unsigned char) c) || strchr ("-_[]\\`^{}|", c) != NULL);
+}
+
+/* Looks for `nick' as a whole word in `text', ignoring case like chat
+ * servers do when comparing nicknames. */
+int
+bitu_util_is_mention (const char *text, const char *nick, size_t nick_len)
+{
+  const char *p;
+
+  if (text == NULL || nick_len == 0)
+    return 0;
+  for (p = text; *p; p++)
+    {
+      if (tolower ((unsigned char) *p) != tolower ((unsigned char) *nick))
+        continue;
+      if (p > text && _bitu_util_is_nick_char (p[-1]))
+        continue;
+      if (strncasecmp (p, nick, nick_len) != 0)
+        continue;
+      if (_bitu_util_is_nick_char (p[nick_len]))
+        continue;
+      return 1;
+    }
+  return 0;
+}
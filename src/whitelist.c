@@ -0,0 +1,237 @@
+/* whitelist.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <taningia/taningia.h>
+#include <bitu/util.h>
+
+#include "hashtable.h"
+#include "hashtable-utils.h"
+#include "whitelist.h"
+
+/* How often, in usec, the file is checked for changes */
+#define WHITELIST_CHECK_INTERVAL 5000000
+
+/* Longest jid checked, the localpart and the domain can have up to
+ * 1023 bytes each (RFC 6122) */
+#define WHITELIST_JID_MAX 2048
+
+
+static pthread_mutex_t _whitelist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hashtable_t *_whitelist = NULL;
+static char *_whitelist_path = NULL;
+static struct stat _whitelist_stat;
+static uint64_t _whitelist_checked = 0;
+
+
+/* Lower cases the bare part of `jid' into `buf'. Returns the length
+ * or -1 when it doesn't fit. */
+static int
+_bitu_whitelist_normalize (const char *jid, char *buf, size_t size)
+{
+  size_t i;
+
+  for (i = 0; jid[i] && jid[i] != '/'; i++)
+    {
+      if (i + 1 >= size)
+        return -1;
+      buf[i] = tolower ((unsigned char) jid[i]);
+    }
+  buf[i] = '\0';
+  return (int) i;
+}
+
+
+/* Reads the whole file in a new table. Entries for a whole domain are
+ * kept as `@domain', so they can be looked up with a pointer to the
+ * `@' of a jid. */
+static hashtable_t *
+_bitu_whitelist_read (const char *path, struct stat *st)
+{
+  FILE *file;
+  hashtable_t *table;
+  char *line = NULL, *entry, *end, key[WHITELIST_JID_MAX];
+  size_t size = 0;
+
+  if ((file = fopen (path, "r")) == NULL)
+    return NULL;
+  if (fstat (fileno (file), st) != 0 ||
+      (table = hashtable_create (hash_string, string_equal, free,
+                                 NULL)) == NULL)
+    {
+      fclose (file);
+      return NULL;
+    }
+
+  while (getline (&line, &size, file) != -1)
+    {
+      for (entry = line; isspace ((unsigned char) *entry); entry++)
+        ;
+      for (end = entry + strlen (entry);
+           end > entry && isspace ((unsigned char) end[-1]); end--)
+        ;
+      *end = '\0';
+      if (*entry == '\0' || *entry == '#' || strchr (entry, '@') == NULL)
+        continue;
+      if (entry[0] == '*' && entry[1] == '@')
+        entry++;
+      if (_bitu_whitelist_normalize (entry, key, sizeof (key)) > 0)
+        hashtable_set (table, strdup (key), (void *) 1);
+    }
+  free (line);
+  fclose (file);
+  return table;
+}
+
+
+/* Must be called with the lock held */
+static int
+_bitu_whitelist_load (void)
+{
+  hashtable_t *table;
+  struct stat st;
+
+  _whitelist_checked = bitu_util_monotonic_time ();
+  if ((table = _bitu_whitelist_read (_whitelist_path, &st)) == NULL)
+    return TA_ERROR;
+  if (_whitelist)
+    hashtable_destroy (_whitelist);
+  _whitelist = table;
+  _whitelist_stat = st;
+  return TA_OK;
+}
+
+
+/* Reads the file again if it changed since the last time. Must be
+ * called with the lock held. */
+static void
+_bitu_whitelist_check (void)
+{
+  struct stat st;
+
+  if (_whitelist_path == NULL ||
+      bitu_util_monotonic_time () - _whitelist_checked
+      < WHITELIST_CHECK_INTERVAL)
+    return;
+  _whitelist_checked = bitu_util_monotonic_time ();
+  if (stat (_whitelist_path, &st) != 0)
+    return;
+  if (st.st_mtime != _whitelist_stat.st_mtime ||
+      st.st_size != _whitelist_stat.st_size ||
+      st.st_ino != _whitelist_stat.st_ino)
+    _bitu_whitelist_load ();
+}
+
+
+/* Uses the whitelist in `path' from now on. NULL turns the whitelist
+ * off. When the file can't be read, the current list is kept. */
+int
+bitu_whitelist_set_file (const char *path)
+{
+  char *old;
+  int status = TA_OK;
+
+  pthread_mutex_lock (&_whitelist_mutex);
+  old = _whitelist_path;
+  if (path == NULL)
+    {
+      if (_whitelist)
+        hashtable_destroy (_whitelist);
+      _whitelist = NULL;
+      _whitelist_path = NULL;
+    }
+  else
+    {
+      _whitelist_path = strdup (path);
+      if ((status = _bitu_whitelist_load ()) != TA_OK)
+        {
+          free (_whitelist_path);
+          _whitelist_path = old;
+          old = NULL;
+        }
+    }
+  pthread_mutex_unlock (&_whitelist_mutex);
+  free (old);
+  return status;
+}
+
+
+int
+bitu_whitelist_reload (void)
+{
+  int status = TA_ERROR;
+
+  pthread_mutex_lock (&_whitelist_mutex);
+  if (_whitelist_path)
+    status = _bitu_whitelist_load ();
+  pthread_mutex_unlock (&_whitelist_mutex);
+  return status;
+}
+
+
+int
+bitu_whitelist_is_enabled (void)
+{
+  int enabled;
+
+  pthread_mutex_lock (&_whitelist_mutex);
+  enabled = _whitelist != NULL;
+  pthread_mutex_unlock (&_whitelist_mutex);
+  return enabled;
+}
+
+
+/* Tells if `jid', bare or full, is in the list, by itself or by its
+ * domain */
+int
+bitu_whitelist_contains (const char *jid)
+{
+  char key[WHITELIST_JID_MAX], *domain;
+  int found = 0;
+
+  if (jid == NULL ||
+      _bitu_whitelist_normalize (jid, key, sizeof (key)) <= 0)
+    return 0;
+
+  pthread_mutex_lock (&_whitelist_mutex);
+  _bitu_whitelist_check ();
+  if (_whitelist != NULL)
+    found = hashtable_get (_whitelist, key) != NULL ||
+      ((domain = strchr (key, '@')) != NULL &&
+       hashtable_get (_whitelist, domain) != NULL);
+  pthread_mutex_unlock (&_whitelist_mutex);
+  return found;
+}
+
+
+int
+bitu_whitelist_get_size (void)
+{
+  int size = 0;
+
+  pthread_mutex_lock (&_whitelist_mutex);
+  if (_whitelist != NULL)
+    size = (int) _whitelist->size;
+  pthread_mutex_unlock (&_whitelist_mutex);
+  return size;
+}
@@ -0,0 +1,37 @@
+/* whitelist.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_WHITELIST_H_
+#define BITU_WHITELIST_H_ 1
+
+/* Process wide list of jids allowed to add bitU to their contacts.
+ * The file has one bare jid per line, or `*@domain' to allow a whole
+ * domain. Blank lines and lines starting with `#' are ignored.
+ *
+ * The list lives in a hash table, so checking a jid costs a single
+ * lookup and doesn't allocate memory. The file is read again when it
+ * changes, checked at most every few seconds, or when
+ * bitu_whitelist_reload() is called. */
+
+int bitu_whitelist_set_file (const char *path);
+int bitu_whitelist_reload (void);
+int bitu_whitelist_is_enabled (void);
+int bitu_whitelist_contains (const char *jid);
+int bitu_whitelist_get_size (void);
+
+#endif /* BITU_WHITELIST_H_ */
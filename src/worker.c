@@ -0,0 +1,823 @@
+/* worker.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#endif
+#include <taningia/taningia.h>
+#include <bitu/transport.h>
+
+#include "worker.h"
+
+/* Size of each ring. It must be a power of two, so the free running
+ * head and tail counters wrap around nicely. */
+#define WORKER_RING_SIZE (64 * 1024)
+
+/* Answers are sent in records of up to this size, so a new record can
+ * be written as soon as half of the ring was read */
+#define WORKER_CHUNK_SIZE (WORKER_RING_SIZE / 2 - sizeof (uint32_t))
+
+/* Longest answer accepted from a plugin */
+#define WORKER_ANSWER_MAX (16 * 1024 * 1024)
+
+/* Workers are recycled after serving this amount of requests, so a
+ * leaking plugin can't grow forever */
+#define WORKER_MAX_REQUESTS 10000
+
+/* Time (in ms) that we wait for an answer before considering a worker
+ * stuck and killing it */
+#define WORKER_TIMEOUT 30000
+
+/* Granularity (in ms) of the waits for an answer. Between each wait we
+ * check if the worker is still alive */
+#define WORKER_POLL_INTERVAL 100
+
+
+/* Single producer, single consumer ring. Records are a 32bit length
+ * followed by the payload. The head is only written by the producer
+ * and the tail only by the consumer. */
+typedef struct
+{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  char data[WORKER_RING_SIZE];
+} _bitu_ring_t;
+
+
+/* The memory shared between bitu and one of its workers */
+typedef struct
+{
+  _bitu_ring_t requests;
+  _bitu_ring_t answers;
+} _bitu_channel_t;
+
+
+/* The channel is a file mapped by both sides, so it survives the exec
+ * of the worker program */
+typedef struct
+{
+  pid_t pid;
+  int busy;
+  unsigned int served;
+  _bitu_channel_t *channel;
+  int channel_fd;
+  int request_fd[2];
+  int answer_fd[2];
+} _bitu_worker_t;
+
+
+struct bitu_worker_pool
+{
+  char *name;
+  char *lib;
+  const char *program;
+  ta_log_t *logger;
+  int nworkers;
+  _bitu_worker_t *workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t available;
+};
+
+
+/* -- Ring helpers -- */
+
+
+static void
+_ring_reset (_bitu_ring_t *ring)
+{
+  ring->head = ring->tail = 0;
+}
+
+
+static void
+_ring_copy_in (_bitu_ring_t *ring, uint32_t pos, const void *src, uint32_t len)
+{
+  uint32_t offset = pos % WORKER_RING_SIZE;
+  uint32_t first = WORKER_RING_SIZE - offset;
+  if (first > len)
+    first = len;
+  memcpy (ring->data + offset, src, first);
+  memcpy (ring->data, (const char *) src + first, len - first);
+}
+
+
+static void
+_ring_copy_out (_bitu_ring_t *ring, uint32_t pos, void *dst, uint32_t len)
+{
+  uint32_t offset = pos % WORKER_RING_SIZE;
+  uint32_t first = WORKER_RING_SIZE - offset;
+  if (first > len)
+    first = len;
+  memcpy (dst, ring->data + offset, first);
+  memcpy ((char *) dst + first, ring->data, len - first);
+}
+
+
+static int
+_ring_write (_bitu_ring_t *ring, const char *data, uint32_t len)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = ring->tail;
+
+  __sync_synchronize ();
+  if (WORKER_RING_SIZE - (head - tail) < len + sizeof (len))
+    return TA_ERROR;
+
+  _ring_copy_in (ring, head, &len, sizeof (len));
+  _ring_copy_in (ring, head + sizeof (len), data, len);
+
+  /* The payload must be visible before the new head */
+  __sync_synchronize ();
+  ring->head = head + sizeof (len) + len;
+  return TA_OK;
+}
+
+
+/* Returns a NUL terminated copy of the next record or NULL if the ring
+ * is empty. */
+static char *
+_ring_read (_bitu_ring_t *ring, uint32_t *len)
+{
+  char *data;
+  uint32_t head = ring->head;
+  uint32_t tail = ring->tail;
+
+  __sync_synchronize ();
+  if (head == tail)
+    return NULL;
+
+  _ring_copy_out (ring, tail, len, sizeof (*len));
+  if (*len > head - tail - sizeof (*len))
+    {
+      /* Garbage, probably written by a dying worker */
+      ring->tail = head;
+      return NULL;
+    }
+  if ((data = malloc (*len + 1)) == NULL)
+    return NULL;
+  _ring_copy_out (ring, tail + sizeof (*len), data, *len);
+  data[*len] = '\0';
+
+  __sync_synchronize ();
+  ring->tail = tail + sizeof (*len) + *len;
+  return data;
+}
+
+
+/* -- Notification helpers -- */
+
+
+/* Descriptors are closed on exec, only the ones a worker needs are
+ * handed over to it */
+static int
+_set_cloexec (int fd, int cloexec)
+{
+  return fcntl (fd, F_SETFD, cloexec ? FD_CLOEXEC : 0) == -1 ? TA_ERROR : TA_OK;
+}
+
+
+static int
+_notifier_open (int fds[2])
+{
+#ifdef __linux__
+  fds[0] = fds[1] = eventfd (0, EFD_CLOEXEC);
+  return fds[0] == -1 ? TA_ERROR : TA_OK;
+#else
+  if (pipe (fds) != 0)
+    return TA_ERROR;
+  _set_cloexec (fds[0], 1);
+  _set_cloexec (fds[1], 1);
+  return TA_OK;
+#endif
+}
+
+
+static void
+_notifier_close (int fds[2])
+{
+  close (fds[0]);
+  if (fds[1] != fds[0])
+    close (fds[1]);
+}
+
+
+static void
+_notify (int fds[2])
+{
+  uint64_t one = 1;
+  while (write (fds[1], &one, sizeof (one)) == -1 && errno == EINTR);
+}
+
+
+/* Returns 1 if the other side notified us, 0 when the timeout (in ms,
+ * -1 for infinite) expires and -1 on errors. */
+static int
+_notifier_wait (int fds[2], int timeout)
+{
+  struct pollfd pfd;
+  uint64_t counter;
+  int r;
+
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+
+  if ((r = poll (&pfd, 1, timeout)) == -1)
+    return errno == EINTR ? 0 : -1;
+  if (r == 0)
+    return 0;
+  if (read (fds[0], &counter, sizeof (counter)) == -1 && errno != EINTR)
+    return -1;
+  return 1;
+}
+
+
+/* -- Worker side -- */
+
+
+/* Waits for room in the ring when it's full. The pool notifies us
+ * every time it takes a record out. */
+static void
+_bitu_worker_send (_bitu_worker_t *worker, const char *data, uint32_t len)
+{
+  while (_ring_write (&worker->channel->answers, data, len) != TA_OK)
+    if (_notifier_wait (worker->request_fd, -1) == -1)
+      _exit (EXIT_FAILURE);
+  _notify (worker->answer_fd);
+}
+
+
+/* An answer is a header followed by as many records as needed to carry
+ * it. The header has a byte that tells the difference between an empty
+ * and a NULL answer and the length of the whole answer. */
+static void
+_bitu_worker_answer (_bitu_worker_t *worker, const char *output)
+{
+  char header[1 + sizeof (uint32_t)];
+  size_t len = output ? strlen (output) : 0;
+  uint32_t sent, chunk;
+
+  if (len > WORKER_ANSWER_MAX)
+    {
+      output = "Answer too long to be sent by an isolated plugin";
+      len = strlen (output);
+    }
+
+  header[0] = output ? '1' : '0';
+  chunk = len;
+  memcpy (header + 1, &chunk, sizeof (chunk));
+  _bitu_worker_send (worker, header, sizeof (header));
+
+  for (sent = 0; sent < len; sent += chunk)
+    {
+      chunk = len - sent;
+      if (chunk > WORKER_CHUNK_SIZE)
+        chunk = WORKER_CHUNK_SIZE;
+      _bitu_worker_send (worker, output + sent, chunk);
+    }
+}
+
+
+static void
+_bitu_worker_serve (_bitu_worker_t *worker, bitu_worker_execute_t execute)
+{
+  bitu_command_t *command;
+  char *request, *output;
+  const char *from, *cmd;
+  uint32_t len;
+
+  while (_notifier_wait (worker->request_fd, -1) >= 0)
+    while ((request = _ring_read (&worker->channel->requests, &len)) != NULL)
+      {
+        /* An empty record means that we should leave */
+        if (len == 0)
+          _exit (EXIT_SUCCESS);
+
+        from = request;
+        cmd = request + strlen (request) + 1;
+        command = bitu_command_new (NULL, cmd, from[0] ? from : NULL);
+        output = command ? execute (command) : NULL;
+
+        _bitu_worker_answer (worker, output);
+
+        if (command)
+          bitu_command_free (command);
+        free (output);
+        free (request);
+      }
+  _exit (EXIT_FAILURE);
+}
+
+
+/* Entry point of the worker program. It's started by the pool as
+ *
+ *   bitu-worker <library> <channel fd> <request fd> <answer fd>
+ *
+ * and serves the requests found in the channel with the
+ * plugin_execute() function of the library until it's asked to
+ * leave. */
+int
+bitu_worker_main (int argc, char **argv)
+{
+  _bitu_worker_t worker;
+  bitu_worker_execute_t execute;
+  void *handle;
+  sigset_t mask;
+
+  if (argc != 5)
+    {
+      fprintf (stderr, "Usage: %s <library> <channel fd> <request fd> "
+               "<answer fd>\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+#ifdef __linux__
+  /* We don't want orphan workers hanging around if bitu dies */
+  prctl (PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+  /* The signal mask is inherited from whatever thread started us */
+  sigemptyset (&mask);
+  pthread_sigmask (SIG_SETMASK, &mask, NULL);
+
+  worker.channel_fd = atoi (argv[2]);
+  worker.request_fd[0] = worker.request_fd[1] = atoi (argv[3]);
+  worker.answer_fd[0] = worker.answer_fd[1] = atoi (argv[4]);
+  worker.channel = mmap (NULL, sizeof (_bitu_channel_t),
+                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                         worker.channel_fd, 0);
+  if (worker.channel == MAP_FAILED)
+    {
+      fprintf (stderr, "Unable to map the channel: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  if ((handle = dlopen (argv[1], RTLD_NOW)) == NULL ||
+      (execute = (bitu_worker_execute_t) dlsym (handle,
+                                                "plugin_execute")) == NULL)
+    {
+      fprintf (stderr, "Unable to load plugin: %s\n", dlerror ());
+      return EXIT_FAILURE;
+    }
+
+  _bitu_worker_serve (&worker, execute);
+  return EXIT_FAILURE;
+}
+
+
+/* -- Pool side -- */
+
+
+/* Other threads may hold locks (even inside of malloc) when we fork, so
+ * the child only makes async signal safe calls until it executes the
+ * worker program. Failing to execute it is reported through `report',
+ * that is closed on a successful exec. */
+static int
+_bitu_worker_spawn (bitu_worker_pool_t *pool, _bitu_worker_t *worker)
+{
+  char fds[3][16], *argv[6];
+  int report[2], error;
+  ssize_t nread;
+  pid_t pid;
+
+  _ring_reset (&worker->channel->requests);
+  _ring_reset (&worker->channel->answers);
+  worker->served = 0;
+  worker->pid = -1;
+
+  snprintf (fds[0], sizeof (fds[0]), "%d", worker->channel_fd);
+  snprintf (fds[1], sizeof (fds[1]), "%d", worker->request_fd[0]);
+  snprintf (fds[2], sizeof (fds[2]), "%d", worker->answer_fd[1]);
+  argv[0] = (char *) pool->program;
+  argv[1] = pool->lib;
+  argv[2] = fds[0];
+  argv[3] = fds[1];
+  argv[4] = fds[2];
+  argv[5] = NULL;
+
+  if (pipe (report) != 0)
+    {
+      ta_log_error (pool->logger, "Unable to start a worker for plugin %s: %s",
+                    pool->name, strerror (errno));
+      return TA_ERROR;
+    }
+  _set_cloexec (report[0], 1);
+  _set_cloexec (report[1], 1);
+
+  if ((pid = fork ()) == -1)
+    {
+      ta_log_error (pool->logger, "Unable to fork a worker for plugin %s: %s",
+                    pool->name, strerror (errno));
+      close (report[0]);
+      close (report[1]);
+      return TA_ERROR;
+    }
+  if (pid == 0)
+    {
+      close (report[0]);
+      _set_cloexec (worker->channel_fd, 0);
+      _set_cloexec (worker->request_fd[0], 0);
+      _set_cloexec (worker->answer_fd[1], 0);
+      execv (pool->program, argv);
+      error = errno;
+      while (write (report[1], &error, sizeof (error)) == -1 && errno == EINTR);
+      _exit (127);
+    }
+
+  close (report[1]);
+  while ((nread = read (report[0], &error, sizeof (error))) == -1 &&
+         errno == EINTR);
+  close (report[0]);
+  if (nread == sizeof (error))
+    {
+      waitpid (pid, NULL, 0);
+      ta_log_error (pool->logger, "Unable to run %s for plugin %s: %s",
+                    pool->program, pool->name, strerror (error));
+      return TA_ERROR;
+    }
+  worker->pid = pid;
+  return TA_OK;
+}
+
+
+static void
+_bitu_worker_stop (_bitu_worker_t *worker)
+{
+  int i;
+
+  if (worker->pid <= 0)
+    return;
+
+  /* Asking nicely first, then giving it a second to leave before
+   * killing it */
+  if (_ring_write (&worker->channel->requests, "", 0) == TA_OK)
+    _notify (worker->request_fd);
+  for (i = 0; i < 10; i++)
+    {
+      if (waitpid (worker->pid, NULL, WNOHANG) != 0)
+        {
+          worker->pid = -1;
+          return;
+        }
+      usleep (100000);
+    }
+  kill (worker->pid, SIGKILL);
+  waitpid (worker->pid, NULL, 0);
+  worker->pid = -1;
+}
+
+
+/* An unlinked file that can be mapped again after an exec */
+static int
+_channel_open (void)
+{
+  int fd;
+#ifdef __linux__
+  fd = memfd_create ("bitu-worker", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/bitu-worker-XXXXXX";
+  if ((fd = mkstemp (path)) != -1)
+    {
+      unlink (path);
+      _set_cloexec (fd, 1);
+    }
+#endif
+  if (fd != -1 && ftruncate (fd, sizeof (_bitu_channel_t)) == -1)
+    {
+      close (fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+
+static int
+_bitu_worker_init (bitu_worker_pool_t *pool, _bitu_worker_t *worker)
+{
+  worker->pid = -1;
+  worker->busy = 0;
+  if ((worker->channel_fd = _channel_open ()) == -1)
+    return TA_ERROR;
+  worker->channel = mmap (NULL, sizeof (_bitu_channel_t),
+                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                          worker->channel_fd, 0);
+  if (worker->channel == MAP_FAILED)
+    {
+      close (worker->channel_fd);
+      return TA_ERROR;
+    }
+  if (_notifier_open (worker->request_fd) != TA_OK)
+    {
+      munmap (worker->channel, sizeof (_bitu_channel_t));
+      close (worker->channel_fd);
+      return TA_ERROR;
+    }
+  if (_notifier_open (worker->answer_fd) != TA_OK)
+    {
+      _notifier_close (worker->request_fd);
+      munmap (worker->channel, sizeof (_bitu_channel_t));
+      close (worker->channel_fd);
+      return TA_ERROR;
+    }
+  if (_bitu_worker_spawn (pool, worker) != TA_OK)
+    {
+      _notifier_close (worker->request_fd);
+      _notifier_close (worker->answer_fd);
+      munmap (worker->channel, sizeof (_bitu_channel_t));
+      close (worker->channel_fd);
+      return TA_ERROR;
+    }
+  return TA_OK;
+}
+
+
+static void
+_bitu_worker_close (_bitu_worker_t *worker)
+{
+  _bitu_worker_stop (worker);
+  _notifier_close (worker->request_fd);
+  _notifier_close (worker->answer_fd);
+  munmap (worker->channel, sizeof (_bitu_channel_t));
+  close (worker->channel_fd);
+}
+
+
+/* Workers run the plugin_execute() function of `lib'. The worker
+ * program is installed with bitu, BITU_WORKER in the environment points
+ * to another one (to run from the build tree, for example). */
+bitu_worker_pool_t *
+bitu_worker_pool_new (const char *name, const char *lib, int nworkers,
+                      ta_log_t *logger)
+{
+  bitu_worker_pool_t *pool;
+  int i;
+
+  if (nworkers < 1)
+    return NULL;
+  if ((pool = malloc (sizeof (bitu_worker_pool_t))) == NULL)
+    return NULL;
+  if ((pool->workers = calloc (nworkers, sizeof (_bitu_worker_t))) == NULL)
+    {
+      free (pool);
+      return NULL;
+    }
+
+  pool->name = strdup (name);
+  pool->lib = strdup (lib);
+  if ((pool->program = getenv ("BITU_WORKER")) == NULL)
+    pool->program = BITU_WORKER_PATH;
+  pool->logger = logger;
+  pool->nworkers = nworkers;
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->available, NULL);
+
+  for (i = 0; i < nworkers; i++)
+    if (_bitu_worker_init (pool, &pool->workers[i]) != TA_OK)
+      {
+        pool->nworkers = i;
+        bitu_worker_pool_free (pool);
+        return NULL;
+      }
+  return pool;
+}
+
+
+void
+bitu_worker_pool_free (bitu_worker_pool_t *pool)
+{
+  int i;
+  for (i = 0; i < pool->nworkers; i++)
+    _bitu_worker_close (&pool->workers[i]);
+  pthread_mutex_destroy (&pool->mutex);
+  pthread_cond_destroy (&pool->available);
+  free (pool->workers);
+  free (pool->name);
+  free (pool->lib);
+  free (pool);
+}
+
+
+int
+bitu_worker_pool_get_size (bitu_worker_pool_t *pool)
+{
+  return pool->nworkers;
+}
+
+
+/* Blocks until a worker is free. Dead workers found in the way are
+ * respawned. Returns NULL only if no worker can be brought back to
+ * life. */
+static _bitu_worker_t *
+_bitu_worker_pool_acquire (bitu_worker_pool_t *pool)
+{
+  _bitu_worker_t *worker;
+  int i, busy;
+
+  pthread_mutex_lock (&pool->mutex);
+  while (1)
+    {
+      for (i = 0, busy = 0; i < pool->nworkers; i++)
+        {
+          worker = &pool->workers[i];
+          if (worker->busy)
+            {
+              busy++;
+              continue;
+            }
+          if (worker->pid <= 0 && _bitu_worker_spawn (pool, worker) != TA_OK)
+            continue;
+          worker->busy = 1;
+          pthread_mutex_unlock (&pool->mutex);
+          return worker;
+        }
+      if (busy == 0)
+        break;
+      pthread_cond_wait (&pool->available, &pool->mutex);
+    }
+  pthread_mutex_unlock (&pool->mutex);
+  return NULL;
+}
+
+
+static void
+_bitu_worker_pool_release (bitu_worker_pool_t *pool, _bitu_worker_t *worker)
+{
+  pthread_mutex_lock (&pool->mutex);
+  worker->busy = 0;
+  pthread_mutex_unlock (&pool->mutex);
+  pthread_cond_signal (&pool->available);
+}
+
+
+/* Called when a worker died or got stuck while running a request. It
+ * gets rid of whatever is left of the process and puts a fresh one in
+ * its place. */
+static char *
+_bitu_worker_pool_recover (bitu_worker_pool_t *pool, _bitu_worker_t *worker,
+                           int timedout)
+{
+  char buf[128];
+
+  if (worker->pid > 0 && kill (worker->pid, SIGKILL) == 0)
+    waitpid (worker->pid, NULL, 0);
+  worker->pid = -1;
+
+  snprintf (buf, sizeof (buf), "Plugin `%s' %s while running your command",
+            pool->name, timedout ? "timed out" : "crashed");
+  ta_log_warn (pool->logger, "%s (worker restarted)", buf);
+
+  _bitu_worker_spawn (pool, worker);
+  return strdup (buf);
+}
+
+
+/* Takes the records of an answer out of the ring as they arrive. The
+ * first one is the header, see _bitu_worker_answer(). Returns 1 when
+ * the whole answer is in `output', 0 if more is expected and -1 if the
+ * worker sent garbage. */
+static int
+_bitu_worker_receive (_bitu_worker_t *worker, char **output, int *started,
+                      uint32_t *total, uint32_t *received)
+{
+  char *record;
+  uint32_t len;
+
+  while ((record = _ring_read (&worker->channel->answers, &len)) != NULL)
+    {
+      /* The worker may be waiting for room in the ring */
+      _notify (worker->request_fd);
+
+      if (!*started)
+        {
+          if (len != 1 + sizeof (uint32_t) ||
+              (record[0] != '0' && record[0] != '1'))
+            goto garbage;
+          memcpy (total, record + 1, sizeof (*total));
+          if (*total > WORKER_ANSWER_MAX || (record[0] == '0' && *total > 0))
+            goto garbage;
+          *started = 1;
+          if (*record == '1' && (*output = malloc (*total + 1)) == NULL)
+            goto garbage;
+          if (*output)
+            (*output)[0] = '\0';
+        }
+      else if (*output == NULL || len > *total - *received)
+        goto garbage;
+      else
+        {
+          memcpy (*output + *received, record, len);
+          *received += len;
+          (*output)[*received] = '\0';
+        }
+      free (record);
+
+      if (*started && *received == *total)
+        return 1;
+    }
+  return 0;
+
+ garbage:
+  free (record);
+  return -1;
+}
+
+
+char *
+bitu_worker_pool_execute (bitu_worker_pool_t *pool, bitu_command_t *command)
+{
+  _bitu_worker_t *worker;
+  const char *from, *cmd;
+  char *request, *output = NULL;
+  size_t from_len, cmd_len;
+  uint32_t total = 0, received = 0;
+  int waited, status, started = 0, timedout = 0;
+
+  from = bitu_command_get_from (command);
+  from = from ? from : "";
+  cmd = bitu_command_get_cmd (command);
+  from_len = strlen (from) + 1;
+  cmd_len = strlen (cmd);
+
+  if (from_len + cmd_len + sizeof (uint32_t) > WORKER_RING_SIZE)
+    return strdup ("Command too long to be sent to an isolated plugin");
+  if ((request = malloc (from_len + cmd_len)) == NULL)
+    return NULL;
+  memcpy (request, from, from_len);
+  memcpy (request + from_len, cmd, cmd_len);
+
+  if ((worker = _bitu_worker_pool_acquire (pool)) == NULL)
+    {
+      free (request);
+      return strdup ("No workers available to run this plugin");
+    }
+
+  _ring_write (&worker->channel->requests, request, from_len + cmd_len);
+  _notify (worker->request_fd);
+  free (request);
+
+  /* Waiting for the answer while keeping an eye on the worker */
+  for (waited = 0; ; )
+    {
+      if ((status = _bitu_worker_receive (worker, &output, &started,
+                                          &total, &received)) == 1)
+        break;
+      if (status == 0)
+        status = _notifier_wait (worker->answer_fd, WORKER_POLL_INTERVAL);
+      if (status == 1)
+        continue;
+      if (status == 0)
+        {
+          if (waitpid (worker->pid, NULL, WNOHANG) != 0)
+            worker->pid = -1;
+          else if ((waited += WORKER_POLL_INTERVAL) < WORKER_TIMEOUT)
+            continue;
+          else
+            timedout = 1;
+        }
+      free (output);
+      output = _bitu_worker_pool_recover (pool, worker, timedout);
+      goto done;
+    }
+
+  /* Recycling old workers to contain leaks */
+  if (++worker->served >= WORKER_MAX_REQUESTS)
+    {
+      _bitu_worker_stop (worker);
+      _bitu_worker_spawn (pool, worker);
+    }
+
+ done:
+  _bitu_worker_pool_release (pool, worker);
+  return output;
+}
@@ -0,0 +1,44 @@
+/* worker.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_WORKER_H_
+#define BITU_WORKER_H_ 1
+
+#include <taningia/taningia.h>
+#include <bitu/transport.h>
+
+/* A pool of processes that run a plugin's execute function out of the
+ * main address space. Each one is the bitu-worker program, that loads
+ * the plugin again on its own. Requests and answers travel through
+ * shared memory rings and each side wakes the other one up through an
+ * eventfd (or a pipe, where eventfd is not available). */
+
+typedef struct bitu_worker_pool bitu_worker_pool_t;
+typedef char *(*bitu_worker_execute_t) (bitu_command_t *command);
+
+bitu_worker_pool_t *bitu_worker_pool_new (const char *name, const char *lib,
+                                          int nworkers, ta_log_t *logger);
+void bitu_worker_pool_free (bitu_worker_pool_t *pool);
+int bitu_worker_pool_get_size (bitu_worker_pool_t *pool);
+char *bitu_worker_pool_execute (bitu_worker_pool_t *pool,
+                                bitu_command_t *command);
+
+/* main() of the bitu-worker program */
+int bitu_worker_main (int argc, char **argv);
+
+#endif /* BITU_WORKER_H_ */
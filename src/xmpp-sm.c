@@ -0,0 +1,376 @@
+/* xmpp-sm.c - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iksemel.h>
+#include <taningia/taningia.h>
+
+#include "xmpp-sm.h"
+
+/* Room for unacked stanzas at first, it doubles up to the maximum */
+#define SM_QUEUE_INITIAL 16
+
+
+struct bitu_xmpp_sm
+{
+  int enabled;          /* Counting in the current stream */
+  int resuming;         /* Waiting for <resumed/> or <failed/> */
+  int requested;        /* An <r/> was sent and not answered yet */
+  char *id;             /* Set when the session can be resumed */
+  uint32_t inbound;     /* Stanzas handled, reported in <a h=''/> */
+  uint32_t acked;       /* Last `h' received from the server */
+  uint32_t dropped;     /* Sent and given up before being acked */
+
+  /* Stanzas not acked yet, oldest first, in a ring */
+  iks **queue;
+  int head;
+  int len;
+  int size;
+  int max;
+};
+
+
+bitu_xmpp_sm_t *
+bitu_xmpp_sm_new (int max_unacked)
+{
+  bitu_xmpp_sm_t *sm;
+  if ((sm = calloc (1, sizeof (bitu_xmpp_sm_t))) == NULL)
+    return NULL;
+  sm->max = max_unacked > 0 ? max_unacked : SM_QUEUE_INITIAL;
+  return sm;
+}
+
+
+static void
+_bitu_xmpp_sm_drop (bitu_xmpp_sm_t *sm, int n)
+{
+  while (n-- > 0 && sm->len > 0)
+    {
+      iks_delete (sm->queue[sm->head]);
+      sm->head = (sm->head + 1) % sm->size;
+      sm->len--;
+    }
+}
+
+
+void
+bitu_xmpp_sm_free (bitu_xmpp_sm_t *sm)
+{
+  _bitu_xmpp_sm_drop (sm, sm->len);
+  free (sm->queue);
+  free (sm->id);
+  free (sm);
+}
+
+
+static int
+_bitu_xmpp_sm_is_ours (iks *node)
+{
+  const char *xmlns = iks_find_attrib (node, "xmlns");
+  return xmlns && strcmp (xmlns, BITU_XMPP_SM_NS) == 0;
+}
+
+
+static uint32_t
+_bitu_xmpp_sm_get_h (iks *node)
+{
+  const char *h = iks_find_attrib (node, "h");
+  return h ? (uint32_t) strtoul (h, NULL, 10) : 0;
+}
+
+
+/* The server handled everything up to `h'. Counters wrap around at
+ * 2^32, like the spec says. Stanzas given up when the queue was full
+ * come before the ones still queued. */
+static void
+_bitu_xmpp_sm_ack (bitu_xmpp_sm_t *sm, uint32_t h)
+{
+  uint32_t n = h - sm->acked;
+  if (n <= sm->dropped)
+    sm->dropped -= n;
+  else
+    {
+      n -= sm->dropped;
+      sm->dropped = 0;
+      _bitu_xmpp_sm_drop (sm, n > (uint32_t) sm->len ? sm->len : (int) n);
+    }
+  sm->acked = h;
+}
+
+
+/* Tells whether the <stream:features/> offered by the server include
+ * stream management */
+int
+bitu_xmpp_sm_supported (iks *features)
+{
+  iks *child;
+  for (child = iks_child (features); child; child = iks_next (child))
+    if (iks_name (child) && strcmp (iks_name (child), "sm") == 0 &&
+        _bitu_xmpp_sm_is_ours (child))
+      return 1;
+  return 0;
+}
+
+
+/* Builds the <enable/> node. Counting starts as soon as it is sent,
+ * so stanzas left from an old session should be replayed right after
+ * it with bitu_xmpp_sm_replay(). */
+iks *
+bitu_xmpp_sm_enable (bitu_xmpp_sm_t *sm)
+{
+  iks *node;
+
+  free (sm->id);
+  sm->id = NULL;
+  sm->enabled = 1;
+  sm->resuming = 0;
+  sm->requested = 0;
+  sm->inbound = 0;
+  sm->acked = 0;
+  sm->dropped = 0;
+
+  node = iks_new ("enable");
+  iks_insert_attrib (node, "xmlns", BITU_XMPP_SM_NS);
+  iks_insert_attrib (node, "resume", "true");
+  return node;
+}
+
+
+/* Builds the <resume/> node, or returns NULL when there's no session
+ * to resume. It replaces resource binding in the new stream. */
+iks *
+bitu_xmpp_sm_resume (bitu_xmpp_sm_t *sm)
+{
+  char h[16];
+  iks *node;
+
+  if (sm->id == NULL)
+    return NULL;
+  snprintf (h, sizeof (h), "%u", sm->inbound);
+  node = iks_new ("resume");
+  iks_insert_attrib (node, "xmlns", BITU_XMPP_SM_NS);
+  iks_insert_attrib (node, "previd", sm->id);
+  iks_insert_attrib (node, "h", h);
+  sm->resuming = 1;
+  return node;
+}
+
+
+int
+bitu_xmpp_sm_is_enabled (bitu_xmpp_sm_t *sm)
+{
+  return sm->enabled;
+}
+
+
+/* Keeps a copy of `stanza' until the server acks it. Stanzas queued
+ * while there's no stream are sent by the next replay. When the queue
+ * is full 1 is returned and a stanza is given up: the oldest one if
+ * the stream is up, as it was sent already, or `stanza' itself
+ * otherwise, since the server may still ack any of the ones sent. */
+int
+bitu_xmpp_sm_queue (bitu_xmpp_sm_t *sm, iks *stanza)
+{
+  iks **queue;
+  int i, size, dropped = 0;
+
+  if (sm->len == sm->size && sm->size < sm->max)
+    {
+      size = sm->size ? sm->size * 2 : SM_QUEUE_INITIAL;
+      size = size < sm->max ? size : sm->max;
+      if ((queue = malloc (size * sizeof (iks *))) == NULL)
+        return TA_ERROR;
+      for (i = 0; i < sm->len; i++)
+        queue[i] = sm->queue[(sm->head + i) % sm->size];
+      free (sm->queue);
+      sm->queue = queue;
+      sm->size = size;
+      sm->head = 0;
+    }
+  if (sm->len == sm->size)
+    {
+      if (!sm->enabled)
+        return 1;
+      /* The server may still ack it, counted apart */
+      _bitu_xmpp_sm_drop (sm, 1);
+      sm->dropped++;
+      dropped = 1;
+    }
+  sm->queue[(sm->head + sm->len) % sm->size] = iks_copy (stanza);
+  sm->len++;
+  return dropped;
+}
+
+
+/* Sends all the stanzas not acked yet, oldest first. Returns how many
+ * were sent. */
+int
+bitu_xmpp_sm_replay (bitu_xmpp_sm_t *sm, bitu_xmpp_sm_send_t send, void *data)
+{
+  int i;
+  for (i = 0; i < sm->len; i++)
+    if (send (sm->queue[(sm->head + i) % sm->size], data) != TA_OK)
+      break;
+  return i;
+}
+
+
+/* Returns an <r/> to be sent when there are stanzas to be acked and no
+ * request is pending, NULL otherwise */
+iks *
+bitu_xmpp_sm_request (bitu_xmpp_sm_t *sm)
+{
+  iks *node;
+  if (!sm->enabled || sm->resuming || sm->requested || sm->len == 0)
+    return NULL;
+  sm->requested = 1;
+  node = iks_new ("r");
+  iks_insert_attrib (node, "xmlns", BITU_XMPP_SM_NS);
+  return node;
+}
+
+
+/* Must be called for each stanza received */
+void
+bitu_xmpp_sm_inbound (bitu_xmpp_sm_t *sm)
+{
+  if (sm->enabled && !sm->resuming)
+    sm->inbound++;
+}
+
+
+bitu_xmpp_sm_result_t
+bitu_xmpp_sm_handle (bitu_xmpp_sm_t *sm, iks *node,
+                     bitu_xmpp_sm_send_t send, void *data)
+{
+  const char *name = iks_name (node), *resume;
+  char h[16];
+  iks *answer;
+
+  if (name == NULL || !_bitu_xmpp_sm_is_ours (node))
+    return BITU_XMPP_SM_IGNORED;
+
+  if (strcmp (name, "r") == 0)
+    {
+      snprintf (h, sizeof (h), "%u", sm->inbound);
+      answer = iks_new ("a");
+      iks_insert_attrib (answer, "xmlns", BITU_XMPP_SM_NS);
+      iks_insert_attrib (answer, "h", h);
+      send (answer, data);
+      iks_delete (answer);
+      return BITU_XMPP_SM_HANDLED;
+    }
+
+  if (strcmp (name, "a") == 0)
+    {
+      _bitu_xmpp_sm_ack (sm, _bitu_xmpp_sm_get_h (node));
+      sm->requested = 0;
+      return BITU_XMPP_SM_HANDLED;
+    }
+
+  if (strcmp (name, "enabled") == 0)
+    {
+      resume = iks_find_attrib (node, "resume");
+      if (resume && (strcmp (resume, "true") == 0 || strcmp (resume, "1") == 0))
+        {
+          free (sm->id);
+          sm->id = iks_find_attrib (node, "id")
+            ? strdup (iks_find_attrib (node, "id")) : NULL;
+        }
+      return BITU_XMPP_SM_ENABLED;
+    }
+
+  if (strcmp (name, "resumed") == 0)
+    {
+      /* What the server didn't get is sent again, nothing else */
+      sm->enabled = 1;
+      sm->resuming = 0;
+      sm->requested = 0;
+      _bitu_xmpp_sm_ack (sm, _bitu_xmpp_sm_get_h (node));
+      bitu_xmpp_sm_replay (sm, send, data);
+      return BITU_XMPP_SM_RESUMED;
+    }
+
+  if (strcmp (name, "failed") == 0)
+    {
+      /* After a failed resumption the stanzas not acked are kept, they
+       * go out again in the new session, except the ones the server
+       * says it got before the drop. When it is <enable/> that fails,
+       * they were sent already and can't be tracked anymore. */
+      if (!sm->resuming)
+        _bitu_xmpp_sm_drop (sm, sm->len);
+      else if (iks_find_attrib (node, "h"))
+        _bitu_xmpp_sm_ack (sm, _bitu_xmpp_sm_get_h (node));
+      sm->dropped = 0;
+      free (sm->id);
+      sm->id = NULL;
+      sm->enabled = 0;
+      sm->resuming = 0;
+      sm->requested = 0;
+      return BITU_XMPP_SM_FAILED;
+    }
+
+  return BITU_XMPP_SM_HANDLED;
+}
+
+
+/* The connection dropped. Everything needed to resume is kept. */
+void
+bitu_xmpp_sm_suspend (bitu_xmpp_sm_t *sm)
+{
+  sm->enabled = 0;
+  sm->resuming = 0;
+  sm->requested = 0;
+}
+
+
+/* The stream was closed on purpose, there's nothing to resume */
+void
+bitu_xmpp_sm_reset (bitu_xmpp_sm_t *sm)
+{
+  bitu_xmpp_sm_suspend (sm);
+  _bitu_xmpp_sm_drop (sm, sm->len);
+  free (sm->id);
+  sm->id = NULL;
+  sm->inbound = 0;
+  sm->acked = 0;
+  sm->dropped = 0;
+}
+
+
+int
+bitu_xmpp_sm_get_unacked (bitu_xmpp_sm_t *sm)
+{
+  return sm->len;
+}
+
+
+uint32_t
+bitu_xmpp_sm_get_inbound (bitu_xmpp_sm_t *sm)
+{
+  return sm->inbound;
+}
+
+
+const char *
+bitu_xmpp_sm_get_id (bitu_xmpp_sm_t *sm)
+{
+  return sm->id;
+}
@@ -0,0 +1,66 @@
+/* xmpp-sm.h - This file is part of the bitu program
+ *
+ * Copyright (C) 2012  Lincoln de Sousa <lincoln@comum.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITU_XMPP_SM_H_
+#define BITU_XMPP_SM_H_ 1
+
+#include <stdint.h>
+#include <iksemel.h>
+
+/* XEP-0198 stream management, client side. It counts the stanzas
+ * handled in both directions, keeps the ones the server didn't ack yet
+ * and knows how to resume a session after the connection drops, so
+ * only the stanzas that were lost get sent again. It doesn't own the
+ * connection: nodes to be sent go through a callback and the ones
+ * received are handed to bitu_xmpp_sm_handle(). Not thread safe. */
+
+#define BITU_XMPP_SM_NS "urn:xmpp:sm:3"
+
+typedef struct bitu_xmpp_sm bitu_xmpp_sm_t;
+typedef int (*bitu_xmpp_sm_send_t) (iks *node, void *data);
+
+typedef enum
+{
+  BITU_XMPP_SM_IGNORED,      /* Not a stream management node */
+  BITU_XMPP_SM_HANDLED,      /* Ack or ack request, nothing to do */
+  BITU_XMPP_SM_ENABLED,      /* The server accepted <enable/> */
+  BITU_XMPP_SM_RESUMED,      /* The old session is back */
+  BITU_XMPP_SM_FAILED,       /* Enabling or resuming failed */
+} bitu_xmpp_sm_result_t;
+
+bitu_xmpp_sm_t *bitu_xmpp_sm_new (int max_unacked);
+void bitu_xmpp_sm_free (bitu_xmpp_sm_t *sm);
+int bitu_xmpp_sm_supported (iks *features);
+iks *bitu_xmpp_sm_enable (bitu_xmpp_sm_t *sm);
+iks *bitu_xmpp_sm_resume (bitu_xmpp_sm_t *sm);
+int bitu_xmpp_sm_is_enabled (bitu_xmpp_sm_t *sm);
+int bitu_xmpp_sm_queue (bitu_xmpp_sm_t *sm, iks *stanza);
+int bitu_xmpp_sm_replay (bitu_xmpp_sm_t *sm, bitu_xmpp_sm_send_t send,
+                         void *data);
+iks *bitu_xmpp_sm_request (bitu_xmpp_sm_t *sm);
+void bitu_xmpp_sm_inbound (bitu_xmpp_sm_t *sm);
+bitu_xmpp_sm_result_t bitu_xmpp_sm_handle (bitu_xmpp_sm_t *sm, iks *node,
+                                           bitu_xmpp_sm_send_t send,
+                                           void *data);
+void bitu_xmpp_sm_suspend (bitu_xmpp_sm_t *sm);
+void bitu_xmpp_sm_reset (bitu_xmpp_sm_t *sm);
+int bitu_xmpp_sm_get_unacked (bitu_xmpp_sm_t *sm);
+uint32_t bitu_xmpp_sm_get_inbound (bitu_xmpp_sm_t *sm);
+const char *bitu_xmpp_sm_get_id (bitu_xmpp_sm_t *sm);
+
+#endif /* BITU_XMPP_SM_H_ */